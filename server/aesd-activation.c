@@ -0,0 +1,69 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-activation.c
+​*​ ​@brief​ Socket activation with the LISTEN_FDS/LISTEN_PID protocol
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "aesd-activation.h"
+
+int aesd_activation_listen_fds(void)
+{
+    const char *pid_str = getenv("LISTEN_PID");
+    const char *fds_str = getenv("LISTEN_FDS");
+    char *p_end = NULL;
+    long pid;
+    long fds = 0;
+
+    if ((pid_str == NULL) || (fds_str == NULL)) {
+        return 0;
+    }
+
+    // Descriptors meant for another process in the chain are not ours
+    pid = strtol(pid_str, &p_end, 10);
+    if ((*p_end == '\0') && (pid == getpid())) {
+        fds = strtol(fds_str, &p_end, 10);
+        if ((*p_end != '\0') || (fds < 0)) {
+            fds = 0;
+        }
+    }
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return fds;
+}
+
+bool aesd_activation_is_listener(int fd)
+{
+    int value = 0;
+    socklen_t len = sizeof(value);
+
+    if ((getsockopt(fd, SOL_SOCKET, SO_TYPE, &value, &len) == -1) ||
+        (value != SOCK_STREAM)) {
+        return false;
+    }
+
+    len = sizeof(value);
+    if ((getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &len) == -1) ||
+        (value == 0)) {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-activation.h
+​*​ ​@brief​ Socket activation with the LISTEN_FDS/LISTEN_PID protocol
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*
+* A service manager, or aesdlaunch, binds and listens before starting the
+* server and passes the sockets as descriptors AESD_LISTEN_FDS_START onwards,
+* with LISTEN_FDS holding their count and LISTEN_PID the pid they are meant
+* for. Connections queue in the kernel until the server starts accepting.
+*/
+
+#ifndef AESD_ACTIVATION_H
+#define AESD_ACTIVATION_H
+
+#include <stdbool.h>
+
+#define AESD_LISTEN_FDS_START   (3)
+
+/**
+ * Number of listening sockets passed to this process, 0 when it was not
+ * socket activated. The variables are removed from the environment so they
+ * are not passed on to other programs.
+ */
+extern int aesd_activation_listen_fds(void);
+
+/**
+ * True if fd is a listening stream socket
+ */
+extern bool aesd_activation_is_listener(int fd);
+
+#endif /* AESD_ACTIVATION_H */
@@ -0,0 +1,191 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-admission.c
+​*​ ​@brief​ Admission control and load shedding driven by Linux PSI
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "aesd-admission.h"
+
+const char *aesd_psi_names[AESD_PSI_RESOURCES] = { "cpu", "memory", "io" };
+
+static const char *psi_paths[AESD_PSI_RESOURCES] = {
+    "/proc/pressure/cpu",
+    "/proc/pressure/memory",
+    "/proc/pressure/io",
+};
+
+static struct aesd_admission_config admission_config;
+static bool psi_available[AESD_PSI_RESOURCES];
+static double psi_avg10[AESD_PSI_RESOURCES];
+
+// Decisions are read by client threads and updated by the sampler
+static bool shedding = false;
+static bool deferring = false;
+static unsigned int connections = 0;
+static size_t queued_bytes = 0;
+static unsigned long accepted = 0;
+static unsigned long shed_pressure = 0;
+static unsigned long shed_connections = 0;
+static unsigned long shed_queued = 0;
+static unsigned long replies_deferred = 0;
+
+void aesd_admission_init(const struct aesd_admission_config *config)
+{
+    int res;
+
+    admission_config = *config;
+    for (res = 0; res < AESD_PSI_RESOURCES; res++) {
+        psi_available[res] = true;
+        psi_avg10[res] = 0;
+    }
+}
+
+// Read the "some avg10" value of a pressure file, returns -1 if unavailable
+static double psi_read_avg10(const char *path)
+{
+    FILE *psi_file;
+    double avg10 = -1;
+
+    psi_file = fopen(path, "r");
+    if (psi_file == NULL) {
+        return -1;
+    }
+    if (fscanf(psi_file, "some avg10=%lf", &avg10) != 1) {
+        avg10 = -1;
+    }
+    fclose(psi_file);
+
+    return avg10;
+}
+
+// Whether any resource is at or above its threshold, 0 thresholds are ignored
+static bool psi_over(const double *thresholds)
+{
+    int res;
+
+    for (res = 0; res < AESD_PSI_RESOURCES; res++) {
+        if ((thresholds[res] > 0) && (psi_avg10[res] >= thresholds[res])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void aesd_admission_sample(void)
+{
+    bool shed, defer;
+    int res;
+
+    for (res = 0; res < AESD_PSI_RESOURCES; res++) {
+        if (!psi_available[res]) {
+            continue;
+        }
+        psi_avg10[res] = psi_read_avg10(psi_paths[res]);
+        if (psi_avg10[res] < 0) {
+            syslog(LOG_WARNING, "PSI not available from %s, ignoring %s pressure\n",
+                    psi_paths[res], aesd_psi_names[res]);
+            psi_available[res] = false;
+            psi_avg10[res] = 0;
+        }
+    }
+
+    shed = psi_over(admission_config.shed_avg10);
+    defer = psi_over(admission_config.defer_avg10) ||
+            ((admission_config.max_queued_bytes > 0) &&
+             (__atomic_load_n(&queued_bytes, __ATOMIC_RELAXED) >= admission_config.max_queued_bytes));
+
+    if (shed != shedding) {
+        syslog(LOG_WARNING, "Admission: %s shedding new connections (cpu %.2f memory %.2f io %.2f)\n",
+                shed ? "started" : "stopped", psi_avg10[AESD_PSI_CPU],
+                psi_avg10[AESD_PSI_MEMORY], psi_avg10[AESD_PSI_IO]);
+    }
+    if (defer != deferring) {
+        syslog(LOG_WARNING, "Admission: %s deferring replies\n", defer ? "started" : "stopped");
+    }
+
+    __atomic_store_n(&shedding, shed, __ATOMIC_RELAXED);
+    __atomic_store_n(&deferring, defer, __ATOMIC_RELAXED);
+}
+
+bool aesd_admission_admit(void)
+{
+    if (__atomic_load_n(&shedding, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&shed_pressure, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if ((admission_config.max_connections > 0) &&
+        (__atomic_load_n(&connections, __ATOMIC_RELAXED) >= admission_config.max_connections)) {
+        __atomic_add_fetch(&shed_connections, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if ((admission_config.max_queued_bytes > 0) &&
+        (__atomic_load_n(&queued_bytes, __ATOMIC_RELAXED) >= admission_config.max_queued_bytes)) {
+        __atomic_add_fetch(&shed_queued, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&accepted, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void aesd_admission_release(void)
+{
+    __atomic_sub_fetch(&connections, 1, __ATOMIC_RELAXED);
+}
+
+void aesd_admission_queued(size_t *reported, size_t queued)
+{
+    if (queued > *reported) {
+        __atomic_add_fetch(&queued_bytes, queued - *reported, __ATOMIC_RELAXED);
+    } else if (queued < *reported) {
+        __atomic_sub_fetch(&queued_bytes, *reported - queued, __ATOMIC_RELAXED);
+    }
+    *reported = queued;
+}
+
+bool aesd_admission_defer_replies(void)
+{
+    return __atomic_load_n(&deferring, __ATOMIC_RELAXED);
+}
+
+void aesd_admission_count_deferred(void)
+{
+    __atomic_add_fetch(&replies_deferred, 1, __ATOMIC_RELAXED);
+}
+
+void aesd_admission_get_stats(struct aesd_admission_stats *stats)
+{
+    int res;
+
+    stats->accepted = __atomic_load_n(&accepted, __ATOMIC_RELAXED);
+    stats->shed_pressure = __atomic_load_n(&shed_pressure, __ATOMIC_RELAXED);
+    stats->shed_connections = __atomic_load_n(&shed_connections, __ATOMIC_RELAXED);
+    stats->shed_queued = __atomic_load_n(&shed_queued, __ATOMIC_RELAXED);
+    stats->replies_deferred = __atomic_load_n(&replies_deferred, __ATOMIC_RELAXED);
+    stats->connections = __atomic_load_n(&connections, __ATOMIC_RELAXED);
+    stats->queued_bytes = __atomic_load_n(&queued_bytes, __ATOMIC_RELAXED);
+    stats->shedding = __atomic_load_n(&shedding, __ATOMIC_RELAXED);
+    stats->deferring = __atomic_load_n(&deferring, __ATOMIC_RELAXED);
+    for (res = 0; res < AESD_PSI_RESOURCES; res++) {
+        stats->avg10[res] = psi_avg10[res];
+    }
+}
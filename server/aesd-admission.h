@@ -0,0 +1,105 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-admission.h
+​*​ ​@brief​ Admission control and load shedding driven by Linux PSI
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+#ifndef AESD_ADMISSION_H
+#define AESD_ADMISSION_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+enum aesd_psi_resource {
+    AESD_PSI_CPU,
+    AESD_PSI_MEMORY,
+    AESD_PSI_IO,
+    AESD_PSI_RESOURCES,
+};
+
+struct aesd_admission_config {
+    /**
+     * "some avg10" pressure percentage at which new connections are shed,
+     * 0 disables the check for that resource
+     */
+    double shed_avg10[AESD_PSI_RESOURCES];
+    /**
+     * "some avg10" pressure percentage at which replies are deferred
+     */
+    double defer_avg10[AESD_PSI_RESOURCES];
+    /**
+     * Open connections at which new connections are shed, 0 is unlimited
+     */
+    unsigned int max_connections;
+    /**
+     * Bytes waiting in all send queues at which new connections are shed
+     * and replies deferred, 0 is unlimited
+     */
+    size_t max_queued_bytes;
+};
+
+struct aesd_admission_stats {
+    unsigned long accepted;
+    unsigned long shed_pressure;
+    unsigned long shed_connections;
+    unsigned long shed_queued;
+    unsigned long replies_deferred;
+    unsigned int connections;
+    size_t queued_bytes;
+    bool shedding;
+    bool deferring;
+    double avg10[AESD_PSI_RESOURCES];
+};
+
+extern const char *aesd_psi_names[AESD_PSI_RESOURCES];
+
+extern void aesd_admission_init(const struct aesd_admission_config *config);
+
+/**
+ * Read /proc/pressure and update the shed and defer decisions
+ */
+extern void aesd_admission_sample(void);
+
+/**
+ * Decide whether a newly accepted connection may be served, counts it as open if so
+ * @return true to serve the connection, false to close it straight away
+ */
+extern bool aesd_admission_admit(void);
+
+/**
+ * Count an admitted connection as closed
+ */
+extern void aesd_admission_release(void);
+
+/**
+ * Account for a change in the number of bytes a connection has queued.
+ * @param reported bytes last reported for this connection, updated to queued
+ */
+extern void aesd_admission_queued(size_t *reported, size_t queued);
+
+/**
+ * @return true while replies should be held back
+ */
+extern bool aesd_admission_defer_replies(void);
+
+/**
+ * Count a reply that was held back
+ */
+extern void aesd_admission_count_deferred(void);
+
+extern void aesd_admission_get_stats(struct aesd_admission_stats *stats);
+
+#endif /* AESD_ADMISSION_H */
@@ -0,0 +1,331 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-capture.c
+​*​ ​@brief​ Record client traffic into a capture file for aesdreplay
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-capture.h"
+#include "aesd-frame.h"
+#include "aesd-lock.h"
+
+#define BUFFER_SIZE         (64 * 1024)
+// Type, conn, delay and length varints in front of a record's data
+#define RECORD_HEADER_MAX   (1 + (3 * AESD_FRAME_VARINT_MAX))
+#define MAX_SUFFIX          (1000)
+
+static struct aesd_lock capture_lock = AESD_LOCK_INITIALIZER("capture");
+static int capture_fd = -1;
+static uint64_t capture_limit = 0;
+static char *buffer = NULL;
+static size_t buffered = 0;
+static uint64_t last_us = 0;
+static uint64_t next_conn = 1;
+static struct aesd_capture_stats stats;
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t tx_bytes;
+
+    while (len > 0) {
+        tx_bytes = write(fd, buf, len);
+        if (tx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf = (const char *)buf + tx_bytes;
+        len -= tx_bytes;
+    }
+    return true;
+}
+
+// Write out the buffer, capture_lock held. A failed write stops the capture.
+static void flush_locked(void)
+{
+    if ((buffered > 0) && !write_full(capture_fd, buffer, buffered)) {
+        syslog(LOG_ERR, "Error writing capture, stopping it: %s\n", strerror(errno));
+        stats.active = false;
+    }
+    buffered = 0;
+}
+
+// Append one record, capture_lock held
+static void record_locked(char type, uint64_t conn, uint64_t extra, const void *data, size_t len)
+{
+    char header[RECORD_HEADER_MAX];
+    size_t header_len = 0;
+    uint64_t now_us = monotonic_us();
+
+    if (!stats.active) {
+        return;
+    }
+    if ((capture_limit > 0) &&
+        (stats.file_bytes + RECORD_HEADER_MAX + len > capture_limit)) {
+        if (stats.dropped++ == 0) {
+            syslog(LOG_INFO, "Capture reached its %llu byte limit\n",
+                    (unsigned long long)capture_limit);
+        }
+        return;
+    }
+
+    header[header_len++] = type;
+    header_len += aesd_frame_put_varint(header + header_len, conn);
+    header_len += aesd_frame_put_varint(header + header_len,
+                                        (now_us > last_us) ? now_us - last_us : 0);
+    if (type == AESD_CAPTURE_OPEN) {
+        header_len += aesd_frame_put_varint(header + header_len, extra);
+    } else if (type == AESD_CAPTURE_DATA) {
+        header_len += aesd_frame_put_varint(header + header_len, len);
+    }
+    if (now_us > last_us) {
+        last_us = now_us;
+    }
+
+    if (buffered + header_len + len > BUFFER_SIZE) {
+        flush_locked();
+    }
+    memcpy(buffer + buffered, header, header_len);
+    buffered += header_len;
+    if (buffered + len <= BUFFER_SIZE) {
+        memcpy(buffer + buffered, data, len);
+        buffered += len;
+    } else {
+        // Too large to buffer, goes out behind its header
+        flush_locked();
+        if (stats.active && !write_full(capture_fd, data, len)) {
+            syslog(LOG_ERR, "Error writing capture, stopping it: %s\n", strerror(errno));
+            stats.active = false;
+        }
+    }
+
+    stats.records++;
+    stats.file_bytes += header_len + len;
+    if (type == AESD_CAPTURE_DATA) {
+        stats.bytes += len;
+    }
+}
+
+int aesd_capture_open(const char *path, uint64_t limit)
+{
+    struct aesd_capture_header header;
+    struct timespec ts;
+    char name[PATH_MAX];
+    int suffix;
+    int fd = -1;
+
+    // Never append to or overwrite an earlier capture
+    snprintf(name, sizeof(name), "%s", path);
+    for (suffix = 1; suffix <= MAX_SUFFIX; suffix++) {
+        fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if ((fd != -1) || (errno != EEXIST)) {
+            break;
+        }
+        snprintf(name, sizeof(name), "%s.%d", path, suffix);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+
+    buffer = malloc(BUFFER_SIZE);
+    if (buffer == NULL) {
+        close(fd);
+        unlink(name);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AESD_CAPTURE_MAGIC, sizeof(header.magic));
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (!write_full(fd, &header, sizeof(header))) {
+        close(fd);
+        unlink(name);
+        free(buffer);
+        buffer = NULL;
+        return -1;
+    }
+
+    aesd_lock(&capture_lock);
+    capture_fd = fd;
+    capture_limit = limit;
+    buffered = 0;
+    last_us = monotonic_us();
+    memset(&stats, 0, sizeof(stats));
+    stats.active = true;
+    stats.file_bytes = sizeof(header);
+    aesd_unlock(&capture_lock);
+
+    syslog(LOG_INFO, "Capturing client traffic to %s\n", name);
+    return 0;
+}
+
+uint64_t aesd_capture_connect(uint64_t flags)
+{
+    uint64_t conn = 0;
+
+    // Checked unlocked first, a server not capturing takes no lock
+    if (!__atomic_load_n(&stats.active, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    aesd_lock(&capture_lock);
+    if (stats.active) {
+        conn = next_conn++;
+        stats.connections++;
+        record_locked(AESD_CAPTURE_OPEN, conn, flags, NULL, 0);
+    }
+    aesd_unlock(&capture_lock);
+    return conn;
+}
+
+void aesd_capture_data(uint64_t conn, const void *buf, size_t len)
+{
+    if ((conn == 0) || (len == 0)) {
+        return;
+    }
+    aesd_lock(&capture_lock);
+    record_locked(AESD_CAPTURE_DATA, conn, 0, buf, len);
+    aesd_unlock(&capture_lock);
+}
+
+void aesd_capture_shut(uint64_t conn)
+{
+    if (conn == 0) {
+        return;
+    }
+    aesd_lock(&capture_lock);
+    record_locked(AESD_CAPTURE_SHUT, conn, 0, NULL, 0);
+    aesd_unlock(&capture_lock);
+}
+
+void aesd_capture_disconnect(uint64_t conn)
+{
+    if (conn == 0) {
+        return;
+    }
+    aesd_lock(&capture_lock);
+    record_locked(AESD_CAPTURE_CLOSE, conn, 0, NULL, 0);
+    aesd_unlock(&capture_lock);
+}
+
+void aesd_capture_flush(void)
+{
+    if (!__atomic_load_n(&stats.active, __ATOMIC_RELAXED)) {
+        return;
+    }
+    aesd_lock(&capture_lock);
+    if (stats.active) {
+        flush_locked();
+    }
+    aesd_unlock(&capture_lock);
+}
+
+void aesd_capture_get_stats(struct aesd_capture_stats *out)
+{
+    aesd_lock(&capture_lock);
+    *out = stats;
+    aesd_unlock(&capture_lock);
+}
+
+void aesd_capture_close(void)
+{
+    aesd_lock(&capture_lock);
+    if (capture_fd != -1) {
+        if (stats.active) {
+            flush_locked();
+        }
+        stats.active = false;
+        close(capture_fd);
+        capture_fd = -1;
+    }
+    free(buffer);
+    buffer = NULL;
+    aesd_unlock(&capture_lock);
+}
+
+ssize_t aesd_capture_parse(const char *buf, size_t len, uint64_t *clock_us,
+                            struct aesd_capture_record *record)
+{
+    uint64_t delay_us, value;
+    size_t pos = 1;
+    int status;
+    int field;
+
+    if (len == 0) {
+        return 0;
+    }
+    memset(record, 0, sizeof(*record));
+    record->type = buf[0];
+    if ((record->type != AESD_CAPTURE_OPEN) && (record->type != AESD_CAPTURE_DATA) &&
+        (record->type != AESD_CAPTURE_SHUT) && (record->type != AESD_CAPTURE_CLOSE)) {
+        return -1;
+    }
+
+    // conn, delay, then the flags or length of the types that have one
+    for (field = 0; field < 3; field++) {
+        if ((field == 2) && (record->type != AESD_CAPTURE_OPEN) &&
+            (record->type != AESD_CAPTURE_DATA)) {
+            break;
+        }
+        status = aesd_frame_get_varint(buf + pos, len - pos, &value);
+        if (status <= 0) {
+            return status;
+        }
+        pos += status;
+        if (field == 0) {
+            record->conn = value;
+        } else if (field == 1) {
+            delay_us = value;
+        } else if (record->type == AESD_CAPTURE_OPEN) {
+            record->flags = value;
+        } else {
+            if (value > len - pos) {
+                return 0;
+            }
+            record->data = buf + pos;
+            record->len = value;
+            pos += value;
+        }
+    }
+    if (record->conn == 0) {
+        return -1;
+    }
+
+    *clock_us += delay_us;
+    record->time_us = *clock_us;
+    return pos;
+}
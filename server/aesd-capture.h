@@ -0,0 +1,138 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-capture.h
+​*​ ​@brief​ Record client traffic into a capture file for aesdreplay
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* With --capture the server records what every client sends, and when, so
+* aesdreplay can drive the same traffic against a server later. A capture
+* file is a struct aesd_capture_header followed by records, each one event
+* on one connection:
+*
+*   u8 type, varint conn, varint usec since the previous record
+*   AESD_CAPTURE_OPEN   then varint flags
+*   AESD_CAPTURE_DATA   then varint len, len bytes as received
+*
+* Varints are the LEB128 ones of aesd-frame.h. Connections are numbered
+* from 1 in the order they opened. Records are written in time order under
+* one lock and buffered, a capture is only complete once the server has
+* closed it. If the file already exists the capture goes to the first free
+* path + ".N" instead, so the new server of an upgrade writes its own file.
+*/
+
+#ifndef AESD_CAPTURE_H
+#define AESD_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define AESD_CAPTURE_MAGIC      ("ACP1")
+
+#define AESD_CAPTURE_OPEN       ('O')   // Client connected
+#define AESD_CAPTURE_DATA       ('D')   // Bytes received from the client
+#define AESD_CAPTURE_SHUT       ('S')   // Client finished sending
+#define AESD_CAPTURE_CLOSE      ('C')   // Server closed the connection
+
+// The connection was handed over already binary framed, its magic was read
+// by the previous server
+#define AESD_CAPTURE_FRAMED     (1U << 0)
+
+struct aesd_capture_header {
+    char magic[4];
+    uint32_t pad;
+    /**
+     * CLOCK_REALTIME the capture started at, in nanoseconds
+     */
+    uint64_t start_ns;
+};
+
+/**
+ * One parsed record, data points into the parsed buffer
+ */
+struct aesd_capture_record {
+    char type;
+    uint64_t conn;
+    uint64_t flags;
+    uint64_t time_us;       // Since the capture started
+    const char *data;
+    size_t len;
+};
+
+struct aesd_capture_stats {
+    bool active;
+    uint64_t connections;
+    uint64_t records;
+    /**
+     * Bytes received from clients and written to the file
+     */
+    uint64_t bytes;
+    uint64_t file_bytes;
+    /**
+     * Records not written once the size limit was reached or a write failed
+     */
+    uint64_t dropped;
+};
+
+/**
+ * Start capturing into path, or the first free path + ".N", stopping once
+ * the file holds limit bytes if it is not 0. Returns 0, or -1 with errno set.
+ */
+extern int aesd_capture_open(const char *path, uint64_t limit);
+
+/**
+ * Record a new connection, returns its number or 0 if not capturing
+ */
+extern uint64_t aesd_capture_connect(uint64_t flags);
+
+/**
+ * Record len bytes received on conn, which may be 0 to do nothing
+ */
+extern void aesd_capture_data(uint64_t conn, const void *buf, size_t len);
+
+/**
+ * Record that the client on conn finished sending
+ */
+extern void aesd_capture_shut(uint64_t conn);
+
+/**
+ * Record that conn was closed
+ */
+extern void aesd_capture_disconnect(uint64_t conn);
+
+/**
+ * Write out the records buffered so far
+ */
+extern void aesd_capture_flush(void);
+
+/**
+ * Snapshot of the capture counters
+ */
+extern void aesd_capture_get_stats(struct aesd_capture_stats *stats);
+
+/**
+ * Flush and close the capture file
+ */
+extern void aesd_capture_close(void);
+
+/**
+ * Parse the record at the start of the len bytes at buf into record, adding
+ * its delay to *clock_us. Returns its length, 0 if buf ends before it does
+ * or -1 if it is malformed.
+ */
+extern ssize_t aesd_capture_parse(const char *buf, size_t len, uint64_t *clock_us,
+                                    struct aesd_capture_record *record);
+
+#endif /* AESD_CAPTURE_H */
@@ -0,0 +1,406 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-checksum.c
+​*​ ​@brief​ Per-record CRC32C of the data file and recovery of a torn tail
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aesd-checksum.h"
+#include "aesd-crc32c.h"
+
+#define ENTRY_SIZE          (sizeof(struct aesd_checksum_entry))
+#define ENTRY_CHUNK         (4096)
+// Longer appends get one entry per this many bytes
+#define MAX_ENTRY_LEN       (1U << 30)
+
+static int crc_fd = -1;
+static char crc_path[PATH_MAX];
+// Sidecar entries before this one are punched out
+static uint64_t punched_entries = 0;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+// Read len bytes at offset, returns false on error or end of file
+static bool read_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+    ssize_t rx_bytes;
+
+    while (len > 0) {
+        rx_bytes = pread(fd, buf, len, offset);
+        if (rx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (rx_bytes == 0) {
+            errno = EIO;
+            return false;
+        }
+        buf = (char *)buf + rx_bytes;
+        len -= rx_bytes;
+        offset += rx_bytes;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t tx_bytes;
+
+    while (len > 0) {
+        tx_bytes = write(fd, buf, len);
+        if (tx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf = (const char *)buf + tx_bytes;
+        len -= tx_bytes;
+    }
+    return true;
+}
+
+// Give the newline separated records of the data file from start to end
+// entries in a new sidecar. It is built under a temporary name and renamed
+// into place, so a crash part way leaves no sidecar rather than a short one.
+static int adopt(const char *data, uint64_t start, uint64_t end,
+                    struct aesd_checksum_recovery *result)
+{
+    char tmp_path[PATH_MAX + 8];
+    struct aesd_checksum_entry *entries = malloc(ENTRY_CHUNK * ENTRY_SIZE);
+    const char *p_end;
+    uint64_t pos = start;
+    uint64_t limit;
+    size_t count = 0;
+    bool ok = true;
+    int fd;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", crc_path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Error open(%s): %s\n", tmp_path, strerror(errno));
+        ok = false;
+    } else if (entries == NULL) {
+        syslog(LOG_ERR, "Error failed to malloc()\n");
+        errno = ENOMEM;
+        ok = false;
+    }
+
+    // A record ends at a newline, after MAX_ENTRY_LEN bytes or at the end
+    while (ok && (pos < end)) {
+        limit = (end - pos < MAX_ENTRY_LEN) ? end - pos : MAX_ENTRY_LEN;
+        p_end = memchr(data + pos, '\n', limit);
+        entries[count].len = (p_end != NULL) ? (uint64_t)(p_end + 1 - (data + pos)) : limit;
+        entries[count].end = pos + entries[count].len;
+        entries[count].crc = aesd_crc32c(0, data + pos, entries[count].len);
+        pos = entries[count].end;
+        result->adopted++;
+        if (++count == ENTRY_CHUNK) {
+            ok = write_full(fd, entries, count * ENTRY_SIZE);
+            count = 0;
+        }
+    }
+
+    ok = ok && write_full(fd, entries, count * ENTRY_SIZE) && (fdatasync(fd) == 0);
+    if (fd != -1) {
+        close(fd);
+    }
+    ok = ok && (rename(tmp_path, crc_path) == 0);
+    if (!ok) {
+        syslog(LOG_ERR, "Error writing checksums for %s: %s\n", crc_path, strerror(errno));
+        unlink(tmp_path);
+    }
+    free(entries);
+    return ok ? 0 : -1;
+}
+
+// Check every entry of the sidecar against the data file, mapped at data.
+// Sets *keep_entries to the number of entries up to the last good one and
+// *good_end to where the last good record ends, at least head.
+static int check(const char *data, uint64_t data_size, uint64_t entry_count, uint64_t head,
+                    struct aesd_checksum_recovery *result, uint64_t *keep_entries,
+                    uint64_t *good_end)
+{
+    struct aesd_checksum_entry *entries = malloc(ENTRY_CHUNK * ENTRY_SIZE);
+    uint64_t covered = head;
+    uint64_t bad = 0;
+    uint64_t bad_start = 0;
+    uint64_t i, start;
+    size_t count = 0, j = 0;
+    bool in_file, good;
+
+    *keep_entries = 0;
+    *good_end = head;
+    if (entries == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (i = 0; i < entry_count; i++, j++) {
+        if (j == count) {
+            count = (entry_count - i < ENTRY_CHUNK) ? entry_count - i : ENTRY_CHUNK;
+            if (!read_full(crc_fd, entries, count * ENTRY_SIZE, i * ENTRY_SIZE)) {
+                free(entries);
+                return -1;
+            }
+            j = 0;
+        }
+
+        // Punched by retention along with the records it covered
+        if ((entries[j].end == 0) && (entries[j].len == 0) && (entries[j].crc == 0)) {
+            *keep_entries = i + 1;
+            continue;
+        }
+
+        in_file = (entries[j].len <= entries[j].end) && (entries[j].end <= data_size);
+        start = entries[j].end - entries[j].len;
+        good = in_file && (aesd_crc32c(0, data + start, entries[j].len) == entries[j].crc);
+
+        // A bad record still has an entry, its bytes are not unchecked
+        if (in_file) {
+            if (start > covered) {
+                result->unchecked += start - covered;
+            }
+            if (entries[j].end > covered) {
+                covered = entries[j].end;
+            }
+        }
+
+        if (!good) {
+            if (bad == 0) {
+                bad_start = start;
+            }
+            bad++;
+            continue;
+        }
+
+        // Everything bad so far is followed by this good record, so corrupt
+        if ((bad > 0) && (result->corrupt == 0)) {
+            result->first_corrupt = bad_start;
+        }
+        result->corrupt += bad;
+        bad = 0;
+        result->records++;
+        result->bytes += entries[j].len;
+        *keep_entries = i + 1;
+        *good_end = covered;
+    }
+
+    result->torn_entries = bad;
+    free(entries);
+    return 0;
+}
+
+int aesd_checksum_open(const char *path, bool repair, struct aesd_checksum_recovery *result)
+{
+    struct stat data_stat, crc_stat;
+    uint64_t keep_entries, good_end, head;
+    double start = now_sec();
+    char *data = NULL;
+    off_t data_pos;
+    int data_fd;
+    int saved_errno;
+    int status = 0;
+
+    memset(result, 0, sizeof(*result));
+    snprintf(crc_path, sizeof(crc_path), "%s%s", path, AESD_CHECKSUM_SUFFIX);
+
+    data_fd = open(path, (repair ? O_RDWR : O_RDONLY) | O_CREAT | O_CLOEXEC, 0666);
+    if ((data_fd == -1) || (fstat(data_fd, &data_stat) == -1)) {
+        saved_errno = errno;
+        if (data_fd != -1) {
+            close(data_fd);
+        }
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Checked in place, reading through a mapping is faster than copying
+    // the file out even before the checksums are added
+    if (data_stat.st_size > 0) {
+        data = mmap(NULL, data_stat.st_size, PROT_READ, MAP_SHARED, data_fd, 0);
+        if (data == MAP_FAILED) {
+            saved_errno = errno;
+            close(data_fd);
+            errno = saved_errno;
+            return -1;
+        }
+        madvise(data, data_stat.st_size, MADV_SEQUENTIAL);
+    }
+
+    // Records dropped by retention leave a hole at the start of the file,
+    // and zeros up to the first record where less than a block was punched
+    data_pos = lseek(data_fd, 0, SEEK_DATA);
+    head = (data_pos == -1) ? data_stat.st_size : data_pos;
+    while ((head < (uint64_t)data_stat.st_size) && (data[head] == '\0')) {
+        head++;
+    }
+
+    if ((access(crc_path, F_OK) == -1) && (errno == ENOENT) && (data_stat.st_size > 0)) {
+        status = adopt(data, head, data_stat.st_size, result);
+        result->unchecked = head;
+    }
+
+    if (status == 0) {
+        crc_fd = open(crc_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        if ((crc_fd == -1) || (fstat(crc_fd, &crc_stat) == -1)) {
+            status = -1;
+        }
+    }
+
+    if ((status == 0) && (result->adopted == 0)) {
+        status = check(data, data_stat.st_size, crc_stat.st_size / ENTRY_SIZE, head,
+                        result, &keep_entries, &good_end);
+        result->torn_bytes = data_stat.st_size - good_end;
+        // A partly written entry is torn too
+        if (crc_stat.st_size % ENTRY_SIZE != 0) {
+            result->torn_entries++;
+        }
+
+        if ((status == 0) && repair &&
+            ((result->torn_bytes > 0) || (result->torn_entries > 0))) {
+            if ((ftruncate(data_fd, good_end) == -1) ||
+                (ftruncate(crc_fd, keep_entries * ENTRY_SIZE) == -1) ||
+                (fdatasync(data_fd) == -1) || (fdatasync(crc_fd) == -1)) {
+                status = -1;
+            } else {
+                result->truncated = true;
+            }
+        }
+    }
+
+    saved_errno = errno;
+    if (data != NULL) {
+        munmap(data, data_stat.st_size);
+    }
+    close(data_fd);
+    if ((status == -1) && (crc_fd != -1)) {
+        close(crc_fd);
+        crc_fd = -1;
+    }
+    result->seconds = now_sec() - start;
+    errno = saved_errno;
+    return status;
+}
+
+int aesd_checksum_append(uint64_t end, const void *buf, size_t len)
+{
+    struct aesd_checksum_entry entry;
+    const char *p = buf;
+    uint64_t pos = end - len;
+
+    if (crc_fd == -1) {
+        return 0;
+    }
+
+    while (len > 0) {
+        entry.len = (len < MAX_ENTRY_LEN) ? len : MAX_ENTRY_LEN;
+        entry.end = pos + entry.len;
+        entry.crc = aesd_crc32c(0, p, entry.len);
+        // One write per entry, so O_APPEND never splits it
+        if (write(crc_fd, &entry, ENTRY_SIZE) != ENTRY_SIZE) {
+            return -1;
+        }
+        p += entry.len;
+        pos += entry.len;
+        len -= entry.len;
+    }
+    return 0;
+}
+
+int aesd_checksum_sync(void)
+{
+    if (crc_fd == -1) {
+        return 0;
+    }
+    return fdatasync(crc_fd);
+}
+
+void aesd_checksum_punch(uint64_t offset)
+{
+    struct aesd_checksum_entry entry;
+    struct stat crc_stat;
+    uint64_t lo, hi, mid;
+
+    if ((crc_fd == -1) || (fstat(crc_fd, &crc_stat) == -1)) {
+        return;
+    }
+
+    // Entries are in end order, find the first ending after offset
+    lo = punched_entries;
+    hi = crc_stat.st_size / ENTRY_SIZE;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (!read_full(crc_fd, &entry, ENTRY_SIZE, mid * ENTRY_SIZE)) {
+            return;
+        }
+        if (entry.end <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if ((lo > punched_entries) &&
+        (fallocate(crc_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    punched_entries * ENTRY_SIZE, (lo - punched_entries) * ENTRY_SIZE) == -1)) {
+        syslog(LOG_ERR, "Error fallocate(PUNCH_HOLE) %s: %s\n", crc_path, strerror(errno));
+        return;
+    }
+    punched_entries = lo;
+}
+
+void aesd_checksum_close(bool remove)
+{
+    if (crc_fd == -1) {
+        return;
+    }
+    close(crc_fd);
+    crc_fd = -1;
+    if (remove && (unlink(crc_path) == -1)) {
+        syslog(LOG_ERR, "Error unlink(%s): %s\n", crc_path, strerror(errno));
+    }
+}
+
+void aesd_checksum_discard(const char *path)
+{
+    char stale_path[PATH_MAX];
+
+    snprintf(stale_path, sizeof(stale_path), "%s%s", path, AESD_CHECKSUM_SUFFIX);
+    if (unlink(stale_path) == 0) {
+        syslog(LOG_INFO, "Removed %s, appends are not checksummed\n", stale_path);
+    }
+}
@@ -0,0 +1,117 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-checksum.h
+​*​ ​@brief​ Per-record CRC32C of the data file and recovery of a torn tail
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+*
+* The data file holds the history exactly as replies send it, so checksums
+* live in a sidecar next to it, path + ".crc". Every append adds one entry
+* to the sidecar: where the record ends in the data file, its length and
+* the CRC32C of its bytes. Entries are 16 bytes in host byte order and
+* appended with O_APPEND, so two servers taking part in an upgrade can both
+* write them.
+*
+* At start the data file is checked against the sidecar. A crash can leave
+* a record whose bytes or entry never reached the disk. Only the tail of the
+* file can hold such records, so bad entries after the last good one, and
+* data after the last good record, are a torn tail and are cut off. A bad
+* entry followed by good ones is corruption. It is reported and kept. Data
+* between good records without entries was written by a server without
+* checksums and is left unchecked.
+*/
+
+#ifndef AESD_CHECKSUM_H
+#define AESD_CHECKSUM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_CHECKSUM_SUFFIX    (".crc")
+
+struct aesd_checksum_entry {
+    uint64_t end;
+    uint32_t len;
+    uint32_t crc;
+};
+
+struct aesd_checksum_recovery {
+    /**
+     * Records checked and their bytes, and how long it took
+     */
+    uint64_t records;
+    uint64_t bytes;
+    double seconds;
+    /**
+     * Bad entries before the last good one, and the first one's offset
+     */
+    uint64_t corrupt;
+    uint64_t first_corrupt;
+    /**
+     * Data file bytes and entries past the last good record
+     */
+    uint64_t torn_bytes;
+    uint64_t torn_entries;
+    /**
+     * Whether the torn tail was cut off
+     */
+    bool truncated;
+    /**
+     * Data file bytes no entry covers
+     */
+    uint64_t unchecked;
+    /**
+     * Records of a data file without a sidecar given entries
+     */
+    uint64_t adopted;
+};
+
+/**
+ * Check the data file at path against its sidecar and open the sidecar for
+ * appends. Without a sidecar the records already in the data file are given
+ * entries. A torn tail is cut off if repair is set, which it must not be
+ * while another server may be appending. Returns 0, or -1 with errno set.
+ */
+extern int aesd_checksum_open(const char *path, bool repair,
+                                struct aesd_checksum_recovery *result);
+
+/**
+ * Add the entries of len bytes just appended to the data file, ending at
+ * end. Returns 0, or -1 with errno set.
+ */
+extern int aesd_checksum_append(uint64_t end, const void *buf, size_t len);
+
+/**
+ * fdatasync() the sidecar. Returns 0 if it is not open, or -1 with errno set.
+ */
+extern int aesd_checksum_sync(void);
+
+/**
+ * Free the sidecar blocks of entries for records ending at or before offset
+ */
+extern void aesd_checksum_punch(uint64_t offset);
+
+/**
+ * Close the sidecar, and remove it along with the data file if remove is set
+ */
+extern void aesd_checksum_close(bool remove);
+
+/**
+ * Remove a sidecar left next to the data file at path by an earlier server,
+ * it would not cover appends made without checksums
+ */
+extern void aesd_checksum_discard(const char *path);
+
+#endif /* AESD_CHECKSUM_H */
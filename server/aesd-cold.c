@@ -0,0 +1,600 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-cold.c
+​*​ ​@brief​ Compressed blocks of cold history and decompression on read
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "aesd-cold.h"
+#include "aesd-crc32c.h"
+#include "aesd-lz.h"
+
+#define HEADER_SIZE     (sizeof(struct aesd_cold_header))
+#define BLOCK_ALIGN     (8)
+#define MIN_BLOCKS      (64)
+
+// Where a block is and what it holds
+struct cold_block {
+    uint64_t start;
+    uint64_t pos;
+    uint32_t raw_len;
+    uint32_t comp_len;
+    uint32_t crc;
+};
+
+// The block a thread decompressed last
+struct cold_cache {
+    uint64_t pos;       // File position of the block, UINT64_MAX for none
+    char *raw;
+    size_t raw_cap;
+    char *comp;
+    size_t comp_cap;
+};
+
+// Blocks in history order. cold_end is also read without the lock, so reads
+// past every block never take it.
+static pthread_mutex_t cold_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cold_fd = -1;
+static char cold_path[PATH_MAX];
+static struct cold_block *blocks = NULL;
+static size_t block_count = 0;
+static size_t block_capacity = 0;
+static uint64_t cold_end = 0;
+static uint64_t file_end = 0;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static bool cache_key_ok = false;
+
+static uint64_t decodes = 0;
+static uint64_t decode_bytes = 0;
+static uint64_t decode_ns = 0;
+static uint64_t cache_hits = 0;
+static uint64_t compressed = 0;
+static uint64_t compressed_bytes = 0;
+static uint64_t compress_ns = 0;
+static uint64_t crc_errors = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t block_size(uint32_t comp_len)
+{
+    return (HEADER_SIZE + comp_len + BLOCK_ALIGN - 1) & ~(uint64_t)(BLOCK_ALIGN - 1);
+}
+
+// Read len bytes at offset, returns false on error or end of file
+static bool read_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+    ssize_t rx_bytes;
+
+    while (len > 0) {
+        rx_bytes = pread(fd, buf, len, offset);
+        if (rx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (rx_bytes == 0) {
+            errno = EIO;
+            return false;
+        }
+        buf = (char *)buf + rx_bytes;
+        len -= rx_bytes;
+        offset += rx_bytes;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t tx_bytes;
+
+    while (len > 0) {
+        tx_bytes = write(fd, buf, len);
+        if (tx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf = (const char *)buf + tx_bytes;
+        len -= tx_bytes;
+    }
+    return true;
+}
+
+static void cache_free(void *arg)
+{
+    struct cold_cache *cache = arg;
+
+    free(cache->raw);
+    free(cache->comp);
+    free(cache);
+}
+
+static void cache_key_init(void)
+{
+    cache_key_ok = (pthread_key_create(&cache_key, cache_free) == 0);
+}
+
+// This thread's decoded block, NULL with errno set if it cannot have one
+static struct cold_cache *cache_get(void)
+{
+    struct cold_cache *cache;
+
+    pthread_once(&cache_once, cache_key_init);
+    if (!cache_key_ok) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    cache = pthread_getspecific(cache_key);
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if ((cache == NULL) || (pthread_setspecific(cache_key, cache) != 0)) {
+            free(cache);
+            errno = ENOMEM;
+            return NULL;
+        }
+        cache->pos = UINT64_MAX;
+    }
+    return cache;
+}
+
+// Grow *buf to hold len bytes
+static bool cache_reserve(char **buf, size_t *cap, size_t len)
+{
+    char *grown;
+
+    if (*cap >= len) {
+        return true;
+    }
+    grown = realloc(*buf, len);
+    if (grown == NULL) {
+        return false;
+    }
+    *buf = grown;
+    *cap = len;
+    return true;
+}
+
+// Index of the first block ending past offset, under cold_lock
+static size_t block_after(uint64_t offset)
+{
+    size_t lo = 0;
+    size_t hi = block_count;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (blocks[mid].start + blocks[mid].raw_len <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static bool block_push(const struct cold_block *block)
+{
+    struct cold_block *grown;
+    size_t capacity;
+
+    if (block_count == block_capacity) {
+        capacity = (block_capacity == 0) ? MIN_BLOCKS : block_capacity * 2;
+        grown = realloc(blocks, capacity * sizeof(*blocks));
+        if (grown == NULL) {
+            return false;
+        }
+        blocks = grown;
+        block_capacity = capacity;
+    }
+    blocks[block_count++] = *block;
+    __atomic_store_n(&cold_end, block->start + block->raw_len, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Free the file space of blocks from position from up to to
+static void punch(uint64_t from, uint64_t to)
+{
+    if ((to > from) &&
+        (fallocate(cold_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from) == -1)) {
+        syslog(LOG_ERR, "Error fallocate(PUNCH_HOLE) %s: %s\n", cold_path, strerror(errno));
+    }
+}
+
+// Load every block from the first one after the punched front of the file,
+// stopping at the first that is torn or not a block
+static int load(void)
+{
+    struct aesd_cold_header header;
+    struct cold_block block;
+    struct stat cold_stat;
+    uint64_t first_pos = 0;
+    uint64_t pos;
+    off_t data_pos;
+
+    if (fstat(cold_fd, &cold_stat) == -1) {
+        return -1;
+    }
+    data_pos = lseek(cold_fd, 0, SEEK_DATA);
+    pos = (data_pos == -1) ? (uint64_t)cold_stat.st_size : (uint64_t)data_pos;
+    pos &= ~(uint64_t)(BLOCK_ALIGN - 1);
+
+    while (pos + HEADER_SIZE <= (uint64_t)cold_stat.st_size) {
+        if (!read_full(cold_fd, &header, HEADER_SIZE, pos)) {
+            return -1;
+        }
+
+        // Zeros where less than a filesystem block of dropped blocks remains
+        if ((block_count == 0) && (header.magic == 0)) {
+            pos += BLOCK_ALIGN;
+            continue;
+        }
+
+        if ((header.magic != AESD_COLD_MAGIC) || (header.raw_len == 0) ||
+            (header.comp_len == 0) || (header.comp_len > header.raw_len) ||
+            (pos + HEADER_SIZE + header.comp_len > (uint64_t)cold_stat.st_size) ||
+            ((block_count > 0) && (header.start < cold_end))) {
+            break;
+        }
+
+        // A gap means retention dropped the history before it while the
+        // blocks it held were still waiting to be punched
+        if ((block_count > 0) && (header.start > cold_end)) {
+            punch(first_pos, pos);
+            block_count = 0;
+        }
+        if (block_count == 0) {
+            first_pos = pos;
+        }
+
+        block.start = header.start;
+        block.pos = pos;
+        block.raw_len = header.raw_len;
+        block.comp_len = header.comp_len;
+        block.crc = header.crc;
+        if (!block_push(&block)) {
+            errno = ENOMEM;
+            return -1;
+        }
+        pos += block_size(header.comp_len);
+    }
+
+    if (block_count == 0) {
+        __atomic_store_n(&cold_end, 0, __ATOMIC_RELEASE);
+    }
+
+    // New blocks go right after the last good one
+    if (pos != (uint64_t)cold_stat.st_size) {
+        if (pos < (uint64_t)cold_stat.st_size) {
+            syslog(LOG_ERR, "Cut off %llu bytes of torn blocks from %s\n",
+                    (unsigned long long)(cold_stat.st_size - pos), cold_path);
+        }
+        if (ftruncate(cold_fd, pos) == -1) {
+            return -1;
+        }
+    }
+    file_end = pos;
+    return 0;
+}
+
+int aesd_cold_open(const char *path, bool create)
+{
+    int saved_errno;
+
+    snprintf(cold_path, sizeof(cold_path), "%s%s", path, AESD_COLD_SUFFIX);
+    cold_fd = open(cold_path, O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT : 0), 0666);
+    if (cold_fd == -1) {
+        return ((errno == ENOENT) && !create) ? 0 : -1;
+    }
+
+    pthread_mutex_lock(&cold_lock);
+    if (load() == -1) {
+        saved_errno = errno;
+        pthread_mutex_unlock(&cold_lock);
+        aesd_cold_close(false);
+        errno = saved_errno;
+        return -1;
+    }
+    pthread_mutex_unlock(&cold_lock);
+    return 0;
+}
+
+int aesd_cold_add(uint64_t start, const void *buf, size_t len)
+{
+    struct aesd_cold_header header;
+    struct cold_block block;
+    uint64_t started = now_ns();
+    size_t bound = aesd_lz_bound(len);
+    size_t total;
+    char *out;
+    bool pushed;
+
+    if (cold_fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    if ((len == 0) || (len > UINT32_MAX - BLOCK_ALIGN)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    out = malloc(HEADER_SIZE + bound + BLOCK_ALIGN);
+    if (out == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    header.magic = AESD_COLD_MAGIC;
+    header.crc = aesd_crc32c(0, buf, len);
+    header.start = start;
+    header.raw_len = len;
+    header.comp_len = aesd_lz_compress(buf, len, out + HEADER_SIZE, bound);
+    if ((header.comp_len == 0) || (header.comp_len >= len)) {
+        // Stored as is, decoding it is a copy
+        memcpy(out + HEADER_SIZE, buf, len);
+        header.comp_len = len;
+    }
+    memcpy(out, &header, HEADER_SIZE);
+    total = block_size(header.comp_len);
+    memset(out + HEADER_SIZE + header.comp_len, 0, total - HEADER_SIZE - header.comp_len);
+
+    // Readers may use the block as soon as it is listed, so it is on disk
+    // first. A block cut short is removed so the next one lines up.
+    if (!write_full(cold_fd, out, total) || (fdatasync(cold_fd) == -1)) {
+        int saved_errno = errno;
+
+        if (ftruncate(cold_fd, file_end) == -1) {
+            syslog(LOG_ERR, "Error ftruncate(%s): %s\n", cold_path, strerror(errno));
+        }
+        free(out);
+        errno = saved_errno;
+        return -1;
+    }
+    free(out);
+
+    block.start = start;
+    block.raw_len = header.raw_len;
+    block.comp_len = header.comp_len;
+    block.crc = header.crc;
+    pthread_mutex_lock(&cold_lock);
+    block.pos = file_end;
+    file_end += total;
+    pushed = block_push(&block);
+    compressed++;
+    compressed_bytes += len;
+    compress_ns += now_ns() - started;
+    pthread_mutex_unlock(&cold_lock);
+    if (!pushed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+// Decompress block into cache, checking its CRC
+static int decode(const struct cold_block *block, struct cold_cache *cache)
+{
+    uint64_t started = now_ns();
+    bool stored = (block->comp_len == block->raw_len);
+
+    cache->pos = UINT64_MAX;
+    if (!cache_reserve(&cache->raw, &cache->raw_cap, block->raw_len) ||
+        (!stored && !cache_reserve(&cache->comp, &cache->comp_cap, block->comp_len))) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (!read_full(cold_fd, stored ? cache->raw : cache->comp, block->comp_len,
+                    block->pos + HEADER_SIZE)) {
+        return -1;
+    }
+    if (!stored && (aesd_lz_decompress(cache->comp, block->comp_len, cache->raw,
+                                        block->raw_len) != (ssize_t)block->raw_len)) {
+        errno = EIO;
+    } else if (aesd_crc32c(0, cache->raw, block->raw_len) != block->crc) {
+        errno = EIO;
+    } else {
+        cache->pos = block->pos;
+        __atomic_fetch_add(&decodes, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&decode_bytes, block->raw_len, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&decode_ns, now_ns() - started, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    __atomic_fetch_add(&crc_errors, 1, __ATOMIC_RELAXED);
+    syslog(LOG_ERR, "Error block of history at %llu in %s is corrupt\n",
+            (unsigned long long)block->start, cold_path);
+    return -1;
+}
+
+ssize_t aesd_cold_read(void *buf, size_t len, uint64_t offset)
+{
+    struct cold_block block;
+    struct cold_cache *cache;
+    size_t i;
+
+    if (offset >= __atomic_load_n(&cold_end, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&cold_lock);
+    i = block_after(offset);
+    if ((i == block_count) || (blocks[i].start > offset)) {
+        pthread_mutex_unlock(&cold_lock);
+        return 0;
+    }
+    block = blocks[i];
+    pthread_mutex_unlock(&cold_lock);
+
+    cache = cache_get();
+    if (cache == NULL) {
+        return -1;
+    }
+    if (cache->pos == block.pos) {
+        __atomic_fetch_add(&cache_hits, 1, __ATOMIC_RELAXED);
+    } else if (decode(&block, cache) == -1) {
+        return -1;
+    }
+
+    if (len > block.start + block.raw_len - offset) {
+        len = block.start + block.raw_len - offset;
+    }
+    memcpy(buf, cache->raw + (offset - block.start), len);
+    return len;
+}
+
+ssize_t aesd_cold_pread(int fd, void *buf, size_t len, uint64_t offset)
+{
+    ssize_t rx_bytes = aesd_cold_read(buf, len, offset);
+    size_t i;
+
+    if (rx_bytes != 0) {
+        return rx_bytes;
+    }
+
+    // Stop short of a block after offset, the data file no longer holds it
+    if (offset < __atomic_load_n(&cold_end, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&cold_lock);
+        i = block_after(offset);
+        if ((i < block_count) && (len > blocks[i].start - offset)) {
+            len = blocks[i].start - offset;
+        }
+        pthread_mutex_unlock(&cold_lock);
+    }
+    rx_bytes = pread(fd, buf, len, offset);
+
+    // A block added meanwhile may have had its range punched under the read
+    if ((rx_bytes > 0) && (offset < __atomic_load_n(&cold_end, __ATOMIC_ACQUIRE))) {
+        ssize_t cold_bytes = aesd_cold_read(buf, len, offset);
+
+        if (cold_bytes != 0) {
+            return cold_bytes;
+        }
+    }
+    return rx_bytes;
+}
+
+uint64_t aesd_cold_end(void)
+{
+    return __atomic_load_n(&cold_end, __ATOMIC_ACQUIRE);
+}
+
+uint64_t aesd_cold_covered(uint64_t offset)
+{
+    size_t i;
+
+    pthread_mutex_lock(&cold_lock);
+    i = block_after(offset);
+    if ((i < block_count) && (blocks[i].start <= offset)) {
+        offset = blocks[i].start + blocks[i].raw_len;
+        for (i++; (i < block_count) && (blocks[i].start == offset); i++) {
+            offset += blocks[i].raw_len;
+        }
+    }
+    pthread_mutex_unlock(&cold_lock);
+    return offset;
+}
+
+void aesd_cold_drop(uint64_t offset)
+{
+    uint64_t from, to;
+    size_t n;
+
+    pthread_mutex_lock(&cold_lock);
+    for (n = 0; (n < block_count) && (blocks[n].start + blocks[n].raw_len <= offset); n++);
+    if (n == 0) {
+        pthread_mutex_unlock(&cold_lock);
+        return;
+    }
+    from = blocks[0].pos;
+    to = blocks[n - 1].pos + block_size(blocks[n - 1].comp_len);
+    memmove(blocks, blocks + n, (block_count - n) * sizeof(*blocks));
+    block_count -= n;
+    if (block_count == 0) {
+        __atomic_store_n(&cold_end, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&cold_lock);
+
+    punch(from, to);
+}
+
+void aesd_cold_get_stats(struct aesd_cold_stats *stats)
+{
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&cold_lock);
+    stats->blocks = block_count;
+    if (block_count > 0) {
+        stats->start = blocks[0].start;
+        stats->end = blocks[block_count - 1].start + blocks[block_count - 1].raw_len;
+    }
+    for (i = 0; i < block_count; i++) {
+        stats->raw_bytes += blocks[i].raw_len;
+        stats->comp_bytes += blocks[i].comp_len;
+    }
+    stats->compressed = compressed;
+    stats->compressed_bytes = compressed_bytes;
+    stats->compress_ns = compress_ns;
+    pthread_mutex_unlock(&cold_lock);
+    stats->decodes = __atomic_load_n(&decodes, __ATOMIC_RELAXED);
+    stats->decode_bytes = __atomic_load_n(&decode_bytes, __ATOMIC_RELAXED);
+    stats->decode_ns = __atomic_load_n(&decode_ns, __ATOMIC_RELAXED);
+    stats->cache_hits = __atomic_load_n(&cache_hits, __ATOMIC_RELAXED);
+    stats->crc_errors = __atomic_load_n(&crc_errors, __ATOMIC_RELAXED);
+}
+
+void aesd_cold_close(bool remove)
+{
+    pthread_mutex_lock(&cold_lock);
+    free(blocks);
+    blocks = NULL;
+    block_count = 0;
+    block_capacity = 0;
+    __atomic_store_n(&cold_end, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cold_lock);
+
+    if (cold_fd == -1) {
+        return;
+    }
+    close(cold_fd);
+    cold_fd = -1;
+    if (remove && (unlink(cold_path) == -1)) {
+        syslog(LOG_ERR, "Error unlink(%s): %s\n", cold_path, strerror(errno));
+    }
+}
@@ -0,0 +1,134 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-cold.h
+​*​ ​@brief​ Compressed blocks of cold history and decompression on read
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* Sealed segments of the history far enough behind its end are compressed
+* with aesd-lz into blocks appended to path + ".lz", then punched out of the
+* data file. Offsets do not change: a block says which history offset it
+* starts at, and reads of a compressed offset are answered by decompressing
+* its block instead of from the data file. Every thread keeps the block it
+* read last, so a reply streaming through the history decodes each block
+* once.
+*
+* A block is a header followed by its compressed bytes, padded to 8 bytes.
+* Integers are in host byte order. A block whose data did not compress is
+* stored as is, with comp_len equal to raw_len. The CRC32C of the
+* decompressed bytes is checked on every decode.
+*
+* Blocks follow each other in history order. A block is only written once
+* the data under it is on disk, and is synced before the data file is
+* punched, so a crash loses at most a block that was never used. Blocks that
+* retention drops are punched out of the front of the file, which leaves
+* zeros where blocks used to be.
+*/
+
+#ifndef AESD_COLD_H
+#define AESD_COLD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define AESD_COLD_SUFFIX    (".lz")
+#define AESD_COLD_MAGIC     (0x315a4c41U)  // "ALZ1"
+
+struct aesd_cold_header {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t start;
+    uint32_t raw_len;
+    uint32_t comp_len;
+};
+
+struct aesd_cold_stats {
+    size_t blocks;
+    /**
+     * History offsets the blocks run between, and their sizes
+     */
+    uint64_t start;
+    uint64_t end;
+    uint64_t raw_bytes;
+    uint64_t comp_bytes;
+    /**
+     * Blocks decompressed, their bytes and time, and reads answered from
+     * a block already decompressed
+     */
+    uint64_t decodes;
+    uint64_t decode_bytes;
+    uint64_t decode_ns;
+    uint64_t cache_hits;
+    /**
+     * Blocks written since start, their bytes and time spent compressing
+     */
+    uint64_t compressed;
+    uint64_t compressed_bytes;
+    uint64_t compress_ns;
+    uint64_t crc_errors;
+};
+
+/**
+ * Load the blocks of path + ".lz", creating it if create is set. A torn
+ * block at the end is cut off. Returns 0, also when there is no file to
+ * load, or -1 with errno set.
+ */
+extern int aesd_cold_open(const char *path, bool create);
+
+/**
+ * Compress len bytes of history starting at offset start into a new block
+ * and sync it. Reads see the block once this returns 0, -1 sets errno.
+ */
+extern int aesd_cold_add(uint64_t start, const void *buf, size_t len);
+
+/**
+ * Copy up to len bytes of compressed history from offset into buf. Returns
+ * the number copied, which stops at the end of a block, 0 if offset is not
+ * compressed or -1 with errno set.
+ */
+extern ssize_t aesd_cold_read(void *buf, size_t len, uint64_t offset);
+
+/**
+ * pread() from the data file fd, decompressing what it no longer holds
+ */
+extern ssize_t aesd_cold_pread(int fd, void *buf, size_t len, uint64_t offset);
+
+/**
+ * Offset one past the last compressed byte, 0 if nothing is
+ */
+extern uint64_t aesd_cold_end(void);
+
+/**
+ * Where the run of blocks holding offset ends, offset itself if no block
+ * holds it
+ */
+extern uint64_t aesd_cold_covered(uint64_t offset);
+
+/**
+ * Forget the blocks ending at or before offset and punch them out of the file
+ */
+extern void aesd_cold_drop(uint64_t offset);
+
+/**
+ * Snapshot of the block and decode counters
+ */
+extern void aesd_cold_get_stats(struct aesd_cold_stats *stats);
+
+/**
+ * Close the file, and remove it if remove is set
+ */
+extern void aesd_cold_close(bool remove);
+
+#endif /* AESD_COLD_H */
@@ -0,0 +1,191 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-crc32c.c
+​*​ ​@brief​ CRC32C (Castagnoli) with the SSE4.2 crc32 instruction when present
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "aesd-crc32c.h"
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY     (0x82f63b78U)
+// Bytes each of the three hardware streams covers per round
+#define STREAM_BLOCK    (4096)
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+static uint32_t slice_table[8][256];
+// Multiplies a CRC by x^(8 * STREAM_BLOCK) mod P, a byte of the CRC at a time
+static uint32_t shift_table[4][256];
+static bool use_sse42 = false;
+
+// a * b mod P, both reflected
+static uint32_t multiply_mod_p(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1U << 31;
+    uint32_t product = 0;
+
+    while (m != 0) {
+        if (a & m) {
+            product ^= b;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// x^(8 * len) mod P, by squaring
+static uint32_t x_pow_bytes_mod_p(uint64_t len)
+{
+    uint64_t n = len * 8;
+    uint32_t result = 1U << 31;     // x^0
+    uint32_t square = 1U << 30;     // x^1
+
+    while (n != 0) {
+        if (n & 1) {
+            result = multiply_mod_p(square, result);
+        }
+        square = multiply_mod_p(square, square);
+        n >>= 1;
+    }
+    return result;
+}
+
+static void tables_init(void)
+{
+    uint32_t shift_op = x_pow_bytes_mod_p(STREAM_BLOCK);
+    uint32_t crc;
+    int n, k;
+
+    for (n = 0; n < 256; n++) {
+        crc = n;
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        slice_table[0][n] = crc;
+    }
+    for (n = 0; n < 256; n++) {
+        crc = slice_table[0][n];
+        for (k = 1; k < 8; k++) {
+            crc = slice_table[0][crc & 0xff] ^ (crc >> 8);
+            slice_table[k][n] = crc;
+        }
+        for (k = 0; k < 4; k++) {
+            shift_table[k][n] = multiply_mod_p(shift_op, (uint32_t)n << (8 * k));
+        }
+    }
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    use_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t aesd_crc32c_table(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t c = ~crc;
+    uint64_t word;
+
+    pthread_once(&tables_once, tables_init);
+    while (len >= 8) {
+        memcpy(&word, p, 8);
+        c ^= word;
+        c = slice_table[7][c & 0xff] ^ slice_table[6][(c >> 8) & 0xff] ^
+            slice_table[5][(c >> 16) & 0xff] ^ slice_table[4][(c >> 24) & 0xff] ^
+            slice_table[3][(c >> 32) & 0xff] ^ slice_table[2][(c >> 40) & 0xff] ^
+            slice_table[1][(c >> 48) & 0xff] ^ slice_table[0][c >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        c = slice_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+    return ~(uint32_t)c;
+}
+
+#if defined(__x86_64__)
+// CRC of the stream so far followed by STREAM_BLOCK zero bytes
+static inline uint32_t shift_block(uint32_t crc)
+{
+    return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^
+            shift_table[2][(crc >> 16) & 0xff] ^ shift_table[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    const unsigned char *block_end;
+    uint64_t c0 = ~crc;
+    uint64_t c1, c2;
+    uint64_t w0, w1, w2;
+
+    // Three blocks at a time, the second and third start from a zero CRC and
+    // are folded in by shifting the running CRC past them
+    while (len >= 3 * STREAM_BLOCK) {
+        c1 = 0;
+        c2 = 0;
+        block_end = p + STREAM_BLOCK;
+        do {
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p + STREAM_BLOCK, 8);
+            memcpy(&w2, p + 2 * STREAM_BLOCK, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+            p += 8;
+        } while (p < block_end);
+        c0 = shift_block((uint32_t)c0) ^ c1;
+        c0 = shift_block((uint32_t)c0) ^ c2;
+        p += 2 * STREAM_BLOCK;
+        len -= 3 * STREAM_BLOCK;
+    }
+
+    while (len >= 8) {
+        memcpy(&w0, p, 8);
+        c0 = _mm_crc32_u64(c0, w0);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        c0 = _mm_crc32_u8((uint32_t)c0, *p++);
+    }
+    return ~(uint32_t)c0;
+}
+#endif
+
+uint32_t aesd_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&tables_once, tables_init);
+#if defined(__x86_64__)
+    if (use_sse42) {
+        return crc32c_sse42(crc, buf, len);
+    }
+#endif
+    return aesd_crc32c_table(crc, buf, len);
+}
+
+const char *aesd_crc32c_impl(void)
+{
+    pthread_once(&tables_once, tables_init);
+    return use_sse42 ? "sse4.2" : "table";
+}
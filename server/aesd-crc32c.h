@@ -0,0 +1,45 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-crc32c.h
+​*​ ​@brief​ CRC32C (Castagnoli) with the SSE4.2 crc32 instruction when present
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* On x86-64 CPUs with SSE4.2 the crc32 instruction runs three independent
+* streams over adjacent blocks, which hides its latency, and the three CRCs
+* are combined with a table that shifts a CRC past a block of zeros. Other
+* CPUs use a slicing-by-8 table.
+*/
+
+#ifndef AESD_CRC32C_H
+#define AESD_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CRC32C of len bytes at buf, continuing from crc, which is 0 to start
+ */
+extern uint32_t aesd_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Same result as aesd_crc32c() from the table implementation only
+ */
+extern uint32_t aesd_crc32c_table(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * Name of the implementation aesd_crc32c() uses, "sse4.2" or "table"
+ */
+extern const char *aesd_crc32c_impl(void);
+
+#endif /* AESD_CRC32C_H */
@@ -0,0 +1,101 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-fairq.c
+​*​ ​@brief​ Weighted fair queue serializing access to the append stage
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+#include "aesd-fairq.h"
+
+void aesd_fairq_init(struct aesd_fairq *q)
+{
+    aesd_lock_init(&q->lock, "fairq");
+    q->vtime = 0;
+    q->busy = false;
+    TAILQ_INIT(&q->waiting);
+}
+
+void aesd_fairq_destroy(struct aesd_fairq *q)
+{
+    aesd_lock_destroy(&q->lock);
+}
+
+void aesd_fairq_flow_init(struct aesd_fairq_flow *flow, double weight)
+{
+    flow->weight = (weight > 0) ? weight : 1.0;
+    flow->last_finish = 0;
+}
+
+// Waiting ticket with the smallest finish tag, ties go to the oldest
+static struct aesd_fairq_ticket *fairq_next(struct aesd_fairq *q)
+{
+    struct aesd_fairq_ticket *ticket;
+    struct aesd_fairq_ticket *p_min = NULL;
+
+    TAILQ_FOREACH(ticket, &q->waiting, tickets) {
+        if ((p_min == NULL) || (ticket->finish < p_min->finish)) {
+            p_min = ticket;
+        }
+    }
+    return p_min;
+}
+
+void aesd_fairq_enter(struct aesd_fairq *q, struct aesd_fairq_flow *flow, size_t cost)
+{
+    struct aesd_fairq_ticket ticket;
+
+    aesd_lock(&q->lock);
+
+    // Flows may be shared by several connections so tags are assigned under the lock
+    ticket.start = (flow->last_finish > q->vtime) ? flow->last_finish : q->vtime;
+    ticket.finish = ticket.start + (cost / flow->weight);
+    flow->last_finish = ticket.finish;
+
+    // Uncontended, take the stage straight away
+    if (!q->busy && TAILQ_EMPTY(&q->waiting)) {
+        q->busy = true;
+        q->vtime = ticket.start;
+        aesd_unlock(&q->lock);
+        return;
+    }
+
+    pthread_cond_init(&ticket.cond, NULL);
+    TAILQ_INSERT_TAIL(&q->waiting, &ticket, tickets);
+
+    while (q->busy || (fairq_next(q) != &ticket)) {
+        aesd_lock_cond_wait(&ticket.cond, &q->lock);
+    }
+
+    TAILQ_REMOVE(&q->waiting, &ticket, tickets);
+    pthread_cond_destroy(&ticket.cond);
+    q->busy = true;
+    q->vtime = ticket.start;
+
+    aesd_unlock(&q->lock);
+}
+
+void aesd_fairq_leave(struct aesd_fairq *q)
+{
+    struct aesd_fairq_ticket *p_next;
+
+    aesd_lock(&q->lock);
+
+    q->busy = false;
+    p_next = fairq_next(q);
+    if (p_next != NULL) {
+        pthread_cond_signal(&p_next->cond);
+    }
+
+    aesd_unlock(&q->lock);
+}
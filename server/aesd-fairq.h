@@ -0,0 +1,87 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-fairq.h
+​*​ ​@brief​ Weighted fair queue serializing access to the append stage
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*
+* Threads ask for a turn with the number of bytes they are about to append.
+* Each flow's requests are tagged with a virtual finish time of
+* start + bytes / weight, where start is the later of the queue's virtual time
+* and the flow's previous finish time, and turns are granted in order of the
+* smallest finish tag. A flow pushing megabytes therefore
+* waits behind flows sending small packets instead of winning every race for
+* the lock.
+*/
+
+#ifndef AESD_FAIRQ_H
+#define AESD_FAIRQ_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "aesd-lock.h"
+
+struct aesd_fairq_flow {
+    /**
+     * Share of the append stage relative to other flows
+     */
+    double weight;
+    /**
+     * Virtual finish time of the flow's last request
+     */
+    double last_finish;
+};
+
+struct aesd_fairq_ticket {
+    double start;
+    double finish;
+    pthread_cond_t cond;
+    TAILQ_ENTRY(aesd_fairq_ticket) tickets;
+};
+
+struct aesd_fairq {
+    struct aesd_lock lock;
+    /**
+     * Start tag of the request holding or last holding the stage
+     */
+    double vtime;
+    /**
+     * A thread currently holds the stage
+     */
+    bool busy;
+    /**
+     * Threads waiting for a turn
+     */
+    TAILQ_HEAD(fairq_head, aesd_fairq_ticket) waiting;
+};
+
+extern void aesd_fairq_init(struct aesd_fairq *q);
+
+extern void aesd_fairq_destroy(struct aesd_fairq *q);
+
+extern void aesd_fairq_flow_init(struct aesd_fairq_flow *flow, double weight);
+
+/**
+ * Block until it is flow's turn to append cost bytes. Every call must be
+ * followed by aesd_fairq_leave().
+ */
+extern void aesd_fairq_enter(struct aesd_fairq *q, struct aesd_fairq_flow *flow, size_t cost);
+
+/**
+ * Give up the turn and wake the waiter with the smallest finish tag
+ */
+extern void aesd_fairq_leave(struct aesd_fairq *q);
+
+#endif /* AESD_FAIRQ_H */
@@ -0,0 +1,64 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-frame.c
+​*​ ​@brief​ Length-prefixed binary framing negotiated at connection start
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#include <stdbool.h>
+#include <string.h>
+#include "aesd-frame.h"
+
+enum aesd_frame_mode aesd_frame_detect(const char *buf, size_t len)
+{
+    size_t cmp_len = (len < AESD_FRAME_MAGIC_LEN) ? len : AESD_FRAME_MAGIC_LEN;
+    bool binary = (memcmp(buf, AESD_FRAME_MAGIC, cmp_len) == 0);
+    bool replica = (memcmp(buf, AESD_FRAME_REPLICA_MAGIC, cmp_len) == 0);
+
+    // The magics open with a NUL byte, which a newline client has no use for
+    if (!binary && !replica) {
+        return AESD_FRAME_NEWLINE;
+    }
+    if (cmp_len < AESD_FRAME_MAGIC_LEN) {
+        return AESD_FRAME_UNKNOWN;
+    }
+    return binary ? AESD_FRAME_BINARY : AESD_FRAME_REPLICA;
+}
+
+size_t aesd_frame_put_varint(char *buf, uint64_t value)
+{
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        buf[len++] = (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (char)value;
+    return len;
+}
+
+int aesd_frame_get_varint(const char *buf, size_t len, uint64_t *value)
+{
+    uint64_t result = 0;
+    size_t i;
+
+    for (i = 0; (i < len) && (i < AESD_FRAME_VARINT_MAX); i++) {
+        result |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+        if ((buf[i] & 0x80) == 0) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return (i == AESD_FRAME_VARINT_MAX) ? -1 : 0;
+}
@@ -0,0 +1,65 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-frame.h
+​*​ ​@brief​ Length-prefixed binary framing negotiated at connection start
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* A connection is newline framed unless its first bytes are
+* AESD_FRAME_MAGIC. After the magic every packet the client sends is a
+* frame: its payload length as an unsigned LEB128 varint followed by that
+* many arbitrary bytes. Every reply on such a connection is framed the same
+* way, so a client knows where each history reply ends.
+*
+* A connection opening with AESD_FRAME_REPLICA_MAGIC instead is a follower
+* replicating the history, see aesd-replica.h.
+*/
+
+#ifndef AESD_FRAME_H
+#define AESD_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_FRAME_MAGIC        ("\0AF1")
+#define AESD_FRAME_MAGIC_LEN    (4)
+#define AESD_FRAME_REPLICA_MAGIC    ("\0AR1")
+// Longest varint a 64 bit length encodes to
+#define AESD_FRAME_VARINT_MAX   (10)
+
+enum aesd_frame_mode {
+    AESD_FRAME_UNKNOWN,     // Too few bytes received to tell yet
+    AESD_FRAME_NEWLINE,
+    AESD_FRAME_BINARY,
+    AESD_FRAME_REPLICA,     // Follower, same magic length
+};
+
+/**
+ * Framing of a connection whose first len received bytes are buf
+ */
+extern enum aesd_frame_mode aesd_frame_detect(const char *buf, size_t len);
+
+/**
+ * Encode value into buf, which must hold AESD_FRAME_VARINT_MAX bytes.
+ * Returns the number of bytes written.
+ */
+extern size_t aesd_frame_put_varint(char *buf, uint64_t value);
+
+/**
+ * Decode the varint at the start of the len bytes at buf into *value.
+ * Returns its length, 0 if buf ends before the varint does or -1 if it is
+ * longer than AESD_FRAME_VARINT_MAX bytes.
+ */
+extern int aesd_frame_get_varint(const char *buf, size_t len, uint64_t *value);
+
+#endif /* AESD_FRAME_H */
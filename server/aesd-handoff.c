@@ -0,0 +1,145 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-handoff.c
+​*​ ​@brief​ Listening socket handoff between an old and a new server process
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "aesd-handoff.h"
+
+pid_t aesd_handoff_spawn(const char *path, char *const argv[], int *chan)
+{
+    int pair[2];
+    char fd_str[16];
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == -1) {
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        int saved_errno = errno;
+
+        close(pair[0]);
+        close(pair[1]);
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Only the child's end of the channel survives the exec
+        close(pair[0]);
+        if (fcntl(pair[1], F_SETFD, 0) == -1) {
+            _exit(127);
+        }
+        snprintf(fd_str, sizeof(fd_str), "%d", pair[1]);
+        setenv(AESD_HANDOFF_ENV, fd_str, 1);
+        execv(path, argv);
+        _exit(127);
+    }
+
+    close(pair[1]);
+    *chan = pair[0];
+    return pid;
+}
+
+int aesd_handoff_inherited(void)
+{
+    const char *fd_str = getenv(AESD_HANDOFF_ENV);
+    char *p_end = NULL;
+    long fd;
+
+    if (fd_str == NULL) {
+        return -1;
+    }
+
+    fd = strtol(fd_str, &p_end, 10);
+    unsetenv(AESD_HANDOFF_ENV);
+    if ((*p_end != '\0') || (fd < 0)) {
+        return -1;
+    }
+
+    // Keep the channel from leaking into a later upgrade of this process
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int aesd_handoff_send(int chan, char type, int fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &type, .iov_len = 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd != -1) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    while (sendmsg(chan, &msg, MSG_NOSIGNAL) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int aesd_handoff_recv(int chan, char *type, int *fd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = type, .iov_len = 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        len = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC);
+    } while ((len == -1) && (errno == EINTR));
+
+    if (len <= 0) {
+        return len;
+    }
+
+    *fd = -1;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    return 1;
+}
@@ -0,0 +1,76 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-handoff.h
+​*​ ​@brief​ Listening socket handoff between an old and a new server process
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*
+* An upgrade execs the new binary with one end of a SOCK_SEQPACKET socket
+* pair named in AESD_HANDOFF_ENV. Every message is one type byte, optionally
+* carrying a descriptor with SCM_RIGHTS:
+*
+*   old -> new  AESD_HANDOFF_LISTENER  listening socket, repeated per listener
+*   old -> new  AESD_HANDOFF_END       no more listeners follow
+*   new -> old  AESD_HANDOFF_READY     new server is accepting
+*   old -> new  AESD_HANDOFF_CLIENT    idle client connection to take over
+*   old -> new  AESD_HANDOFF_FRAMED    same, for a connection using binary frames
+*
+* The old server stops accepting on READY and exits once its own
+* connections have drained. Closing the pair ends the handoff.
+*
+* The same framing hands history readers the mirror on the --shm-socket
+* listener:
+*
+*   server -> reader  AESD_HANDOFF_HISTORY  read-only history mirror memfd
+*/
+
+#ifndef AESD_HANDOFF_H
+#define AESD_HANDOFF_H
+
+#include <sys/types.h>
+
+#define AESD_HANDOFF_ENV        ("AESD_HANDOFF_FD")
+
+#define AESD_HANDOFF_LISTENER   ('L')
+#define AESD_HANDOFF_END        ('E')
+#define AESD_HANDOFF_READY      ('R')
+#define AESD_HANDOFF_CLIENT     ('C')
+#define AESD_HANDOFF_FRAMED     ('F')
+#define AESD_HANDOFF_HISTORY    ('H')
+
+/**
+ * Fork and exec path with argv, passing it the other end of a new handoff
+ * channel. Returns the child pid and stores the channel in *chan, or returns
+ * -1 with errno set.
+ */
+extern pid_t aesd_handoff_spawn(const char *path, char *const argv[], int *chan);
+
+/**
+ * Channel inherited from the old server, or -1 when not started by an upgrade
+ */
+extern int aesd_handoff_inherited(void);
+
+/**
+ * Send a message, passing fd along unless it is -1. Safe to call from several
+ * threads at once. Returns 0, or -1 with errno set.
+ */
+extern int aesd_handoff_send(int chan, char type, int fd);
+
+/**
+ * Receive one message into *type and *fd, *fd is -1 when none was passed.
+ * Returns 1 for a message, 0 once the peer has closed the channel, or -1 with
+ * errno set.
+ */
+extern int aesd_handoff_recv(int chan, char *type, int *fd);
+
+#endif /* AESD_HANDOFF_H */
@@ -0,0 +1,1490 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-history.c
+​*​ ​@brief​ Single append path for the history and its shared memory mirror
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "aesd-history.h"
+#include "aesd-checksum.h"
+#include "aesd-cold.h"
+#include "aesd-lock.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE (0x0010)
+#endif
+
+#define SEED_CHUNK_SIZE     (64 * 1024)
+#define INDEX_MIN_RECORDS   (1024)
+#define INDEX_MIN_SEGMENTS  (16)
+#define SEGMENT_SIZE        (1024 * 1024)
+#define BLOOM_BITS_LOG2     (18)
+#define BLOOM_BYTES         ((1U << BLOOM_BITS_LOG2) / 8)
+#define TRIGRAM_MASK        (0xffffff)
+#define GREP_CHUNK_SIZE     (1024 * 1024)
+#define INDEX_MIN_STAMPS    (64)
+#define STAMP_PREFIX        ("timestamp:")
+#define STAMP_PREFIX_LEN    (10)
+#define STAMP_FORMAT        ("%a, %d %b %Y %T %z")
+#define RETENTION_PERIOD_S  (1)
+#define MIN_PINS            (16)
+// Appends wake the retention thread early once a limit is overrun by 1/8
+#define RETENTION_SLACK_SHIFT (3)
+
+// A run of whole records of about SEGMENT_SIZE bytes. Once the segment is
+// full, the first search to read all of it leaves a bloom filter of every
+// three byte sequence in it, so the append path never hashes anything.
+struct history_segment {
+    uint64_t start;
+    uint8_t *bloom;
+};
+
+// Orders appends so the mirror and index hold them in data file order
+static struct aesd_lock history_lock = AESD_LOCK_INITIALIZER("history");
+static struct aesd_history_shm *shm = NULL;
+static size_t shm_len = 0;
+static int shm_fd = -1;
+
+// Record index, the offset one past the end of every record in order. The
+// history runs from history_start, the records before it are dropped.
+static bool indexed = false;
+static uint64_t *record_ends = NULL;
+static size_t record_count = 0;
+static size_t record_capacity = 0;
+static uint64_t history_start = 0;
+static uint64_t history_bytes = 0;
+static uint64_t records_dropped = 0;
+
+// Timestamp records, when each was written and where it ends
+struct history_stamp {
+    time_t time;
+    uint64_t end;
+};
+
+static struct history_stamp *stamps = NULL;
+static size_t stamp_count = 0;
+static size_t stamp_capacity = 0;
+
+// Retention thread, and the data file descriptor it punches holes with
+static struct aesd_history_retention retention;
+static pthread_t retention_thread;
+static pthread_cond_t retention_cond = PTHREAD_COND_INITIALIZER;
+static bool retention_running = false;
+static bool retention_stop = false;
+static int punch_fd = -1;
+static uint64_t punched = 0;
+static uint64_t punching = 0;       // Where a punch under way ends
+
+// Data file offsets zerocopy replies have mapped, in offset order with the
+// number of mappings from each. Nothing from the lowest one on is punched.
+struct history_pin {
+    uint64_t offset;
+    size_t count;
+};
+
+static struct history_pin *pins = NULL;
+static size_t pin_count = 0;
+static size_t pin_capacity = 0;
+
+// Cold segment compression, run by the retention thread unless paused
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+static bool compress_paused = false;
+static bool compress_busy = false;
+
+// Replication senders waiting for the history to grow
+static pthread_cond_t append_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int append_waiters = 0;
+
+// Sync thread, the data file descriptor it runs fdatasync() on and the
+// watermark below which every appended byte is on disk
+static enum aesd_durability durability = AESD_DURABILITY_NONE;
+static unsigned int sync_period_ms = 0;
+static pthread_t sync_thread;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;
+static bool sync_running = false;
+static bool sync_stop = false;
+static int sync_fd = -1;
+static int sync_error = 0;
+static uint64_t durable = 0;
+static uint64_t appends = 0;
+static uint64_t durable_appends = 0;
+static uint64_t syncs = 0;
+static uint64_t sync_us_total = 0;
+static uint64_t sync_us_max = 0;
+
+// Segments, the last one takes appends until it passes SEGMENT_SIZE
+static struct history_segment *segments = NULL;
+static size_t segment_count = 0;
+static size_t segment_capacity = 0;
+
+// Drop an index that cannot grow rather than leave it wrong
+static void index_drop(void)
+{
+    size_t i;
+
+    free(record_ends);
+    record_ends = NULL;
+    record_count = 0;
+    record_capacity = 0;
+    for (i = 0; i < segment_count; i++) {
+        free(segments[i].bloom);
+    }
+    free(segments);
+    segments = NULL;
+    segment_count = 0;
+    segment_capacity = 0;
+    free(stamps);
+    stamps = NULL;
+    stamp_count = 0;
+    stamp_capacity = 0;
+    indexed = false;
+}
+
+// Bloom filter bit of a trigram, one multiplicative hash. A pattern checks
+// one bit per trigram it holds, so one bit each keeps the filter sparse.
+static inline uint32_t bloom_bit(uint32_t gram)
+{
+    return (gram * 0x9e3779b1U) >> (32 - BLOOM_BITS_LOG2);
+}
+
+// Start a new segment at history offset start
+static bool segment_add(uint64_t start)
+{
+    struct history_segment *grown;
+    size_t capacity;
+
+    if (segment_count == segment_capacity) {
+        capacity = (segment_capacity == 0) ? INDEX_MIN_SEGMENTS : segment_capacity * 2;
+        grown = realloc(segments, capacity * sizeof(*segments));
+        if (grown == NULL) {
+            return false;
+        }
+        segments = grown;
+        segment_capacity = capacity;
+    }
+
+    segments[segment_count].start = start;
+    segments[segment_count].bloom = NULL;
+    segment_count++;
+    return true;
+}
+
+// End a record at the current end of the history
+static void index_end_record(void)
+{
+    uint64_t *grown;
+    size_t capacity;
+
+    if (record_count == record_capacity) {
+        capacity = (record_capacity == 0) ? INDEX_MIN_RECORDS : record_capacity * 2;
+        grown = realloc(record_ends, capacity * sizeof(*record_ends));
+        if (grown == NULL) {
+            syslog(LOG_ERR, "Error record index over %zu records, dropping it\n", record_count);
+            index_drop();
+            return;
+        }
+        record_ends = grown;
+        record_capacity = capacity;
+    }
+    record_ends[record_count++] = history_bytes;
+
+    // A full segment is followed by a new one from the next record on
+    if (((segment_count == 0) && !segment_add(history_start)) ||
+        ((history_bytes - segments[segment_count - 1].start >= SEGMENT_SIZE) &&
+            !segment_add(history_bytes))) {
+        syslog(LOG_ERR, "Error history index over %zu segments, dropping it\n", segment_count);
+        index_drop();
+    }
+}
+
+// Account for len appended bytes, ending a record if end_record is set
+static void index_append(size_t len, bool end_record)
+{
+    history_bytes += len;
+    if (indexed && end_record) {
+        index_end_record();
+    }
+}
+
+// Note when a timestamp record just appended was written. A record that
+// does not parse, or no room to note it, only makes age retention coarser.
+static void index_stamp(const char *buf, size_t len)
+{
+    struct history_stamp *grown;
+    char text[64];
+    struct tm tm;
+    size_t capacity;
+
+    if (!indexed || (len <= STAMP_PREFIX_LEN) || (len - STAMP_PREFIX_LEN >= sizeof(text)) ||
+        (memcmp(buf, STAMP_PREFIX, STAMP_PREFIX_LEN) != 0)) {
+        return;
+    }
+
+    memcpy(text, buf + STAMP_PREFIX_LEN, len - STAMP_PREFIX_LEN);
+    text[len - STAMP_PREFIX_LEN] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(text, STAMP_FORMAT, &tm) == NULL) {
+        return;
+    }
+
+    if (stamp_count == stamp_capacity) {
+        capacity = (stamp_capacity == 0) ? INDEX_MIN_STAMPS : stamp_capacity * 2;
+        grown = realloc(stamps, capacity * sizeof(*stamps));
+        if (grown == NULL) {
+            return;
+        }
+        stamps = grown;
+        stamp_capacity = capacity;
+    }
+    stamps[stamp_count].time = timegm(&tm) - tm.tm_gmtoff;
+    stamps[stamp_count].end = history_bytes;
+    stamp_count++;
+}
+
+// Index the records of a chunk read from the data file, newline terminated
+static void index_seed(const char *buf, size_t len)
+{
+    const char *p = buf;
+    const char *p_end;
+
+    while ((p_end = memchr(p, '\n', len - (p - buf))) != NULL) {
+        index_append(p_end + 1 - p, true);
+        index_stamp(p, p_end + 1 - p);
+        p = p_end + 1;
+    }
+    index_append(len - (p - buf), false);
+}
+
+// Copy bytes into the ring at the current end, then publish them
+static void mirror_append(const char *buf, size_t len)
+{
+    char *ring = (char *)shm + shm->header_size;
+    uint64_t mask = shm->capacity - 1;
+    uint64_t end = shm->end;
+    size_t first;
+
+    // Readers must see the raised reserve before any overwritten byte
+    __atomic_store_n(&shm->reserve, end + len, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    // Only the last capacity bytes of a large append survive anyway
+    if (len > shm->capacity) {
+        end += len - shm->capacity;
+        buf += len - shm->capacity;
+        len = shm->capacity;
+    }
+
+    first = shm->capacity - (end & mask);
+    if (first > len) {
+        first = len;
+    }
+    memcpy(ring + (end & mask), buf, first);
+    memcpy(ring, buf + first, len - first);
+
+    __atomic_store_n(&shm->end, end + len, __ATOMIC_RELEASE);
+}
+
+// Wake every reader sleeping on seq
+static void mirror_wake(void)
+{
+    __atomic_add_fetch(&shm->seq, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &shm->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Index and mirror the data file from history_bytes up to offset end, or to
+// its end of file if end is 0
+static void history_load(int fd, uint64_t end)
+{
+    char *buf = malloc(SEED_CHUNK_SIZE);
+    size_t rd_size;
+    ssize_t rx_bytes;
+
+    if (buf == NULL) {
+        syslog(LOG_ERR, "Error failed to malloc()\n");
+        return;
+    }
+
+    while ((end == 0) || (history_bytes < end)) {
+        rd_size = SEED_CHUNK_SIZE;
+        if ((end != 0) && (end - history_bytes < rd_size)) {
+            rd_size = end - history_bytes;
+        }
+        rx_bytes = aesd_cold_pread(fd, buf, rd_size, history_bytes);
+        if (rx_bytes <= 0) {
+            break;
+        }
+        index_seed(buf, rx_bytes);
+        if (shm != NULL) {
+            mirror_append(buf, rx_bytes);
+        }
+    }
+    free(buf);
+}
+
+// Offset of the first retained byte of the data file. Dropped records are
+// punched out of the file, which leaves zeros where less than a block of
+// them remains, so that is the first byte after the leading hole that is
+// not zero. A history that really starts with zeros loses them.
+static uint64_t history_first_byte(int fd)
+{
+    char buf[4096];
+    off_t pos = lseek(fd, 0, SEEK_DATA);
+    ssize_t rx_bytes;
+    ssize_t i;
+
+    if (pos == -1) {
+        pos = 0;
+    }
+
+    while ((rx_bytes = pread(fd, buf, sizeof(buf), pos)) > 0) {
+        for (i = 0; i < rx_bytes; i++) {
+            if (buf[i] != '\0') {
+                return pos + i;
+            }
+        }
+        pos += rx_bytes;
+    }
+    return pos;
+}
+
+// Load what the data file holds already into the index and ring
+static void history_seed(const char *path)
+{
+    struct aesd_cold_stats cold;
+    uint64_t tail_start;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return;
+    }
+    history_start = history_first_byte(fd);
+
+    // Compressed segments were punched out of the data file, the history
+    // starts at the first block if the blocks reach the data left in it
+    aesd_cold_get_stats(&cold);
+    if ((cold.blocks > 0) && (cold.start < history_start) && (cold.end >= history_start)) {
+        history_start = cold.start;
+    }
+    history_bytes = history_start;
+    punched = history_start;
+
+    // The ring holds history offset o at o % capacity, from the first one
+    if (shm != NULL) {
+        shm->start = history_start;
+        shm->reserve = history_start;
+        shm->end = history_start;
+    }
+    history_load(fd, 0);
+    close(fd);
+
+    // Whatever follows the last newline is a record of its own
+    tail_start = (record_count > 0) ? record_ends[record_count - 1] : history_start;
+    if (indexed && (history_bytes > tail_start)) {
+        index_end_record();
+    }
+}
+
+// Create the memfd mirror, returns 0 or -1 with errno set
+static int mirror_init(size_t capacity)
+{
+    size_t ring_size = 4096;
+    void *mapping;
+    int saved_errno;
+
+    while (ring_size < capacity) {
+        ring_size <<= 1;
+    }
+
+    shm_fd = memfd_create("aesd-history", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm_fd == -1) {
+        return -1;
+    }
+
+    shm_len = AESD_HISTORY_HEADER_SIZE + ring_size;
+    if (ftruncate(shm_fd, shm_len) == 0) {
+        mapping = mmap(NULL, shm_len, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        if (mapping != MAP_FAILED) {
+            shm = mapping;
+        }
+    }
+
+    // Fix the size, and once this mapping exists allow no other writer
+    if ((shm == NULL) ||
+        (fcntl(shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                                    F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) == -1)) {
+        saved_errno = errno;
+        aesd_history_close_mirror();
+        errno = saved_errno;
+        return -1;
+    }
+
+    shm->magic = AESD_HISTORY_MAGIC;
+    shm->version = AESD_HISTORY_VERSION;
+    shm->header_size = AESD_HISTORY_HEADER_SIZE;
+    shm->capacity = ring_size;
+    shm->start = 0;
+    shm->reserve = 0;
+    shm->end = 0;
+    shm->seq = 0;
+    shm->closed = 0;
+    return 0;
+}
+
+int aesd_history_init(const char *path, bool indexed_history, size_t mirror_capacity)
+{
+    if ((mirror_capacity > 0) && (mirror_init(mirror_capacity) == -1)) {
+        return -1;
+    }
+
+    aesd_lock(&history_lock);
+    indexed = indexed_history;
+    if (indexed || (shm != NULL)) {
+        history_seed(path);
+    }
+    aesd_unlock(&history_lock);
+    return 0;
+}
+
+void aesd_history_close_mirror(void)
+{
+    aesd_lock(&history_lock);
+    if (shm != NULL) {
+        __atomic_store_n(&shm->closed, 1, __ATOMIC_RELEASE);
+        mirror_wake();
+        munmap(shm, shm_len);
+        shm = NULL;
+    }
+    if (shm_fd != -1) {
+        close(shm_fd);
+        shm_fd = -1;
+    }
+    aesd_unlock(&history_lock);
+}
+
+void aesd_history_destroy(void)
+{
+    aesd_history_close_mirror();
+
+    aesd_lock(&history_lock);
+    retention_stop = true;
+    pthread_cond_signal(&retention_cond);
+    aesd_unlock(&history_lock);
+    if (retention_running) {
+        pthread_join(retention_thread, NULL);
+        retention_running = false;
+    }
+    if (punch_fd != -1) {
+        close(punch_fd);
+        punch_fd = -1;
+    }
+
+    aesd_lock(&history_lock);
+    sync_stop = true;
+    pthread_cond_signal(&sync_cond);
+    aesd_unlock(&history_lock);
+    if (sync_running) {
+        pthread_join(sync_thread, NULL);
+        sync_running = false;
+    }
+    if (sync_fd != -1) {
+        close(sync_fd);
+        sync_fd = -1;
+    }
+
+    aesd_lock(&history_lock);
+    index_drop();
+    free(pins);
+    pins = NULL;
+    pin_count = 0;
+    pin_capacity = 0;
+    aesd_unlock(&history_lock);
+}
+
+// True once appends overran a size limit far enough to trim before the next
+// periodic pass, under history_lock
+static bool retention_overrun(void)
+{
+    if ((retention.max_bytes > 0) && (history_bytes - history_start >
+            retention.max_bytes + (retention.max_bytes >> RETENTION_SLACK_SHIFT))) {
+        return true;
+    }
+    return (retention.max_records > 0) && (record_count >
+            retention.max_records + (retention.max_records >> RETENTION_SLACK_SHIFT));
+}
+
+int aesd_history_append(FILE *data_file, const char *buf, size_t len, uint64_t *end_offset)
+{
+    int status = 0;
+    off_t end;
+
+    aesd_lock(&history_lock);
+
+    // Flushed so a reply read right after sees the bytes
+    if ((fwrite(buf, 1, len, data_file) != len) || (fflush(data_file) != 0)) {
+        status = -1;
+    } else {
+        // Another server appending during an upgrade leaves a gap to pick up
+        // first, the append mode file position is the end of the file
+        if (indexed && ((end = ftello(data_file)) != -1) &&
+            ((uint64_t)end > history_bytes + len)) {
+            history_load(fileno(data_file), end - len);
+        }
+        index_append(len, true);
+        index_stamp(buf, len);
+        if (aesd_checksum_append(history_bytes, buf, len) == -1) {
+            syslog(LOG_ERR, "Error writing checksum of record at %llu: %s\n",
+                    (unsigned long long)(history_bytes - len), strerror(errno));
+        }
+        appends++;
+        if (end_offset != NULL) {
+            *end_offset = history_bytes;
+        }
+        if (retention_running && retention_overrun()) {
+            pthread_cond_signal(&retention_cond);
+        }
+        if (durability == AESD_DURABILITY_BATCH) {
+            pthread_cond_signal(&sync_cond);
+        }
+        if (shm != NULL) {
+            mirror_append(buf, len);
+            mirror_wake();
+        }
+        if (append_waiters > 0) {
+            pthread_cond_broadcast(&append_cond);
+        }
+    }
+
+    aesd_unlock(&history_lock);
+    return status;
+}
+
+int aesd_history_skip(FILE *data_file, uint64_t offset)
+{
+    int status = 0;
+
+    aesd_lock(&history_lock);
+    if (history_bytes != history_start) {
+        errno = EEXIST;
+        status = -1;
+    } else if (offset > history_bytes) {
+        // A hole up to offset, which the next start skips like punched records
+        if ((fflush(data_file) != 0) || (ftruncate(fileno(data_file), offset) == -1)) {
+            status = -1;
+        } else {
+            history_start = offset;
+            history_bytes = offset;
+            punched = offset;
+            if (shm != NULL) {
+                __atomic_store_n(&shm->reserve, offset, __ATOMIC_RELAXED);
+                __atomic_store_n(&shm->end, offset, __ATOMIC_RELEASE);
+                __atomic_store_n(&shm->start, offset, __ATOMIC_RELEASE);
+                mirror_wake();
+            }
+        }
+    }
+    aesd_unlock(&history_lock);
+    return status;
+}
+
+int aesd_history_stat(uint64_t *records, uint64_t *start, uint64_t *end)
+{
+    int status = -1;
+
+    aesd_lock(&history_lock);
+    if (indexed) {
+        *records = record_count;
+        *start = history_start;
+        *end = history_bytes;
+        status = 0;
+    }
+    aesd_unlock(&history_lock);
+    return status;
+}
+
+int aesd_history_tail(uint64_t n, uint64_t *offset, uint64_t *end)
+{
+    int status = -1;
+
+    aesd_lock(&history_lock);
+    if (indexed) {
+        *offset = (n >= record_count) ? history_start : record_ends[record_count - n - 1];
+        *end = history_bytes;
+        status = 0;
+    }
+    aesd_unlock(&history_lock);
+    return status;
+}
+
+static void timespec_add_ms(struct timespec *ts, unsigned int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+int aesd_history_records(uint64_t offset, uint64_t *ends, size_t max)
+{
+    size_t lo = 0;
+    size_t hi;
+    size_t i;
+    int count = -1;
+
+    aesd_lock(&history_lock);
+    hi = record_count;
+    if (!indexed) {
+        errno = ENOTSUP;
+    } else if ((offset < history_start) || (offset > history_bytes)) {
+        errno = ERANGE;
+    } else {
+        // First record ending after offset, which has to start there
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+
+            if (record_ends[mid] <= offset) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if ((offset != history_start) && ((lo == 0) || (record_ends[lo - 1] != offset))) {
+            errno = EINVAL;
+        } else {
+            for (i = 0; (i < max) && (lo + i < record_count); i++) {
+                ends[i] = record_ends[lo + i];
+            }
+            count = i;
+        }
+    }
+    aesd_unlock(&history_lock);
+    return count;
+}
+
+bool aesd_history_wait_end(uint64_t offset, unsigned int timeout_ms)
+{
+    struct timespec wake;
+    bool grown;
+
+    clock_gettime(CLOCK_REALTIME, &wake);
+    timespec_add_ms(&wake, timeout_ms);
+
+    aesd_lock(&history_lock);
+    append_waiters++;
+    while ((history_bytes <= offset) &&
+           (aesd_lock_cond_timedwait(&append_cond, &history_lock, &wake) != ETIMEDOUT)) {
+    }
+    append_waiters--;
+    grown = (history_bytes > offset);
+    aesd_unlock(&history_lock);
+    return grown;
+}
+
+// Run fdatasync() over everything appended so far and raise the watermark.
+// Appends made while it runs wait for the next one, which covers them all.
+// Called and returns under history_lock.
+static void sync_history(void)
+{
+    uint64_t target = history_bytes;
+    uint64_t target_appends = appends;
+    struct timespec start, done;
+    uint64_t us;
+    int status;
+
+    aesd_unlock(&history_lock);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = fdatasync(sync_fd);
+    if (status == 0) {
+        status = aesd_checksum_sync();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &done);
+    aesd_lock(&history_lock);
+
+    // The kernel may have dropped the dirty pages it failed to write, so a
+    // later fdatasync() succeeding proves nothing: stop raising the watermark
+    if (status == -1) {
+        sync_error = errno;
+        syslog(LOG_ERR, "Error fdatasync(): %s, appends are no longer made durable\n",
+                strerror(errno));
+        pthread_cond_broadcast(&durable_cond);
+        return;
+    }
+
+    us = (done.tv_sec - start.tv_sec) * 1000000ULL + (done.tv_nsec - start.tv_nsec) / 1000;
+    syncs++;
+    sync_us_total += us;
+    if (us > sync_us_max) {
+        sync_us_max = us;
+    }
+    durable = target;
+    durable_appends = target_appends;
+    pthread_cond_broadcast(&durable_cond);
+}
+
+// Batch mode syncs as soon as there is anything to sync, so every append
+// waits for at most the sync in progress plus its own. Periodic mode syncs
+// every sync_period_ms if anything was appended.
+static void *sync_func(void *arg)
+{
+    struct timespec wake, now;
+
+    (void)arg;
+    aesd_lock(&history_lock);
+    clock_gettime(CLOCK_REALTIME, &wake);
+    while (!sync_stop && (sync_error == 0)) {
+        if (history_bytes > durable) {
+            sync_history();
+        }
+
+        if (durability == AESD_DURABILITY_BATCH) {
+            if (!sync_stop && (history_bytes == durable)) {
+                aesd_lock_cond_wait(&sync_cond, &history_lock);
+            }
+            continue;
+        }
+
+        // Skip the periods a slow sync overran rather than sync back to back
+        clock_gettime(CLOCK_REALTIME, &now);
+        do {
+            timespec_add_ms(&wake, sync_period_ms);
+        } while ((wake.tv_sec < now.tv_sec) ||
+                 ((wake.tv_sec == now.tv_sec) && (wake.tv_nsec <= now.tv_nsec)));
+        while (!sync_stop &&
+               (aesd_lock_cond_timedwait(&sync_cond, &history_lock, &wake) != ETIMEDOUT)) {
+        }
+    }
+    aesd_unlock(&history_lock);
+    return NULL;
+}
+
+int aesd_history_durable(const char *path, enum aesd_durability mode, unsigned int period_ms)
+{
+    int status;
+
+    if (mode == AESD_DURABILITY_NONE) {
+        return 0;
+    }
+
+    sync_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (sync_fd == -1) {
+        return -1;
+    }
+
+    aesd_lock(&history_lock);
+    durability = mode;
+    sync_period_ms = period_ms;
+    sync_stop = false;
+    aesd_unlock(&history_lock);
+
+    status = pthread_create(&sync_thread, NULL, sync_func, NULL);
+    if (status != 0) {
+        aesd_lock(&history_lock);
+        durability = AESD_DURABILITY_NONE;
+        aesd_unlock(&history_lock);
+        close(sync_fd);
+        sync_fd = -1;
+        errno = status;
+        return -1;
+    }
+    sync_running = true;
+    return 0;
+}
+
+int aesd_history_wait_durable(uint64_t offset)
+{
+    int status = 0;
+
+    aesd_lock(&history_lock);
+    if (durability == AESD_DURABILITY_BATCH) {
+        while ((durable < offset) && (sync_error == 0)) {
+            aesd_lock_cond_wait(&durable_cond, &history_lock);
+        }
+        if (durable < offset) {
+            errno = sync_error;
+            status = -1;
+        }
+    }
+    aesd_unlock(&history_lock);
+    return status;
+}
+
+uint64_t aesd_history_start(void)
+{
+    uint64_t start;
+
+    aesd_lock(&history_lock);
+    start = history_start;
+    aesd_unlock(&history_lock);
+    return start;
+}
+
+void aesd_history_get_stats(struct aesd_history_stats *stats)
+{
+    size_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    aesd_lock(&history_lock);
+    stats->indexed = indexed;
+    stats->records = record_count;
+    stats->records_dropped = records_dropped;
+    stats->start = history_start;
+    stats->end = history_bytes;
+    stats->punched = punched;
+    stats->segments = segment_count;
+    for (i = 0; i < segment_count; i++) {
+        stats->blooms += (segments[i].bloom != NULL);
+    }
+    stats->durability = durability;
+    stats->durable = durable;
+    stats->appends = appends;
+    stats->durable_appends = durable_appends;
+    stats->syncs = syncs;
+    stats->sync_us_total = sync_us_total;
+    stats->sync_us_max = sync_us_max;
+    stats->sync_failed = (sync_error != 0);
+    aesd_unlock(&history_lock);
+}
+
+// First record boundary the retention policy keeps, under history_lock
+static uint64_t retention_cut(time_t now)
+{
+    uint64_t cut = history_start;
+    size_t lo = 0;
+    size_t hi = record_count;
+    size_t mid;
+    size_t i;
+
+    // Oldest record that ends inside the last max_bytes starts the history
+    if ((retention.max_bytes > 0) && (history_bytes - history_start > retention.max_bytes)) {
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (record_ends[mid] < history_bytes - retention.max_bytes) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if ((lo < record_count) && (record_ends[lo] > cut)) {
+            cut = record_ends[lo];
+        }
+    }
+
+    if ((retention.max_records > 0) && (record_count > retention.max_records) &&
+        (record_ends[record_count - retention.max_records - 1] > cut)) {
+        cut = record_ends[record_count - retention.max_records - 1];
+    }
+
+    // Everything up to a timestamp record was written before its time
+    if (retention.max_age_s > 0) {
+        for (i = 0; (i < stamp_count) && (stamps[i].time + (time_t)retention.max_age_s < now); i++) {
+            if (stamps[i].end > cut) {
+                cut = stamps[i].end;
+            }
+        }
+    }
+    return cut;
+}
+
+// Drop the records before history offset cut from the index, under
+// history_lock. Memory shrinks with the index.
+static void retention_trim(uint64_t cut)
+{
+    uint64_t *shrunk;
+    size_t i, n;
+
+    for (n = 0; (n < record_count) && (record_ends[n] <= cut); n++);
+    memmove(record_ends, record_ends + n, (record_count - n) * sizeof(*record_ends));
+    record_count -= n;
+    records_dropped += n;
+    if ((record_capacity > INDEX_MIN_RECORDS) && (record_count < record_capacity / 4)) {
+        shrunk = realloc(record_ends, (record_capacity / 2) * sizeof(*record_ends));
+        if (shrunk != NULL) {
+            record_ends = shrunk;
+            record_capacity /= 2;
+        }
+    }
+
+    // Segments wholly before cut go, the last one always stays
+    for (n = 0; (n + 1 < segment_count) && (segments[n + 1].start <= cut); n++) {
+        free(segments[n].bloom);
+    }
+    memmove(segments, segments + n, (segment_count - n) * sizeof(*segments));
+    segment_count -= n;
+    if ((segment_count > 0) && (segments[0].start < cut)) {
+        segments[0].start = cut;
+    }
+
+    for (i = 0; (i < stamp_count) && (stamps[i].end <= cut); i++);
+    memmove(stamps, stamps + i, (stamp_count - i) * sizeof(*stamps));
+    stamp_count -= i;
+
+    history_start = cut;
+}
+
+// Free the disk blocks of the data file from offset from up to to. The
+// part of a block left over at either end is zeroed instead, so the next
+// server start finds the first retained record. Returns how far the file is
+// punched now.
+static uint64_t retention_punch(uint64_t from, uint64_t to)
+{
+    if (fallocate(punch_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from) == -1) {
+        syslog(LOG_ERR, "Error fallocate(PUNCH_HOLE): %s, disk space is not reclaimed\n",
+                strerror(errno));
+        close(punch_fd);
+        punch_fd = -1;
+        return from;
+    }
+    return to;
+}
+
+// The next range to compress, from where the blocks end to the first
+// segment boundary after it that is compress_after bytes behind the end.
+// Returns false if there is none yet, under history_lock.
+static bool compress_next(uint64_t *from, uint64_t *to)
+{
+    size_t lo = 0;
+    size_t hi = segment_count;
+    size_t mid;
+
+    if ((retention.compress_after == 0) || compress_paused || !indexed) {
+        return false;
+    }
+
+    *from = aesd_cold_end();
+    if (*from < history_start) {
+        *from = history_start;
+    }
+
+    // First segment starting after from
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (segments[mid].start <= *from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == segment_count) {
+        return false;
+    }
+    *to = segments[lo].start;
+    return *to + retention.compress_after <= history_bytes;
+}
+
+// Compress history offsets from up to to into a block. The block is only
+// made of data already on disk, so a crash cannot leave a block holding
+// records the data file lost. Returns 0, or -1 with errno set.
+static int compress_range(uint64_t from, uint64_t to)
+{
+    char *buf = malloc(to - from);
+    size_t done = 0;
+    ssize_t rx_bytes;
+    int status = -1;
+
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ((fdatasync(punch_fd) == 0) && (aesd_checksum_sync() == 0)) {
+        while (done < to - from) {
+            rx_bytes = pread(punch_fd, buf + done, to - from - done, from + done);
+            if ((rx_bytes == -1) && (errno == EINTR)) {
+                continue;
+            }
+            if (rx_bytes <= 0) {
+                if (rx_bytes == 0) {
+                    errno = EIO;
+                }
+                break;
+            }
+            done += rx_bytes;
+        }
+        if (done == to - from) {
+            status = aesd_cold_add(from, buf, done);
+        }
+    }
+    free(buf);
+    return status;
+}
+
+// Apply the retention policy once a second, or sooner when woken by an append
+// that overran a limit, and compress every cold segment. A range is punched
+// only once no zerocopy reply has it mapped. One that left the history also
+// waits a period, so replies that started reading it before have finished.
+// One that was compressed goes on the next pass, readers of the data file
+// read it again from its block if one appeared under them.
+static void *retention_func(void *arg)
+{
+    struct timespec wake, now;
+    struct timespec punch_due = {0, 0};
+    uint64_t punch_to = history_start;
+    uint64_t drop_to = history_start;
+    uint64_t dropped = history_start;
+    uint64_t cut, from, to, covered;
+
+    (void)arg;
+    aesd_lock(&history_lock);
+    while (!retention_stop) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (((punch_to > punched) || (drop_to > dropped)) && (now.tv_sec >= punch_due.tv_sec)) {
+            // Stop short of what zerocopy replies still have mapped, the
+            // rest waits for them to be sent
+            from = punched;
+            punching = punch_to;
+            if ((pin_count > 0) && (pins[0].offset < punching)) {
+                punching = (pins[0].offset > from) ? pins[0].offset : from;
+            }
+            aesd_unlock(&history_lock);
+            // Entries go first, a crash in between leaves records unchecked
+            // rather than entries for zeroed records
+            to = from;
+            if ((punch_fd != -1) && (punching > from)) {
+                aesd_checksum_punch(punching);
+                to = retention_punch(from, punching);
+            }
+            aesd_cold_drop(drop_to);
+            aesd_lock(&history_lock);
+            punched = to;
+            punching = to;
+            dropped = drop_to;
+            // A failed punch is not retried
+            if (punch_fd == -1) {
+                punch_to = punched;
+            }
+        }
+
+        cut = retention_cut(time(NULL));
+        if (indexed && (cut > history_start)) {
+            retention_trim(cut);
+        }
+
+        // Segments are compressed one at a time, back to back, while there
+        // are any to catch up on
+        if (compress_next(&from, &to)) {
+            compress_busy = true;
+            aesd_unlock(&history_lock);
+            if (compress_range(from, to) == -1) {
+                syslog(LOG_ERR, "Error compressing history at %llu-%llu: %s, "
+                        "no longer compressing\n", (unsigned long long)from,
+                        (unsigned long long)to, strerror(errno));
+                retention.compress_after = 0;
+            }
+            aesd_lock(&history_lock);
+            compress_busy = false;
+            pthread_cond_broadcast(&compress_cond);
+            continue;
+        }
+
+        // A pending range is punched whole before the next one is started.
+        // Compressed history goes from the data file too, and blocks the
+        // history no longer reaches go from the compressed file.
+        covered = aesd_cold_covered(history_start);
+        if ((punch_to <= punched) && (drop_to <= dropped) &&
+            ((covered > punched) || (history_start > dropped))) {
+            punch_to = (covered > punched) ? covered : punched;
+            punch_due.tv_sec = now.tv_sec;
+            if ((history_start > punched) || (history_start > dropped)) {
+                punch_due.tv_sec += RETENTION_PERIOD_S + 1;
+            }
+            drop_to = history_start;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += RETENTION_PERIOD_S;
+        aesd_lock_cond_timedwait(&retention_cond, &history_lock, &wake);
+    }
+    aesd_unlock(&history_lock);
+    return NULL;
+}
+
+int aesd_history_retain(const char *path, const struct aesd_history_retention *policy)
+{
+    int status;
+
+    if (!indexed) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Read too, to compress what it holds
+    punch_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (punch_fd == -1) {
+        return -1;
+    }
+
+    retention = *policy;
+    retention_stop = false;
+    status = pthread_create(&retention_thread, NULL, retention_func, NULL);
+    if (status != 0) {
+        close(punch_fd);
+        punch_fd = -1;
+        errno = status;
+        return -1;
+    }
+    retention_running = true;
+    return 0;
+}
+
+void aesd_history_pause_compression(bool paused)
+{
+    aesd_lock(&history_lock);
+    compress_paused = paused;
+    while (paused && compress_busy) {
+        aesd_lock_cond_wait(&compress_cond, &history_lock);
+    }
+    aesd_unlock(&history_lock);
+}
+
+// Index of the first pin at or after offset, under history_lock
+static size_t pin_find(uint64_t offset)
+{
+    size_t lo = 0;
+    size_t hi = pin_count;
+    size_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (pins[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool aesd_history_pin(uint64_t offset)
+{
+    struct history_pin *grown;
+    size_t capacity;
+    size_t i;
+
+    aesd_lock(&history_lock);
+    if ((offset < punched) || (offset < punching)) {
+        aesd_unlock(&history_lock);
+        return false;
+    }
+
+    i = pin_find(offset);
+    if ((i < pin_count) && (pins[i].offset == offset)) {
+        pins[i].count++;
+        aesd_unlock(&history_lock);
+        return true;
+    }
+    if (pin_count == pin_capacity) {
+        capacity = (pin_capacity == 0) ? MIN_PINS : pin_capacity * 2;
+        grown = realloc(pins, capacity * sizeof(*pins));
+        if (grown == NULL) {
+            aesd_unlock(&history_lock);
+            return false;
+        }
+        pins = grown;
+        pin_capacity = capacity;
+    }
+    memmove(pins + i + 1, pins + i, (pin_count - i) * sizeof(*pins));
+    pins[i].offset = offset;
+    pins[i].count = 1;
+    pin_count++;
+    aesd_unlock(&history_lock);
+    return true;
+}
+
+void aesd_history_unpin(uint64_t offset)
+{
+    size_t i;
+
+    aesd_lock(&history_lock);
+    i = pin_find(offset);
+    if ((i < pin_count) && (pins[i].offset == offset) && (--pins[i].count == 0)) {
+        memmove(pins + i, pins + i + 1, (pin_count - i - 1) * sizeof(*pins));
+        pin_count--;
+    }
+    aesd_unlock(&history_lock);
+}
+
+int aesd_history_reader_fd(void)
+{
+    char path[64];
+
+    if (shm_fd == -1) {
+        return -1;
+    }
+
+    // A read-only open of the memfd, readers cannot map it writable
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", shm_fd);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+// Whether a bloom filter may hold every trigram of pattern
+static bool bloom_may_match(const uint8_t *bloom, const char *pattern, size_t len)
+{
+    uint32_t gram = 0;
+    uint32_t bit;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        gram = ((gram << 8) | (unsigned char)pattern[i]) & TRIGRAM_MASK;
+        bit = bloom_bit(gram);
+        if ((i >= 2) && !(bloom[bit / 8] & (1U << (bit % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Add the trigrams of len bytes to a bloom filter
+static void bloom_add(uint8_t *bloom, const char *buf, size_t len)
+{
+    uint32_t gram = 0;
+    uint32_t bit;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        gram = ((gram << 8) | (unsigned char)buf[i]) & TRIGRAM_MASK;
+        if (i >= 2) {
+            bit = bloom_bit(gram);
+            bloom[bit / 8] |= 1U << (bit % 8);
+        }
+    }
+}
+// Bounds of the record holding history offset pos, under history_lock
+static void record_bounds(uint64_t pos, uint64_t *start, uint64_t *end)
+{
+    size_t lo = 0;
+    size_t hi = record_count;
+    size_t mid;
+
+    // First record ending past pos
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (record_ends[mid] <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *start = (lo > 0) ? record_ends[lo - 1] : history_start;
+    *end = (lo < record_count) ? record_ends[lo] : history_bytes;
+}
+
+// Add a matching record to the growing array in *result
+static bool grep_add(struct aesd_history_grep *result, size_t *capacity,
+                        uint64_t start, uint64_t end)
+{
+    struct aesd_history_match *grown;
+    struct aesd_history_match *last;
+
+    // A record matching more than once is sent once, and runs of matching
+    // records are read as one
+    if (result->count > 0) {
+        last = &result->matches[result->count - 1];
+        if (last->offset + last->len > start) {
+            return true;
+        }
+        if (last->offset + last->len == start) {
+            last->len += end - start;
+            result->bytes += end - start;
+            result->records++;
+            return true;
+        }
+    }
+
+    if (result->count == *capacity) {
+        *capacity = (*capacity == 0) ? INDEX_MIN_RECORDS : *capacity * 2;
+        grown = realloc(result->matches, *capacity * sizeof(*grown));
+        if (grown == NULL) {
+            return false;
+        }
+        result->matches = grown;
+    }
+    result->matches[result->count].offset = start;
+    result->matches[result->count].len = end - start;
+    result->count++;
+    result->records++;
+    result->bytes += end - start;
+    return true;
+}
+
+// A segment picked for a search
+struct grep_range {
+    size_t segment;
+    uint64_t start;
+    uint64_t end;
+    uint8_t *bloom;     // Filled in while searching a full segment without one
+};
+
+// Search a range of the history in fd for pattern, adding every record
+// holding it to result
+static int grep_range(int fd, const char *pattern, size_t len, struct grep_range *range,
+                        char *buf, struct aesd_history_grep *result, size_t *capacity)
+{
+    uint64_t pos = range->start;
+    uint64_t next;
+    uint64_t skip_to = range->start;
+    uint64_t rec_start, rec_end;
+    size_t overlap = len - 1;
+    size_t rd_size;
+    ssize_t rd_bytes;
+    const char *hit;
+    size_t off;
+
+    // Every trigram must land in some chunk while filling a bloom filter
+    if ((range->bloom != NULL) && (overlap < 2)) {
+        overlap = 2;
+    }
+
+    while (pos < range->end) {
+        rd_size = (range->end - pos < GREP_CHUNK_SIZE) ? range->end - pos : GREP_CHUNK_SIZE;
+        rd_bytes = aesd_cold_pread(fd, buf, rd_size, pos);
+        if (rd_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rd_bytes == 0) {
+            break;
+        }
+        if (range->bloom != NULL) {
+            bloom_add(range->bloom, buf, rd_bytes);
+        }
+
+        // The rest of a matching record need not be searched
+        off = (skip_to > pos) ? skip_to - pos : 0;
+        while ((off < (size_t)rd_bytes) &&
+                ((hit = memmem(buf + off, rd_bytes - off, pattern, len)) != NULL)) {
+            aesd_lock(&history_lock);
+            record_bounds(pos + (hit - buf), &rec_start, &rec_end);
+            aesd_unlock(&history_lock);
+
+            if (!grep_add(result, capacity, rec_start, rec_end)) {
+                errno = ENOMEM;
+                return -1;
+            }
+            skip_to = rec_end;
+            off = rec_end - pos;
+        }
+
+        // Overlap chunks so a match across their boundary is found, and skip
+        // what is left of a long matching record unless it is being hashed
+        next = pos + rd_bytes;
+        if ((next < range->end) && ((size_t)rd_bytes > overlap)) {
+            next -= overlap;
+        }
+        if ((range->bloom == NULL) && (skip_to > next)) {
+            next = skip_to;
+        }
+        pos = next;
+    }
+    return 0;
+}
+
+int aesd_history_grep(int fd, const char *pattern, size_t len, struct aesd_history_grep *result)
+{
+    struct grep_range *ranges = NULL;
+    size_t range_count = 0;
+    size_t capacity = 0;
+    char *buf = NULL;
+    size_t i;
+    int status = 0;
+
+    memset(result, 0, sizeof(*result));
+    if (len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    aesd_lock(&history_lock);
+    if (!indexed) {
+        aesd_unlock(&history_lock);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Pick the segments to search up front, appends made later are not
+    // part of this result
+    ranges = calloc(segment_count + 1, sizeof(*ranges));
+    if (ranges == NULL) {
+        aesd_unlock(&history_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+    result->segments = segment_count;
+    for (i = 0; i < segment_count; i++) {
+        if ((segments[i].bloom != NULL) && !bloom_may_match(segments[i].bloom, pattern, len)) {
+            continue;
+        }
+        ranges[range_count].segment = i;
+        ranges[range_count].start = segments[i].start;
+        ranges[range_count].end = (i + 1 < segment_count) ? segments[i + 1].start : history_bytes;
+        if ((i + 1 < segment_count) && (segments[i].bloom == NULL)) {
+            // Not fatal if this fails, the segment is searched all the same
+            ranges[range_count].bloom = calloc(1, BLOOM_BYTES);
+        }
+        range_count++;
+    }
+    aesd_unlock(&history_lock);
+
+    result->searched = range_count;
+    buf = malloc(GREP_CHUNK_SIZE);
+    if (buf == NULL) {
+        status = -1;
+        errno = ENOMEM;
+    }
+
+    for (i = 0; (i < range_count) && (status == 0); i++) {
+        status = grep_range(fd, pattern, len, &ranges[i], buf, result, &capacity);
+        if ((status == 0) && (ranges[i].bloom != NULL)) {
+            // Publish the filter unless another search got there first
+            aesd_lock(&history_lock);
+            if (indexed && (ranges[i].segment < segment_count) &&
+                (segments[ranges[i].segment].start == ranges[i].start) &&
+                (segments[ranges[i].segment].bloom == NULL)) {
+                segments[ranges[i].segment].bloom = ranges[i].bloom;
+                ranges[i].bloom = NULL;
+            }
+            aesd_unlock(&history_lock);
+        }
+    }
+
+    for (i = 0; i < range_count; i++) {
+        free(ranges[i].bloom);
+    }
+    free(buf);
+    free(ranges);
+    if (status == -1) {
+        free(result->matches);
+        result->matches = NULL;
+    }
+    return status;
+}
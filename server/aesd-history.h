@@ -0,0 +1,351 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-history.h
+​*​ ​@brief​ Single append path for the history, its record index and shared memory mirror
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* Every append to the history goes through aesd_history_append(), which
+* writes the data file, records where the new record ends in the record
+* index and copies the bytes into a ring in a sealed memfd. Each append is
+* one record. The index lets queries find the last n records without reading
+* the history, it is rebuilt from the newlines in the data file at start.
+* Records are grouped into segments of about 1 MiB. The first search to read
+* a full segment leaves a bloom filter of the three byte sequences in it, so
+* later substring searches only read the segments that may hold the pattern.
+*
+* A retention policy keeps the history to a number of bytes, records or an
+* age, judged by the timestamp records. A background thread drops the oldest
+* records from the index, frees the segments wholly before them and punches
+* their blocks out of the data file. Offsets never move: the history simply
+* starts later, at aesd_history_start(). The same thread compresses full
+* segments once they are far enough behind the end, see aesd-cold.h, and
+* punches them out of the data file too. Reads of the history go through
+* aesd_cold_pread(), which decompresses them.
+*
+* Appends reach the page cache at once. A durability mode decides when they
+* reach the disk: never forced, by an fdatasync() every period, or in batch
+* mode by one fdatasync() covering every append made while the previous one
+* ran. The durable watermark is the offset below which everything is synced,
+* batch mode replies wait for it to pass their record.
+*
+* Followers replicate the history record by record: the leader walks the
+* index with aesd_history_records() and sleeps in aesd_history_wait_end()
+* once caught up, see aesd-replica.h.
+*
+* Same-host readers receive a read-only descriptor for the memfd, map it and
+* follow the history without a system call per record, sleeping on a futex
+* only once they have caught up.
+*
+* Mapping layout, all integers in host byte order:
+*
+*   0                   struct aesd_history_shm
+*   header_size         ring of capacity bytes
+*
+* History offset o is stored at ring[o % capacity]. Offsets from
+* max(start, reserve - capacity) up to end are readable. The writer raises
+* reserve before overwriting ring bytes and end once they are in place, then
+* increments seq and wakes seq's futex. A reader copies bytes out and then
+* checks reserve to find out whether the writer has since overwritten them.
+*/
+
+#ifndef AESD_HISTORY_H
+#define AESD_HISTORY_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define AESD_HISTORY_MAGIC          (0x5453494844534541ULL)    // "AESDHIST"
+#define AESD_HISTORY_VERSION        (1)
+#define AESD_HISTORY_HEADER_SIZE    (4096)
+
+struct aesd_history_shm {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    /**
+     * Ring size in bytes, a power of two
+     */
+    uint64_t capacity;
+    /**
+     * First history offset this mirror holds
+     */
+    uint64_t start;
+    /**
+     * Offset the writer may be overwriting up to
+     */
+    uint64_t reserve;
+    /**
+     * Offset one past the last byte appended
+     */
+    uint64_t end;
+    /**
+     * Futex word, incremented after every append
+     */
+    uint32_t seq;
+    /**
+     * Set once the server stops updating this mirror, readers reconnect
+     */
+    uint32_t closed;
+};
+
+/**
+ * Records found by aesd_history_grep(), adjacent ones are merged
+ */
+struct aesd_history_match {
+    uint64_t offset;
+    uint64_t len;
+};
+
+struct aesd_history_grep {
+    /**
+     * Matching records in history order, malloc()ed
+     */
+    struct aesd_history_match *matches;
+    size_t count;
+    /**
+     * Matching records and their total length
+     */
+    size_t records;
+    uint64_t bytes;
+    /**
+     * Segments in the history and those the bloom filters did not rule out
+     */
+    size_t segments;
+    size_t searched;
+};
+
+struct aesd_history_retention {
+    /**
+     * Limits on what the history keeps, 0 is unlimited
+     */
+    uint64_t max_bytes;
+    uint64_t max_records;
+    uint64_t max_age_s;
+    /**
+     * Segments ending this many bytes before the end are compressed, 0 never
+     */
+    uint64_t compress_after;
+};
+
+enum aesd_durability {
+    AESD_DURABILITY_NONE,       // Left to the kernel's writeback
+    AESD_DURABILITY_PERIODIC,   // fdatasync() every period if anything changed
+    AESD_DURABILITY_BATCH,      // Replies wait for a group fdatasync()
+};
+
+struct aesd_history_stats {
+    bool indexed;
+    uint64_t records;
+    uint64_t records_dropped;
+    /**
+     * History offsets of the first retained byte and one past the last
+     */
+    uint64_t start;
+    uint64_t end;
+    /**
+     * Data file blocks before this offset have been freed
+     */
+    uint64_t punched;
+    size_t segments;
+    size_t blooms;
+    enum aesd_durability durability;
+    /**
+     * Everything before this offset, durable_appends appends, is synced
+     */
+    uint64_t durable;
+    uint64_t appends;
+    uint64_t durable_appends;
+    uint64_t syncs;
+    uint64_t sync_us_total;
+    uint64_t sync_us_max;
+    /**
+     * An fdatasync() failed and the watermark stopped
+     */
+    bool sync_failed;
+};
+
+/**
+ * Load the data file at path into the record index when indexed is set, and
+ * into a new mirror with a ring of at least mirror_capacity bytes unless it
+ * is 0. Returns 0, or -1 with errno set if the mirror could not be created.
+ */
+extern int aesd_history_init(const char *path, bool indexed, size_t mirror_capacity);
+
+/**
+ * Mark the mirror closed, waking its readers, and release it. Appends keep
+ * going to the data file and index.
+ */
+extern void aesd_history_close_mirror(void);
+
+/**
+ * Close the mirror and free the index
+ */
+extern void aesd_history_destroy(void);
+
+/**
+ * Append len bytes to data_file and the mirror, and set *end_offset to the
+ * offset one past them unless it is NULL. Returns 0, or -1 with errno set if
+ * the data file write failed.
+ */
+extern int aesd_history_append(FILE *data_file, const char *buf, size_t len,
+                                uint64_t *end_offset);
+
+/**
+ * Start an empty history at offset instead, leaving a hole in data_file up
+ * to it, for a follower whose leader no longer holds the history before
+ * offset. Returns 0, or -1 with errno set, EEXIST if the history is not
+ * empty.
+ */
+extern int aesd_history_skip(FILE *data_file, uint64_t offset);
+
+/**
+ * Copy the end offsets of up to max records, starting with the record at
+ * offset, into ends. Returns the number copied, 0 at the end of the history,
+ * or -1 with errno set: ERANGE if offset is outside the history, EINVAL if
+ * no record starts there, ENOTSUP if the history is not indexed.
+ */
+extern int aesd_history_records(uint64_t offset, uint64_t *ends, size_t max);
+
+/**
+ * Wait up to timeout_ms for the history to grow past offset. Returns true
+ * once it has.
+ */
+extern bool aesd_history_wait_end(uint64_t offset, unsigned int timeout_ms);
+
+/**
+ * Start syncing the data file at path in mode, period_ms apart in periodic
+ * mode. Returns 0, or -1 with errno set.
+ */
+extern int aesd_history_durable(const char *path, enum aesd_durability mode,
+                                unsigned int period_ms);
+
+/**
+ * In batch mode, wait until the history is synced up to offset. Returns 0,
+ * or -1 with errno set if an fdatasync() failed first.
+ */
+extern int aesd_history_wait_durable(uint64_t offset);
+
+/**
+ * Start applying a retention policy to the indexed history of the data file
+ * at path, and compressing its cold segments. Returns 0, or -1 with errno set.
+ */
+extern int aesd_history_retain(const char *path, const struct aesd_history_retention *policy);
+
+/**
+ * Stop compressing segments, waiting for one in progress, or start again.
+ * Another server must not find blocks being added while it reads them.
+ */
+extern void aesd_history_pause_compression(bool paused);
+
+/**
+ * Offset of the oldest retained record, where full replies start
+ */
+extern uint64_t aesd_history_start(void);
+
+/**
+ * Number of records in the history and the offsets it runs between. Returns
+ * 0, or -1 if the history is not indexed.
+ */
+extern int aesd_history_stat(uint64_t *records, uint64_t *start, uint64_t *end);
+
+/**
+ * Snapshot of the index and retention counters
+ */
+extern void aesd_history_get_stats(struct aesd_history_stats *stats);
+
+/**
+ * Offset the last n records start at and the current end of the history.
+ * Returns 0, or -1 if the history is not indexed.
+ */
+extern int aesd_history_tail(uint64_t n, uint64_t *offset, uint64_t *end);
+
+/**
+ * Find every record holding pattern, reading the history through fd. Free
+ * result->matches afterwards. Returns 0, or -1 with errno set, ENOTSUP if the
+ * history is not indexed.
+ */
+extern int aesd_history_grep(int fd, const char *pattern, size_t len,
+                                struct aesd_history_grep *result);
+
+/**
+ * Keep the data file from offset on from being punched while a zerocopy
+ * reply has it mapped. Returns false if it is punched, or being punched, and
+ * the reply must be copied instead.
+ */
+extern bool aesd_history_pin(uint64_t offset);
+
+/**
+ * Release a pin taken with aesd_history_pin() once the mapping is gone
+ */
+extern void aesd_history_unpin(uint64_t offset);
+
+/**
+ * New read-only descriptor for the mirror to hand to a reader, -1 if there is
+ * no mirror
+ */
+extern int aesd_history_reader_fd(void);
+
+/**
+ * Copy up to len bytes from history offset *pos into buf and advance *pos.
+ * Bytes the writer has overwritten are skipped and counted in *lost. Returns
+ * the number of bytes copied, 0 when the reader has caught up.
+ */
+static inline size_t aesd_history_shm_read(const struct aesd_history_shm *shm, uint64_t *pos,
+                                            char *buf, size_t len, uint64_t *lost)
+{
+    const char *ring = (const char *)shm + shm->header_size;
+    uint64_t mask = shm->capacity - 1;
+    uint64_t end = __atomic_load_n(&shm->end, __ATOMIC_ACQUIRE);
+    uint64_t reserve;
+    uint64_t oldest;
+    size_t first;
+
+    while (1) {
+        reserve = __atomic_load_n(&shm->reserve, __ATOMIC_ACQUIRE);
+        oldest = (reserve > shm->capacity) ? reserve - shm->capacity : 0;
+        if (oldest < shm->start) {
+            oldest = shm->start;
+        }
+        if (*pos < oldest) {
+            *lost += oldest - *pos;
+            *pos = oldest;
+        }
+        if (*pos >= end) {
+            return 0;
+        }
+
+        if (len > end - *pos) {
+            len = end - *pos;
+        }
+        first = shm->capacity - (*pos & mask);
+        if (first > len) {
+            first = len;
+        }
+        memcpy(buf, ring + (*pos & mask), first);
+        memcpy(buf + first, ring, len - first);
+
+        // Keep the copy ahead of the check, as a seqlock reader would
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        reserve = __atomic_load_n(&shm->reserve, __ATOMIC_RELAXED);
+        if (reserve <= *pos + shm->capacity) {
+            *pos += len;
+            return len;
+        }
+    }
+}
+
+#endif /* AESD_HISTORY_H */
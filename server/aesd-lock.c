@@ -0,0 +1,339 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-lock.c
+​*​ ​@brief​ Mutex wrapper with a runtime switchable contention profile
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "aesd-lock.h"
+
+// Every lock profiled so far. No profiled mutex is ever taken with it held,
+// so it can be taken with one held.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct aesd_lock *registry = NULL;
+static bool profiling = false;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int bucket(uint64_t ns)
+{
+    unsigned int i = (ns > 0) ? 63 - __builtin_clzll(ns) : 0;
+
+    return (i < AESD_LOCK_BUCKETS) ? i : AESD_LOCK_BUCKETS - 1;
+}
+
+// Counters have a single writer, the holder of the mutex, so a relaxed load
+// and store is enough
+static void add(uint64_t *counter, uint64_t value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value,
+                        __ATOMIC_RELAXED);
+}
+
+static void raise_max(uint64_t *max, uint64_t value)
+{
+    if (value > __atomic_load_n(max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(max, value, __ATOMIC_RELAXED);
+    }
+}
+
+static void lock_register(struct aesd_lock *lock)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (!lock->registered) {
+        lock->next = registry;
+        registry = lock;
+        __atomic_store_n(&(lock->registered), true, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// Slot of the site func:line, claiming a free one if it has none. NULL once
+// every slot is taken. Called with the mutex held.
+static struct aesd_lock_site *find_site(struct aesd_lock *lock, const char *func, int line)
+{
+    size_t hash = (((uintptr_t)func >> 3) ^ ((size_t)line * 31)) % AESD_LOCK_SITES;
+    struct aesd_lock_site *site;
+    size_t i;
+
+    for (i = 0; i < AESD_LOCK_SITES; i++) {
+        site = &(lock->sites[(hash + i) % AESD_LOCK_SITES]);
+        if (site->func == NULL) {
+            site->line = line;
+            __atomic_store_n(&(site->func), func, __ATOMIC_RELEASE);
+            return site;
+        }
+        if ((site->func == func) && (site->line == line)) {
+            return site;
+        }
+    }
+    return NULL;
+}
+
+// Account the time the holder has had the mutex, called with it held
+static void end_hold(struct aesd_lock *lock)
+{
+    uint64_t hold_ns = monotonic_ns() - lock->hold_start;
+
+    add(&(lock->hold_ns), hold_ns);
+    add(&(lock->hold_hist[bucket(hold_ns)]), 1);
+    raise_max(&(lock->hold_max_ns), hold_ns);
+    if (lock->holder != NULL) {
+        add(&(lock->holder->hold_ns), hold_ns);
+    }
+    lock->hold_start = 0;
+}
+
+int aesd_lock_init(struct aesd_lock *lock, const char *name)
+{
+    memset(lock, 0, sizeof(*lock));
+    lock->name = name;
+    return pthread_mutex_init(&(lock->mutex), NULL);
+}
+
+int aesd_lock_destroy(struct aesd_lock *lock)
+{
+    struct aesd_lock **p_lock;
+
+    pthread_mutex_lock(&registry_lock);
+    for (p_lock = &registry; *p_lock != NULL; p_lock = &((*p_lock)->next)) {
+        if (*p_lock == lock) {
+            *p_lock = lock->next;
+            break;
+        }
+    }
+    lock->registered = false;
+    pthread_mutex_unlock(&registry_lock);
+    return pthread_mutex_destroy(&(lock->mutex));
+}
+
+int aesd_lock_at(struct aesd_lock *lock, const char *func, int line)
+{
+    struct aesd_lock_site *site;
+    uint64_t start = 0, now, wait_ns;
+    int status;
+
+    if (!__atomic_load_n(&profiling, __ATOMIC_RELAXED)) {
+        return pthread_mutex_lock(&(lock->mutex));
+    }
+    if (!__atomic_load_n(&(lock->registered), __ATOMIC_ACQUIRE)) {
+        lock_register(lock);
+    }
+
+    // Only a mutex that is already held is timed waiting
+    status = pthread_mutex_trylock(&(lock->mutex));
+    if (status == EBUSY) {
+        start = monotonic_ns();
+        status = pthread_mutex_lock(&(lock->mutex));
+    }
+    if (status) {
+        return status;
+    }
+    now = monotonic_ns();
+    wait_ns = (start > 0) ? now - start : 0;
+
+    site = find_site(lock, func, line);
+    add(&(lock->acquisitions), 1);
+    add(&(lock->wait_hist[bucket(wait_ns)]), 1);
+    if (start > 0) {
+        add(&(lock->contended), 1);
+        add(&(lock->wait_ns), wait_ns);
+        raise_max(&(lock->wait_max_ns), wait_ns);
+    }
+    if (site != NULL) {
+        add(&(site->acquisitions), 1);
+        if (start > 0) {
+            add(&(site->contended), 1);
+            add(&(site->wait_ns), wait_ns);
+        }
+    } else {
+        add(&(lock->other_sites), 1);
+    }
+
+    lock->hold_start = now;
+    lock->holder = site;
+    return 0;
+}
+
+int aesd_unlock(struct aesd_lock *lock)
+{
+    // Held since before profiling was switched on if hold_start is 0
+    if (lock->hold_start != 0) {
+        end_hold(lock);
+    }
+    return pthread_mutex_unlock(&(lock->mutex));
+}
+
+int aesd_lock_cond_wait(pthread_cond_t *cond, struct aesd_lock *lock)
+{
+    struct aesd_lock_site *holder = lock->holder;
+    bool profiled = (lock->hold_start != 0);
+    int status;
+
+    if (profiled) {
+        end_hold(lock);
+    }
+    status = pthread_cond_wait(cond, &(lock->mutex));
+    if (profiled) {
+        lock->hold_start = monotonic_ns();
+        lock->holder = holder;
+    }
+    return status;
+}
+
+int aesd_lock_cond_timedwait(pthread_cond_t *cond, struct aesd_lock *lock,
+                                const struct timespec *abstime)
+{
+    struct aesd_lock_site *holder = lock->holder;
+    bool profiled = (lock->hold_start != 0);
+    int status;
+
+    if (profiled) {
+        end_hold(lock);
+    }
+    status = pthread_cond_timedwait(cond, &(lock->mutex), abstime);
+    if (profiled) {
+        lock->hold_start = monotonic_ns();
+        lock->holder = holder;
+    }
+    return status;
+}
+
+void aesd_lock_profile(bool on)
+{
+    __atomic_store_n(&profiling, on, __ATOMIC_RELAXED);
+}
+
+bool aesd_lock_profiling(void)
+{
+    return __atomic_load_n(&profiling, __ATOMIC_RELAXED);
+}
+
+void aesd_lock_reset(void)
+{
+    struct aesd_lock *lock;
+    size_t i;
+
+    // Sites keep their slots, only the counts start over
+    pthread_mutex_lock(&registry_lock);
+    for (lock = registry; lock != NULL; lock = lock->next) {
+        __atomic_store_n(&(lock->acquisitions), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(lock->contended), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(lock->wait_ns), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(lock->hold_ns), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(lock->wait_max_ns), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(lock->hold_max_ns), 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&(lock->other_sites), 0, __ATOMIC_RELAXED);
+        for (i = 0; i < AESD_LOCK_BUCKETS; i++) {
+            __atomic_store_n(&(lock->wait_hist[i]), 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&(lock->hold_hist[i]), 0, __ATOMIC_RELAXED);
+        }
+        for (i = 0; i < AESD_LOCK_SITES; i++) {
+            __atomic_store_n(&(lock->sites[i].acquisitions), 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&(lock->sites[i].contended), 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&(lock->sites[i].wait_ns), 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&(lock->sites[i].hold_ns), 0, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+// Upper bound of the bucket holding the given fraction of hist, at most max
+static uint64_t percentile(const uint64_t *hist, double fraction, uint64_t max)
+{
+    uint64_t counts[AESD_LOCK_BUCKETS];
+    uint64_t total = 0, seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < AESD_LOCK_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&hist[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+    for (i = 0; i < AESD_LOCK_BUCKETS; i++) {
+        seen += counts[i];
+        if ((seen > 0) && (seen >= total * fraction)) {
+            if (i == 0) {
+                return 0;
+            }
+            return ((2ULL << i) < max) ? (2ULL << i) : max;
+        }
+    }
+    return 0;
+}
+
+size_t aesd_lock_get_stats(struct aesd_lock_stats *stats, size_t max)
+{
+    struct aesd_lock *lock;
+    struct aesd_lock_site site;
+    size_t count = 0;
+    size_t i, t;
+
+    pthread_mutex_lock(&registry_lock);
+    for (lock = registry; (lock != NULL) && (count < max); lock = lock->next) {
+        struct aesd_lock_stats *out = &stats[count++];
+
+        memset(out, 0, sizeof(*out));
+        out->name = lock->name;
+        out->acquisitions = __atomic_load_n(&(lock->acquisitions), __ATOMIC_RELAXED);
+        out->contended = __atomic_load_n(&(lock->contended), __ATOMIC_RELAXED);
+        out->wait_ns = __atomic_load_n(&(lock->wait_ns), __ATOMIC_RELAXED);
+        out->hold_ns = __atomic_load_n(&(lock->hold_ns), __ATOMIC_RELAXED);
+        out->wait_max_ns = __atomic_load_n(&(lock->wait_max_ns), __ATOMIC_RELAXED);
+        out->hold_max_ns = __atomic_load_n(&(lock->hold_max_ns), __ATOMIC_RELAXED);
+        out->wait_p50_ns = percentile(lock->wait_hist, 0.5, out->wait_max_ns);
+        out->wait_p99_ns = percentile(lock->wait_hist, 0.99, out->wait_max_ns);
+        out->hold_p50_ns = percentile(lock->hold_hist, 0.5, out->hold_max_ns);
+        out->hold_p99_ns = percentile(lock->hold_hist, 0.99, out->hold_max_ns);
+
+        // Insert each site into the top list by total wait
+        for (i = 0; i < AESD_LOCK_SITES; i++) {
+            site.func = __atomic_load_n(&(lock->sites[i].func), __ATOMIC_ACQUIRE);
+            if (site.func == NULL) {
+                continue;
+            }
+            site.line = lock->sites[i].line;
+            site.acquisitions = __atomic_load_n(&(lock->sites[i].acquisitions),
+                                                __ATOMIC_RELAXED);
+            site.contended = __atomic_load_n(&(lock->sites[i].contended), __ATOMIC_RELAXED);
+            site.wait_ns = __atomic_load_n(&(lock->sites[i].wait_ns), __ATOMIC_RELAXED);
+            site.hold_ns = __atomic_load_n(&(lock->sites[i].hold_ns), __ATOMIC_RELAXED);
+            if (site.contended == 0) {
+                continue;
+            }
+            for (t = AESD_LOCK_TOP_SITES; t > 0; t--) {
+                if ((out->top[t - 1].func != NULL) && (out->top[t - 1].wait_ns >= site.wait_ns)) {
+                    break;
+                }
+                if (t < AESD_LOCK_TOP_SITES) {
+                    out->top[t] = out->top[t - 1];
+                }
+            }
+            if (t < AESD_LOCK_TOP_SITES) {
+                out->top[t] = site;
+            }
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return count;
+}
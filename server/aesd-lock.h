@@ -0,0 +1,136 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-lock.h
+​*​ ​@brief​ Mutex wrapper with a runtime switchable contention profile
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* A pthread mutex that can measure itself. While profiling is on every
+* acquisition records how long it waited for the mutex and how long it was
+* then held, into log2 histograms, and the call site that took it, so the
+* sites that wait the most can be named. Profiling is switched on and off
+* at runtime; while it is off a lock costs one extra relaxed load on top of
+* the mutex itself.
+*
+* Counters are only written with the mutex held and read with relaxed
+* atomics, aesd_lock_get_stats() never takes a profiled mutex.
+*/
+
+#ifndef AESD_LOCK_H
+#define AESD_LOCK_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Histogram bucket i counts times of 2^i up to 2^(i+1) nanoseconds
+#define AESD_LOCK_BUCKETS       (32)
+#define AESD_LOCK_SITES         (32)
+#define AESD_LOCK_TOP_SITES     (3)
+
+struct aesd_lock_site {
+    const char *func;       // NULL while the slot is free
+    int line;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+};
+
+struct aesd_lock {
+    pthread_mutex_t mutex;
+    const char *name;
+    bool registered;
+    struct aesd_lock *next;
+    /**
+     * When the holder took the mutex and where, 0 if it was not profiled
+     */
+    uint64_t hold_start;
+    struct aesd_lock_site *holder;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_max_ns;
+    uint64_t wait_hist[AESD_LOCK_BUCKETS];
+    uint64_t hold_hist[AESD_LOCK_BUCKETS];
+    struct aesd_lock_site sites[AESD_LOCK_SITES];
+    /**
+     * Acquisitions from sites once every slot was taken
+     */
+    uint64_t other_sites;
+};
+
+#define AESD_LOCK_INITIALIZER(lock_name) \
+    { .mutex = PTHREAD_MUTEX_INITIALIZER, .name = (lock_name) }
+
+/**
+ * Profile of one lock. Percentiles are the upper bound of their bucket.
+ */
+struct aesd_lock_stats {
+    const char *name;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t wait_p50_ns;
+    uint64_t wait_p99_ns;
+    uint64_t wait_max_ns;
+    uint64_t hold_p50_ns;
+    uint64_t hold_p99_ns;
+    uint64_t hold_max_ns;
+    /**
+     * Sites that waited longest in total, the unused ones with no func
+     */
+    struct aesd_lock_site top[AESD_LOCK_TOP_SITES];
+};
+
+extern int aesd_lock_init(struct aesd_lock *lock, const char *name);
+extern int aesd_lock_destroy(struct aesd_lock *lock);
+
+/**
+ * Lock, recording the calling function and line as the site
+ */
+#define aesd_lock(lock)     aesd_lock_at((lock), __func__, __LINE__)
+
+extern int aesd_lock_at(struct aesd_lock *lock, const char *func, int line);
+extern int aesd_unlock(struct aesd_lock *lock);
+
+/**
+ * pthread_cond_wait() and pthread_cond_timedwait() on a lock, the time
+ * spent waiting does not count as held
+ */
+extern int aesd_lock_cond_wait(pthread_cond_t *cond, struct aesd_lock *lock);
+extern int aesd_lock_cond_timedwait(pthread_cond_t *cond, struct aesd_lock *lock,
+                                    const struct timespec *abstime);
+
+/**
+ * Switch profiling on or off, counters are kept
+ */
+extern void aesd_lock_profile(bool on);
+extern bool aesd_lock_profiling(void);
+
+/**
+ * Clear the counters of every lock profiled so far
+ */
+extern void aesd_lock_reset(void);
+
+/**
+ * Profiles of up to max locks that have been profiled, returns how many
+ */
+extern size_t aesd_lock_get_stats(struct aesd_lock_stats *stats, size_t max);
+
+#endif /* AESD_LOCK_H */
@@ -0,0 +1,266 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-lz.c
+​*​ ​@brief​ Small LZ77 block codec for compressing cold history
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-lz.h"
+
+#define MIN_MATCH       (4)
+#define MAX_OFFSET      (65535)
+#define HASH_LOG        (14)
+// The last match starts this far from the end and the last literals are at
+// least LAST_LITERALS long, which lets the decoder copy in 8 byte words
+#define MF_LIMIT        (12)
+#define LAST_LITERALS   (5)
+// Every 64 misses in a row the search steps one byte further
+#define SKIP_SHIFT      (6)
+#define RUN_MASK        (15)
+#define FAST_COPY       (16)
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+// Number of equal bytes at a and b, reading no further than a_end
+static size_t match_len(const uint8_t *a, const uint8_t *b, const uint8_t *a_end)
+{
+    const uint8_t *start = a;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    uint64_t va, vb;
+
+    while (a + sizeof(va) <= a_end) {
+        memcpy(&va, a, sizeof(va));
+        memcpy(&vb, b, sizeof(vb));
+        if (va != vb) {
+            return (a - start) + (__builtin_ctzll(va ^ vb) >> 3);
+        }
+        a += sizeof(va);
+        b += sizeof(vb);
+    }
+#endif
+    while ((a < a_end) && (*a == *b)) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+// Write a length over RUN_MASK as its continuation bytes
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+    for (len -= RUN_MASK; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emit literals and, when offset is not 0, a match. Returns the new output
+// position or NULL if the sequence would pass op_end.
+static uint8_t *put_sequence(uint8_t *op, uint8_t *op_end, const uint8_t *lit, size_t lit_len,
+                                size_t offset, size_t mlen)
+{
+    uint8_t *token = op++;
+
+    // Token, length bytes of both runs, literals and offset
+    if ((size_t)(op_end - op) < lit_len + (lit_len / 255) + (mlen / 255) + 4) {
+        return NULL;
+    }
+
+    *token = (uint8_t)(((lit_len >= RUN_MASK) ? RUN_MASK : lit_len) << 4);
+    if (lit_len >= RUN_MASK) {
+        op = put_length(op, lit_len);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (offset != 0) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        mlen -= MIN_MATCH;
+        *token |= (mlen >= RUN_MASK) ? RUN_MASK : mlen;
+        if (mlen >= RUN_MASK) {
+            op = put_length(op, mlen);
+        }
+    }
+    return op;
+}
+
+size_t aesd_lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *base = src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *ip_end = base + len;
+    const uint8_t *mf_limit;
+    const uint8_t *match_limit;
+    const uint8_t *ref;
+    uint8_t *op = dst;
+    uint8_t *op_end = op + cap;
+    uint32_t *table;
+    uint32_t seq, h;
+    size_t mlen;
+
+    // Positions of the last four byte sequence with each hash. Starting at
+    // zero only costs a failed compare.
+    table = calloc(1U << HASH_LOG, sizeof(*table));
+    if (table == NULL) {
+        return 0;
+    }
+
+    if (len > MF_LIMIT) {
+        mf_limit = ip_end - MF_LIMIT;
+        match_limit = ip_end - LAST_LITERALS;
+        ip++;
+        while (ip < mf_limit) {
+            seq = read32(ip);
+            h = hash32(seq);
+            ref = base + table[h];
+            table[h] = ip - base;
+            if ((ref >= ip) || (ip - ref > MAX_OFFSET) || (read32(ref) != seq)) {
+                // Incompressible runs are skipped ever faster
+                ip += 1 + ((ip - anchor) >> SKIP_SHIFT);
+                continue;
+            }
+
+            // The match may begin before where it was found
+            while ((ip > anchor) && (ref > base) && (ip[-1] == ref[-1])) {
+                ip--;
+                ref--;
+            }
+            mlen = MIN_MATCH + match_len(ip + MIN_MATCH, ref + MIN_MATCH, match_limit);
+
+            op = put_sequence(op, op_end, anchor, ip - anchor, ip - ref, mlen);
+            if (op == NULL) {
+                free(table);
+                return 0;
+            }
+            ip += mlen;
+            anchor = ip;
+
+            // Index a position inside the match too, runs of similar records
+            // then keep finding the previous one
+            if (ip < mf_limit) {
+                table[hash32(read32(ip - 2))] = ip - 2 - base;
+            }
+        }
+    }
+    free(table);
+
+    op = put_sequence(op, op_end, anchor, ip_end - anchor, 0, 0);
+    return (op == NULL) ? 0 : (size_t)(op - (uint8_t *)dst);
+}
+
+// Read the continuation bytes of a length that was RUN_MASK, false if the
+// input ends first
+static inline bool get_length(const uint8_t **ip, const uint8_t *ip_end, size_t *len)
+{
+    uint8_t b;
+
+    do {
+        if (*ip >= ip_end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+ssize_t aesd_lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = ip + len;
+    uint8_t *op = dst;
+    uint8_t *op_end = op + cap;
+    const uint8_t *match;
+    uint8_t *copy_end;
+    size_t lit_len, mlen, offset;
+    uint8_t token;
+
+    while (ip < ip_end) {
+        token = *ip++;
+
+        // Short literals are copied as one fixed size word pair, which never
+        // reaches the end of a well formed block as the offset still follows
+        lit_len = token >> 4;
+        if ((lit_len < RUN_MASK) && (ip_end - ip >= FAST_COPY + 2) &&
+            (op_end - op >= FAST_COPY)) {
+            memcpy(op, ip, FAST_COPY);
+        } else {
+            if ((lit_len == RUN_MASK) && !get_length(&ip, ip_end, &lit_len)) {
+                return -1;
+            }
+            if ((lit_len > (size_t)(ip_end - ip)) || (lit_len > (size_t)(op_end - op))) {
+                return -1;
+            }
+            memcpy(op, ip, lit_len);
+        }
+        op += lit_len;
+        ip += lit_len;
+        if (ip == ip_end) {
+            return op - (uint8_t *)dst;
+        }
+
+        if (ip_end - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        mlen = token & RUN_MASK;
+        if ((mlen == RUN_MASK) && !get_length(&ip, ip_end, &mlen)) {
+            return -1;
+        }
+        mlen += MIN_MATCH;
+        if ((offset == 0) || (offset > (size_t)(op - (uint8_t *)dst)) ||
+            (mlen > (size_t)(op_end - op))) {
+            return -1;
+        }
+
+        // Matches at least a word back copy a word at a time, overrunning
+        // into space the rest of the block fills in anyway
+        match = op - offset;
+        copy_end = op + mlen;
+        if ((offset >= sizeof(uint64_t)) && (mlen + sizeof(uint64_t) <= (size_t)(op_end - op))) {
+            do {
+                memcpy(op, match, sizeof(uint64_t));
+                op += sizeof(uint64_t);
+                match += sizeof(uint64_t);
+            } while (op < copy_end);
+        } else {
+            while (op < copy_end) {
+                *op++ = *match++;
+            }
+        }
+        op = copy_end;
+    }
+    // A block ends with literals, even if there are none
+    return -1;
+}
@@ -0,0 +1,58 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-lz.h
+​*​ ​@brief​ Small LZ77 block codec for compressing cold history
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* A byte oriented LZ77 codec in the style of LZ4, for blocks of history
+* that are written once and read back many times. The compressor finds
+* matches with a single hash table probe and no chains, the decoder is a
+* loop of literal and match copies, so decoding runs at memory speed.
+*
+* A block is a run of sequences. Each starts with a token byte, the number
+* of literals in its high nibble and the match length less 4 in its low
+* nibble, 15 in either meaning more length bytes follow, each added on until
+* one is below 255. The literals follow, then a 16-bit little endian offset
+* back to the match. The last sequence has literals only, and the block ends
+* with it.
+*/
+
+#ifndef AESD_LZ_H
+#define AESD_LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Output space that always holds the compressed form of len bytes
+ */
+static inline size_t aesd_lz_bound(size_t len)
+{
+    return len + (len / 255) + 16;
+}
+
+/**
+ * Compress len bytes at src into at most cap bytes at dst. Returns the
+ * compressed length, or 0 if it would not fit or memory ran out.
+ */
+extern size_t aesd_lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * Decompress the len byte block at src into at most cap bytes at dst.
+ * Returns the decompressed length, or -1 if the block is malformed or does
+ * not fit.
+ */
+extern ssize_t aesd_lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* AESD_LZ_H */
@@ -0,0 +1,675 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-prof.c
+​*​ ​@brief​ Sampling CPU profiler writing folded stacks
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#define _GNU_SOURCE
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "aesd-prof.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+#define PROF_SUPPORTED      (1)
+#else
+#define PROF_SUPPORTED      (0)
+#endif
+
+// Largest frame the unwinder steps over, anything further is taken as a
+// frame pointer register holding something else
+#define MAX_FRAME_SIZE      (1024 * 1024)
+#define MAX_OBJECTS         (64)
+#define MAX_TEXT            (128)
+// Words above the stack pointer searched for a return address when the frame
+// pointer register does not hold one, as in libc's system call wrappers
+#define SCAN_WORDS          (64)
+#define MAX_NAME            (128)
+
+// ELF32_ST_TYPE and ELF64_ST_TYPE are the same
+#define SYMBOL_TYPE(info)   ELF64_ST_TYPE(info)
+
+struct prof_sample {
+    uint32_t depth;
+    uintptr_t pc[AESD_PROF_DEPTH];      // Leaf first
+};
+
+// Executable segment, return addresses have to point into one
+struct prof_text {
+    uintptr_t lo;
+    uintptr_t hi;
+    bool framed;        // The server itself, built with frame pointers
+};
+
+struct prof_symbol {
+    uintptr_t addr;
+    uintptr_t size;
+    const char *name;
+};
+
+// A loaded executable or shared object and, once looked at, its symbols
+struct prof_object {
+    char path[PATH_MAX];
+    const char *short_name;
+    uintptr_t base;
+    uintptr_t lo;
+    uintptr_t hi;
+    bool loaded;
+    struct prof_symbol *symbols;
+    size_t count;
+    void *map;
+    size_t map_len;
+};
+
+// Unique frame address and the name it resolved to
+struct prof_frame {
+    uintptr_t pc;
+    char *name;
+};
+
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_sample *samples = NULL;
+static uint64_t next_sample = 0;    // Slots claimed, may run past the buffer
+static uint64_t dropped = 0;
+static uint64_t dumped = 0;
+static int writers = 0;             // Handlers filling a slot right now
+static bool paused = false;
+static bool running = false;
+static bool handler_installed = false;
+static unsigned int prof_hz = 0;
+
+static struct prof_text text[MAX_TEXT];
+static size_t text_count = 0;       // Filled before the handler is installed
+static struct prof_object objects[MAX_OBJECTS];
+static size_t object_count = 0;
+
+// Read the two words of a frame record, false if they are not mapped
+// readable. Frame pointer registers of code built without them hold
+// anything, so every record is read through the kernel.
+static bool read_frame(uintptr_t fp, uintptr_t frame[2])
+{
+    struct iovec local = { .iov_base = frame, .iov_len = 2 * sizeof(uintptr_t) };
+    struct iovec remote = { .iov_base = (void *)fp, .iov_len = 2 * sizeof(uintptr_t) };
+
+    return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) ==
+            (ssize_t)(2 * sizeof(uintptr_t));
+}
+
+static bool is_text(uintptr_t addr, bool framed_only)
+{
+    size_t i;
+
+    for (i = 0; i < text_count; i++) {
+        if ((addr >= text[i].lo) && (addr < text[i].hi)) {
+            return !framed_only || text[i].framed;
+        }
+    }
+    return false;
+}
+
+// Whether fp points at a frame record above sp
+static bool is_frame(uintptr_t fp, uintptr_t sp, uintptr_t frame[2])
+{
+    return (fp >= sp) && (fp - sp < MAX_FRAME_SIZE) && (fp % sizeof(uintptr_t) == 0) &&
+            read_frame(fp, frame) && is_text(frame[1], false);
+}
+
+static void prof_handler(int signum, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    struct prof_sample *sample;
+    uintptr_t pc = 0, fp = 0, sp = 0, addr;
+    bool framed;
+    uintptr_t frame[2];
+    uint64_t slot;
+    uint32_t depth;
+    int saved_errno = errno;
+
+    (void)signum;
+    (void)info;
+
+    // Announce the write before looking at paused, see aesd_prof_dump()
+    __atomic_add_fetch(&writers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&paused, __ATOMIC_SEQ_CST) || (samples == NULL)) {
+        goto out;
+    }
+    slot = __atomic_fetch_add(&next_sample, 1, __ATOMIC_RELAXED);
+    if (slot >= AESD_PROF_SAMPLES) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        goto out;
+    }
+
+#if defined(__x86_64__)
+    pc = uc->uc_mcontext.gregs[REG_RIP];
+    fp = uc->uc_mcontext.gregs[REG_RBP];
+    sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__i386__)
+    pc = uc->uc_mcontext.gregs[REG_EIP];
+    fp = uc->uc_mcontext.gregs[REG_EBP];
+    sp = uc->uc_mcontext.gregs[REG_ESP];
+#elif defined(__aarch64__)
+    pc = uc->uc_mcontext.pc;
+    fp = uc->uc_mcontext.regs[29];
+    sp = uc->uc_mcontext.sp;
+#else
+    (void)uc;
+#endif
+
+    sample = &samples[slot];
+    sample->pc[0] = pc;
+    depth = 1;
+
+    // A leaf in a library built without frame pointers has not pushed a
+    // frame record, and may use the register for anything. Its return
+    // address is the first code address on the stack and, as most functions
+    // push the frame pointer first, the word below it is the caller's frame
+    // pointer if the register no longer is.
+    framed = is_frame(fp, sp, frame);
+    if (!is_text(pc, true)) {
+        for (addr = sp; (addr < sp + SCAN_WORDS * sizeof(uintptr_t)) && (!framed || (addr < fp));
+                addr += sizeof(uintptr_t)) {
+            if (read_frame(addr - sizeof(uintptr_t), frame) && is_text(frame[1], false)) {
+                sample->pc[depth++] = frame[1];
+                if (!framed) {
+                    fp = frame[0];
+                }
+                break;
+            }
+        }
+    }
+
+    // A record is the caller's frame pointer then the return address, and
+    // frames only ever get older further up the stack
+    while ((depth < AESD_PROF_DEPTH) && is_frame(fp, sp, frame)) {
+        sample->pc[depth++] = frame[1];
+        sp = fp + 2 * sizeof(uintptr_t);
+        fp = frame[0];
+    }
+    sample->depth = depth;
+
+out:
+    __atomic_sub_fetch(&writers, 1, __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+// Stop handlers from claiming slots and wait out the ones that already have
+static void pause_sampling(void)
+{
+    __atomic_store_n(&paused, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&writers, __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+}
+
+static int add_text(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    int i;
+
+    (void)size;
+    (void)arg;
+    for (i = 0; (i < info->dlpi_phnum) && (text_count < MAX_TEXT); i++) {
+        if ((info->dlpi_phdr[i].p_type == PT_LOAD) && (info->dlpi_phdr[i].p_flags & PF_X)) {
+            text[text_count].lo = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+            text[text_count].hi = text[text_count].lo + info->dlpi_phdr[i].p_memsz;
+            text[text_count].framed = (info->dlpi_name[0] == '\0');
+            text_count++;
+        }
+    }
+    return 0;
+}
+
+int aesd_prof_start(unsigned int hz)
+{
+    struct itimerval timer;
+    struct sigaction action;
+
+    if (!PROF_SUPPORTED) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if ((hz == 0) || (hz > AESD_PROF_MAX_HZ)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&prof_lock);
+    if (samples == NULL) {
+        samples = calloc(AESD_PROF_SAMPLES, sizeof(*samples));
+        if (samples == NULL) {
+            pthread_mutex_unlock(&prof_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    // Where code is loaded, for the handler to tell return addresses apart.
+    // The server loads no objects after it starts.
+    if (text_count == 0) {
+        dl_iterate_phdr(add_text, NULL);
+    }
+
+    // The handler stays installed once sampling stops, a SIGPROF already on
+    // its way would terminate the process otherwise
+    if (!handler_installed) {
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = prof_handler;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        if (sigaction(SIGPROF, &action, NULL) == -1) {
+            pthread_mutex_unlock(&prof_lock);
+            return -1;
+        }
+        handler_installed = true;
+    }
+
+    // At 1 Hz the period is a whole second, which tv_usec cannot hold
+    timer.it_interval.tv_sec = 1 / hz;
+    timer.it_interval.tv_usec = (1000000 / hz) % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) == -1) {
+        pthread_mutex_unlock(&prof_lock);
+        return -1;
+    }
+    __atomic_store_n(&paused, false, __ATOMIC_SEQ_CST);
+    running = true;
+    prof_hz = hz;
+    pthread_mutex_unlock(&prof_lock);
+    return 0;
+}
+
+void aesd_prof_stop(void)
+{
+    struct itimerval timer;
+
+    pthread_mutex_lock(&prof_lock);
+    if (running) {
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, NULL);
+        running = false;
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+static int add_object(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    struct prof_object *object;
+    uintptr_t start, end;
+    const char *slash;
+    int i;
+
+    (void)size;
+    (void)arg;
+    if (object_count == MAX_OBJECTS) {
+        return 1;
+    }
+    object = &objects[object_count];
+    memset(object, 0, sizeof(*object));
+
+    // The executable comes first, with no name
+    snprintf(object->path, sizeof(object->path), "%s",
+                (info->dlpi_name[0] != '\0') ? info->dlpi_name : "/proc/self/exe");
+    slash = strrchr(info->dlpi_name, '/');
+    object->short_name = (info->dlpi_name[0] == '\0') ? program_invocation_short_name :
+                            (slash != NULL) ? slash + 1 : info->dlpi_name;
+    object->base = info->dlpi_addr;
+    object->lo = UINTPTR_MAX;
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        if (info->dlpi_phdr[i].p_type != PT_LOAD) {
+            continue;
+        }
+        start = info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+        end = start + info->dlpi_phdr[i].p_memsz;
+        if (start < object->lo) {
+            object->lo = start;
+        }
+        if (end > object->hi) {
+            object->hi = end;
+        }
+    }
+    if (object->lo < object->hi) {
+        object_count++;
+    }
+    return 0;
+}
+
+static int compare_symbol(const void *a, const void *b)
+{
+    const struct prof_symbol *x = a;
+    const struct prof_symbol *y = b;
+
+    return (x->addr < y->addr) ? -1 : (x->addr > y->addr);
+}
+
+// Load the function symbols of an object from its file, the full symbol
+// table if it was not stripped or else the dynamic one
+static void load_symbols(struct prof_object *object)
+{
+    const ElfW(Ehdr) *ehdr;
+    const ElfW(Shdr) *shdrs, *symtab = NULL, *strtab;
+    const ElfW(Sym) *syms;
+    struct stat st;
+    size_t i, nsyms;
+    int fd;
+
+    object->loaded = true;
+    fd = open(object->path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if ((fstat(fd, &st) == -1) || ((size_t)st.st_size < sizeof(*ehdr))) {
+        close(fd);
+        return;
+    }
+    object->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (object->map == MAP_FAILED) {
+        object->map = NULL;
+        return;
+    }
+    object->map_len = st.st_size;
+
+    ehdr = object->map;
+    if ((memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) ||
+        (ehdr->e_ident[EI_CLASS] != ((sizeof(void *) == 8) ? ELFCLASS64 : ELFCLASS32)) ||
+        (ehdr->e_shentsize != sizeof(ElfW(Shdr))) ||
+        (ehdr->e_shoff + (size_t)ehdr->e_shnum * sizeof(ElfW(Shdr)) > object->map_len)) {
+        return;
+    }
+    shdrs = (const ElfW(Shdr) *)((const char *)object->map + ehdr->e_shoff);
+    for (i = 0; i < ehdr->e_shnum; i++) {
+        if ((shdrs[i].sh_type == SHT_SYMTAB) ||
+            ((shdrs[i].sh_type == SHT_DYNSYM) && (symtab == NULL))) {
+            symtab = &shdrs[i];
+        }
+    }
+    if ((symtab == NULL) || (symtab->sh_link >= ehdr->e_shnum) ||
+        (symtab->sh_offset + symtab->sh_size > object->map_len)) {
+        return;
+    }
+    strtab = &shdrs[symtab->sh_link];
+    if (strtab->sh_offset + strtab->sh_size > object->map_len) {
+        return;
+    }
+
+    syms = (const ElfW(Sym) *)((const char *)object->map + symtab->sh_offset);
+    nsyms = symtab->sh_size / sizeof(ElfW(Sym));
+    object->symbols = calloc(nsyms + 1, sizeof(struct prof_symbol));
+    if (object->symbols == NULL) {
+        return;
+    }
+    for (i = 0; i < nsyms; i++) {
+        if (((SYMBOL_TYPE(syms[i].st_info) != STT_FUNC) &&
+             (SYMBOL_TYPE(syms[i].st_info) != STT_GNU_IFUNC)) ||
+            (syms[i].st_shndx == SHN_UNDEF) || (syms[i].st_value == 0) ||
+            (syms[i].st_name >= strtab->sh_size)) {
+            continue;
+        }
+        object->symbols[object->count].addr = object->base + syms[i].st_value;
+        object->symbols[object->count].size = syms[i].st_size;
+        object->symbols[object->count].name = (const char *)object->map +
+                                                strtab->sh_offset + syms[i].st_name;
+        object->count++;
+    }
+    qsort(object->symbols, object->count, sizeof(struct prof_symbol), compare_symbol);
+}
+
+// Name of the function holding pc, or object+offset if it has no symbol
+static char *resolve(uintptr_t pc)
+{
+    struct prof_object *object = NULL;
+    const struct prof_symbol *symbol = NULL;
+    char name[MAX_NAME];
+    size_t lo, hi, mid, i;
+
+    for (i = 0; i < object_count; i++) {
+        if ((pc >= objects[i].lo) && (pc < objects[i].hi)) {
+            object = &objects[i];
+            break;
+        }
+    }
+    if (object == NULL) {
+        return strdup("[unknown]");
+    }
+    if (!object->loaded) {
+        load_symbols(object);
+    }
+
+    // Last symbol starting at or before pc
+    lo = 0;
+    hi = object->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (object->symbols[mid].addr <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {
+        symbol = &object->symbols[lo - 1];
+        if ((symbol->size > 0) && (pc >= symbol->addr + symbol->size)) {
+            symbol = NULL;
+        }
+    }
+    if (symbol != NULL) {
+        return strdup(symbol->name);
+    }
+    snprintf(name, sizeof(name), "%s+0x%lx", object->short_name,
+                (unsigned long)(pc - object->base));
+    return strdup(name);
+}
+
+static int compare_frame(const void *a, const void *b)
+{
+    const struct prof_frame *x = a;
+    const struct prof_frame *y = b;
+
+    return (x->pc < y->pc) ? -1 : (x->pc > y->pc);
+}
+
+static int compare_string(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Return addresses point past the call, look up the call itself
+static uintptr_t frame_pc(const struct prof_sample *sample, uint32_t i)
+{
+    return (i == 0) ? sample->pc[0] : sample->pc[i] - 1;
+}
+
+static const char *frame_name(const struct prof_frame *frames, size_t count, uintptr_t pc)
+{
+    struct prof_frame key = { .pc = pc };
+    const struct prof_frame *frame = bsearch(&key, frames, count, sizeof(*frames),
+                                                compare_frame);
+
+    return (frame != NULL) ? frame->name : "[unknown]";
+}
+
+// Write count samples to file as folded stacks, false on failure
+static bool write_folded(FILE *file, const struct prof_sample *copy, size_t count)
+{
+    struct prof_frame *frames = NULL;
+    char **stacks = NULL;
+    size_t frame_count = 0, unique = 0;
+    size_t i, run;
+    uint32_t d;
+    bool ok = false;
+
+    for (i = 0; i < count; i++) {
+        frame_count += copy[i].depth;
+    }
+    frames = calloc(frame_count + 1, sizeof(*frames));
+    stacks = calloc(count + 1, sizeof(*stacks));
+    if ((frames == NULL) || (stacks == NULL)) {
+        goto done;
+    }
+
+    // Resolve every distinct address once
+    frame_count = 0;
+    for (i = 0; i < count; i++) {
+        for (d = 0; d < copy[i].depth; d++) {
+            frames[frame_count++].pc = frame_pc(&copy[i], d);
+        }
+    }
+    qsort(frames, frame_count, sizeof(*frames), compare_frame);
+    for (i = 0; i < frame_count; i++) {
+        if ((unique == 0) || (frames[i].pc != frames[unique - 1].pc)) {
+            frames[unique++].pc = frames[i].pc;
+        }
+    }
+    object_count = 0;
+    dl_iterate_phdr(add_object, NULL);
+    for (i = 0; i < unique; i++) {
+        frames[i].name = resolve(frames[i].pc);
+        if (frames[i].name == NULL) {
+            goto done;
+        }
+    }
+
+    // One line per sample, outermost frame first, then count equal lines
+    for (i = 0; i < count; i++) {
+        size_t len = 0, pos = 0;
+
+        for (d = 0; d < copy[i].depth; d++) {
+            len += strlen(frame_name(frames, unique, frame_pc(&copy[i], d))) + 1;
+        }
+        stacks[i] = malloc(len + 1);
+        if (stacks[i] == NULL) {
+            goto done;
+        }
+        for (d = copy[i].depth; d > 0; d--) {
+            pos += sprintf(stacks[i] + pos, "%s%s", (pos > 0) ? ";" : "",
+                            frame_name(frames, unique, frame_pc(&copy[i], d - 1)));
+        }
+        stacks[i][pos] = '\0';
+    }
+    qsort(stacks, count, sizeof(*stacks), compare_string);
+    for (i = 0; i < count; i += run) {
+        for (run = 1; (i + run < count) && (strcmp(stacks[i], stacks[i + run]) == 0); run++) {
+        }
+        fprintf(file, "%s %zu\n", stacks[i], run);
+    }
+    ok = true;
+
+done:
+    for (i = 0; (frames != NULL) && (i < unique); i++) {
+        free(frames[i].name);
+    }
+    for (i = 0; (stacks != NULL) && (i < count); i++) {
+        free(stacks[i]);
+    }
+    for (i = 0; i < object_count; i++) {
+        free(objects[i].symbols);
+        if (objects[i].map != NULL) {
+            munmap(objects[i].map, objects[i].map_len);
+        }
+    }
+    object_count = 0;
+    free(frames);
+    free(stacks);
+    if (!ok) {
+        errno = ENOMEM;
+    }
+    return ok;
+}
+
+long aesd_prof_dump(const char *path)
+{
+    struct prof_sample *copy;
+    size_t count;
+    FILE *file;
+    bool ok;
+
+    pthread_mutex_lock(&prof_lock);
+    if (samples == NULL) {
+        pthread_mutex_unlock(&prof_lock);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // Take the samples out and let sampling go on while they are resolved
+    pause_sampling();
+    count = (next_sample < AESD_PROF_SAMPLES) ? next_sample : AESD_PROF_SAMPLES;
+    copy = malloc((count + 1) * sizeof(*copy));
+    if (copy != NULL) {
+        memcpy(copy, samples, count * sizeof(*copy));
+        next_sample = 0;
+        dumped += count;
+    }
+    __atomic_store_n(&paused, false, __ATOMIC_SEQ_CST);
+    if (copy == NULL) {
+        pthread_mutex_unlock(&prof_lock);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    file = fopen(path, "we");
+    if (file == NULL) {
+        free(copy);
+        pthread_mutex_unlock(&prof_lock);
+        return -1;
+    }
+    ok = write_folded(file, copy, count);
+    if (fclose(file) != 0) {
+        ok = false;
+    }
+    free(copy);
+    pthread_mutex_unlock(&prof_lock);
+    return ok ? (long)count : -1;
+}
+
+void aesd_prof_get_stats(struct aesd_prof_stats *stats)
+{
+    uint64_t claimed;
+
+    pthread_mutex_lock(&prof_lock);
+    claimed = __atomic_load_n(&next_sample, __ATOMIC_RELAXED);
+    stats->running = running;
+    stats->hz = prof_hz;
+    stats->samples = (claimed < AESD_PROF_SAMPLES) ? claimed : AESD_PROF_SAMPLES;
+    stats->dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    stats->dumped = dumped;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+void aesd_prof_destroy(void)
+{
+    aesd_prof_stop();
+    pthread_mutex_lock(&prof_lock);
+    if (samples != NULL) {
+        pause_sampling();
+        free(samples);
+        samples = NULL;
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
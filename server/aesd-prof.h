@@ -0,0 +1,79 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-prof.h
+​*​ ​@brief​ Sampling CPU profiler writing folded stacks
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* A sampling CPU profiler for targets where perf is not available. While it
+* runs, ITIMER_PROF sends SIGPROF every 1/hz of CPU time the process uses,
+* to the thread that was using it. The handler walks that thread's frame
+* pointers from the interrupted context and stores the stack into a sample
+* buffer allocated up front; once the buffer is full further samples are
+* only counted as dropped.
+*
+* aesd_prof_dump() writes the buffered samples as folded stacks, one line
+* per distinct stack from the outermost frame to the leaf with its sample
+* count, the input flamegraph.pl and speedscope take. Frames are named from
+* the symbol tables of the executable and shared objects, or as object+offset
+* where an object has none. The server has to be built with frame pointers
+* for stacks deeper than the leaf, the Makefile does so.
+*
+* Frame pointers are walked on x86_64, i386 and aarch64 only.
+*/
+
+#ifndef AESD_PROF_H
+#define AESD_PROF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_PROF_SUFFIX    (".folded")
+#define AESD_PROF_SAMPLES   (8192)
+#define AESD_PROF_DEPTH     (32)
+#define AESD_PROF_MAX_HZ    (1000)
+
+struct aesd_prof_stats {
+    bool running;
+    unsigned int hz;
+    uint64_t samples;       // Buffered and not dumped yet
+    uint64_t dropped;       // With the buffer full
+    uint64_t dumped;        // Written out by every dump so far
+};
+
+/**
+ * Start sampling hz times per second of CPU time, allocating the sample
+ * buffer on first use. Returns 0, or -1 with errno set.
+ */
+extern int aesd_prof_start(unsigned int hz);
+
+/**
+ * Stop sampling, buffered samples are kept for a dump
+ */
+extern void aesd_prof_stop(void);
+
+/**
+ * Write the buffered samples to path as folded stacks and empty the
+ * buffer. Returns the number of samples written, or -1 with errno set.
+ */
+extern long aesd_prof_dump(const char *path);
+
+extern void aesd_prof_get_stats(struct aesd_prof_stats *stats);
+
+/**
+ * Stop sampling and free the buffer
+ */
+extern void aesd_prof_destroy(void);
+
+#endif /* AESD_PROF_H */
@@ -0,0 +1,261 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-ratelimit.c
+​*​ ​@brief​ Token bucket rate limiting per connection and per source address
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "aesd-ratelimit.h"
+
+#define SOURCE_HASH_SIZE    (256)
+#define MAX_SOURCE_WEIGHTS  (32)
+
+struct source_weight {
+    char addr[INET6_ADDRSTRLEN];
+    double weight;
+};
+
+static pthread_mutex_t sources_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct aesd_rl_source *sources[SOURCE_HASH_SIZE];
+static double source_rates[AESD_RL_DIRS];
+static struct source_weight source_weights[MAX_SOURCE_WEIGHTS];
+static int num_source_weights = 0;
+
+static double timespec_diff_sec(const struct timespec *end, const struct timespec *start)
+{
+    return (end->tv_sec - start->tv_sec) + ((end->tv_nsec - start->tv_nsec) / 1e9);
+}
+
+void aesd_token_bucket_init(struct aesd_token_bucket *bucket, double rate)
+{
+    // Allow up to one second worth of bytes in a burst
+    bucket->rate = rate;
+    bucket->burst = (rate < 1) ? 1 : rate;
+    bucket->tokens = bucket->burst;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+static void token_bucket_refill(struct aesd_token_bucket *bucket, const struct timespec *now)
+{
+    bucket->tokens += bucket->rate * timespec_diff_sec(now, &bucket->last);
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last = *now;
+}
+
+// Bytes available from a bucket, updates wait_ms if there are none
+static size_t token_bucket_available(struct aesd_token_bucket *bucket,
+                                        const struct timespec *now, int *wait_ms)
+{
+    int bucket_wait_ms;
+
+    if (bucket->rate == 0) {
+        return (size_t)-1;
+    }
+
+    token_bucket_refill(bucket, now);
+    if (bucket->tokens >= 1) {
+        return (size_t)bucket->tokens;
+    }
+
+    // Time until at least one whole token is available
+    bucket_wait_ms = (int)(((1 - bucket->tokens) / bucket->rate) * 1000) + 1;
+    if ((*wait_ms < 0) || (bucket_wait_ms < *wait_ms)) {
+        *wait_ms = bucket_wait_ms;
+    }
+    return 0;
+}
+
+void aesd_rl_set_source_rates(double ingest_rate, double reply_rate)
+{
+    source_rates[AESD_RL_INGEST] = ingest_rate;
+    source_rates[AESD_RL_REPLY] = reply_rate;
+}
+
+int aesd_rl_set_source_weight(const char *addr, double weight)
+{
+    if (num_source_weights == MAX_SOURCE_WEIGHTS) {
+        return -1;
+    }
+
+    strncpy(source_weights[num_source_weights].addr, addr, INET6_ADDRSTRLEN - 1);
+    source_weights[num_source_weights].weight = weight;
+    num_source_weights++;
+    return 0;
+}
+
+// Pointer to and length of the address bytes that identify a source
+static const void *source_key(const struct sockaddr_storage *addr, size_t *len)
+{
+    if (addr->ss_family == AF_INET) {
+        *len = sizeof(struct in_addr);
+        return &(((struct sockaddr_in *)addr)->sin_addr);
+    } else if (addr->ss_family == AF_INET6) {
+        *len = sizeof(struct in6_addr);
+        return &(((struct sockaddr_in6 *)addr)->sin6_addr);
+    }
+
+    // Every other family is treated as a single local source
+    *len = 0;
+    return NULL;
+}
+
+// FNV-1a hash of the address bytes
+static unsigned int source_hash(const void *key, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)key;
+    uint32_t hash = 2166136261u;
+
+    while (len-- > 0) {
+        hash ^= *p++;
+        hash *= 16777619u;
+    }
+    return hash % SOURCE_HASH_SIZE;
+}
+
+static bool source_match(const struct aesd_rl_source *source, const struct sockaddr_storage *addr)
+{
+    const void *key, *source_key_bytes;
+    size_t len, source_len;
+
+    if (source->addr.ss_family != addr->ss_family) {
+        return false;
+    }
+
+    key = source_key(addr, &len);
+    source_key_bytes = source_key(&source->addr, &source_len);
+    return (len == source_len) && ((len == 0) || (memcmp(key, source_key_bytes, len) == 0));
+}
+
+static double source_weight(const struct sockaddr_storage *addr)
+{
+    char addr_str[INET6_ADDRSTRLEN];
+    size_t len;
+    const void *key = source_key(addr, &len);
+    int i;
+
+    if ((key == NULL) || (inet_ntop(addr->ss_family, key, addr_str, sizeof(addr_str)) == NULL)) {
+        return 1.0;
+    }
+
+    for (i = 0; i < num_source_weights; i++) {
+        if (strcmp(source_weights[i].addr, addr_str) == 0) {
+            return source_weights[i].weight;
+        }
+    }
+    return 1.0;
+}
+
+struct aesd_rl_source *aesd_rl_source_get(const struct sockaddr_storage *addr)
+{
+    struct aesd_rl_source *source;
+    size_t len;
+    const void *key = source_key(addr, &len);
+    unsigned int bucket = source_hash(key, len);
+    int dir;
+
+    pthread_mutex_lock(&sources_lock);
+
+    for (source = sources[bucket]; source != NULL; source = source->next) {
+        if (source_match(source, addr)) {
+            source->refs++;
+            pthread_mutex_unlock(&sources_lock);
+            return source;
+        }
+    }
+
+    source = calloc(1, sizeof(*source));
+    if (source != NULL) {
+        source->addr = *addr;
+        pthread_mutex_init(&source->lock, NULL);
+        for (dir = 0; dir < AESD_RL_DIRS; dir++) {
+            aesd_token_bucket_init(&source->buckets[dir], source_rates[dir]);
+        }
+        aesd_fairq_flow_init(&source->flow, source_weight(addr));
+        source->refs = 1;
+        source->next = sources[bucket];
+        sources[bucket] = source;
+    }
+
+    pthread_mutex_unlock(&sources_lock);
+    return source;
+}
+
+void aesd_rl_source_put(struct aesd_rl_source *source)
+{
+    struct aesd_rl_source **pp_source;
+    size_t len;
+    const void *key = source_key(&source->addr, &len);
+
+    pthread_mutex_lock(&sources_lock);
+
+    source->refs--;
+    if (source->refs == 0) {
+        for (pp_source = &sources[source_hash(key, len)]; *pp_source != NULL;
+                pp_source = &((*pp_source)->next)) {
+            if (*pp_source == source) {
+                *pp_source = source->next;
+                break;
+            }
+        }
+        pthread_mutex_destroy(&source->lock);
+        free(source);
+    }
+
+    pthread_mutex_unlock(&sources_lock);
+}
+
+size_t aesd_rl_allowance(struct aesd_token_bucket *conn_bucket,
+                            struct aesd_rl_source *source,
+                            enum aesd_rl_dir dir, int *wait_ms)
+{
+    struct timespec now;
+    size_t allowed, source_allowed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    allowed = token_bucket_available(conn_bucket, &now, wait_ms);
+
+    if (source->buckets[dir].rate != 0) {
+        pthread_mutex_lock(&source->lock);
+        source_allowed = token_bucket_available(&source->buckets[dir], &now, wait_ms);
+        pthread_mutex_unlock(&source->lock);
+        if (source_allowed < allowed) {
+            allowed = source_allowed;
+        }
+    }
+
+    return allowed;
+}
+
+void aesd_rl_consume(struct aesd_token_bucket *conn_bucket,
+                        struct aesd_rl_source *source,
+                        enum aesd_rl_dir dir, size_t bytes)
+{
+    if (conn_bucket->rate != 0) {
+        conn_bucket->tokens -= bytes;
+    }
+
+    if (source->buckets[dir].rate != 0) {
+        pthread_mutex_lock(&source->lock);
+        source->buckets[dir].tokens -= bytes;
+        pthread_mutex_unlock(&source->lock);
+    }
+}
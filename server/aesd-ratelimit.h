@@ -0,0 +1,115 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-ratelimit.h
+​*​ ​@brief​ Token bucket rate limiting per connection and per source address
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+#ifndef AESD_RATELIMIT_H
+#define AESD_RATELIMIT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "aesd-fairq.h"
+
+enum aesd_rl_dir {
+    AESD_RL_INGEST,     // Bytes received from the client
+    AESD_RL_REPLY,      // Bytes sent back to the client
+    AESD_RL_DIRS,
+};
+
+struct aesd_token_bucket {
+    /**
+     * Tokens (bytes) added per second, 0 means unlimited
+     */
+    double rate;
+    /**
+     * Maximum number of tokens the bucket can hold
+     */
+    double burst;
+    /**
+     * Tokens currently available
+     */
+    double tokens;
+    /**
+     * Time tokens were last added
+     */
+    struct timespec last;
+};
+
+/**
+ * State shared by every connection from the same source address
+ */
+struct aesd_rl_source {
+    struct sockaddr_storage addr;
+    pthread_mutex_t lock;
+    struct aesd_token_bucket buckets[AESD_RL_DIRS];
+    /**
+     * Flow used to schedule this source's appends in the fair queue
+     */
+    struct aesd_fairq_flow flow;
+    /**
+     * Number of connections holding a reference
+     */
+    unsigned int refs;
+    struct aesd_rl_source *next;
+};
+
+extern void aesd_token_bucket_init(struct aesd_token_bucket *bucket, double rate);
+
+/**
+ * Set the rates used for the per-source buckets of sources created from now on
+ */
+extern void aesd_rl_set_source_rates(double ingest_rate, double reply_rate);
+
+/**
+ * Set the fair queue weight given to a source address, addr is the textual
+ * form printed by inet_ntop(). Returns -1 if the table of weights is full.
+ */
+extern int aesd_rl_set_source_weight(const char *addr, double weight);
+
+/**
+ * Find or create the shared state for the address of a client, takes a reference.
+ * @return the source or NULL if allocation failed
+ */
+extern struct aesd_rl_source *aesd_rl_source_get(const struct sockaddr_storage *addr);
+
+/**
+ * Drop a reference taken by aesd_rl_source_get(), frees the source with the last one
+ */
+extern void aesd_rl_source_put(struct aesd_rl_source *source);
+
+/**
+ * Number of bytes a connection may move in direction dir right now, limited by
+ * its own bucket and the bucket of its source. When no bytes are allowed
+ * wait_ms is lowered to the time until tokens become available, a negative
+ * (infinite) wait_ms is replaced, otherwise it is left unchanged.
+ * @return number of bytes allowed, (size_t)-1 when neither bucket is limited
+ */
+extern size_t aesd_rl_allowance(struct aesd_token_bucket *conn_bucket,
+                                struct aesd_rl_source *source,
+                                enum aesd_rl_dir dir, int *wait_ms);
+
+/**
+ * Take bytes moved in direction dir out of the connection and source buckets
+ */
+extern void aesd_rl_consume(struct aesd_token_bucket *conn_bucket,
+                            struct aesd_rl_source *source,
+                            enum aesd_rl_dir dir, size_t bytes);
+
+#endif /* AESD_RATELIMIT_H */
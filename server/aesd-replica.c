@@ -0,0 +1,795 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-replica.c
+​*​ ​@brief​ Leader to follower replication of the history
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "aesd-cold.h"
+#include "aesd-frame.h"
+#include "aesd-history.h"
+#include "aesd-replica.h"
+
+#define HEADER_SIZE     (sizeof(struct aesd_replica_header))
+#define HELLO_SIZE      (2 * sizeof(uint64_t))
+#define BATCH_RECORDS   (256)
+#define BATCH_SIZE      (256 * 1024)
+// Bytes sent and not yet acked before the leader waits for an ack
+#define WINDOW_SIZE     (8 * 1024 * 1024)
+#define HEARTBEAT_MS    (1000)
+// Either side gives up on a peer silent for this long
+#define SILENCE_MS      (5000)
+#define WAIT_MS         (100)
+#define RETRY_MS        (1000)
+#define MAX_RECORD      (256 * 1024 * 1024)
+#define RX_MIN_SIZE     (256 * 1024)
+#define TEXT_SIZE       (160)
+
+// A follower being served, on the stack of its connection's thread
+struct replica_peer {
+    struct aesd_replica_follower stats;
+    int fd;
+    char ack[sizeof(uint64_t)];
+    size_t ack_len;
+    uint64_t last_ack_ms;
+    bool closed;
+    LIST_ENTRY(replica_peer) entries;
+};
+
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, replica_peer) peers = LIST_HEAD_INITIALIZER(peers);
+
+// Follower side, one thread appending what the leader streams
+static pthread_mutex_t follow_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t follow_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t follow_thread;
+static bool follow_running = false;
+static bool follow_stop = false;
+static int follow_sock = -1;
+static char follow_host[PATH_MAX];
+static char follow_port[NI_MAXSERV];
+static char follow_path[PATH_MAX];
+static struct aesd_lock *append_mutex = NULL;
+static struct aesd_replica_stats follow_stats;
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static char *put_header(char *p, uint8_t type, uint32_t len, uint64_t offset)
+{
+    struct aesd_replica_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.type = type;
+    header.len = htole32(len);
+    header.offset = htole64(offset);
+    memcpy(p, &header, sizeof(header));
+    return p + sizeof(header);
+}
+
+// Take in the acks the follower has sent so far. Returns false once it has
+// closed the connection, setting closed, or on error.
+static bool read_acks(struct replica_peer *peer)
+{
+    uint64_t acked;
+    ssize_t rx_bytes;
+
+    while (1) {
+        rx_bytes = recv(peer->fd, peer->ack + peer->ack_len, sizeof(peer->ack) - peer->ack_len, 0);
+        if (rx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+        }
+        if (rx_bytes == 0) {
+            peer->closed = true;
+            return false;
+        }
+        peer->ack_len += rx_bytes;
+        if (peer->ack_len == sizeof(peer->ack)) {
+            memcpy(&acked, peer->ack, sizeof(acked));
+            __atomic_store_n(&(peer->stats.acked), le64toh(acked), __ATOMIC_RELAXED);
+            peer->ack_len = 0;
+            peer->last_ack_ms = monotonic_ms();
+        }
+    }
+}
+
+// Send len bytes, taking in acks while the socket is full. Returns false if
+// the follower went away or stopped reading.
+static bool send_full(struct replica_peer *peer, const char *buf, size_t len)
+{
+    struct pollfd pfd;
+    ssize_t tx_bytes;
+    int ready;
+
+    while (len > 0) {
+        tx_bytes = send(peer->fd, buf, len, MSG_NOSIGNAL);
+        if (tx_bytes > 0) {
+            buf += tx_bytes;
+            len -= tx_bytes;
+            continue;
+        }
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            return false;
+        }
+
+        pfd.fd = peer->fd;
+        pfd.events = POLLIN | POLLOUT;
+        pfd.revents = 0;
+        ready = poll(&pfd, 1, SILENCE_MS);
+        if (ready == 0) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+        if ((ready == -1) && (errno != EINTR)) {
+            return false;
+        }
+        if ((ready > 0) && (pfd.revents & POLLIN) && !read_acks(peer)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Send a message without a payload, or with text as its payload
+static bool send_message(struct replica_peer *peer, uint8_t type, uint64_t offset,
+                            const char *text)
+{
+    char msg[HEADER_SIZE + TEXT_SIZE];
+    size_t len = (text != NULL) ? strnlen(text, TEXT_SIZE) : 0;
+
+    if (len > 0) {
+        memcpy(msg + HEADER_SIZE, text, len);
+    }
+    put_header(msg, type, len, offset);
+    return send_full(peer, msg, HEADER_SIZE + len);
+}
+
+// Receive the rest of the follower's opening, len bytes into buf
+static bool recv_hello(int fd, char *buf, size_t len)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    ssize_t rx_bytes;
+
+    while (len > 0) {
+        rx_bytes = recv(fd, buf, len, 0);
+        if (rx_bytes > 0) {
+            buf += rx_bytes;
+            len -= rx_bytes;
+            continue;
+        }
+        if (rx_bytes == 0) {
+            errno = ECONNRESET;
+            return false;
+        }
+        if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+            return false;
+        }
+        if (poll(&pfd, 1, SILENCE_MS) == 0) {
+            errno = ETIMEDOUT;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read history offsets from up to to into buf
+static bool read_history(int data_fd, char *buf, uint64_t from, uint64_t to)
+{
+    ssize_t rx_bytes;
+
+    while (from < to) {
+        rx_bytes = aesd_cold_pread(data_fd, buf, to - from, from);
+        if ((rx_bytes == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if (rx_bytes <= 0) {
+            if (rx_bytes == 0) {
+                errno = EIO;
+            }
+            return false;
+        }
+        buf += rx_bytes;
+        from += rx_bytes;
+    }
+    return true;
+}
+
+// Send the whole records from pos up to ends[count - 1], each behind its
+// header and followed by the current end of the history. The records are
+// read in behind where their headers go and moved up one at a time.
+static bool send_batch(struct replica_peer *peer, int data_fd, char **out, size_t *out_cap,
+                        uint64_t pos, const uint64_t *ends, int count)
+{
+    size_t need = (ends[count - 1] - pos) + (count + 1) * HEADER_SIZE;
+    uint64_t records, start, end;
+    char *grown;
+    char *p;
+    char *data;
+    int i;
+
+    if (need > *out_cap) {
+        grown = realloc(*out, need);
+        if (grown == NULL) {
+            return false;
+        }
+        *out = grown;
+        *out_cap = need;
+    }
+
+    data = *out + (count + 1) * HEADER_SIZE;
+    if (!read_history(data_fd, data, pos, ends[count - 1])) {
+        return false;
+    }
+
+    p = *out;
+    for (i = 0; i < count; i++) {
+        p = put_header(p, AESD_REPLICA_RECORD, ends[i] - pos, pos);
+        memmove(p, data, ends[i] - pos);
+        p += ends[i] - pos;
+        data += ends[i] - pos;
+        pos = ends[i];
+    }
+
+    if (aesd_history_stat(&records, &start, &end) == -1) {
+        end = pos;
+    }
+    p = put_header(p, AESD_REPLICA_END, 0, end);
+    return send_full(peer, *out, p - *out);
+}
+
+int aesd_replica_serve(int fd, const char *name, const char *buf, size_t len,
+                        const char *path, bool (*stopping)(void))
+{
+    struct replica_peer peer;
+    uint64_t ends[BATCH_RECORDS];
+    char hello[HELLO_SIZE];
+    char text[TEXT_SIZE];
+    char *out = NULL;
+    size_t out_cap = 0;
+    uint64_t records, start, end, value;
+    uint64_t pos, acked, now_ms;
+    uint64_t last_tx_ms = 0;
+    int data_fd = -1;
+    int count;
+    int n;
+    int saved_errno;
+    bool ok = true;
+
+    memset(&peer, 0, sizeof(peer));
+    peer.fd = fd;
+    snprintf(peer.stats.name, sizeof(peer.stats.name), "%s", name);
+
+    if (len > HELLO_SIZE) {
+        len = HELLO_SIZE;
+    }
+    memcpy(hello, buf, len);
+    if (!recv_hello(fd, hello + len, HELLO_SIZE - len)) {
+        syslog(LOG_ERR, "Error follower %s did not open the stream: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    // An empty follower picks up wherever this history starts
+    memcpy(&value, hello + sizeof(uint64_t), sizeof(value));
+    pos = le64toh(value);
+    memcpy(&value, hello, sizeof(value));
+    count = -1;
+    if (aesd_history_stat(&records, &start, &end) == -1) {
+        start = 0;
+        end = 0;
+        errno = ENOTSUP;
+    } else {
+        if ((le64toh(value) == pos) && (pos < start)) {
+            pos = start;
+        }
+        count = aesd_history_records(pos, ends, 0);
+    }
+    if (count == -1) {
+        saved_errno = errno;
+        snprintf(text, sizeof(text), "cannot stream from offset %llu of history %llu-%llu: %s",
+                    (unsigned long long)pos, (unsigned long long)start,
+                    (unsigned long long)end, strerror(saved_errno));
+        syslog(LOG_ERR, "Error follower %s: %s\n", name, text);
+        send_message(&peer, AESD_REPLICA_ERROR, pos, text);
+        errno = saved_errno;
+        return -1;
+    }
+
+    data_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if ((data_fd == -1) || !send_message(&peer, AESD_REPLICA_START, pos, NULL)) {
+        saved_errno = errno;
+        syslog(LOG_ERR, "Error starting stream to follower %s: %s\n", name, strerror(errno));
+        if (data_fd != -1) {
+            close(data_fd);
+        }
+        errno = saved_errno;
+        return -1;
+    }
+
+    peer.stats.sent = pos;
+    peer.stats.acked = pos;
+    peer.last_ack_ms = monotonic_ms();
+    pthread_mutex_lock(&peers_lock);
+    LIST_INSERT_HEAD(&peers, &peer, entries);
+    pthread_mutex_unlock(&peers_lock);
+    syslog(LOG_INFO, "Follower %s replicating from offset %llu\n", name, (unsigned long long)pos);
+
+    while (ok && !stopping()) {
+        if (!read_acks(&peer)) {
+            ok = false;
+            break;
+        }
+
+        // A full window waits for the follower to catch up
+        acked = __atomic_load_n(&(peer.stats.acked), __ATOMIC_RELAXED);
+        if (pos - acked >= WINDOW_SIZE) {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+            __atomic_fetch_add(&(peer.stats.window_waits), 1, __ATOMIC_RELAXED);
+            if (monotonic_ms() - peer.last_ack_ms >= SILENCE_MS) {
+                errno = ETIMEDOUT;
+                ok = false;
+                break;
+            }
+            poll(&pfd, 1, HEARTBEAT_MS);
+            continue;
+        }
+
+        count = aesd_history_records(pos, ends, BATCH_RECORDS);
+        if (count == -1) {
+            saved_errno = errno;
+            snprintf(text, sizeof(text), "history at offset %llu is gone: %s",
+                        (unsigned long long)pos, strerror(saved_errno));
+            send_message(&peer, AESD_REPLICA_ERROR, pos, text);
+            errno = saved_errno;
+            ok = false;
+            break;
+        }
+
+        // Caught up, a heartbeat now and then shows the leader is still here
+        if (count == 0) {
+            now_ms = monotonic_ms();
+            if (now_ms - last_tx_ms >= HEARTBEAT_MS) {
+                if (!send_message(&peer, AESD_REPLICA_END, pos, NULL)) {
+                    ok = false;
+                    break;
+                }
+                last_tx_ms = now_ms;
+            }
+            aesd_history_wait_end(pos, WAIT_MS);
+            continue;
+        }
+
+        // Whole records up to the batch size, a larger record goes alone
+        for (n = 1; (n < count) && (ends[n] - pos <= BATCH_SIZE); n++);
+        if (!send_batch(&peer, data_fd, &out, &out_cap, pos, ends, n)) {
+            ok = false;
+            break;
+        }
+        pos = ends[n - 1];
+        last_tx_ms = monotonic_ms();
+        __atomic_store_n(&(peer.stats.sent), pos, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&(peer.stats.records), n, __ATOMIC_RELAXED);
+    }
+
+    saved_errno = errno;
+    pthread_mutex_lock(&peers_lock);
+    LIST_REMOVE(&peer, entries);
+    pthread_mutex_unlock(&peers_lock);
+    close(data_fd);
+    free(out);
+
+    if (ok || peer.closed) {
+        syslog(LOG_INFO, "Follower %s stopped at offset %llu, acked to %llu\n", name,
+                (unsigned long long)pos, (unsigned long long)peer.stats.acked);
+        return 0;
+    }
+    syslog(LOG_ERR, "Error streaming to follower %s at offset %llu: %s\n", name,
+            (unsigned long long)pos, strerror(saved_errno));
+    errno = saved_errno;
+    return -1;
+}
+
+size_t aesd_replica_get_followers(struct aesd_replica_follower *followers, size_t max)
+{
+    struct replica_peer *peer;
+    size_t n = 0;
+
+    pthread_mutex_lock(&peers_lock);
+    LIST_FOREACH(peer, &peers, entries) {
+        if (n == max) {
+            break;
+        }
+        memcpy(followers[n].name, peer->stats.name, sizeof(followers[n].name));
+        followers[n].sent = __atomic_load_n(&(peer->stats.sent), __ATOMIC_RELAXED);
+        followers[n].acked = __atomic_load_n(&(peer->stats.acked), __ATOMIC_RELAXED);
+        followers[n].records = __atomic_load_n(&(peer->stats.records), __ATOMIC_RELAXED);
+        followers[n].window_waits = __atomic_load_n(&(peer->stats.window_waits), __ATOMIC_RELAXED);
+        n++;
+    }
+    pthread_mutex_unlock(&peers_lock);
+    return n;
+}
+
+// Connect to the leader, -1 with errno set if it cannot be reached
+static int connect_leader(void)
+{
+    struct addrinfo hints, *res, *p_ai;
+    struct sockaddr_un addr;
+    int status;
+    int fd = -1;
+
+    if (follow_port[0] == '\0') {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        // aesd_replica_follow() checked that the path fits
+        memcpy(addr.sun_path, follow_host, strnlen(follow_host, sizeof(addr.sun_path) - 1));
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if ((fd != -1) && (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    status = getaddrinfo(follow_host, follow_port, &hints, &res);
+    if (status != 0) {
+        errno = (status == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    for (p_ai = res; p_ai != NULL; p_ai = p_ai->ai_next) {
+        fd = socket(p_ai->ai_family, p_ai->ai_socktype | SOCK_CLOEXEC, p_ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, p_ai->ai_addr, p_ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Act on one message from the leader. Returns false if the stream has to
+// end.
+static bool apply_message(const struct aesd_replica_header *header, const char *payload,
+                            FILE *data_file, bool *started)
+{
+    uint32_t len = le32toh(header->len);
+    uint64_t offset = le64toh(header->offset);
+    uint64_t applied = __atomic_load_n(&follow_stats.applied, __ATOMIC_RELAXED);
+    uint64_t records, start, end;
+    int status;
+
+    switch (header->type) {
+    case AESD_REPLICA_START:
+        if (aesd_history_stat(&records, &start, &end) == -1) {
+            syslog(LOG_ERR, "Error the history is not indexed, cannot follow\n");
+            return false;
+        }
+        if (offset != end) {
+            if ((start != end) || (aesd_history_skip(data_file, offset) == -1)) {
+                syslog(LOG_ERR, "Error leader streams from offset %llu, the history runs "
+                        "%llu-%llu\n", (unsigned long long)offset, (unsigned long long)start,
+                        (unsigned long long)end);
+                return false;
+            }
+            syslog(LOG_INFO, "Empty history starts at %llu, where the leader's does\n",
+                    (unsigned long long)offset);
+        }
+        __atomic_store_n(&follow_stats.applied, offset, __ATOMIC_RELAXED);
+        *started = true;
+        syslog(LOG_INFO, "Following leader %s from offset %llu\n", follow_host,
+                (unsigned long long)offset);
+        return true;
+
+    case AESD_REPLICA_RECORD:
+        if (!*started || (offset != applied)) {
+            syslog(LOG_ERR, "Error record at %llu out of order, the history ends at %llu\n",
+                    (unsigned long long)offset, (unsigned long long)applied);
+            return false;
+        }
+        aesd_lock(append_mutex);
+        status = aesd_history_append(data_file, payload, len, &end);
+        aesd_unlock(append_mutex);
+        if (status == -1) {
+            syslog(LOG_ERR, "Error aesd_history_append(): %s\n", strerror(errno));
+            return false;
+        }
+        __atomic_store_n(&follow_stats.applied, end, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&follow_stats.records, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&follow_stats.bytes, len, __ATOMIC_RELAXED);
+        return true;
+
+    case AESD_REPLICA_END:
+        __atomic_store_n(&follow_stats.leader_end, offset, __ATOMIC_RELAXED);
+        return true;
+
+    case AESD_REPLICA_ERROR:
+        syslog(LOG_ERR, "Error leader %s ended the stream: %.*s\n", follow_host,
+                (int)len, payload);
+        return false;
+
+    default:
+        syslog(LOG_ERR, "Error unknown replication message '%c'\n", header->type);
+        return false;
+    }
+}
+
+// Open the stream on a connection to the leader and append what it sends
+// until it ends
+static void follow_stream(int sock, FILE *data_file)
+{
+    struct aesd_replica_header header;
+    struct timeval tv = { .tv_sec = HEARTBEAT_MS / 1000, .tv_usec = 0 };
+    char hello[AESD_FRAME_MAGIC_LEN + HELLO_SIZE];
+    uint64_t records, start, end, value;
+    uint64_t acked, applied;
+    uint64_t last_rx_ms = monotonic_ms();
+    size_t rx_cap = RX_MIN_SIZE;
+    size_t rx_len = 0;
+    size_t used, need;
+    ssize_t rx_bytes;
+    char *rx = malloc(rx_cap);
+    char *grown;
+    bool started = false;
+    bool ok = true;
+
+    if ((rx == NULL) || (aesd_history_stat(&records, &start, &end) == -1)) {
+        syslog(LOG_ERR, "Error cannot follow without memory and an indexed history\n");
+        free(rx);
+        return;
+    }
+
+    memcpy(hello, AESD_FRAME_REPLICA_MAGIC, AESD_FRAME_MAGIC_LEN);
+    value = htole64(start);
+    memcpy(hello + AESD_FRAME_MAGIC_LEN, &value, sizeof(value));
+    value = htole64(end);
+    memcpy(hello + AESD_FRAME_MAGIC_LEN + sizeof(value), &value, sizeof(value));
+    acked = end;
+
+    // Receives time out every heartbeat period to check on the leader
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    tv.tv_sec = SILENCE_MS / 1000;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (send(sock, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello)) {
+        syslog(LOG_ERR, "Error opening stream from leader %s: %s\n", follow_host, strerror(errno));
+        free(rx);
+        return;
+    }
+
+    while (ok && !__atomic_load_n(&follow_stop, __ATOMIC_RELAXED)) {
+        rx_bytes = recv(sock, rx + rx_len, rx_cap - rx_len, 0);
+        if ((rx_bytes == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+            if (monotonic_ms() - last_rx_ms >= SILENCE_MS) {
+                syslog(LOG_ERR, "Error leader %s silent for %d ms, reconnecting\n",
+                        follow_host, SILENCE_MS);
+                break;
+            }
+            continue;
+        }
+        if (rx_bytes <= 0) {
+            if (rx_bytes == 0) {
+                syslog(LOG_INFO, "Leader %s closed the stream\n", follow_host);
+            } else if (!__atomic_load_n(&follow_stop, __ATOMIC_RELAXED)) {
+                syslog(LOG_ERR, "Error recv() from leader: %s\n", strerror(errno));
+            }
+            break;
+        }
+        last_rx_ms = monotonic_ms();
+        rx_len += rx_bytes;
+
+        // Every whole message received, the buffer grows for a larger one
+        used = 0;
+        need = 0;
+        while (ok && (rx_len - used >= HEADER_SIZE)) {
+            memcpy(&header, rx + used, HEADER_SIZE);
+            if (le32toh(header.len) > MAX_RECORD) {
+                syslog(LOG_ERR, "Error replication message of %u bytes\n", le32toh(header.len));
+                ok = false;
+                break;
+            }
+            if (rx_len - used - HEADER_SIZE < le32toh(header.len)) {
+                need = HEADER_SIZE + le32toh(header.len);
+                break;
+            }
+            ok = apply_message(&header, rx + used + HEADER_SIZE, data_file, &started);
+            used += HEADER_SIZE + le32toh(header.len);
+        }
+        rx_len -= used;
+        memmove(rx, rx + used, rx_len);
+        if (need > rx_cap) {
+            grown = realloc(rx, need);
+            if (grown == NULL) {
+                syslog(LOG_ERR, "Error failed to realloc()\n");
+                break;
+            }
+            rx = grown;
+            rx_cap = need;
+        }
+
+        // One ack covers everything this read appended, once durable
+        applied = __atomic_load_n(&follow_stats.applied, __ATOMIC_RELAXED);
+        if (started && (applied > acked)) {
+            if (aesd_history_wait_durable(applied) == -1) {
+                syslog(LOG_ERR, "Error replicated records not made durable: %s\n", strerror(errno));
+                break;
+            }
+            value = htole64(applied);
+            if (send(sock, &value, sizeof(value), MSG_NOSIGNAL) != sizeof(value)) {
+                syslog(LOG_ERR, "Error sending ack to leader: %s\n", strerror(errno));
+                break;
+            }
+            acked = applied;
+            __atomic_store_n(&follow_stats.acked, acked, __ATOMIC_RELAXED);
+        }
+    }
+    free(rx);
+}
+
+// Follow the leader, reconnecting a retry period after every stream ends
+static void *follow_func(void *arg)
+{
+    struct timespec wake;
+    FILE *data_file = fopen(follow_path, "a+e");
+    bool reported = false;
+    int sock;
+
+    (void)arg;
+    if (data_file == NULL) {
+        syslog(LOG_ERR, "Error fopen(): %s, not following\n", strerror(errno));
+        return NULL;
+    }
+
+    pthread_mutex_lock(&follow_lock);
+    while (!follow_stop) {
+        pthread_mutex_unlock(&follow_lock);
+        sock = connect_leader();
+        pthread_mutex_lock(&follow_lock);
+
+        if (sock == -1) {
+            // Reported once until the leader is back
+            if (!reported) {
+                syslog(LOG_ERR, "Error connecting to leader %s: %s, retrying\n", follow_host,
+                        strerror(errno));
+                reported = true;
+            }
+        } else if (!follow_stop) {
+            reported = false;
+            follow_sock = sock;
+            follow_stats.connects++;
+            __atomic_store_n(&follow_stats.connected, true, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&follow_lock);
+
+            follow_stream(sock, data_file);
+
+            pthread_mutex_lock(&follow_lock);
+            __atomic_store_n(&follow_stats.connected, false, __ATOMIC_RELAXED);
+            follow_sock = -1;
+            close(sock);
+        } else {
+            close(sock);
+        }
+
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += (RETRY_MS % 1000) * 1000000L;
+        wake.tv_sec += RETRY_MS / 1000 + wake.tv_nsec / 1000000000L;
+        wake.tv_nsec %= 1000000000L;
+        while (!follow_stop &&
+               (pthread_cond_timedwait(&follow_cond, &follow_lock, &wake) != ETIMEDOUT)) {
+        }
+    }
+    pthread_mutex_unlock(&follow_lock);
+
+    fclose(data_file);
+    return NULL;
+}
+
+int aesd_replica_follow(const char *host, const char *port, const char *path,
+                        struct aesd_lock *mutex)
+{
+    int status;
+
+    if (follow_running) {
+        return 0;
+    }
+    if ((port == NULL) && (strlen(host) >= sizeof(((struct sockaddr_un*)0)->sun_path))) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    snprintf(follow_host, sizeof(follow_host), "%s", host);
+    snprintf(follow_port, sizeof(follow_port), "%s", (port != NULL) ? port : "");
+    snprintf(follow_path, sizeof(follow_path), "%s", path);
+    append_mutex = mutex;
+
+    pthread_mutex_lock(&follow_lock);
+    follow_stop = false;
+    follow_stats.following = true;
+    pthread_mutex_unlock(&follow_lock);
+
+    status = pthread_create(&follow_thread, NULL, follow_func, NULL);
+    if (status != 0) {
+        follow_stats.following = false;
+        errno = status;
+        return -1;
+    }
+    follow_running = true;
+    return 0;
+}
+
+void aesd_replica_unfollow(void)
+{
+    if (!follow_running) {
+        return;
+    }
+
+    // Shutting the socket down wakes the thread out of recv()
+    pthread_mutex_lock(&follow_lock);
+    follow_stop = true;
+    if (follow_sock != -1) {
+        shutdown(follow_sock, SHUT_RDWR);
+    }
+    pthread_cond_signal(&follow_cond);
+    pthread_mutex_unlock(&follow_lock);
+
+    pthread_join(follow_thread, NULL);
+    follow_running = false;
+    follow_stats.following = false;
+}
+
+void aesd_replica_get_stats(struct aesd_replica_stats *stats)
+{
+    pthread_mutex_lock(&follow_lock);
+    stats->following = follow_stats.following;
+    stats->connects = follow_stats.connects;
+    pthread_mutex_unlock(&follow_lock);
+    stats->connected = __atomic_load_n(&follow_stats.connected, __ATOMIC_RELAXED);
+    stats->applied = __atomic_load_n(&follow_stats.applied, __ATOMIC_RELAXED);
+    stats->acked = __atomic_load_n(&follow_stats.acked, __ATOMIC_RELAXED);
+    stats->leader_end = __atomic_load_n(&follow_stats.leader_end, __ATOMIC_RELAXED);
+    stats->records = __atomic_load_n(&follow_stats.records, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&follow_stats.bytes, __ATOMIC_RELAXED);
+}
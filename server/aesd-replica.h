@@ -0,0 +1,132 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-replica.h
+​*​ ​@brief​ Leader to follower replication of the history
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* A follower is an aesdsocket started with --follow. It connects to the
+* leader like any client, opens with AESD_FRAME_REPLICA_MAGIC and the start
+* and end offsets of its own history, and the leader streams it every
+* record from the follower's end on. The follower appends each one to its
+* own history, so both keep the same records at the same offsets, and
+* answers replies and queries from it without accepting appends.
+*
+* Acks are pipelined: the leader keeps up to a window of bytes in flight and
+* the follower acks how far it has appended after every read from the
+* socket, in batch durability mode once it is durable too. A follower whose
+* history is empty starts wherever the leader's retained history does.
+*
+* Messages, integers little endian:
+*
+*   follower -> leader  magic, u64 start, u64 end     once, to open
+*   leader -> follower  struct aesd_replica_header    then len bytes
+*   follower -> leader  u64 offset                    ack, repeated
+*
+*   AESD_REPLICA_START   offset the stream starts at, once
+*   AESD_REPLICA_RECORD  one record starting at offset
+*   AESD_REPLICA_END     the leader's history end, after every batch and
+*                        once a heartbeat period while idle
+*   AESD_REPLICA_ERROR   why the leader is closing the stream, as text
+*
+* A follower reconnects when the stream ends, and stops following when
+* promoted to take over from its leader.
+*/
+
+#ifndef AESD_REPLICA_H
+#define AESD_REPLICA_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesd-lock.h"
+
+#define AESD_REPLICA_START      ('S')
+#define AESD_REPLICA_RECORD     ('D')
+#define AESD_REPLICA_END        ('E')
+#define AESD_REPLICA_ERROR      ('X')
+
+struct aesd_replica_header {
+    uint8_t type;
+    uint8_t pad[3];
+    uint32_t len;
+    uint64_t offset;
+};
+
+/**
+ * A follower connected to this server
+ */
+struct aesd_replica_follower {
+    char name[64];
+    /**
+     * History offset sent up to and acked up to
+     */
+    uint64_t sent;
+    uint64_t acked;
+    uint64_t records;
+    /**
+     * Times the window was full and sending waited for an ack
+     */
+    uint64_t window_waits;
+};
+
+struct aesd_replica_stats {
+    bool following;
+    bool connected;
+    /**
+     * History offset appended up to, acked up to and the leader's end as
+     * last reported
+     */
+    uint64_t applied;
+    uint64_t acked;
+    uint64_t leader_end;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t connects;
+};
+
+/**
+ * Stream the history of the data file at path to the follower on fd, whose
+ * first len bytes after the magic are in buf, until it disconnects or
+ * stopping() returns true. Returns 0, or -1 with errno set.
+ */
+extern int aesd_replica_serve(int fd, const char *name, const char *buf, size_t len,
+                                const char *path, bool (*stopping)(void));
+
+/**
+ * Copy up to max of the connected followers into followers, returns how
+ * many were copied
+ */
+extern size_t aesd_replica_get_followers(struct aesd_replica_follower *followers, size_t max);
+
+/**
+ * Start following the leader at host and port, or at the unix socket host
+ * if port is NULL, appending to the data file at path under mutex. Returns
+ * 0, or -1 with errno set.
+ */
+extern int aesd_replica_follow(const char *host, const char *port, const char *path,
+                                struct aesd_lock *mutex);
+
+/**
+ * Stop following, once the record being appended is done
+ */
+extern void aesd_replica_unfollow(void);
+
+/**
+ * Snapshot of the follower counters
+ */
+extern void aesd_replica_get_stats(struct aesd_replica_stats *stats);
+
+#endif /* AESD_REPLICA_H */
@@ -0,0 +1,346 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-sendq.h
+​*​ ​@brief​ Per-connection outbound queue for non-blocking client replies
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "aesd-sendq.h"
+
+void aesd_sendq_init(struct aesd_sendq *q, size_t hwm)
+{
+    TAILQ_INIT(&q->head);
+    TAILQ_INIT(&q->inflight);
+    q->queued = 0;
+    q->hwm = hwm;
+    q->send_calls = 0;
+    q->zc_next_id = 0;
+    q->zc_completed = 0;
+    q->zc_copied = 0;
+}
+
+static void sendq_free_chunk(struct aesd_sendq_chunk *chunk)
+{
+    if (chunk->release != NULL) {
+        chunk->release(chunk->release_arg);
+    } else {
+        free(chunk->data);
+    }
+    free(chunk);
+}
+
+void aesd_sendq_destroy(struct aesd_sendq *q)
+{
+    struct aesd_sendq_chunk *chunk;
+
+    while (!TAILQ_EMPTY(&q->head)) {
+        chunk = TAILQ_FIRST(&q->head);
+        TAILQ_REMOVE(&q->head, chunk, chunks);
+        sendq_free_chunk(chunk);
+    }
+
+    while (!TAILQ_EMPTY(&q->inflight)) {
+        chunk = TAILQ_FIRST(&q->inflight);
+        TAILQ_REMOVE(&q->inflight, chunk, chunks);
+        sendq_free_chunk(chunk);
+    }
+    q->queued = 0;
+}
+
+// Allocate an empty chunk able to hold at least len bytes at the end of the queue
+static struct aesd_sendq_chunk *sendq_add_chunk(struct aesd_sendq *q, size_t len)
+{
+    struct aesd_sendq_chunk *chunk;
+    size_t capacity = AESD_SENDQ_CHUNK_SIZE;
+
+    if (len > capacity) {
+        capacity = (len + AESD_SENDQ_CHUNK_ALIGN - 1) & ~(size_t)(AESD_SENDQ_CHUNK_ALIGN - 1);
+    }
+
+    chunk = calloc(1, sizeof(*chunk));
+    if (chunk == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    chunk->data = aligned_alloc(AESD_SENDQ_CHUNK_ALIGN, capacity);
+    if (chunk->data == NULL) {
+        free(chunk);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    chunk->capacity = capacity;
+    TAILQ_INSERT_TAIL(&q->head, chunk, chunks);
+
+    return chunk;
+}
+
+int aesd_sendq_append(struct aesd_sendq *q, const char *data, size_t len)
+{
+    struct aesd_sendq_chunk *chunk = TAILQ_LAST(&q->head, sendq_head);
+    size_t copy_len;
+
+    if (len > aesd_sendq_room(q)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    while (len > 0) {
+        // Fill the spare space in the last chunk before allocating another
+        if ((chunk == NULL) || (chunk->len == chunk->capacity)) {
+            chunk = sendq_add_chunk(q, len);
+            if (chunk == NULL) {
+                return -1;
+            }
+        }
+
+        copy_len = chunk->capacity - chunk->len;
+        if (copy_len > len) {
+            copy_len = len;
+        }
+        memcpy(&(chunk->data[chunk->len]), data, copy_len);
+        chunk->len += copy_len;
+        q->queued += copy_len;
+        data += copy_len;
+        len -= copy_len;
+    }
+
+    return 0;
+}
+
+int aesd_sendq_append_ref(struct aesd_sendq *q, const char *data, size_t len,
+                            bool zerocopy, void (*release)(void *arg),
+                            void *release_arg)
+{
+    struct aesd_sendq_chunk *chunk;
+
+    if (len > aesd_sendq_room(q)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    chunk = calloc(1, sizeof(*chunk));
+    if (chunk == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Full capacity keeps aesd_sendq_reserve() from writing into caller memory
+    chunk->data = (char *)data;
+    chunk->len = len;
+    chunk->capacity = len;
+    chunk->release = release;
+    chunk->release_arg = release_arg;
+    chunk->zerocopy = zerocopy;
+    TAILQ_INSERT_TAIL(&q->head, chunk, chunks);
+    q->queued += len;
+
+    return 0;
+}
+
+char *aesd_sendq_reserve(struct aesd_sendq *q, size_t *avail)
+{
+    struct aesd_sendq_chunk *chunk = TAILQ_LAST(&q->head, sendq_head);
+
+    if ((chunk == NULL) || (chunk->len == chunk->capacity)) {
+        chunk = sendq_add_chunk(q, AESD_SENDQ_CHUNK_SIZE);
+        if (chunk == NULL) {
+            return NULL;
+        }
+    }
+
+    *avail = chunk->capacity - chunk->len;
+    return &(chunk->data[chunk->len]);
+}
+
+void aesd_sendq_commit(struct aesd_sendq *q, size_t len)
+{
+    struct aesd_sendq_chunk *chunk = TAILQ_LAST(&q->head, sendq_head);
+
+    chunk->len += len;
+    q->queued += len;
+}
+
+ssize_t aesd_sendq_flush(struct aesd_sendq *q, int fd, size_t max_bytes)
+{
+    struct aesd_sendq_chunk *chunk;
+    ssize_t tx_bytes;
+    size_t tx_total = 0;
+    size_t tx_len;
+    int flags;
+
+    while (!TAILQ_EMPTY(&q->head) && (tx_total < max_bytes)) {
+        chunk = TAILQ_FIRST(&q->head);
+
+        // Nothing committed to the last chunk yet. An empty chunk reserved
+        // before a reply was queued by reference goes instead.
+        if (chunk->sent == chunk->len) {
+            if (TAILQ_NEXT(chunk, chunks) == NULL) {
+                break;
+            }
+            TAILQ_REMOVE(&q->head, chunk, chunks);
+            sendq_free_chunk(chunk);
+            continue;
+        }
+
+        flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+        tx_len = chunk->len - chunk->sent;
+        if (tx_len > max_bytes - tx_total) {
+            tx_len = max_bytes - tx_total;
+            flags |= MSG_MORE;
+        }
+        if ((TAILQ_NEXT(chunk, chunks) != NULL) && (TAILQ_NEXT(chunk, chunks)->len > 0)) {
+            flags |= MSG_MORE;
+        }
+        if (chunk->zerocopy) {
+            flags |= MSG_ZEROCOPY;
+        }
+
+        tx_bytes = send(fd, &(chunk->data[chunk->sent]), tx_len, flags);
+        q->send_calls++;
+        if (tx_bytes == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                break; // Socket full, wait until it is writable again
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == ENOBUFS) && chunk->zerocopy) {
+                // Out of optmem for pinning pages, send the rest as a copy
+                chunk->zerocopy = false;
+                continue;
+            }
+            return -1;
+        }
+
+        // Every successful zerocopy send gets the next notification id
+        if (flags & MSG_ZEROCOPY) {
+            if (chunk->zc_ids == 0) {
+                chunk->zc_first_id = q->zc_next_id;
+            }
+            chunk->zc_ids++;
+            chunk->zc_pending++;
+            q->zc_next_id++;
+        }
+
+        chunk->sent += tx_bytes;
+        q->queued -= tx_bytes;
+        tx_total += tx_bytes;
+
+        if (chunk->sent == chunk->len) {
+            TAILQ_REMOVE(&q->head, chunk, chunks);
+            if (chunk->zc_pending > 0) {
+                TAILQ_INSERT_TAIL(&q->inflight, chunk, chunks);
+            } else {
+                sendq_free_chunk(chunk);
+            }
+        }
+    }
+
+    return tx_total;
+}
+
+// Count the notification ids in [lo, hi] that belong to chunk
+static uint32_t sendq_zc_overlap(const struct aesd_sendq_chunk *chunk, uint32_t lo, uint32_t hi)
+{
+    // Ids are compared as signed distances from lo so the 32 bit counter may wrap
+    int32_t first = (int32_t)(chunk->zc_first_id - lo);
+    int32_t last = (int32_t)(chunk->zc_first_id + chunk->zc_ids - 1 - lo);
+    int32_t end = (int32_t)(hi - lo);
+
+    if (first < 0) {
+        first = 0;
+    }
+    if (last > end) {
+        last = end;
+    }
+
+    return (last >= first) ? (uint32_t)(last - first + 1) : 0;
+}
+
+// Credit the completed id range [lo, hi] to every chunk it covers
+static void sendq_zc_complete(struct aesd_sendq *q, struct sendq_head *list, uint32_t lo, uint32_t hi)
+{
+    struct aesd_sendq_chunk *chunk;
+    struct aesd_sendq_chunk *next;
+
+    for (chunk = TAILQ_FIRST(list); chunk != NULL; chunk = next) {
+        next = TAILQ_NEXT(chunk, chunks);
+        if (chunk->zc_pending == 0) {
+            continue;
+        }
+
+        chunk->zc_pending -= sendq_zc_overlap(chunk, lo, hi);
+
+        if ((chunk->zc_pending == 0) && (list == &q->inflight)) {
+            TAILQ_REMOVE(list, chunk, chunks);
+            sendq_free_chunk(chunk);
+        }
+    }
+}
+
+int aesd_sendq_reap_zerocopy(struct aesd_sendq *q, int fd)
+{
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sock_extended_err *serr;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return 0; // Error queue drained
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) ||
+                  ((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR)))) {
+                continue;
+            }
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if ((serr->ee_errno != 0) || (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)) {
+                continue;
+            }
+
+            // Chunks still being sent can hold completed ids too
+            sendq_zc_complete(q, &q->head, serr->ee_info, serr->ee_data);
+            sendq_zc_complete(q, &q->inflight, serr->ee_info, serr->ee_data);
+
+            q->zc_completed += serr->ee_data - serr->ee_info + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                q->zc_copied += serr->ee_data - serr->ee_info + 1;
+            }
+        }
+    }
+}
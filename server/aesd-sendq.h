@@ -0,0 +1,176 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-sendq.h
+​*​ ​@brief​ Per-connection outbound queue for non-blocking client replies
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+#ifndef AESD_SENDQ_H
+#define AESD_SENDQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+
+// Size and alignment of each buffer allocated to hold queued reply data
+#define AESD_SENDQ_CHUNK_SIZE   (64 * 1024)
+#define AESD_SENDQ_CHUNK_ALIGN  (4096)
+
+struct aesd_sendq_chunk {
+    /**
+     * Buffer holding the queued bytes, either a page aligned buffer owned by
+     * the queue or memory owned by the caller of aesd_sendq_append_ref()
+     */
+    char *data;
+    /**
+     * Number of bytes stored in data
+     */
+    size_t len;
+    /**
+     * Number of bytes of data already handed to the kernel
+     */
+    size_t sent;
+    /**
+     * Total number of bytes data can hold
+     */
+    size_t capacity;
+    /**
+     * Called instead of free() once the kernel no longer needs data
+     */
+    void (*release)(void *arg);
+    void *release_arg;
+    /**
+     * Send data with MSG_ZEROCOPY
+     */
+    bool zerocopy;
+    /**
+     * Zerocopy notification id of the first send() of this chunk, number of
+     * ids assigned to it and how many the kernel has not reported complete yet
+     */
+    uint32_t zc_first_id;
+    uint32_t zc_ids;
+    uint32_t zc_pending;
+    TAILQ_ENTRY(aesd_sendq_chunk) chunks;
+};
+
+TAILQ_HEAD(sendq_head, aesd_sendq_chunk);
+
+struct aesd_sendq {
+    struct sendq_head head;
+    /**
+     * Zerocopy chunks fully sent but still pinned by the kernel
+     */
+    struct sendq_head inflight;
+    /**
+     * Bytes queued but not yet accepted by the kernel
+     */
+    size_t queued;
+    /**
+     * High-water mark, queued may never grow past this value
+     */
+    size_t hwm;
+    /**
+     * Number of send() system calls made by aesd_sendq_flush()
+     */
+    unsigned long send_calls;
+    /**
+     * Notification id the kernel assigns to the next MSG_ZEROCOPY send
+     */
+    uint32_t zc_next_id;
+    /**
+     * Zerocopy sends completed, and how many of those the kernel copied anyway
+     */
+    unsigned long zc_completed;
+    unsigned long zc_copied;
+};
+
+extern void aesd_sendq_init(struct aesd_sendq *q, size_t hwm);
+
+/**
+ * Free every queued chunk. Zerocopy chunks are released even if the kernel
+ * has not reported them complete, callers should drain with
+ * aesd_sendq_reap_zerocopy() first.
+ */
+extern void aesd_sendq_destroy(struct aesd_sendq *q);
+
+/**
+ * Copy len bytes from data to the end of the queue.
+ * @return 0 on success, -1 with errno set to ENOBUFS if the data would push the
+ *          queue past its high-water mark or ENOMEM if allocation failed
+ */
+extern int aesd_sendq_append(struct aesd_sendq *q, const char *data, size_t len);
+
+/**
+ * Queue len bytes at data without copying them. The memory must stay valid
+ * until release(release_arg) is called. With zerocopy set the bytes are sent
+ * with MSG_ZEROCOPY and release is deferred until the kernel reports the
+ * sends complete on the socket error queue.
+ * @return 0 on success, -1 with errno set as for aesd_sendq_append()
+ */
+extern int aesd_sendq_append_ref(struct aesd_sendq *q, const char *data, size_t len,
+                                    bool zerocopy, void (*release)(void *arg),
+                                    void *release_arg);
+
+/**
+ * Reserve space at the end of the queue so callers can read() straight into it.
+ * @param avail set to the number of bytes that can be written to the returned pointer
+ * @return pointer to the free space or NULL if allocation failed
+ */
+extern char *aesd_sendq_reserve(struct aesd_sendq *q, size_t *avail);
+
+/**
+ * Add len bytes written into the space returned by aesd_sendq_reserve() to the queue
+ */
+extern void aesd_sendq_commit(struct aesd_sendq *q, size_t len);
+
+/**
+ * Write as much queued data as the socket accepts without blocking. Every
+ * chunk but the last is sent with MSG_MORE so a multi-chunk reply leaves in
+ * full sized segments and the final one is pushed out immediately.
+ * @param max_bytes limit on the number of bytes written by this call
+ * @return number of bytes written, -1 on a socket error
+ */
+extern ssize_t aesd_sendq_flush(struct aesd_sendq *q, int fd, size_t max_bytes);
+
+/**
+ * Read zerocopy completion notifications from the socket error queue and
+ * release the chunks the kernel is done with.
+ * @return 0 on success, -1 on a socket error
+ */
+extern int aesd_sendq_reap_zerocopy(struct aesd_sendq *q, int fd);
+
+/**
+ * @return number of bytes that can still be appended before reaching the high-water mark
+ */
+static inline size_t aesd_sendq_room(const struct aesd_sendq *q)
+{
+    return (q->queued >= q->hwm) ? 0 : q->hwm - q->queued;
+}
+
+static inline bool aesd_sendq_empty(const struct aesd_sendq *q)
+{
+    return (q->queued == 0);
+}
+
+/**
+ * @return true while the kernel still holds zerocopy chunks of this queue
+ */
+static inline bool aesd_sendq_zerocopy_pending(const struct aesd_sendq *q)
+{
+    return !TAILQ_EMPTY(&q->inflight);
+}
+
+#endif /* AESD_SENDQ_H */
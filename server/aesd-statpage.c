@@ -0,0 +1,174 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-statpage.c
+​*​ ​@brief​ Counters published in a seqlocked shared memory page
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-statpage.h"
+
+static struct aesd_statpage *page = NULL;
+static size_t page_len = 0;
+static char page_path[PATH_MAX];
+static dev_t page_dev;
+static ino_t page_ino;
+
+int aesd_statpage_open(const char *path, const struct aesd_statpage_desc *fields,
+                        size_t count, unsigned int interval_ms)
+{
+    struct aesd_statpage_field *field;
+    char tmp_path[PATH_MAX];
+    size_t text_count = 0;
+    struct stat st;
+    void *mapping;
+    size_t i;
+    int saved_errno;
+    int fd;
+
+    if ((count > AESD_STATPAGE_MAX_FIELDS) ||
+        (snprintf(page_path, sizeof(page_path), "%s", path) >= (int)sizeof(page_path)) ||
+        (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid()) >=
+            (int)sizeof(tmp_path))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Readers opening the path only ever see a complete page
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        text_count += (fields[i].type == AESD_STAT_TEXT);
+    }
+    page_len = AESD_STATPAGE_HEADER_SIZE + count * sizeof(struct aesd_statpage_field) +
+                text_count * AESD_STATPAGE_TEXT;
+    if ((ftruncate(fd, page_len) == -1) || (fstat(fd, &st) == -1)) {
+        goto fail;
+    }
+    mapping = mmap(NULL, page_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        goto fail;
+    }
+    page = mapping;
+    page_dev = st.st_dev;
+    page_ino = st.st_ino;
+
+    page->magic = AESD_STATPAGE_MAGIC;
+    page->version = AESD_STATPAGE_VERSION;
+    page->header_size = AESD_STATPAGE_HEADER_SIZE;
+    page->field_size = sizeof(struct aesd_statpage_field);
+    page->field_count = count;
+    page->interval_ms = interval_ms;
+    page->pid = getpid();
+    text_count = 0;
+    for (i = 0; i < count; i++) {
+        field = (struct aesd_statpage_field *)aesd_statpage_field(page, i);
+        snprintf(field->name, sizeof(field->name), "%s", fields[i].name);
+        field->type = fields[i].type;
+        if (field->type == AESD_STAT_TEXT) {
+            field->text_offset = AESD_STATPAGE_HEADER_SIZE +
+                                    count * sizeof(struct aesd_statpage_field) +
+                                    text_count++ * AESD_STATPAGE_TEXT;
+        }
+    }
+
+    if (rename(tmp_path, path) == -1) {
+        munmap(page, page_len);
+        page = NULL;
+        goto fail;
+    }
+    close(fd);
+    return 0;
+
+fail:
+    saved_errno = errno;
+    close(fd);
+    unlink(tmp_path);
+    errno = saved_errno;
+    return -1;
+}
+
+// Store the text in the field's slot a word at a time, for readers copying
+// it out under the seqlock
+static void publish_text(struct aesd_statpage_field *field, const char *text)
+{
+    char slot[AESD_STATPAGE_TEXT] = { 0 };
+    uint64_t word;
+    size_t w;
+
+    snprintf(slot, sizeof(slot), "%s", (text != NULL) ? text : "");
+    for (w = 0; w < sizeof(slot); w += sizeof(word)) {
+        memcpy(&word, &slot[w], sizeof(word));
+        __atomic_store_n((uint64_t *)((char *)page + field->text_offset + w), word,
+                            __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&field->value, strlen(slot), __ATOMIC_RELAXED);
+}
+
+void aesd_statpage_publish(const uint64_t *values, const char *const *texts)
+{
+    struct aesd_statpage_field *field;
+    struct timespec now;
+    uint64_t seq;
+    uint32_t i;
+
+    if (page == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    // Only the main loop publishes, the seqlock has a single writer
+    seq = page->seq;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < page->field_count; i++) {
+        field = (struct aesd_statpage_field *)aesd_statpage_field(page, i);
+        if (field->type == AESD_STAT_TEXT) {
+            publish_text(field, texts[i]);
+            continue;
+        }
+        __atomic_store_n(&field->value, values[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&page->updated_ns,
+                        (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void aesd_statpage_close(void)
+{
+    struct stat st;
+
+    if (page == NULL) {
+        return;
+    }
+    __atomic_store_n(&page->closed, 1, __ATOMIC_RELEASE);
+    munmap(page, page_len);
+    page = NULL;
+
+    // After an upgrade the path holds the new server's page
+    if ((stat(page_path, &st) == 0) && (st.st_dev == page_dev) && (st.st_ino == page_ino)) {
+        unlink(page_path);
+    }
+}
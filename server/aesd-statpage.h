@@ -0,0 +1,194 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-statpage.h
+​*​ ​@brief​ Counters published in a seqlocked shared memory page
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* The server's counters, published into a small shared memory file for
+* monitoring agents that poll often. A scrape maps the file and copies the
+* values out, no connection to the server and no system call on its side.
+* The server rewrites the values every interval_ms from its main loop.
+*
+* The file is created next to its path and renamed into place, so a reader
+* opening the path always finds a complete page. A server taking over
+* through an upgrade renames its own page over the old one; the old server
+* then sets closed in the page it leaves behind, and readers that see it
+* open the path again.
+*
+* File layout, all integers in host byte order:
+*
+*   0                   struct aesd_statpage
+*   header_size         field_count struct aesd_statpage_field of field_size
+*   text_offset         AESD_STATPAGE_TEXT bytes for each text field
+*
+* A text field's value is the length of its text, and the text itself is
+* NUL terminated in the slot at the field's text_offset.
+*
+* Fields never change name, type or position for a version. New versions
+* only append fields, so readers look fields up by name and skip types they
+* do not know. The values, texts and updated_ns are covered by the seqlock seq: it
+* is odd while the server writes them, a reader copies them out between two
+* equal even reads of seq.
+*/
+
+#ifndef AESD_STATPAGE_H
+#define AESD_STATPAGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define AESD_STATPAGE_MAGIC         (0x5441545344534541ULL)    // "AESDSTAT"
+#define AESD_STATPAGE_VERSION       (1)
+#define AESD_STATPAGE_HEADER_SIZE   (64)
+#define AESD_STATPAGE_NAME          (40)
+#define AESD_STATPAGE_MAX_FIELDS    (128)
+#define AESD_STATPAGE_TEXT          (64)
+
+enum aesd_statpage_type {
+    AESD_STAT_COUNTER = 1,      // uint64_t that only grows while the server runs
+    AESD_STAT_GAUGE = 2,        // uint64_t that goes up and down
+    AESD_STAT_REAL = 3,         // IEEE 754 double stored in the value's bits
+    AESD_STAT_TEXT = 4,         // Text in a slot after the fields, value holds its length
+};
+
+struct aesd_statpage {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t field_size;
+    uint32_t field_count;
+    /**
+     * Odd while the server writes the values
+     */
+    uint64_t seq;
+    /**
+     * CLOCK_REALTIME nanoseconds the values were taken at
+     */
+    uint64_t updated_ns;
+    uint32_t interval_ms;
+    int32_t pid;
+    /**
+     * Set once the server stops updating this page, readers reopen the path
+     */
+    uint32_t closed;
+};
+
+struct aesd_statpage_field {
+    char name[AESD_STATPAGE_NAME];      // NUL terminated
+    uint32_t type;                      // enum aesd_statpage_type
+    uint32_t text_offset;               // Slot of an AESD_STAT_TEXT field, else 0
+    uint64_t value;
+};
+
+/**
+ * Field the server publishes
+ */
+struct aesd_statpage_desc {
+    const char *name;
+    enum aesd_statpage_type type;
+};
+
+/**
+ * Create the page at path for count fields, published every interval_ms.
+ * Returns 0, or -1 with errno set.
+ */
+extern int aesd_statpage_open(const char *path, const struct aesd_statpage_desc *fields,
+                                size_t count, unsigned int interval_ms);
+
+/**
+ * Write one value per field, in the order of the descriptions. Text fields
+ * take their text from texts instead, truncated to fit the slot.
+ */
+extern void aesd_statpage_publish(const uint64_t *values, const char *const *texts);
+
+/**
+ * Mark the page closed and unlink it unless another server's page has
+ * since been renamed over the path
+ */
+extern void aesd_statpage_close(void);
+
+static inline uint64_t aesd_statpage_real(double value)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline double aesd_statpage_to_real(uint64_t bits)
+{
+    double value;
+
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * Field i of the page, stepping by the field size the page was written with
+ */
+static inline const struct aesd_statpage_field *aesd_statpage_field(
+                                            const struct aesd_statpage *page, uint32_t i)
+{
+    return (const struct aesd_statpage_field *)((const char *)page + page->header_size +
+                                                (size_t)i * page->field_size);
+}
+
+/**
+ * Copy the page's field_count values into values, the text of text fields
+ * into texts unless it is NULL, and the time they were taken into
+ * updated_ns. The caller checks every text slot lies inside the page.
+ * Returns false if the server kept writing through every attempt.
+ */
+static inline bool aesd_statpage_read(const struct aesd_statpage *page, uint64_t *values,
+                                        char (*texts)[AESD_STATPAGE_TEXT],
+                                        uint64_t *updated_ns)
+{
+    const struct aesd_statpage_field *field;
+    uint64_t before, after;
+    uint64_t word;
+    uint32_t i;
+    size_t w;
+    int attempt;
+
+    for (attempt = 0; attempt < 1000; attempt++) {
+        before = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        for (i = 0; i < page->field_count; i++) {
+            field = aesd_statpage_field(page, i);
+            values[i] = __atomic_load_n(&field->value, __ATOMIC_RELAXED);
+            if ((texts == NULL) || (field->type != AESD_STAT_TEXT)) {
+                continue;
+            }
+            for (w = 0; w < AESD_STATPAGE_TEXT; w += sizeof(word)) {
+                word = __atomic_load_n((const uint64_t *)((const char *)page +
+                                        field->text_offset + w), __ATOMIC_RELAXED);
+                memcpy(&texts[i][w], &word, sizeof(word));
+            }
+            texts[i][AESD_STATPAGE_TEXT - 1] = '\0';
+        }
+        *updated_ns = __atomic_load_n(&page->updated_ns, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+        if (before == after) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif /* AESD_STATPAGE_H */
@@ -0,0 +1,154 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-timerwheel.c
+​*​ ​@brief​ Hierarchical timer wheel for per-connection deadlines
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*/
+
+#include "aesd-timerwheel.h"
+
+#define WHEEL_MASK      (AESD_WHEEL_SLOTS - 1)
+// Longest delay the wheels can hold, later deadlines are clamped to it
+#define WHEEL_MAX_DELTA ((1ULL << (AESD_WHEEL_BITS * AESD_WHEEL_LEVELS)) - 1)
+
+void aesd_timerwheel_init(struct aesd_timerwheel *wheel, unsigned int tick_ms, uint64_t now_ms)
+{
+    int level, slot;
+
+    aesd_lock_init(&wheel->lock, "timerwheel");
+    wheel->tick_ms = tick_ms;
+    wheel->now = now_ms / tick_ms;
+    for (level = 0; level < AESD_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < AESD_WHEEL_SLOTS; slot++) {
+            LIST_INIT(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+void aesd_timerwheel_destroy(struct aesd_timerwheel *wheel)
+{
+    aesd_lock_destroy(&wheel->lock);
+}
+
+void aesd_timer_init(struct aesd_timer *timer, aesd_timer_fn fn, void *arg)
+{
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->pending = false;
+}
+
+// Place a timer in the slot covering its expiry tick
+static void wheel_insert(struct aesd_timerwheel *wheel, struct aesd_timer *timer)
+{
+    uint64_t delta;
+    int level = 0;
+
+    if (timer->expires <= wheel->now) {
+        timer->expires = wheel->now + 1;
+    }
+    delta = timer->expires - wheel->now;
+    if (delta > WHEEL_MAX_DELTA) {
+        delta = WHEEL_MAX_DELTA;
+        timer->expires = wheel->now + delta;
+    }
+
+    // Smallest level whose range covers the delay
+    while ((level < AESD_WHEEL_LEVELS - 1) &&
+           (delta >= (1ULL << (AESD_WHEEL_BITS * (level + 1))))) {
+        level++;
+    }
+
+    LIST_INSERT_HEAD(&wheel->slots[level][(timer->expires >> (AESD_WHEEL_BITS * level)) & WHEEL_MASK],
+                        timer, entries);
+    timer->pending = true;
+}
+
+void aesd_timer_add_locked(struct aesd_timerwheel *wheel, struct aesd_timer *timer, uint64_t expires_ms)
+{
+    if (timer->pending) {
+        LIST_REMOVE(timer, entries);
+        timer->pending = false;
+    }
+
+    // Round up so a timer never fires before its deadline
+    timer->expires = (expires_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    wheel_insert(wheel, timer);
+}
+
+void aesd_timer_mod(struct aesd_timerwheel *wheel, struct aesd_timer *timer, uint64_t expires_ms)
+{
+    aesd_lock(&wheel->lock);
+    aesd_timer_add_locked(wheel, timer, expires_ms);
+    aesd_unlock(&wheel->lock);
+}
+
+void aesd_timer_del(struct aesd_timerwheel *wheel, struct aesd_timer *timer)
+{
+    aesd_lock(&wheel->lock);
+    if (timer->pending) {
+        LIST_REMOVE(timer, entries);
+        timer->pending = false;
+    }
+    aesd_unlock(&wheel->lock);
+}
+
+// Move every timer of an upper level slot down to the level it now belongs in
+static void wheel_cascade(struct aesd_timerwheel *wheel, int level, int slot)
+{
+    struct aesd_timer *timer;
+
+    while (!LIST_EMPTY(&wheel->slots[level][slot])) {
+        timer = LIST_FIRST(&wheel->slots[level][slot]);
+        LIST_REMOVE(timer, entries);
+        if (timer->expires <= wheel->now) {
+            // Due this very tick, the current level 0 slot is run next
+            LIST_INSERT_HEAD(&wheel->slots[0][wheel->now & WHEEL_MASK], timer, entries);
+        } else {
+            wheel_insert(wheel, timer);
+        }
+    }
+}
+
+void aesd_timerwheel_advance(struct aesd_timerwheel *wheel, uint64_t now_ms)
+{
+    uint64_t target = now_ms / wheel->tick_ms;
+    struct aesd_timer_list *list;
+    struct aesd_timer *timer;
+    int level;
+
+    aesd_lock(&wheel->lock);
+
+    while (wheel->now < target) {
+        wheel->now++;
+
+        // Crossing into a new lap of a level pulls the next slot of the level above down
+        for (level = 1; level < AESD_WHEEL_LEVELS; level++) {
+            if ((wheel->now & ((1ULL << (AESD_WHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            wheel_cascade(wheel, level, (wheel->now >> (AESD_WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+
+        list = &wheel->slots[0][wheel->now & WHEEL_MASK];
+        while (!LIST_EMPTY(list)) {
+            timer = LIST_FIRST(list);
+            LIST_REMOVE(timer, entries);
+            timer->pending = false;
+            timer->fn(timer, timer->arg);
+        }
+    }
+
+    aesd_unlock(&wheel->lock);
+}
@@ -0,0 +1,99 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-timerwheel.h
+​*​ ​@brief​ Hierarchical timer wheel for per-connection deadlines
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*
+* Timers are intrusive and live in one of AESD_WHEEL_LEVELS wheels of
+* AESD_WHEEL_SLOTS slots. Level n slots each cover SLOTS^n ticks, so adding
+* and removing a timer is O(1) and advancing costs O(1) per tick plus the
+* occasional cascade of one upper level slot into the level below.
+*/
+
+#ifndef AESD_TIMERWHEEL_H
+#define AESD_TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "aesd-lock.h"
+
+#define AESD_WHEEL_BITS     (6)
+#define AESD_WHEEL_SLOTS    (1 << AESD_WHEEL_BITS)
+#define AESD_WHEEL_LEVELS   (4)
+
+struct aesd_timer;
+
+/**
+ * Expiry callback, called by aesd_timerwheel_advance() with the wheel lock
+ * held. It may re-arm the timer with aesd_timer_add_locked() but must not
+ * call any function that takes the wheel lock.
+ */
+typedef void (*aesd_timer_fn)(struct aesd_timer *timer, void *arg);
+
+struct aesd_timer {
+    /**
+     * Tick the timer expires on
+     */
+    uint64_t expires;
+    aesd_timer_fn fn;
+    void *arg;
+    bool pending;
+    LIST_ENTRY(aesd_timer) entries;
+};
+
+LIST_HEAD(aesd_timer_list, aesd_timer);
+
+struct aesd_timerwheel {
+    struct aesd_lock lock;
+    /**
+     * Length of one tick in milliseconds
+     */
+    unsigned int tick_ms;
+    /**
+     * Last tick processed by aesd_timerwheel_advance()
+     */
+    uint64_t now;
+    struct aesd_timer_list slots[AESD_WHEEL_LEVELS][AESD_WHEEL_SLOTS];
+};
+
+extern void aesd_timerwheel_init(struct aesd_timerwheel *wheel, unsigned int tick_ms, uint64_t now_ms);
+
+extern void aesd_timerwheel_destroy(struct aesd_timerwheel *wheel);
+
+extern void aesd_timer_init(struct aesd_timer *timer, aesd_timer_fn fn, void *arg);
+
+/**
+ * Arm or re-arm timer to expire at expires_ms on the same clock passed to
+ * aesd_timerwheel_advance(). Deadlines already passed fire on the next advance.
+ */
+extern void aesd_timer_mod(struct aesd_timerwheel *wheel, struct aesd_timer *timer, uint64_t expires_ms);
+
+/**
+ * aesd_timer_mod() for use from an expiry callback, the wheel lock must be held
+ */
+extern void aesd_timer_add_locked(struct aesd_timerwheel *wheel, struct aesd_timer *timer, uint64_t expires_ms);
+
+/**
+ * Disarm timer. Once this returns the callback is not running and will not run.
+ */
+extern void aesd_timer_del(struct aesd_timerwheel *wheel, struct aesd_timer *timer);
+
+/**
+ * Process every tick up to now_ms, calling the callback of each expired timer
+ */
+extern void aesd_timerwheel_advance(struct aesd_timerwheel *wheel, uint64_t now_ms);
+
+#endif /* AESD_TIMERWHEEL_H */
@@ -0,0 +1,275 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-trace.c
+​*​ ​@brief​ Per-thread rings of stage timings, dumped on request
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aesd-trace.h"
+
+// Ring ids are 16 bits in a dumped event
+#define MAX_RINGS           (65535)
+
+struct aesd_trace_ring {
+    struct aesd_trace_ring *next;
+    bool in_use;
+    uint16_t id;
+    uint32_t conn;
+    // Events ever recorded, only the owning thread writes it
+    uint64_t head;
+    struct aesd_trace_event events[];
+};
+
+static const char *stage_names[AESD_TRACE_STAGES] = {
+    "recv", "fairq", "lock", "append", "reply", "query", "durable", "send",
+};
+
+__thread struct aesd_trace_ring *aesd_trace_self = NULL;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct aesd_trace_ring *rings = NULL;
+static size_t ring_count = 0;
+static size_t ring_events = 0;     // 0 while tracing is off
+static uint32_t next_conn = 1;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t tx_bytes;
+
+    while (len > 0) {
+        tx_bytes = write(fd, buf, len);
+        if (tx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf = (const char *)buf + tx_bytes;
+        len -= tx_bytes;
+    }
+    return true;
+}
+
+int aesd_trace_init(size_t events)
+{
+    size_t size = 1;
+
+    if (events == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (size < events) {
+        size <<= 1;
+    }
+    pthread_mutex_lock(&trace_lock);
+    ring_events = size;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+void aesd_trace_attach(void)
+{
+    struct aesd_trace_ring *ring;
+
+    if (__atomic_load_n(&ring_events, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    // Reuse the ring a finished connection handed back, its oldest events
+    // are overwritten first
+    pthread_mutex_lock(&trace_lock);
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        if (!ring->in_use) {
+            break;
+        }
+    }
+    if ((ring == NULL) && (ring_count < MAX_RINGS)) {
+        ring = calloc(1, sizeof(*ring) + ring_events * sizeof(struct aesd_trace_event));
+        if (ring != NULL) {
+            ring->id = ++ring_count;
+            ring->next = rings;
+            rings = ring;
+        }
+    }
+    if (ring != NULL) {
+        ring->in_use = true;
+        ring->conn = next_conn++;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    aesd_trace_self = ring;
+}
+
+void aesd_trace_detach(void)
+{
+    if (aesd_trace_self == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    aesd_trace_self->in_use = false;
+    pthread_mutex_unlock(&trace_lock);
+    aesd_trace_self = NULL;
+}
+
+void aesd_trace_record(enum aesd_trace_stage stage, uint64_t start_ns, uint32_t bytes)
+{
+    struct aesd_trace_ring *ring = aesd_trace_self;
+    struct aesd_trace_event *event;
+    uint64_t dur_ns = clock_ns(CLOCK_MONOTONIC_RAW) - start_ns;
+
+    if (ring == NULL) {
+        return;
+    }
+    event = &ring->events[ring->head & (ring_events - 1)];
+    event->start_ns = start_ns;
+    event->dur_ns = (dur_ns > UINT32_MAX) ? UINT32_MAX : dur_ns;
+    event->conn = ring->conn;
+    event->bytes = bytes;
+    event->stage = stage;
+    event->ring = ring->id;
+    // Publishes the event to a dump running alongside
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// Copy the events of ring still held into out, returns how many. The owner
+// keeps recording meanwhile, events it may have overwritten during the copy
+// are left out.
+static size_t copy_ring(struct aesd_trace_ring *ring, struct aesd_trace_event *out)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t first = (head > ring_events) ? head - ring_events : 0;
+    uint64_t after, i;
+
+    for (i = first; i < head; i++) {
+        out[i - first] = ring->events[i & (ring_events - 1)];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if (after > first + ring_events) {
+        // Slots of events from first up to after - ring_events were reused
+        uint64_t lost = after - ring_events - first;
+
+        if (lost >= head - first) {
+            return 0;
+        }
+        memmove(out, out + lost, (head - first - lost) * sizeof(*out));
+        first += lost;
+    }
+    return head - first;
+}
+
+long aesd_trace_dump(const char *path)
+{
+    struct aesd_trace_header header;
+    struct aesd_trace_event *buf;
+    struct aesd_trace_ring *ring;
+    uint64_t total = 0;
+    size_t count;
+    bool ok = true;
+    int fd;
+
+    if (__atomic_load_n(&ring_events, __ATOMIC_RELAXED) == 0) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    buf = malloc(ring_events * sizeof(*buf));
+    if (buf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        free(buf);
+        return -1;
+    }
+
+    // The event count goes in once it is known
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, AESD_TRACE_MAGIC, sizeof(header.magic));
+    header.event_size = sizeof(struct aesd_trace_event);
+    header.raw_ns = clock_ns(CLOCK_MONOTONIC_RAW);
+    header.realtime_ns = clock_ns(CLOCK_REALTIME);
+    ok = write_full(fd, &header, sizeof(header));
+
+    // Rings are only ever added, the lock keeps the list still
+    pthread_mutex_lock(&trace_lock);
+    for (ring = rings; ok && (ring != NULL); ring = ring->next) {
+        count = copy_ring(ring, buf);
+        ok = write_full(fd, buf, count * sizeof(*buf));
+        total += count;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    header.events = total;
+    if (ok && (pwrite(fd, &header, sizeof(header), 0) != sizeof(header))) {
+        ok = false;
+    }
+    if (close(fd) == -1) {
+        ok = false;
+    }
+    free(buf);
+    return ok ? (long)total : -1;
+}
+
+bool aesd_trace_get_stats(size_t *ring_total, uint64_t *events)
+{
+    struct aesd_trace_ring *ring;
+
+    *ring_total = 0;
+    *events = 0;
+    pthread_mutex_lock(&trace_lock);
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        *events += __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+    *ring_total = ring_count;
+    pthread_mutex_unlock(&trace_lock);
+    return __atomic_load_n(&ring_events, __ATOMIC_RELAXED) > 0;
+}
+
+const char *aesd_trace_stage_name(unsigned int stage)
+{
+    return (stage < AESD_TRACE_STAGES) ? stage_names[stage] : "unknown";
+}
+
+void aesd_trace_destroy(void)
+{
+    struct aesd_trace_ring *ring;
+
+    pthread_mutex_lock(&trace_lock);
+    ring_events = 0;
+    while (rings != NULL) {
+        ring = rings;
+        rings = ring->next;
+        free(ring);
+    }
+    ring_count = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
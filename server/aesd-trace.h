@@ -0,0 +1,145 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesd-trace.h
+​*​ ​@brief​ Per-thread rings of stage timings, dumped on request
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* A flight recorder of how long each stage of serving a packet took. Every
+* client thread records into a ring of its own, so recording takes no lock:
+* a CLOCK_MONOTONIC_RAW read before and after the stage and a store into
+* the ring. A thread gets a ring when its connection starts and hands it
+* back when it ends, and the events stay in it until later connections
+* overwrite them, so a dump also shows recently closed connections.
+*
+* With tracing off a stage costs one thread-local load and a branch.
+*
+* aesd_trace_dump() writes every ring into a file, a struct
+* aesd_trace_header followed by the events ordered by ring, in host byte
+* order. aesdtrace2json turns it into Chrome trace JSON or sums it up per
+* stage.
+*/
+
+#ifndef AESD_TRACE_H
+#define AESD_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define AESD_TRACE_SUFFIX   (".trace")
+#define AESD_TRACE_MAGIC    ("ATR1")
+
+enum aesd_trace_stage {
+    AESD_TRACE_RECV,        // recv() of client bytes
+    AESD_TRACE_FAIRQ,       // Waiting for a fair turn at the append stage
+    AESD_TRACE_LOCK,        // Waiting for thread_mutex
+    AESD_TRACE_APPEND,      // aesd_history_append() under thread_mutex
+    AESD_TRACE_REPLY,       // Queueing a history reply
+    AESD_TRACE_QUERY,       // Answering a query
+    AESD_TRACE_DURABLE,     // Holding replies until appends are durable
+    AESD_TRACE_SEND,        // Writing queued replies to the socket
+    AESD_TRACE_STAGES,
+};
+
+struct aesd_trace_event {
+    uint64_t start_ns;      // CLOCK_MONOTONIC_RAW
+    uint32_t dur_ns;
+    uint32_t conn;          // Connection number, from 1
+    uint32_t bytes;         // Bytes the stage moved, if any
+    uint16_t stage;
+    uint16_t ring;          // Ring the event was recorded in, from 1
+};
+
+struct aesd_trace_header {
+    char magic[4];
+    uint32_t event_size;
+    uint64_t events;
+    /**
+     * CLOCK_MONOTONIC_RAW and CLOCK_REALTIME at the dump, to put events
+     * on the wall clock
+     */
+    uint64_t raw_ns;
+    uint64_t realtime_ns;
+};
+
+struct aesd_trace_ring;
+
+extern __thread struct aesd_trace_ring *aesd_trace_self;
+
+/**
+ * Start tracing with rings of events events each, rounded up to a power of
+ * two. Returns 0, or -1 with errno set.
+ */
+extern int aesd_trace_init(size_t events);
+
+/**
+ * Give the calling thread a ring for a new connection. Does nothing if
+ * tracing is off or no ring can be allocated.
+ */
+extern void aesd_trace_attach(void);
+
+/**
+ * Hand the calling thread's ring back, keeping its events
+ */
+extern void aesd_trace_detach(void);
+
+extern void aesd_trace_record(enum aesd_trace_stage stage, uint64_t start_ns, uint32_t bytes);
+
+/**
+ * Start of a stage, 0 if the calling thread is not tracing
+ */
+static inline uint64_t aesd_trace_begin(void)
+{
+    struct timespec ts;
+
+    if (aesd_trace_self == NULL) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Record the stage that began at start_ns
+ */
+static inline void aesd_trace_end(enum aesd_trace_stage stage, uint64_t start_ns, uint32_t bytes)
+{
+    if (start_ns != 0) {
+        aesd_trace_record(stage, start_ns, bytes);
+    }
+}
+
+/**
+ * Write every ring to path, replacing it. Returns the number of events
+ * written, or -1 with errno set.
+ */
+extern long aesd_trace_dump(const char *path);
+
+/**
+ * Rings allocated and events recorded since start, false if tracing is off
+ */
+extern bool aesd_trace_get_stats(size_t *rings, uint64_t *events);
+
+/**
+ * Name of a stage for dumps and stats
+ */
+extern const char *aesd_trace_stage_name(unsigned int stage);
+
+/**
+ * Free every ring, tracing stops
+ */
+extern void aesd_trace_destroy(void);
+
+#endif /* AESD_TRACE_H */
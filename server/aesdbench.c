@@ -0,0 +1,1119 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesdbench.c
+​*​ ​@brief​ Load generator and benchmarks for aesdsocket
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*
+* Usage: ./aesdbench <benchmark> [options]
+*   reply       Time full history replies, optionally sampling the server's
+*               CPU time from /proc/<pid>/stat to compare send modes
+*   transport   Compare loopback TCP with the unix domain socket listener for
+*               64 byte packets, round trip latency and pipelined throughput
+*   framing     Compare newline packets with binary frames of -s bytes over
+*               TCP, round trip latency and pipelined throughput
+*   append      Append latency and throughput of -c clients each making -n
+*               round trips with -s byte binary frames, to compare the
+*               server's durability modes
+*   crc         CRC32C throughput over -s byte records, the implementation
+*               the server picks against the table fallback
+*   lz          Compression ratio and throughput of the cold history codec
+*               over -s byte blocks of a -f history file, or -n MiB of
+*               generated device telemetry with the server's timestamps
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <netdb.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include "aesd-frame.h"
+#include "aesd-crc32c.h"
+#include "aesd-lz.h"
+
+#define BENCH_SUCCESS       (0)
+#define BENCH_FAILURE       (-1)
+#define DEFAULT_HOST        ("localhost")
+#define DEFAULT_PORT        ("9000")
+#define RX_SIZE             (256 * 1024)
+#define PACKET_SIZE         (64)
+#define DEFAULT_FRAME_SIZE  (64 * 1024)
+#define LZ_BLOCK_SIZE       (1024 * 1024)
+#define LZ_DECODE_ROUNDS    (5)
+#define TELEMETRY_DEVICES   (256)
+
+struct bench_options {
+    const char *host;
+    const char *port;
+    unsigned long count;
+    pid_t server_pid;
+    const char *unix_path;
+    size_t packet_size;
+    unsigned long clients;
+    const char *corpus_path;
+};
+
+enum bench_transport {
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX,
+    TRANSPORTS,
+};
+
+static const char *transport_names[TRANSPORTS] = { "tcp", "unix" };
+
+enum bench_framing {
+    FRAMING_NEWLINE,
+    FRAMING_BINARY,
+    FRAMINGS,
+};
+
+static const char *framing_names[FRAMINGS] = { "newline", "binary" };
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+// Open a TCP connection to host:port, returns -1 on failure
+static int connect_tcp(const char *host, const char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *addr_list, *p_ai;
+    int fd = -1;
+    int status;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    status = getaddrinfo(host, port, &hints, &addr_list);
+    if (status != 0) {
+        fprintf(stderr, "Error getaddrinfo(): %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    for (p_ai = addr_list; p_ai != NULL; p_ai = p_ai->ai_next) {
+        fd = socket(p_ai->ai_family, p_ai->ai_socktype, p_ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, p_ai->ai_addr, p_ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addr_list);
+
+    if (fd == -1) {
+        fprintf(stderr, "Error connect() to %s:%s: %s\n", host, port, strerror(errno));
+    }
+    return fd;
+}
+
+// Open a connection to the unix domain socket at path, returns -1 on failure
+static int connect_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((fd != -1) && (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)) {
+        close(fd);
+        fd = -1;
+    }
+
+    if (fd == -1) {
+        fprintf(stderr, "Error connect() to %s: %s\n", path, strerror(errno));
+    }
+    return fd;
+}
+
+// Write all of buf to fd, returns false on error
+static bool send_all(int fd, const char *buf, size_t len)
+{
+    ssize_t tx_bytes;
+
+    while (len > 0) {
+        tx_bytes = send(fd, buf, len, MSG_NOSIGNAL);
+        if (tx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += tx_bytes;
+        len -= tx_bytes;
+    }
+    return true;
+}
+
+// Read from fd until the peer closes, returns number of bytes read or -1
+static long long recv_until_close(int fd, char *buf, size_t buf_size)
+{
+    long long total = 0;
+    ssize_t rx_bytes;
+
+    while (1) {
+        rx_bytes = recv(fd, buf, buf_size, 0);
+        if (rx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rx_bytes == 0) {
+            return total;
+        }
+        total += rx_bytes;
+    }
+}
+
+// Read replies until the stream ends with packet, the last one sent. Every
+// reply is the history up to its own packet, so only the reply to the last
+// packet ends with it. Returns the number of bytes read or -1.
+static long long recv_through(int fd, char *buf, size_t buf_size, const char *packet)
+{
+    char tail[PACKET_SIZE];
+    size_t tail_len = 0;
+    size_t keep;
+    long long total = 0;
+    ssize_t rx_bytes;
+
+    while (1) {
+        rx_bytes = recv(fd, buf, buf_size, 0);
+        if (rx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rx_bytes == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        total += rx_bytes;
+
+        // Keep the last PACKET_SIZE bytes of the stream
+        if (rx_bytes >= PACKET_SIZE) {
+            memcpy(tail, buf + rx_bytes - PACKET_SIZE, PACKET_SIZE);
+            tail_len = PACKET_SIZE;
+        } else {
+            keep = (tail_len + rx_bytes > PACKET_SIZE) ? PACKET_SIZE - rx_bytes : tail_len;
+            memmove(tail, tail + tail_len - keep, keep);
+            memcpy(tail + keep, buf, rx_bytes);
+            tail_len = keep + rx_bytes;
+        }
+
+        if ((tail_len == PACKET_SIZE) && (memcmp(tail, packet, PACKET_SIZE) == 0)) {
+            return total;
+        }
+    }
+}
+
+// Read count binary framed replies, returns the number of bytes read or -1
+static long long recv_frames(int fd, char *buf, size_t buf_size, unsigned long count)
+{
+    char header[AESD_FRAME_VARINT_MAX];
+    size_t header_len = 0;
+    uint64_t payload_left = 0;
+    bool in_payload = false;
+    long long total = 0;
+    ssize_t rx_bytes, i, take;
+    int status;
+
+    while (count > 0) {
+        rx_bytes = recv(fd, buf, buf_size, 0);
+        if (rx_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (rx_bytes == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        total += rx_bytes;
+
+        for (i = 0; (i < rx_bytes) && (count > 0); i += take) {
+            if (in_payload) {
+                take = (payload_left < (uint64_t)(rx_bytes - i)) ? payload_left : rx_bytes - i;
+                payload_left -= take;
+                if (payload_left == 0) {
+                    in_payload = false;
+                    count--;
+                }
+                continue;
+            }
+
+            take = 1;
+            header[header_len++] = buf[i];
+            status = aesd_frame_get_varint(header, header_len, &payload_left);
+            if (status == -1) {
+                errno = EPROTO;
+                return -1;
+            }
+            if (status > 0) {
+                header_len = 0;
+                if (payload_left == 0) {
+                    count--;
+                } else {
+                    in_payload = true;
+                }
+            }
+        }
+    }
+    return total;
+}
+
+// Fill packet with a newline terminated line unique to transport and seq
+static void make_packet(char *packet, enum bench_transport transport, unsigned long seq)
+{
+    int len = snprintf(packet, PACKET_SIZE, "aesdbench %s %lu ", transport_names[transport], seq);
+
+    memset(packet + len, 'x', PACKET_SIZE - 1 - len);
+    packet[PACKET_SIZE - 1] = '\n';
+}
+
+// Fill a packet of size bytes ending in a line unique to framing and seq. In
+// binary mode the frame header goes in front, returns the bytes to send.
+static size_t make_framed_packet(char *buf, size_t size, enum bench_framing framing,
+                                    unsigned long seq)
+{
+    size_t header_len = 0;
+    int len;
+
+    if (framing == FRAMING_BINARY) {
+        header_len = aesd_frame_put_varint(buf, size);
+    }
+    memset(buf + header_len, 'x', size - PACKET_SIZE);
+    len = snprintf(buf + header_len + size - PACKET_SIZE, PACKET_SIZE, "aesdbench %s %lu ",
+                    framing_names[framing], seq);
+    memset(buf + header_len + size - PACKET_SIZE + len, 'x', PACKET_SIZE - 1 - len);
+    buf[header_len + size - 1] = '\n';
+    return header_len + size;
+}
+
+// Read the replies to count packets, the last of which ends with tail
+static long long recv_framed_replies(int fd, enum bench_framing framing, char *rx_buffer,
+                                        const char *tail, unsigned long count)
+{
+    if (framing == FRAMING_BINARY) {
+        return recv_frames(fd, rx_buffer, RX_SIZE, count);
+    }
+    return recv_through(fd, rx_buffer, RX_SIZE, tail);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+// Read utime + stime of a process in seconds, returns -1 if unavailable
+static double process_cpu_sec(pid_t pid)
+{
+    char path[64];
+    char stat_buf[1024];
+    unsigned long utime = 0, stime = 0;
+    FILE *stat_file;
+    char *p;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    stat_file = fopen(path, "r");
+    if (stat_file == NULL) {
+        return -1;
+    }
+    if (fgets(stat_buf, sizeof(stat_buf), stat_file) == NULL) {
+        fclose(stat_file);
+        return -1;
+    }
+    fclose(stat_file);
+
+    // Fields after the command name, utime and stime are fields 14 and 15
+    p = strrchr(stat_buf, ')');
+    if ((p == NULL) ||
+        (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                &utime, &stime) != 2)) {
+        return -1;
+    }
+
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// Send one packet per connection and time the full history reply
+static int bench_reply(const struct bench_options *opts)
+{
+    char *rx_buffer = malloc(RX_SIZE);
+    long long reply_bytes = 0;
+    long long rx_total = 0;
+    double cpu_start = -1, cpu_end = -1;
+    double start, elapsed;
+    unsigned long i;
+    int fd;
+
+    if (rx_buffer == NULL) {
+        fprintf(stderr, "Error failed to malloc()\n");
+        return BENCH_FAILURE;
+    }
+
+    if (opts->server_pid > 0) {
+        cpu_start = process_cpu_sec(opts->server_pid);
+    }
+
+    start = now_sec();
+    for (i = 0; i < opts->count; i++) {
+        fd = connect_tcp(opts->host, opts->port);
+        if (fd == -1) {
+            free(rx_buffer);
+            return BENCH_FAILURE;
+        }
+
+        if (!send_all(fd, "aesdbench reply\n", 16) || (shutdown(fd, SHUT_WR) == -1)) {
+            fprintf(stderr, "Error send(): %s\n", strerror(errno));
+            close(fd);
+            free(rx_buffer);
+            return BENCH_FAILURE;
+        }
+
+        reply_bytes = recv_until_close(fd, rx_buffer, RX_SIZE);
+        close(fd);
+        if (reply_bytes == -1) {
+            fprintf(stderr, "Error recv(): %s\n", strerror(errno));
+            free(rx_buffer);
+            return BENCH_FAILURE;
+        }
+        rx_total += reply_bytes;
+    }
+    elapsed = now_sec() - start;
+
+    if (opts->server_pid > 0) {
+        cpu_end = process_cpu_sec(opts->server_pid);
+    }
+
+    printf("replies:        %lu\n", opts->count);
+    printf("last reply:     %lld bytes\n", reply_bytes);
+    printf("throughput:     %.1f MB/s\n", rx_total / elapsed / 1e6);
+    printf("reply latency:  %.3f ms\n", elapsed * 1e3 / opts->count);
+    if ((cpu_start >= 0) && (cpu_end >= 0)) {
+        printf("server cpu:     %.3f ms/reply\n", (cpu_end - cpu_start) * 1e3 / opts->count);
+    }
+
+    free(rx_buffer);
+    return BENCH_SUCCESS;
+}
+
+// Round trips, one packet in flight at a time. Both transports share one
+// history, which every reply returns in full, so they take turns to see the
+// same history sizes.
+static bool transport_latency(const struct bench_options *opts, int *fds, double **latency,
+                                char *rx_buffer, unsigned long *seq)
+{
+    char packet[PACKET_SIZE];
+    unsigned long i;
+    double start;
+    int t;
+
+    for (i = 0; i < opts->count; i++) {
+        for (t = 0; t < TRANSPORTS; t++) {
+            enum bench_transport transport = (t + i) % TRANSPORTS;
+
+            make_packet(packet, transport, (*seq)++);
+            start = now_sec();
+            if (!send_all(fds[transport], packet, PACKET_SIZE) ||
+                (recv_through(fds[transport], rx_buffer, RX_SIZE, packet) == -1)) {
+                fprintf(stderr, "Error %s round trip: %s\n", transport_names[transport],
+                        strerror(errno));
+                return false;
+            }
+            latency[transport][i] = now_sec() - start;
+        }
+    }
+    return true;
+}
+
+// Pipelined, every packet written before the replies are read back. Runs go
+// TCP, unix, unix, TCP so both transports see the same history sizes.
+static bool transport_throughput(const struct bench_options *opts, int *fds, double *elapsed,
+                                    long long *reply_total, char *rx_buffer, unsigned long *seq)
+{
+    static const enum bench_transport order[] = {
+        TRANSPORT_TCP, TRANSPORT_UNIX, TRANSPORT_UNIX, TRANSPORT_TCP
+    };
+    char packet[PACKET_SIZE];
+    unsigned long i;
+    long long rx_bytes;
+    double start;
+    int run;
+
+    for (run = 0; run < 4; run++) {
+        enum bench_transport transport = order[run];
+
+        start = now_sec();
+        for (i = 0; i < opts->count; i++) {
+            make_packet(packet, transport, (*seq)++);
+            if (!send_all(fds[transport], packet, PACKET_SIZE)) {
+                fprintf(stderr, "Error %s send(): %s\n", transport_names[transport],
+                        strerror(errno));
+                return false;
+            }
+        }
+
+        // packet still holds the last one sent
+        rx_bytes = recv_through(fds[transport], rx_buffer, RX_SIZE, packet);
+        if (rx_bytes == -1) {
+            fprintf(stderr, "Error %s recv(): %s\n", transport_names[transport], strerror(errno));
+            return false;
+        }
+        elapsed[transport] += now_sec() - start;
+        reply_total[transport] += rx_bytes;
+    }
+    return true;
+}
+
+// Compare TCP and unix socket clients sending 64 byte packets
+static int bench_transport(const struct bench_options *opts)
+{
+    char *rx_buffer = malloc(RX_SIZE);
+    double *latency[TRANSPORTS];
+    double elapsed[TRANSPORTS] = { 0, 0 };
+    long long reply_total[TRANSPORTS] = { 0, 0 };
+    int fds[TRANSPORTS] = { -1, -1 };
+    unsigned long seq = 0;
+    unsigned long i;
+    bool ok = false;
+    int t;
+
+    latency[TRANSPORT_TCP] = calloc(opts->count, sizeof(double));
+    latency[TRANSPORT_UNIX] = calloc(opts->count, sizeof(double));
+
+    if (opts->unix_path == NULL) {
+        fprintf(stderr, "Error transport benchmark needs -u unix_socket_path\n");
+    } else if ((rx_buffer == NULL) || (latency[TRANSPORT_TCP] == NULL) ||
+                (latency[TRANSPORT_UNIX] == NULL)) {
+        fprintf(stderr, "Error failed to malloc()\n");
+    } else {
+        fds[TRANSPORT_TCP] = connect_tcp(opts->host, opts->port);
+        fds[TRANSPORT_UNIX] = connect_unix(opts->unix_path);
+        ok = (fds[TRANSPORT_TCP] != -1) && (fds[TRANSPORT_UNIX] != -1) &&
+                transport_latency(opts, fds, latency, rx_buffer, &seq) &&
+                transport_throughput(opts, fds, elapsed, reply_total, rx_buffer, &seq);
+    }
+
+    if (ok) {
+        printf("packets:        %lu x %d bytes per transport and run\n", opts->count, PACKET_SIZE);
+        printf("%-10s %12s %12s %12s %14s %12s\n", "transport", "rtt mean us", "rtt p50 us",
+                "rtt p99 us", "packets/s", "reply MB/s");
+        for (t = 0; t < TRANSPORTS; t++) {
+            double sum = 0;
+
+            for (i = 0; i < opts->count; i++) {
+                sum += latency[t][i];
+            }
+            qsort(latency[t], opts->count, sizeof(double), compare_double);
+            printf("%-10s %12.1f %12.1f %12.1f %14.0f %12.1f\n", transport_names[t],
+                    sum * 1e6 / opts->count,
+                    latency[t][opts->count / 2] * 1e6,
+                    latency[t][(opts->count * 99) / 100] * 1e6,
+                    2 * opts->count / elapsed[t],
+                    reply_total[t] / elapsed[t] / 1e6);
+        }
+    }
+
+    for (t = 0; t < TRANSPORTS; t++) {
+        if (fds[t] != -1) {
+            close(fds[t]);
+        }
+        free(latency[t]);
+    }
+    free(rx_buffer);
+    return ok ? BENCH_SUCCESS : BENCH_FAILURE;
+}
+
+// Round trips, one packet in flight at a time, taking turns as the history
+// the replies return is shared
+static bool framing_latency(const struct bench_options *opts, int *fds, double **latency,
+                            char *packet, char *rx_buffer, unsigned long *seq)
+{
+    size_t len;
+    unsigned long i;
+    double start;
+    int f;
+
+    for (i = 0; i < opts->count; i++) {
+        for (f = 0; f < FRAMINGS; f++) {
+            enum bench_framing framing = (f + i) % FRAMINGS;
+
+            len = make_framed_packet(packet, opts->packet_size, framing, (*seq)++);
+            start = now_sec();
+            if (!send_all(fds[framing], packet, len) ||
+                (recv_framed_replies(fds[framing], framing, rx_buffer,
+                                        packet + len - PACKET_SIZE, 1) == -1)) {
+                fprintf(stderr, "Error %s round trip: %s\n", framing_names[framing],
+                        strerror(errno));
+                return false;
+            }
+            latency[framing][i] = now_sec() - start;
+        }
+    }
+    return true;
+}
+
+// Pipelined runs in newline, binary, binary, newline order. With a server pid
+// its CPU time is charged to the framing of each run.
+static bool framing_throughput(const struct bench_options *opts, int *fds, double *elapsed,
+                                double *server_cpu, char *packet, char *rx_buffer,
+                                unsigned long *seq)
+{
+    static const enum bench_framing order[] = {
+        FRAMING_NEWLINE, FRAMING_BINARY, FRAMING_BINARY, FRAMING_NEWLINE
+    };
+    size_t len = 0;
+    unsigned long i;
+    double start;
+    double cpu_start = -1;
+    int run;
+
+    for (run = 0; run < 4; run++) {
+        enum bench_framing framing = order[run];
+
+        if (opts->server_pid > 0) {
+            cpu_start = process_cpu_sec(opts->server_pid);
+        }
+        start = now_sec();
+        for (i = 0; i < opts->count; i++) {
+            len = make_framed_packet(packet, opts->packet_size, framing, (*seq)++);
+            if (!send_all(fds[framing], packet, len)) {
+                fprintf(stderr, "Error %s send(): %s\n", framing_names[framing], strerror(errno));
+                return false;
+            }
+        }
+
+        if (recv_framed_replies(fds[framing], framing, rx_buffer,
+                                packet + len - PACKET_SIZE, opts->count) == -1) {
+            fprintf(stderr, "Error %s recv(): %s\n", framing_names[framing], strerror(errno));
+            return false;
+        }
+        elapsed[framing] += now_sec() - start;
+        if ((cpu_start >= 0) && (server_cpu[framing] >= 0)) {
+            server_cpu[framing] += process_cpu_sec(opts->server_pid) - cpu_start;
+        } else {
+            server_cpu[framing] = -1;
+        }
+    }
+    return true;
+}
+
+// Compare newline packets with binary frames of the same size over TCP
+static int bench_framing(const struct bench_options *opts)
+{
+    char *rx_buffer = malloc(RX_SIZE);
+    char *packet = malloc(opts->packet_size + AESD_FRAME_VARINT_MAX);
+    double *latency[FRAMINGS];
+    double elapsed[FRAMINGS] = { 0, 0 };
+    double server_cpu[FRAMINGS] = { 0, 0 };
+    int fds[FRAMINGS] = { -1, -1 };
+    unsigned long seq = 0;
+    unsigned long i;
+    bool ok = false;
+    int f;
+
+    latency[FRAMING_NEWLINE] = calloc(opts->count, sizeof(double));
+    latency[FRAMING_BINARY] = calloc(opts->count, sizeof(double));
+
+    if (opts->packet_size < PACKET_SIZE) {
+        fprintf(stderr, "Error framing benchmark needs packets of at least %d bytes\n",
+                PACKET_SIZE);
+    } else if ((rx_buffer == NULL) || (packet == NULL) || (latency[FRAMING_NEWLINE] == NULL) ||
+                (latency[FRAMING_BINARY] == NULL)) {
+        fprintf(stderr, "Error failed to malloc()\n");
+    } else {
+        fds[FRAMING_NEWLINE] = connect_tcp(opts->host, opts->port);
+        fds[FRAMING_BINARY] = connect_tcp(opts->host, opts->port);
+        ok = (fds[FRAMING_NEWLINE] != -1) && (fds[FRAMING_BINARY] != -1) &&
+                send_all(fds[FRAMING_BINARY], AESD_FRAME_MAGIC, AESD_FRAME_MAGIC_LEN) &&
+                framing_latency(opts, fds, latency, packet, rx_buffer, &seq) &&
+                framing_throughput(opts, fds, elapsed, server_cpu, packet, rx_buffer, &seq);
+    }
+
+    if (ok) {
+        printf("packets:        %lu x %zu bytes per framing and run\n", opts->count,
+                opts->packet_size);
+        printf("%-10s %12s %12s %12s %14s %12s %14s\n", "framing", "rtt mean us", "rtt p50 us",
+                "rtt p99 us", "packets/s", "ingest MB/s", "server cpu us");
+        for (f = 0; f < FRAMINGS; f++) {
+            double sum = 0;
+
+            for (i = 0; i < opts->count; i++) {
+                sum += latency[f][i];
+            }
+            qsort(latency[f], opts->count, sizeof(double), compare_double);
+            printf("%-10s %12.1f %12.1f %12.1f %14.0f %12.1f", framing_names[f],
+                    sum * 1e6 / opts->count,
+                    latency[f][opts->count / 2] * 1e6,
+                    latency[f][(opts->count * 99) / 100] * 1e6,
+                    2 * opts->count / elapsed[f],
+                    2 * opts->count * opts->packet_size / elapsed[f] / 1e6);
+            // Server CPU per pipelined packet, replies included
+            if ((opts->server_pid > 0) && (server_cpu[f] >= 0)) {
+                printf(" %14.1f", server_cpu[f] * 1e6 / (2 * opts->count));
+            }
+            printf("\n");
+        }
+    }
+
+    for (f = 0; f < FRAMINGS; f++) {
+        if (fds[f] != -1) {
+            close(fds[f]);
+        }
+        free(latency[f]);
+    }
+    free(packet);
+    free(rx_buffer);
+    return ok ? BENCH_SUCCESS : BENCH_FAILURE;
+}
+
+// One append benchmark client and the latency of each of its round trips
+struct append_client {
+    pthread_t thread;
+    const struct bench_options *opts;
+    unsigned long id;
+    double *latency;
+    bool ok;
+};
+
+static void *append_client_func(void *arg)
+{
+    struct append_client *client = arg;
+    const struct bench_options *opts = client->opts;
+    char *rx_buffer = malloc(RX_SIZE);
+    char *packet = malloc(opts->packet_size + AESD_FRAME_VARINT_MAX);
+    unsigned long i;
+    size_t len;
+    double start;
+    int fd = -1;
+
+    client->ok = false;
+    if ((rx_buffer == NULL) || (packet == NULL)) {
+        fprintf(stderr, "Error failed to malloc()\n");
+    } else if (((fd = connect_tcp(opts->host, opts->port)) != -1) &&
+                send_all(fd, AESD_FRAME_MAGIC, AESD_FRAME_MAGIC_LEN)) {
+        client->ok = true;
+        for (i = 0; client->ok && (i < opts->count); i++) {
+            len = make_framed_packet(packet, opts->packet_size, FRAMING_BINARY,
+                                        client->id * opts->count + i);
+            start = now_sec();
+            client->ok = send_all(fd, packet, len) &&
+                            (recv_frames(fd, rx_buffer, RX_SIZE, 1) != -1);
+            client->latency[i] = now_sec() - start;
+        }
+        if (!client->ok) {
+            fprintf(stderr, "Error client %lu round trip: %s\n", client->id, strerror(errno));
+        }
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+    free(packet);
+    free(rx_buffer);
+    return NULL;
+}
+
+// Concurrent clients appending one frame at a time, each waiting for its
+// reply. Replies are the whole history, so run the server with a retention
+// limit to keep them from dominating the latency.
+static int bench_append(const struct bench_options *opts)
+{
+    struct append_client *clients = calloc(opts->clients, sizeof(struct append_client));
+    double *latency = calloc(opts->clients * opts->count, sizeof(double));
+    unsigned long total = opts->clients * opts->count;
+    unsigned long started = 0;
+    unsigned long c;
+    double start, elapsed, sum = 0;
+    bool ok = true;
+
+    if ((clients == NULL) || (latency == NULL)) {
+        fprintf(stderr, "Error failed to malloc()\n");
+        free(clients);
+        free(latency);
+        return BENCH_FAILURE;
+    }
+
+    start = now_sec();
+    for (c = 0; c < opts->clients; c++) {
+        clients[c].opts = opts;
+        clients[c].id = c;
+        clients[c].latency = latency + c * opts->count;
+        if (pthread_create(&(clients[c].thread), NULL, append_client_func, &clients[c]) != 0) {
+            fprintf(stderr, "Error pthread_create()\n");
+            ok = false;
+            break;
+        }
+        started++;
+    }
+    for (c = 0; c < started; c++) {
+        pthread_join(clients[c].thread, NULL);
+        ok = ok && clients[c].ok;
+    }
+    elapsed = now_sec() - start;
+
+    if (ok) {
+        for (c = 0; c < total; c++) {
+            sum += latency[c];
+        }
+        qsort(latency, total, sizeof(double), compare_double);
+        printf("appends:        %lu clients x %lu x %zu bytes\n", opts->clients, opts->count,
+                opts->packet_size);
+        printf("%12s %12s %12s %12s %12s\n", "mean us", "p50 us", "p99 us", "max us",
+                "appends/s");
+        printf("%12.1f %12.1f %12.1f %12.1f %12.0f\n", sum * 1e6 / total,
+                latency[total / 2] * 1e6, latency[(total * 99) / 100] * 1e6,
+                latency[total - 1] * 1e6, total / elapsed);
+    }
+
+    free(clients);
+    free(latency);
+    return ok ? BENCH_SUCCESS : BENCH_FAILURE;
+}
+
+// Checksum -n MiB of -s byte records with each CRC32C implementation
+static int bench_crc(const struct bench_options *opts)
+{
+    size_t total = opts->count * 1024 * 1024;
+    size_t records = total / opts->packet_size;
+    unsigned char *buf = malloc(records * opts->packet_size);
+    uint32_t results[2] = { 0, 0 };
+    double elapsed[2];
+    double start;
+    size_t i;
+    int impl;
+
+    if ((records == 0) || (buf == NULL)) {
+        fprintf(stderr, "Error failed to malloc()\n");
+        free(buf);
+        return BENCH_FAILURE;
+    }
+    for (i = 0; i < records * opts->packet_size; i++) {
+        buf[i] = (unsigned char)(i * 131 + (i >> 11));
+    }
+
+    for (impl = 0; impl < 2; impl++) {
+        start = now_sec();
+        for (i = 0; i < records; i++) {
+            results[impl] ^= (impl == 0) ?
+                aesd_crc32c(0, buf + i * opts->packet_size, opts->packet_size) :
+                aesd_crc32c_table(0, buf + i * opts->packet_size, opts->packet_size);
+        }
+        elapsed[impl] = now_sec() - start;
+    }
+
+    printf("records:        %zu x %zu bytes\n", records, opts->packet_size);
+    printf("%-10s %10.2f GB/s %10.1f ns/record\n", aesd_crc32c_impl(),
+            records * opts->packet_size / elapsed[0] / 1e9, elapsed[0] * 1e9 / records);
+    printf("%-10s %10.2f GB/s %10.1f ns/record\n", "table",
+            records * opts->packet_size / elapsed[1] / 1e9, elapsed[1] * 1e9 / records);
+    free(buf);
+    if (results[0] != results[1]) {
+        fprintf(stderr, "Error implementations disagree\n");
+        return BENCH_FAILURE;
+    }
+    return BENCH_SUCCESS;
+}
+
+// xorshift64, the corpus is the same on every run
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Fill buf with len bytes of history as devices reporting in would leave
+// it: a reading per line from a fleet of devices whose values drift, and a
+// timestamp record from the server every ten seconds
+static void telemetry_corpus(char *buf, size_t len)
+{
+    static const char *statuses[] = { "ok", "ok", "ok", "ok", "ok", "ok", "degraded", "fault" };
+    int temp[TELEMETRY_DEVICES];
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    time_t now = 1792195200;    // Oct 2026
+    unsigned long seq = 0;
+    size_t pos = 0;
+    char line[160];
+    struct tm tm;
+    int line_len;
+    int dev;
+
+    for (dev = 0; dev < TELEMETRY_DEVICES; dev++) {
+        temp[dev] = 150 + (int)(next_random(&state) % 200);
+    }
+
+    while (pos < len) {
+        if (seq % 400 == 0) {
+            now += 10;
+            gmtime_r(&now, &tm);
+            line_len = strftime(line, sizeof(line), "timestamp:%a, %d %b %Y %T +0000\n", &tm);
+        } else {
+            dev = next_random(&state) % TELEMETRY_DEVICES;
+            temp[dev] += (int)(next_random(&state) % 5) - 2;
+            line_len = snprintf(line, sizeof(line),
+                                "dev=%08x seq=%lu temp=%d.%d hum=%d rssi=-%d bat=%d status=%s\n",
+                                0x5a000000U + dev * 7919U, seq, temp[dev] / 10, temp[dev] % 10,
+                                30 + (int)(next_random(&state) % 40),
+                                40 + (int)(next_random(&state) % 50),
+                                100 - (int)(seq / 100000) % 100,
+                                statuses[next_random(&state) % 8]);
+        }
+        if ((size_t)line_len > len - pos) {
+            line_len = len - pos;
+        }
+        memcpy(buf + pos, line, line_len);
+        pos += line_len;
+        seq++;
+    }
+}
+
+// Read the history file at path whole, setting *len
+static char *read_corpus(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "rb");
+    char *buf = NULL;
+    long size;
+
+    if (file == NULL) {
+        fprintf(stderr, "Error fopen(%s): %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if ((fseek(file, 0, SEEK_END) == 0) && ((size = ftell(file)) > 0) &&
+        (fseek(file, 0, SEEK_SET) == 0)) {
+        buf = malloc(size);
+        if ((buf != NULL) && (fread(buf, 1, size, file) != (size_t)size)) {
+            free(buf);
+            buf = NULL;
+        }
+        *len = size;
+    }
+    if (buf == NULL) {
+        fprintf(stderr, "Error reading %s\n", path);
+    }
+    fclose(file);
+    return buf;
+}
+
+// Compress a corpus in -s byte blocks as the server compresses cold
+// segments, then decompress it LZ_DECODE_ROUNDS times and keep the fastest
+static int bench_lz(const struct bench_options *opts)
+{
+    size_t len = opts->count * 1024 * 1024;
+    size_t block = opts->packet_size;
+    size_t blocks, bound, comp_total = 0;
+    size_t *comp_len = NULL;
+    char *corpus, *comp = NULL, *out = NULL;
+    double start, compress_s, decode_s = 0;
+    size_t i, off, n;
+    int round;
+    bool ok = true;
+
+    corpus = (opts->corpus_path != NULL) ? read_corpus(opts->corpus_path, &len) : malloc(len);
+    if (corpus == NULL) {
+        return BENCH_FAILURE;
+    }
+    if (opts->corpus_path == NULL) {
+        telemetry_corpus(corpus, len);
+    }
+
+    blocks = (len + block - 1) / block;
+    bound = aesd_lz_bound(block);
+    comp = malloc(blocks * bound);
+    comp_len = calloc(blocks, sizeof(*comp_len));
+    out = malloc(block);
+    if ((comp == NULL) || (comp_len == NULL) || (out == NULL)) {
+        fprintf(stderr, "Error failed to malloc()\n");
+        ok = false;
+    }
+
+    start = now_sec();
+    for (i = 0, off = 0; ok && (i < blocks); i++, off += block) {
+        n = (len - off < block) ? len - off : block;
+        comp_len[i] = aesd_lz_compress(corpus + off, n, comp + i * bound, bound);
+        comp_total += comp_len[i];
+    }
+    compress_s = now_sec() - start;
+
+    for (round = 0; ok && (round < LZ_DECODE_ROUNDS); round++) {
+        start = now_sec();
+        for (i = 0, off = 0; ok && (i < blocks); i++, off += block) {
+            n = (len - off < block) ? len - off : block;
+            ok = (aesd_lz_decompress(comp + i * bound, comp_len[i], out, n) == (ssize_t)n);
+            // Checked on the first round only, outside what it times
+            if (ok && (round == 0)) {
+                double check = now_sec();
+
+                ok = (memcmp(out, corpus + off, n) == 0);
+                start += now_sec() - check;
+            }
+        }
+        if ((round == 0) || (now_sec() - start < decode_s)) {
+            decode_s = now_sec() - start;
+        }
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error block %zu did not decompress to its input\n", i - 1);
+    } else {
+        printf("corpus:         %s, %.1f MiB in %zu blocks of %zu bytes\n",
+                (opts->corpus_path != NULL) ? opts->corpus_path : "generated telemetry",
+                len / 1048576.0, blocks, block);
+        printf("%12s %12s %14s %14s\n", "ratio", "compressed", "compress MB/s",
+                "decode MB/s");
+        printf("%12.2f %12zu %14.1f %14.1f\n", (double)len / comp_total, comp_total,
+                len / compress_s / 1e6, len / decode_s / 1e6);
+    }
+    free(corpus);
+    free(comp);
+    free(comp_len);
+    free(out);
+    return ok ? BENCH_SUCCESS : BENCH_FAILURE;
+}
+
+static void usage(void)
+{
+    printf("Usage: ./aesdbench reply [-a host] [-p port] [-n count] [-P server_pid]\n"
+           "       ./aesdbench transport -u unix_socket_path [-a host] [-p port] [-n count]\n"
+           "       ./aesdbench framing [-a host] [-p port] [-n count] [-s packet_size] [-P server_pid]\n"
+           "       ./aesdbench append [-a host] [-p port] [-n count] [-s packet_size] [-c clients]\n"
+           "       ./aesdbench crc [-n MiB] [-s record_size]\n"
+           "       ./aesdbench lz [-n MiB] [-s block_size] [-f history_file]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options opts = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .count = 100,
+        .server_pid = 0,
+        .unix_path = NULL,
+        .packet_size = DEFAULT_FRAME_SIZE,
+        .clients = 1,
+        .corpus_path = NULL,
+    };
+    const char *benchmark;
+    bool size_given = false;
+    int opt;
+
+    if (argc < 2) {
+        usage();
+        return BENCH_FAILURE;
+    }
+    benchmark = argv[1];
+    optind = 2;
+
+    while ((opt = getopt(argc, argv, "a:p:n:P:u:s:c:f:")) != -1) {
+        switch (opt) {
+        case 'a':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = optarg;
+            break;
+        case 'n':
+            opts.count = strtoul(optarg, NULL, 10);
+            break;
+        case 'P':
+            opts.server_pid = (pid_t)strtol(optarg, NULL, 10);
+            break;
+        case 'u':
+            opts.unix_path = optarg;
+            break;
+        case 's':
+            opts.packet_size = strtoul(optarg, NULL, 10);
+            size_given = true;
+            break;
+        case 'c':
+            opts.clients = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            opts.corpus_path = optarg;
+            break;
+        default:
+            usage();
+            return BENCH_FAILURE;
+        }
+    }
+
+    if ((opts.count == 0) || (opts.clients == 0)) {
+        usage();
+        return BENCH_FAILURE;
+    }
+
+    if (strcmp(benchmark, "reply") == 0) {
+        return bench_reply(&opts);
+    }
+
+    if (strcmp(benchmark, "transport") == 0) {
+        return bench_transport(&opts);
+    }
+
+    if (strcmp(benchmark, "framing") == 0) {
+        return bench_framing(&opts);
+    }
+
+    if (strcmp(benchmark, "crc") == 0) {
+        return bench_crc(&opts);
+    }
+
+    if (strcmp(benchmark, "lz") == 0) {
+        // Blocks as large as the history segments the server compresses
+        if (!size_given) {
+            opts.packet_size = LZ_BLOCK_SIZE;
+        }
+        if (opts.packet_size == 0) {
+            usage();
+            return BENCH_FAILURE;
+        }
+        return bench_lz(&opts);
+    }
+
+    if (strcmp(benchmark, "append") == 0) {
+        if (opts.packet_size < PACKET_SIZE) {
+            fprintf(stderr, "Error append benchmark needs packets of at least %d bytes\n",
+                    PACKET_SIZE);
+            return BENCH_FAILURE;
+        }
+        return bench_append(&opts);
+    }
+
+    usage();
+    return BENCH_FAILURE;
+}
@@ -0,0 +1,154 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesdlaunch.c
+​*​ ​@brief​ Socket activation launcher for aesdsocket
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 16 2026
+*
+* Usage: ./aesdlaunch [-a address] [-p port] [-b backlog] -- server [args...]
+*
+* Binds and listens on every address of port the way a service manager
+* would, then execs the server with the sockets passed by the
+* LISTEN_FDS/LISTEN_PID protocol. Connections made before the server is up
+* wait in the listen backlog instead of being refused.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "aesd-activation.h"
+
+#define LAUNCH_FAILURE      (1)
+#define DEFAULT_PORT        ("9000")
+#define DEFAULT_BACKLOG     (128)
+#define MAX_LISTENERS       (16)
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./aesdlaunch [-a address] [-p port] [-b backlog] -- server [args...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *address = NULL;
+    const char *port = DEFAULT_PORT;
+    int backlog = DEFAULT_BACKLOG;
+    int fds[MAX_LISTENERS];
+    int nfds = 0;
+    int sockopt_yes = 1;
+    char env_str[32];
+    struct addrinfo hints;
+    struct addrinfo *addr_list, *p_ai;
+    int status;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "a:p:b:")) != -1) {
+        switch (opt) {
+        case 'a':
+            address = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        default:
+            usage();
+            return LAUNCH_FAILURE;
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        return LAUNCH_FAILURE;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    status = getaddrinfo(address, port, &hints, &addr_list);
+    if (status != 0) {
+        fprintf(stderr, "Error getaddrinfo(): %s\n", gai_strerror(status));
+        return LAUNCH_FAILURE;
+    }
+
+    for (p_ai = addr_list; (p_ai != NULL) && (nfds < MAX_LISTENERS); p_ai = p_ai->ai_next) {
+        int fd = socket(p_ai->ai_family, p_ai->ai_socktype, p_ai->ai_protocol);
+
+        if (fd == -1) {
+            fprintf(stderr, "Error socket(): %s\n", strerror(errno));
+            continue;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &sockopt_yes, sizeof(sockopt_yes));
+        // Keep IPv6 sockets from claiming the IPv4 port bound next to them
+        if (p_ai->ai_family == AF_INET6) {
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &sockopt_yes, sizeof(sockopt_yes));
+        }
+
+        if ((bind(fd, p_ai->ai_addr, p_ai->ai_addrlen) == -1) || (listen(fd, backlog) == -1)) {
+            fprintf(stderr, "Error bind()/listen(): %s\n", strerror(errno));
+            close(fd);
+            continue;
+        }
+        fds[nfds++] = fd;
+    }
+    freeaddrinfo(addr_list);
+
+    if (nfds == 0) {
+        fprintf(stderr, "Error no address of port %s could be bound\n", port);
+        return LAUNCH_FAILURE;
+    }
+
+    // Move the sockets into place from AESD_LISTEN_FDS_START, going through
+    // descriptors above the range so none is overwritten before it is moved
+    for (i = 0; i < nfds; i++) {
+        int fd = fcntl(fds[i], F_DUPFD, AESD_LISTEN_FDS_START + MAX_LISTENERS);
+
+        if (fd == -1) {
+            fprintf(stderr, "Error fcntl(): %s\n", strerror(errno));
+            return LAUNCH_FAILURE;
+        }
+        close(fds[i]);
+        fds[i] = fd;
+    }
+    for (i = 0; i < nfds; i++) {
+        if (dup2(fds[i], AESD_LISTEN_FDS_START + i) == -1) {
+            fprintf(stderr, "Error dup2(): %s\n", strerror(errno));
+            return LAUNCH_FAILURE;
+        }
+        close(fds[i]);
+    }
+
+    // exec keeps the pid, so the server finds its own pid in LISTEN_PID
+    snprintf(env_str, sizeof(env_str), "%d", nfds);
+    setenv("LISTEN_FDS", env_str, 1);
+    snprintf(env_str, sizeof(env_str), "%d", (int)getpid());
+    setenv("LISTEN_PID", env_str, 1);
+
+    execvp(argv[optind], &argv[optind]);
+    fprintf(stderr, "Error exec %s: %s\n", argv[optind], strerror(errno));
+    return LAUNCH_FAILURE;
+}
@@ -0,0 +1,842 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesdreplay.c
+​*​ ​@brief​ Replay a capture against aesdsocket and report latency percentiles
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* Usage: ./aesdreplay [-a host] [-p port | -u unix_socket_path] [-s speed] capture
+*
+* Drives the client traffic a server recorded with --capture against a
+* server: every connection opens, sends the same bytes and finishes sending
+* at the same point in time as in the capture, divided by speed. A speed of
+* 0 sends everything as fast as the server takes it. Followers in the
+* capture are not replayed.
+*
+* The latency of a packet runs from when its last byte was written until its
+* reply has arrived. Binary framed replies are counted exactly. A newline
+* reply is the history up to its packet, so it is recognised by ending with
+* the last packet sent; a history holding the same line earlier can end the
+* wait early, and the replies to queries are only known to have arrived
+* once the server closes the connection. Replies are timed from when the
+* connection's last byte arrived in that case.
+*
+* Events that ran late against the schedule are reported too, a replay that
+* could not keep up did not reproduce the captured load.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include "aesd-capture.h"
+#include "aesd-frame.h"
+
+#define REPLAY_SUCCESS      (0)
+#define REPLAY_FAILURE      (1)
+#define DEFAULT_HOST        ("localhost")
+#define DEFAULT_PORT        ("9000")
+#define RX_SIZE             (256 * 1024)
+// Bytes of the last packet a newline reply has to end with
+#define TAIL_SIZE           (64)
+// Give up on replies this long after the last event and the last byte read
+#define DRAIN_SEC           (10)
+
+struct replay_options {
+    const char *host;
+    const char *port;
+    const char *unix_path;
+    double speed;
+};
+
+struct frame_parser {
+    char header[AESD_FRAME_VARINT_MAX];
+    size_t header_len;
+    uint64_t payload_left;
+    bool in_payload;
+};
+
+struct replay_conn {
+    int fd;                     // -1 until opened and once closed
+    bool opened;
+    bool shut_pending;          // Finish sending once out is written
+    bool shut;
+    enum aesd_frame_mode framing;  // Unknown until the first bytes are queued
+    size_t magic_left;          // Bytes of the frame magic still to write
+    // Bytes still to write
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    // Times the packets waiting for replies were sent, a ring
+    double *pending;
+    size_t pending_head;
+    size_t pending_count;
+    size_t pending_cap;
+    // Last bytes sent and received, and the end of the newest packet sent
+    char tx_tail[TAIL_SIZE];
+    size_t tx_tail_len;
+    char rx_tail[TAIL_SIZE];
+    size_t rx_tail_len;
+    char packet_tail[TAIL_SIZE];
+    size_t packet_tail_len;
+    struct frame_parser tx_frames;
+    struct frame_parser rx_frames;
+    double last_rx;
+};
+
+// Growing array of samples in seconds
+struct samples {
+    double *values;
+    size_t count;
+    size_t cap;
+};
+
+struct replay_totals {
+    unsigned long connections;
+    unsigned long skipped;
+    unsigned long packets;
+    unsigned long unanswered;
+    unsigned long errors;
+    unsigned long long tx_bytes;
+    unsigned long long rx_bytes;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static bool samples_add(struct samples *samples, double value)
+{
+    if (samples->count == samples->cap) {
+        size_t cap = (samples->cap == 0) ? 1024 : samples->cap * 2;
+        double *grown = realloc(samples->values, cap * sizeof(double));
+
+        if (grown == NULL) {
+            return false;
+        }
+        samples->values = grown;
+        samples->cap = cap;
+    }
+    samples->values[samples->count++] = value;
+    return true;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da > db) - (da < db);
+}
+
+// Sorts samples, then the value below which fraction of them fall
+static double percentile(struct samples *samples, double fraction)
+{
+    size_t i;
+
+    if (samples->count == 0) {
+        return 0;
+    }
+    if (fraction == 0) {
+        qsort(samples->values, samples->count, sizeof(double), compare_double);
+    }
+    i = (size_t)(fraction * samples->count);
+    return samples->values[(i < samples->count) ? i : samples->count - 1];
+}
+
+// Open a TCP connection to host:port, or to the unix socket at unix_path
+static int connect_server(const struct replay_options *opts)
+{
+    struct addrinfo hints;
+    struct addrinfo *addr_list, *p_ai;
+    struct sockaddr_un addr;
+    int fd = -1;
+    int status;
+
+    if (opts->unix_path != NULL) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", opts->unix_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if ((fd != -1) && (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    status = getaddrinfo(opts->host, opts->port, &hints, &addr_list);
+    if (status != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (p_ai = addr_list; p_ai != NULL; p_ai = p_ai->ai_next) {
+        fd = socket(p_ai->ai_family, p_ai->ai_socktype, p_ai->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, p_ai->ai_addr, p_ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addr_list);
+    return fd;
+}
+
+// Feed len bytes to a frame parser, returns how many frames they completed
+// or -1 on a malformed header
+static long frames_completed(struct frame_parser *parser, const char *buf, size_t len)
+{
+    long frames = 0;
+    size_t i, take;
+    int status;
+
+    for (i = 0; i < len; i += take) {
+        if (parser->in_payload) {
+            take = (parser->payload_left < len - i) ? parser->payload_left : len - i;
+            parser->payload_left -= take;
+            if (parser->payload_left == 0) {
+                parser->in_payload = false;
+                frames++;
+            }
+            continue;
+        }
+
+        take = 1;
+        parser->header[parser->header_len++] = buf[i];
+        status = aesd_frame_get_varint(parser->header, parser->header_len,
+                                        &parser->payload_left);
+        if (status == -1) {
+            return -1;
+        }
+        if (status > 0) {
+            parser->header_len = 0;
+            if (parser->payload_left == 0) {
+                frames++;
+            } else {
+                parser->in_payload = true;
+            }
+        }
+    }
+    return frames;
+}
+
+// Keep the last TAIL_SIZE bytes of a stream in tail
+static void tail_update(char *tail, size_t *tail_len, const char *buf, size_t len)
+{
+    size_t keep;
+
+    if (len >= TAIL_SIZE) {
+        memcpy(tail, buf + len - TAIL_SIZE, TAIL_SIZE);
+        *tail_len = TAIL_SIZE;
+        return;
+    }
+    keep = (*tail_len + len > TAIL_SIZE) ? TAIL_SIZE - len : *tail_len;
+    memmove(tail, tail + *tail_len - keep, keep);
+    memcpy(tail + keep, buf, len);
+    *tail_len = keep + len;
+}
+
+static bool pending_push(struct replay_conn *conn, double sent_at)
+{
+    if (conn->pending_count == conn->pending_cap) {
+        size_t cap = (conn->pending_cap == 0) ? 16 : conn->pending_cap * 2;
+        double *grown = malloc(cap * sizeof(double));
+        size_t i;
+
+        if (grown == NULL) {
+            return false;
+        }
+        for (i = 0; i < conn->pending_count; i++) {
+            grown[i] = conn->pending[(conn->pending_head + i) % conn->pending_cap];
+        }
+        free(conn->pending);
+        conn->pending = grown;
+        conn->pending_head = 0;
+        conn->pending_cap = cap;
+    }
+    conn->pending[(conn->pending_head + conn->pending_count) % conn->pending_cap] = sent_at;
+    conn->pending_count++;
+    return true;
+}
+
+// Time the oldest count packets waiting as answered at now
+static bool pending_answer(struct replay_conn *conn, size_t count, double now,
+                            struct samples *latency)
+{
+    while ((count-- > 0) && (conn->pending_count > 0)) {
+        if (!samples_add(latency, now - conn->pending[conn->pending_head])) {
+            return false;
+        }
+        conn->pending_head = (conn->pending_head + 1) % conn->pending_cap;
+        conn->pending_count--;
+    }
+    return true;
+}
+
+// Account for len bytes just written, every packet they end starts waiting
+static bool conn_sent(struct replay_conn *conn, const char *buf, size_t len, double now,
+                        struct replay_totals *totals)
+{
+    const char *p_end;
+    long frames;
+    size_t n;
+
+    if (conn->framing == AESD_FRAME_BINARY) {
+        n = (conn->magic_left < len) ? conn->magic_left : len;
+        conn->magic_left -= n;
+        frames = frames_completed(&conn->tx_frames, buf + n, len - n);
+        if (frames == -1) {
+            return false;
+        }
+        while (frames-- > 0) {
+            if (!pending_push(conn, now)) {
+                return false;
+            }
+            totals->packets++;
+        }
+        return true;
+    }
+
+    while (len > 0) {
+        p_end = memchr(buf, '\n', len);
+        n = (p_end == NULL) ? len : (size_t)(p_end - buf) + 1;
+        tail_update(conn->tx_tail, &conn->tx_tail_len, buf, n);
+        if (p_end != NULL) {
+            // Tails only reach back to the start of their own packet
+            memcpy(conn->packet_tail, conn->tx_tail, conn->tx_tail_len);
+            conn->packet_tail_len = conn->tx_tail_len;
+            conn->tx_tail_len = 0;
+            if (!pending_push(conn, now)) {
+                return false;
+            }
+            totals->packets++;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Write as much of out as the socket takes, then finish sending if due.
+// Returns false if the connection failed.
+static bool conn_flush(struct replay_conn *conn, struct replay_totals *totals)
+{
+    ssize_t tx_bytes;
+
+    // Held back until the first bytes show how to count packets
+    if (conn->framing == AESD_FRAME_UNKNOWN) {
+        if (!conn->shut_pending) {
+            return true;
+        }
+        conn->framing = AESD_FRAME_NEWLINE;
+    }
+
+    while (conn->out_len > 0) {
+        tx_bytes = send(conn->fd, conn->out, conn->out_len, MSG_NOSIGNAL);
+        if (tx_bytes == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (!conn_sent(conn, conn->out, tx_bytes, now_sec(), totals)) {
+            return false;
+        }
+        totals->tx_bytes += tx_bytes;
+        conn->out_len -= tx_bytes;
+        memmove(conn->out, conn->out + tx_bytes, conn->out_len);
+    }
+    if (conn->shut_pending && !conn->shut) {
+        shutdown(conn->fd, SHUT_WR);
+        conn->shut = true;
+    }
+    return true;
+}
+
+static bool conn_queue(struct replay_conn *conn, const char *buf, size_t len)
+{
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = (conn->out_cap == 0) ? RX_SIZE : conn->out_cap;
+        char *grown;
+
+        while (cap < conn->out_len + len) {
+            cap *= 2;
+        }
+        grown = realloc(conn->out, cap);
+        if (grown == NULL) {
+            return false;
+        }
+        conn->out = grown;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, buf, len);
+    conn->out_len += len;
+    return true;
+}
+
+// Read what the server sent and time the packets it answered. Returns
+// false once the connection is done.
+static bool conn_receive(struct replay_conn *conn, char *rx_buffer, struct samples *latency,
+                            struct replay_totals *totals)
+{
+    ssize_t rx_bytes;
+    long frames;
+    double now;
+
+    while (1) {
+        rx_bytes = recv(conn->fd, rx_buffer, RX_SIZE, 0);
+        if (rx_bytes == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return true;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            totals->errors++;
+            return false;
+        }
+        if (rx_bytes == 0) {
+            // Whatever is still waiting was answered by the last bytes read,
+            // if they arrived after the newest packet was sent
+            if ((conn->pending_count > 0) &&
+                (conn->last_rx >= conn->pending[(conn->pending_head + conn->pending_count - 1) %
+                                                conn->pending_cap])) {
+                pending_answer(conn, conn->pending_count, conn->last_rx, latency);
+            }
+            totals->unanswered += conn->pending_count;
+            conn->pending_count = 0;
+            return false;
+        }
+
+        now = now_sec();
+        conn->last_rx = now;
+        totals->rx_bytes += rx_bytes;
+
+        if (conn->framing == AESD_FRAME_BINARY) {
+            frames = frames_completed(&conn->rx_frames, rx_buffer, rx_bytes);
+            if ((frames == -1) || !pending_answer(conn, frames, now, latency)) {
+                totals->errors++;
+                return false;
+            }
+            continue;
+        }
+
+        // A reply ending with the newest packet answers every packet before it
+        tail_update(conn->rx_tail, &conn->rx_tail_len, rx_buffer, rx_bytes);
+        if ((conn->pending_count > 0) && (conn->packet_tail_len > 0) &&
+            (conn->rx_tail_len >= conn->packet_tail_len) &&
+            (memcmp(conn->rx_tail + conn->rx_tail_len - conn->packet_tail_len,
+                    conn->packet_tail, conn->packet_tail_len) == 0) &&
+            !pending_answer(conn, conn->pending_count, now, latency)) {
+            totals->errors++;
+            return false;
+        }
+    }
+}
+
+static void conn_close(struct replay_conn *conn)
+{
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    free(conn->out);
+    free(conn->pending);
+    conn->out = NULL;
+    conn->pending = NULL;
+    conn->out_len = 0;
+    conn->out_cap = 0;
+    conn->pending_cap = 0;
+}
+
+// Carry out one captured event
+static bool replay_event(const struct replay_options *opts, const struct aesd_capture_record *rec,
+                            struct replay_conn *conn, struct replay_totals *totals)
+{
+    int fd_flags;
+
+    switch (rec->type) {
+    case AESD_CAPTURE_OPEN:
+        if (conn->opened) {
+            return true;
+        }
+        conn->opened = true;
+        conn->fd = connect_server(opts);
+        if (conn->fd == -1) {
+            fprintf(stderr, "Error connecting connection %llu: %s\n",
+                    (unsigned long long)rec->conn, strerror(errno));
+            totals->errors++;
+            return true;
+        }
+        fd_flags = fcntl(conn->fd, F_GETFL);
+        fcntl(conn->fd, F_SETFL, fd_flags | O_NONBLOCK);
+        totals->connections++;
+        // Handed over mid-connection, the previous server read the magic
+        if (rec->flags & AESD_CAPTURE_FRAMED) {
+            conn->framing = AESD_FRAME_BINARY;
+            conn->magic_left = AESD_FRAME_MAGIC_LEN;
+            return conn_queue(conn, AESD_FRAME_MAGIC, AESD_FRAME_MAGIC_LEN);
+        }
+        return true;
+
+    case AESD_CAPTURE_DATA:
+        if (conn->fd == -1) {
+            return true;
+        }
+        if (!conn_queue(conn, rec->data, rec->len)) {
+            return false;
+        }
+
+        // Nothing is written before the first bytes tell a follower or a
+        // binary framed client apart, so out still starts with them
+        if (conn->framing == AESD_FRAME_UNKNOWN) {
+            conn->framing = aesd_frame_detect(conn->out, conn->out_len);
+            if (conn->framing == AESD_FRAME_REPLICA) {
+                totals->connections--;
+                totals->skipped++;
+                conn_close(conn);
+                return true;
+            }
+            if (conn->framing == AESD_FRAME_BINARY) {
+                conn->magic_left = AESD_FRAME_MAGIC_LEN;
+            }
+        }
+        break;
+
+    case AESD_CAPTURE_SHUT:
+    case AESD_CAPTURE_CLOSE:
+        // A client the server closed on still finishes sending, so the
+        // server finishes its replies and closes this one too
+        if (conn->fd == -1) {
+            return true;
+        }
+        conn->shut_pending = true;
+        break;
+
+    default:
+        return true;
+    }
+
+    // A connection the server dropped is an error, not the end of the replay
+    if (!conn_flush(conn, totals)) {
+        totals->errors++;
+        conn_close(conn);
+    }
+    return true;
+}
+
+// Read the capture at path whole, setting *len
+static char *read_capture(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "rb");
+    char *buf = NULL;
+    long size;
+
+    if (file == NULL) {
+        fprintf(stderr, "Error fopen(%s): %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if ((fseek(file, 0, SEEK_END) == 0) && ((size = ftell(file)) > 0) &&
+        (fseek(file, 0, SEEK_SET) == 0)) {
+        buf = malloc(size);
+        if ((buf != NULL) && (fread(buf, 1, size, file) != (size_t)size)) {
+            free(buf);
+            buf = NULL;
+        }
+        *len = size;
+    }
+    if (buf == NULL) {
+        fprintf(stderr, "Error reading %s\n", path);
+    }
+    fclose(file);
+    return buf;
+}
+
+// Parse every record of the capture in buf, returns the count or -1
+static long parse_capture(const char *buf, size_t len, struct aesd_capture_record **records,
+                            uint64_t *max_conn)
+{
+    const struct aesd_capture_header *header = (const void *)buf;
+    struct aesd_capture_record *list = NULL;
+    size_t pos = sizeof(*header);
+    size_t count = 0, cap = 0;
+    uint64_t clock_us = 0;
+    ssize_t status;
+
+    if ((len < sizeof(*header)) ||
+        (memcmp(header->magic, AESD_CAPTURE_MAGIC, sizeof(header->magic)) != 0)) {
+        fprintf(stderr, "Error not a capture file\n");
+        return -1;
+    }
+
+    *max_conn = 0;
+    while (pos < len) {
+        if (count == cap) {
+            struct aesd_capture_record *grown;
+
+            cap = (cap == 0) ? 4096 : cap * 2;
+            grown = realloc(list, cap * sizeof(*list));
+            if (grown == NULL) {
+                free(list);
+                fprintf(stderr, "Error failed to malloc()\n");
+                return -1;
+            }
+            list = grown;
+        }
+        status = aesd_capture_parse(buf + pos, len - pos, &clock_us, &list[count]);
+        if (status == -1) {
+            fprintf(stderr, "Error malformed record at %zu\n", pos);
+            free(list);
+            return -1;
+        }
+        if (status == 0) {
+            // Cut off, the server was still writing or was killed
+            fprintf(stderr, "Capture ends in a partial record at %zu\n", pos);
+            break;
+        }
+        if (list[count].conn > *max_conn) {
+            *max_conn = list[count].conn;
+        }
+        pos += status;
+        count++;
+    }
+    *records = list;
+    return count;
+}
+
+static int replay(const struct replay_options *opts, const struct aesd_capture_record *records,
+                    size_t record_count, uint64_t max_conn)
+{
+    struct replay_conn *conns = calloc(max_conn + 1, sizeof(*conns));
+    struct pollfd *pollfds = calloc(max_conn + 1, sizeof(*pollfds));
+    uint64_t *poll_conns = calloc(max_conn + 1, sizeof(*poll_conns));
+    char *rx_buffer = malloc(RX_SIZE);
+    struct samples latency = { NULL, 0, 0 };
+    struct samples slip = { NULL, 0, 0 };
+    struct replay_totals totals;
+    double duration = 0, start, now, due, last_progress;
+    size_t next = 0;
+    size_t nfds, i;
+    uint64_t c;
+    int timeout_ms;
+    bool ok = true;
+
+    memset(&totals, 0, sizeof(totals));
+    if ((conns == NULL) || (pollfds == NULL) || (poll_conns == NULL) || (rx_buffer == NULL)) {
+        fprintf(stderr, "Error failed to malloc()\n");
+        ok = false;
+    }
+    for (c = 0; ok && (c <= max_conn); c++) {
+        conns[c].fd = -1;
+    }
+    if (record_count > 0) {
+        duration = records[record_count - 1].time_us / 1e6;
+    }
+
+    start = now_sec();
+    last_progress = start;
+    while (ok) {
+        now = now_sec();
+
+        // Everything due by now, then wait for replies until the next event
+        while (ok && (next < record_count)) {
+            due = start + ((opts->speed > 0) ? records[next].time_us / 1e6 / opts->speed : 0);
+            if (due > now) {
+                break;
+            }
+            ok = samples_add(&slip, now - due) &&
+                    replay_event(opts, &records[next], &conns[records[next].conn], &totals);
+            next++;
+            last_progress = now;
+        }
+
+        nfds = 0;
+        for (c = 1; ok && (c <= max_conn); c++) {
+            if (conns[c].fd == -1) {
+                continue;
+            }
+            pollfds[nfds].fd = conns[c].fd;
+            pollfds[nfds].events = POLLIN | ((conns[c].out_len > 0) ? POLLOUT : 0);
+            pollfds[nfds].revents = 0;
+            poll_conns[nfds++] = c;
+        }
+        if (!ok || ((next == record_count) && (nfds == 0))) {
+            break;
+        }
+        if ((next == record_count) && (now - last_progress > DRAIN_SEC)) {
+            fprintf(stderr, "Giving up on %zu connections still open\n", nfds);
+            break;
+        }
+
+        timeout_ms = 1000;
+        if (next < record_count) {
+            due = start + ((opts->speed > 0) ? records[next].time_us / 1e6 / opts->speed : 0);
+            timeout_ms = (due > now) ? (int)((due - now) * 1e3) : 0;
+        }
+        if ((poll(pollfds, nfds, timeout_ms) == -1) && (errno != EINTR)) {
+            fprintf(stderr, "Error poll(): %s\n", strerror(errno));
+            ok = false;
+            break;
+        }
+
+        for (i = 0; ok && (i < nfds); i++) {
+            struct replay_conn *conn = &conns[poll_conns[i]];
+
+            if (pollfds[i].revents & POLLOUT) {
+                if (!conn_flush(conn, &totals)) {
+                    totals.errors++;
+                    conn_close(conn);
+                    continue;
+                }
+            }
+            if (pollfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                last_progress = now_sec();
+                if (!conn_receive(conn, rx_buffer, &latency, &totals)) {
+                    conn_close(conn);
+                }
+            }
+        }
+    }
+    now = now_sec();
+
+    for (c = 0; (conns != NULL) && (c <= max_conn); c++) {
+        totals.unanswered += conns[c].pending_count;
+        conn_close(&conns[c]);
+    }
+
+    if (ok) {
+        printf("capture:        %zu records, %lu connections (%lu followers skipped) over %.3f s\n",
+                record_count, totals.connections, totals.skipped, duration);
+        printf("replay:         %.3f s at %s, %.1f%% of the captured rate\n", now - start,
+                (opts->speed > 0) ? "the scheduled speed" : "full speed",
+                (now > start) ? 100.0 * duration / (now - start) : 0);
+        printf("traffic:        %llu bytes sent, %llu bytes received\n", totals.tx_bytes,
+                totals.rx_bytes);
+        printf("packets:        %lu sent, %zu timed, %lu unanswered, %lu errors\n",
+                totals.packets, latency.count, totals.unanswered, totals.errors);
+        printf("%-10s %10s %10s %10s %10s %10s\n", "us", "p50", "p90", "p99", "p99.9", "max");
+        if (latency.count > 0) {
+            percentile(&latency, 0);
+            printf("%-10s %10.0f %10.0f %10.0f %10.0f %10.0f\n", "latency",
+                    percentile(&latency, 0.5) * 1e6, percentile(&latency, 0.9) * 1e6,
+                    percentile(&latency, 0.99) * 1e6, percentile(&latency, 0.999) * 1e6,
+                    latency.values[latency.count - 1] * 1e6);
+        }
+        if (slip.count > 0) {
+            percentile(&slip, 0);
+            printf("%-10s %10.0f %10.0f %10.0f %10.0f %10.0f\n", "late by",
+                    percentile(&slip, 0.5) * 1e6, percentile(&slip, 0.9) * 1e6,
+                    percentile(&slip, 0.99) * 1e6, percentile(&slip, 0.999) * 1e6,
+                    slip.values[slip.count - 1] * 1e6);
+        }
+    }
+
+    free(conns);
+    free(pollfds);
+    free(poll_conns);
+    free(rx_buffer);
+    free(latency.values);
+    free(slip.values);
+    return ok ? REPLAY_SUCCESS : REPLAY_FAILURE;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./aesdreplay [-a host] [-p port | -u unix_socket_path] "
+                    "[-s speed] capture\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay_options opts = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .unix_path = NULL,
+        .speed = 1,
+    };
+    struct aesd_capture_record *records = NULL;
+    uint64_t max_conn = 0;
+    char *capture;
+    size_t len = 0;
+    long count;
+    char *p_end = NULL;
+    int status;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:p:u:s:")) != -1) {
+        switch (opt) {
+        case 'a':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = optarg;
+            break;
+        case 'u':
+            opts.unix_path = optarg;
+            break;
+        case 's':
+            opts.speed = strtod(optarg, &p_end);
+            if ((*p_end != '\0') || (opts.speed < 0)) {
+                usage();
+                return REPLAY_FAILURE;
+            }
+            break;
+        default:
+            usage();
+            return REPLAY_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return REPLAY_FAILURE;
+    }
+
+    capture = read_capture(argv[optind], &len);
+    if (capture == NULL) {
+        return REPLAY_FAILURE;
+    }
+    count = parse_capture(capture, len, &records, &max_conn);
+    if (count == -1) {
+        free(capture);
+        return REPLAY_FAILURE;
+    }
+
+    status = replay(&opts, records, count, max_conn);
+    free(records);
+    free(capture);
+    return status;
+}
@@ -22,6 +22,8 @@
 *    authored by, Robert Love 
 */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <stdio.h>
@@ -29,7 +31,10 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdarg.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <signal.h>
@@ -37,8 +42,36 @@
 #include <pthread.h>
 #include <sys/queue.h>
 #include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <limits.h>
 
 #include "aesd_ioctl.h"
+#include "aesd-sendq.h"
+#include "aesd-ratelimit.h"
+#include "aesd-fairq.h"
+#include "aesd-admission.h"
+#include "aesd-timerwheel.h"
+#include "aesd-handoff.h"
+#include "aesd-activation.h"
+#include "aesd-history.h"
+#include "aesd-frame.h"
+#include "aesd-checksum.h"
+#include "aesd-crc32c.h"
+#include "aesd-cold.h"
+#include "aesd-replica.h"
+#include "aesd-capture.h"
+#include "aesd-trace.h"
+#include "aesd-prof.h"
+#include "aesd-statpage.h"
+#include "aesd-lock.h"
 
 // FreeBSD Macro for safe slist looping
 // Copied from: https://github.com/stockrt/queue.h/blob/master/queue.h
@@ -60,38 +93,347 @@
 #define READ_SIZE           (1024)
 #define WRITE_SIZE          (1024)
 #define AESD_IOCTL_PREFIX_LEN (19)
+#define AESD_QUERY_PREFIX   ("AESDQUERY:")
+#define AESD_QUERY_PREFIX_LEN (10)
+#define QUERY_MAX_LEN       (256)
+#define REPLY_CHUNK_SIZE    (AESD_SENDQ_CHUNK_SIZE)
+#define DEFAULT_SENDQ_HWM   (64 * 1024 * 1024)
+#define ZEROCOPY_DRAIN_MS   (1000)
+#define MAIN_TICK_MS        (100)
+#define ADMISSION_SAMPLE_MS (1000)
+#define DEFER_POLL_MS       (100)
+#define CLIENT_STACK_SIZE   (256 * 1024)
+#define CONN_FDS            (2)     // Socket and data file of each connection
+#define RESERVED_FDS        (64)    // Listeners, history, upgrade and the like
+#define MAX_LISTENERS       (16)
+#define DEFAULT_IDLE_MS     (300 * 1000)
+#define DEFAULT_HEADER_MS   (60 * 1000)
+#define DEFAULT_REPLY_MS    (300 * 1000)
+#define DEFAULT_SHM_SIZE    (4 * 1024 * 1024)
+#define MAX_FRAME_PAYLOAD   (64 * 1024 * 1024)
+#define DEFAULT_SYNC_MS     (100)
+#define MAX_FOLLOWER_STATS  (16)
+#define MAX_TRACE_EVENTS    (1024 * 1024)
+#define DEFAULT_PROFILE_HZ  (99)
+#define MAX_LOCK_STATS      (16)
+#define STATS_PAGE_MS       (250)
+#define DUMP_NAME           ("aesdsocket")
+#define TOP_CONNS           (5)     // stat_fields lists each rank
+
+// Per-connection deadlines tracked on the timer wheel
+enum conn_deadline {
+    DEADLINE_IDLE,      // Nothing received, buffered or queued
+    DEADLINE_HEADER,    // Part of a packet received but no newline yet
+    DEADLINE_REPLY,     // Queued reply making no progress
+    CONN_DEADLINES,
+};
+
+static const char *deadline_names[CONN_DEADLINES] = { "idle", "header", "reply" };
+
+static const char *durability_names[] = { "none", "periodic", "batch" };
+
+// Fields of each rank in the stats page list of connections using the most CPU
+enum conn_top_field {
+    CONN_TOP_PEER,
+    CONN_TOP_CPU_NS,
+    CONN_TOP_BUFFERED,
+    CONN_TOP_RX_PEAK,
+    CONN_TOP_REPLY_BYTES,
+    CONN_TOP_FIELDS,
+};
+
+// Counters published with --stats-page. Version 1 of the page layout: new
+// fields only ever go at the end.
+enum stat_field {
+    STAT_CONNECTIONS,
+    STAT_ACCEPTED,
+    STAT_QUEUED_BYTES,
+    STAT_SHED_PRESSURE,
+    STAT_SHED_CONNECTIONS,
+    STAT_SHED_QUEUED,
+    STAT_REPLIES_DEFERRED,
+    STAT_SHEDDING,
+    STAT_DEFERRING,
+    STAT_PRESSURE_CPU,
+    STAT_PRESSURE_MEMORY,
+    STAT_PRESSURE_IO,
+    STAT_HISTORY_RECORDS,
+    STAT_HISTORY_START,
+    STAT_HISTORY_END,
+    STAT_HISTORY_DROPPED,
+    STAT_HISTORY_SEGMENTS,
+    STAT_DURABLE,
+    STAT_APPENDS,
+    STAT_DURABLE_APPENDS,
+    STAT_SYNCS,
+    STAT_SYNC_US_TOTAL,
+    STAT_SYNC_US_MAX,
+    STAT_SYNC_FAILED,
+    STAT_COLD_BLOCKS,
+    STAT_COLD_RAW_BYTES,
+    STAT_COLD_COMP_BYTES,
+    STAT_COLD_DECODES,
+    STAT_COLD_CRC_ERRORS,
+    STAT_CAPTURE_RECORDS,
+    STAT_CAPTURE_DROPPED,
+    STAT_REPLICA_CONNECTED,
+    STAT_REPLICA_APPLIED,
+    STAT_REPLICA_LEADER_END,
+    STAT_REPLICA_CONNECTS,
+    STAT_FOLLOWERS,
+    STAT_TRACE_EVENTS,
+    STAT_PROFILE_SAMPLES,
+    STAT_PROFILE_DROPPED,
+    STAT_CONN_TOP,
+    STAT_FIELDS = STAT_CONN_TOP + TOP_CONNS * CONN_TOP_FIELDS,
+};
+
+#define CONN_TOP_FIELD(rank, field)     (STAT_CONN_TOP + ((rank) - 1) * CONN_TOP_FIELDS + (field))
+#define CONN_TOP_DESCS(rank) \
+    [CONN_TOP_FIELD(rank, CONN_TOP_PEER)] = { "conn.top." #rank ".peer", AESD_STAT_TEXT }, \
+    [CONN_TOP_FIELD(rank, CONN_TOP_CPU_NS)] = { "conn.top." #rank ".cpu_ns", AESD_STAT_GAUGE }, \
+    [CONN_TOP_FIELD(rank, CONN_TOP_BUFFERED)] = { "conn.top." #rank ".buffered", AESD_STAT_GAUGE }, \
+    [CONN_TOP_FIELD(rank, CONN_TOP_RX_PEAK)] = { "conn.top." #rank ".rx_peak", AESD_STAT_GAUGE }, \
+    [CONN_TOP_FIELD(rank, CONN_TOP_REPLY_BYTES)] = { "conn.top." #rank ".reply_bytes", \
+                                                        AESD_STAT_GAUGE }
+
+static const struct aesd_statpage_desc stat_fields[STAT_FIELDS] = {
+    [STAT_CONNECTIONS] = { "connections", AESD_STAT_GAUGE },
+    [STAT_ACCEPTED] = { "accepted", AESD_STAT_COUNTER },
+    [STAT_QUEUED_BYTES] = { "queued_bytes", AESD_STAT_GAUGE },
+    [STAT_SHED_PRESSURE] = { "shed.pressure", AESD_STAT_COUNTER },
+    [STAT_SHED_CONNECTIONS] = { "shed.connections", AESD_STAT_COUNTER },
+    [STAT_SHED_QUEUED] = { "shed.queued", AESD_STAT_COUNTER },
+    [STAT_REPLIES_DEFERRED] = { "replies_deferred", AESD_STAT_COUNTER },
+    [STAT_SHEDDING] = { "shedding", AESD_STAT_GAUGE },
+    [STAT_DEFERRING] = { "deferring", AESD_STAT_GAUGE },
+    [STAT_PRESSURE_CPU] = { "pressure.cpu.avg10", AESD_STAT_REAL },
+    [STAT_PRESSURE_MEMORY] = { "pressure.memory.avg10", AESD_STAT_REAL },
+    [STAT_PRESSURE_IO] = { "pressure.io.avg10", AESD_STAT_REAL },
+    [STAT_HISTORY_RECORDS] = { "history.records", AESD_STAT_GAUGE },
+    [STAT_HISTORY_START] = { "history.start", AESD_STAT_GAUGE },
+    [STAT_HISTORY_END] = { "history.end", AESD_STAT_COUNTER },
+    [STAT_HISTORY_DROPPED] = { "history.records_dropped", AESD_STAT_COUNTER },
+    [STAT_HISTORY_SEGMENTS] = { "history.segments", AESD_STAT_GAUGE },
+    [STAT_DURABLE] = { "durability.durable", AESD_STAT_COUNTER },
+    [STAT_APPENDS] = { "durability.appends", AESD_STAT_COUNTER },
+    [STAT_DURABLE_APPENDS] = { "durability.durable_appends", AESD_STAT_COUNTER },
+    [STAT_SYNCS] = { "durability.syncs", AESD_STAT_COUNTER },
+    [STAT_SYNC_US_TOTAL] = { "durability.sync_us_total", AESD_STAT_COUNTER },
+    [STAT_SYNC_US_MAX] = { "durability.sync_us_max", AESD_STAT_GAUGE },
+    [STAT_SYNC_FAILED] = { "durability.sync_failed", AESD_STAT_GAUGE },
+    [STAT_COLD_BLOCKS] = { "cold.blocks", AESD_STAT_GAUGE },
+    [STAT_COLD_RAW_BYTES] = { "cold.raw_bytes", AESD_STAT_GAUGE },
+    [STAT_COLD_COMP_BYTES] = { "cold.comp_bytes", AESD_STAT_GAUGE },
+    [STAT_COLD_DECODES] = { "cold.decodes", AESD_STAT_COUNTER },
+    [STAT_COLD_CRC_ERRORS] = { "cold.crc_errors", AESD_STAT_COUNTER },
+    [STAT_CAPTURE_RECORDS] = { "capture.records", AESD_STAT_COUNTER },
+    [STAT_CAPTURE_DROPPED] = { "capture.dropped", AESD_STAT_COUNTER },
+    [STAT_REPLICA_CONNECTED] = { "replica.connected", AESD_STAT_GAUGE },
+    [STAT_REPLICA_APPLIED] = { "replica.applied", AESD_STAT_COUNTER },
+    [STAT_REPLICA_LEADER_END] = { "replica.leader_end", AESD_STAT_COUNTER },
+    [STAT_REPLICA_CONNECTS] = { "replica.connects", AESD_STAT_COUNTER },
+    [STAT_FOLLOWERS] = { "followers", AESD_STAT_GAUGE },
+    [STAT_TRACE_EVENTS] = { "trace.events", AESD_STAT_COUNTER },
+    [STAT_PROFILE_SAMPLES] = { "profile.samples", AESD_STAT_GAUGE },
+    [STAT_PROFILE_DROPPED] = { "profile.dropped", AESD_STAT_COUNTER },
+    CONN_TOP_DESCS(1),
+    CONN_TOP_DESCS(2),
+    CONN_TOP_DESCS(3),
+    CONN_TOP_DESCS(4),
+    CONN_TOP_DESCS(5),
+};
+
+// What to do with a client whose send queue would pass the high-water mark
+enum send_policy {
+    SEND_POLICY_DROP,       // Close the connection
+    SEND_POLICY_TRUNCATE,   // Send only the part of the reply that fits
+};
+
+struct server_config {
+    bool daemon;
+    size_t sendq_hwm;
+    enum send_policy send_policy;
+    size_t zerocopy_threshold;  // 0 disables MSG_ZEROCOPY replies
+    double conn_rates[AESD_RL_DIRS];    // Bytes/sec per connection, 0 is unlimited
+    double source_rates[AESD_RL_DIRS];  // Bytes/sec per source address
+    struct aesd_admission_config admission;
+    uint64_t timeouts_ms[CONN_DEADLINES];   // 0 disables a deadline
+    const char *listen_addrs[MAX_LISTENERS];    // ADDR[:PORT], every address if none
+    int listen_addr_count;
+    const char *unix_path;      // Unix domain stream socket for local clients
+    const char *shm_path;       // Unix socket handing out the history mirror
+    size_t shm_size;            // History mirror ring size in bytes
+    struct aesd_history_retention retention;    // What the history keeps
+    enum aesd_durability durability;    // When appends are synced to disk
+    unsigned int sync_period_ms;        // Periodic mode sync interval
+    bool checksums;             // CRC32C sidecar, torn tail recovery at start
+    const char *data_path;      // History data file
+    const char *follow;         // Leader to replicate, ADDR[:PORT] or unix socket path
+    char follow_host[NI_MAXHOST];
+    char follow_port[NI_MAXSERV];
+    const char *capture_path;   // Client traffic recorded for aesdreplay
+    uint64_t capture_limit;     // Capture file size limit, 0 is unlimited
+    size_t trace_events;        // Stage trace ring size per connection, 0 is off
+    const char *dump_dir;       // Where traces and profiles are written, none are without it
+    bool lock_profile;          // Profile lock contention from the start
+    unsigned int profile_hz;    // CPU profile samples per second from the start, 0 is off
+    const char *stats_page;     // Shared memory file the counters are published in
+};
+
+struct server_config config = {
+    .daemon = false,
+    .sendq_hwm = DEFAULT_SENDQ_HWM,
+    .send_policy = SEND_POLICY_DROP,
+    .zerocopy_threshold = 0,
+    .timeouts_ms = { DEFAULT_IDLE_MS, DEFAULT_HEADER_MS, DEFAULT_REPLY_MS },
+    .shm_size = DEFAULT_SHM_SIZE,
+    .durability = AESD_DURABILITY_NONE,
+    .sync_period_ms = DEFAULT_SYNC_MS,
+    .data_path = TMP_FILE,
+};
 
 bool exit_status = false;
-int socket_fd = 0;
-bool socket_connected = false;
+volatile sig_atomic_t dump_stats = false;
+volatile sig_atomic_t upgrade_requested = false;
+volatile sig_atomic_t promote_requested = false;
+volatile sig_atomic_t dump_trace = false;
+// A follower serves replies and queries but appends only what its leader sends
+bool read_only = false;
+// Listening sockets, all served by the main loop. Entries stay in place
+// once closed so connections keep counting against their listener.
+struct listener {
+    int fd;                             // -1 once closed
+    struct sockaddr_storage addr;
+    char name[sizeof(((struct sockaddr_un*)0)->sun_path) + 8];  // For logs and stats
+    bool owned;                         // Unix socket path is removed on exit
+    bool history;                       // Hands out the history mirror, no client threads
+    unsigned int active;
+    unsigned long connections;
+    unsigned long long rx_bytes;
+    unsigned long long tx_bytes;
+};
+
+struct listener listeners[MAX_LISTENERS];
+int listener_count = 0;
 bool syslog_open = false;
 bool tmp_file_exists = false;
-pthread_mutex_t thread_mutex;
+struct aesd_lock thread_mutex;
 bool mutex_active = false;
 
+// Holds the deadline timer of every connection, advanced by the main loop
+struct aesd_timerwheel conn_wheel;
+bool conn_wheel_active = false;
+
+// Orders client appends between source addresses ahead of thread_mutex
+struct aesd_fairq append_queue;
+bool append_queue_active = false;
+
+// Hot upgrade state. The binary path is resolved at startup so an upgrade
+// execs whatever has since been installed there.
+char exe_path[PATH_MAX];
+char **server_argv = NULL;
+int handoff_chan = -1;          // Channel to the other server during an upgrade
+pid_t handoff_pid = 0;          // New server started by this one
+bool handoff_ready = false;     // New server is accepting, this one drains
+bool handoff_closed = false;    // Other server closed the channel
+
+// Client threads block in poll() until their socket is ready, the timer wheel
+// shuts their socket down, or one of these becomes readable
+int exit_wake_fd = -1;          // Server is exiting
+int handoff_wake_fd = -1;       // New server is accepting, idle connections go to it
+
 #if USE_AESD_CHAR_DEVICE == 0
 timer_t timer;
 bool timer_active = false;
 #endif
 
+// The history indexes a regular data file, not the aesdchar device
+#if USE_AESD_CHAR_DEVICE == 0
+static const bool history_is_file = true;
+#else
+static const bool history_is_file = false;
+#endif
+
+// Resources a connection uses, stored by its thread with relaxed atomics
+// for log_stats() to read from the main thread
+struct conn_usage {
+    uint64_t rx_bytes;          // Received in total
+    uint64_t reply_bytes;       // Queued as replies in total
+    size_t rx_buffered;         // Received and not consumed yet
+    size_t rx_peak;             // Largest the receive buffer grew to
+    size_t queued;              // Reply bytes waiting in the send queue
+    uint64_t cpu_ns;            // Thread CPU time, set as the thread completes
+};
+
 struct thread_info {
     pthread_t thread_id;
-    pthread_mutex_t *mutex;
+    struct aesd_lock *mutex;
     bool thread_complete;
     bool client_connected;
     int client_fd;
     struct sockaddr_storage client_addr;
+    struct listener *listener;              // NULL if handed over from an unknown one
+    enum aesd_frame_mode framing;           // Unknown until the first bytes arrive
+    struct aesd_sendq sendq;
+    struct aesd_rl_source *source;
+    struct aesd_token_bucket buckets[AESD_RL_DIRS];
+    bool zerocopy;
+    size_t queued_reported;
+    unsigned int deferred_replies;
+    uint64_t durable_wait;                  // History end replies are held back for, 0 if none
+    struct aesd_timer timer;
+    uint64_t deadlines[CONN_DEADLINES];     // Absolute ms, 0 when inactive
+    uint64_t timer_armed_ms;                // Expiry the timer is armed for, 0 if not
+    int timed_out;                          // Expired deadline + 1, 0 if none
+    uint64_t capture_conn;                  // Capture connection number, 0 if not captured
+    unsigned long replies;
+    unsigned long long reply_bytes;
+    struct conn_usage usage;
     SLIST_ENTRY(thread_info) threads;
 };
 
-// Handles both SIGINT and SIGTERM signals
+SLIST_HEAD(head_thread, thread_info);
+
+// CPU time of connections closed so far, the live ones are read from their
+// threads' CPU clocks
+static uint64_t closed_cpu_ns = 0;
+static unsigned long closed_conns = 0;
+
+// Handles SIGINT and SIGTERM signals, SIGUSR1 to log server statistics,
+// SIGUSR2 to upgrade to the installed binary, SIGHUP to promote a follower
+// and SIGQUIT to dump the stage trace
 static void signal_handler(int signum)
 {
+    if (signum == SIGUSR1) {
+        dump_stats = true;
+        return;
+    }
+
+    if (signum == SIGUSR2) {
+        upgrade_requested = true;
+        return;
+    }
+
+    if (signum == SIGHUP) {
+        promote_requested = true;
+        return;
+    }
+
+    if (signum == SIGQUIT) {
+        dump_trace = true;
+        return;
+    }
+
     if ((signum == SIGINT) || (signum == SIGTERM)) {
         syslog(LOG_INFO, "Caught signal, exiting\n");
 
-        if (shutdown(socket_fd, SHUT_RDWR) == -1) {
-            syslog(LOG_ERR, "Error: shutdown() %s\n", strerror(errno));
+        int i;
+
+        for (i = 0; i < listener_count; i++) {
+            if ((listeners[i].fd != -1) && (shutdown(listeners[i].fd, SHUT_RDWR) == -1)) {
+                syslog(LOG_ERR, "Error: shutdown() %s\n", strerror(errno));
+            }
         }
 
         // Set global to start server shutdown when possible
@@ -115,7 +457,7 @@ void timer_thread_handler(union sigval sv)
     char ts_format[] = "timestamp:%a, %d %b %Y %T %z\n";
     time_t t;
     struct tm *ts;
-    pthread_mutex_t* mutex = (pthread_mutex_t*)sv.sival_ptr;
+    struct aesd_lock *mutex = (struct aesd_lock *)sv.sival_ptr;
 
     // Fetch current time since Epoch
     t = time(NULL);
@@ -136,25 +478,25 @@ void timer_thread_handler(union sigval sv)
     ts_len = strftime(ts_str, sizeof(ts_str), ts_format, ts);
 
     // Open file to log timestamp to
-    FILE* data_file = fopen(TMP_FILE, "a+");
+    FILE* data_file = fopen(config.data_path, "a+e");
     if (data_file == NULL) {
         syslog(LOG_ERR, "fopen(): %s\n", strerror(errno));
         return;
     }
 
     // Lock thread mutex and write to file then release
-    status = pthread_mutex_lock(mutex);
+    status = aesd_lock(mutex);
     if (status) {
-        syslog(LOG_ERR, "pthread_mutex_lock(): %s\n", strerror(status));
+        syslog(LOG_ERR, "aesd_lock(): %s\n", strerror(status));
     }
 
-    if (ts_len != fwrite(&ts_str, sizeof(char), ts_len, data_file)) {
+    if (aesd_history_append(data_file, ts_str, ts_len, NULL) == -1) {
         syslog(LOG_ERR, "Failed to write timestamp()");
     }
 
-    status = pthread_mutex_unlock(mutex);
+    status = aesd_unlock(mutex);
     if (status) {
-        syslog(LOG_ERR, "pthread_mutex_unlock(): %s\n", strerror(status));
+        syslog(LOG_ERR, "aesd_unlock(): %s\n", strerror(status));
     }
 
     // If we made it here, file was opened successfully so close file
@@ -162,17 +504,147 @@ void timer_thread_handler(union sigval sv)
 
     return;
 }
+
+// Start writing a timestamp every 10 seconds
+static bool start_timestamps(void)
+{
+    struct itimerspec itime_spec;
+
+    // Set time to trigger every 10 seconds, 0 nanoseconds
+    memset(&itime_spec, 0, sizeof(struct itimerspec));
+    itime_spec.it_interval.tv_sec = 10;
+    itime_spec.it_value.tv_sec = 10;
+
+    if (timer_settime(timer, 0, &itime_spec, NULL)) {
+        syslog(LOG_ERR, "Error timer_settime(): %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
 #endif
 
+// Add a bound socket to the listeners, naming it by its local address
+static bool add_listener(int fd)
+{
+    struct listener *l;
+    socklen_t addrlen;
+    char host[INET6_ADDRSTRLEN];
+    char port[8];
+
+    if (listener_count == MAX_LISTENERS) {
+        syslog(LOG_ERR, "Error more than %d listening sockets\n", MAX_LISTENERS);
+        return false;
+    }
+
+    l = &listeners[listener_count];
+    memset(l, 0, sizeof(*l));
+    addrlen = sizeof(l->addr);
+    if (getsockname(fd, (struct sockaddr*)&l->addr, &addrlen) == -1) {
+        syslog(LOG_ERR, "Error getsockname(): %s\n", strerror(errno));
+        return false;
+    }
+
+    if (l->addr.ss_family == AF_UNIX) {
+        const char *path = ((struct sockaddr_un*)&l->addr)->sun_path;
+        size_t path_len = strnlen(path, sizeof(((struct sockaddr_un*)0)->sun_path));
+
+        memcpy(l->name, "unix:", 5);
+        memcpy(l->name + 5, path, path_len);
+        l->name[5 + path_len] = '\0';
+    } else {
+        if (getnameinfo((struct sockaddr*)&l->addr, addrlen, host, sizeof(host), port,
+                        sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            snprintf(host, sizeof(host), "?");
+            snprintf(port, sizeof(port), "?");
+        }
+        snprintf(l->name, sizeof(l->name),
+                    (l->addr.ss_family == AF_INET6) ? "[%s]:%s" : "%s:%s", host, port);
+    }
+
+    l->fd = fd;
+    listener_count++;
+    return true;
+}
+
+// Listener a connection was accepted on, judged by the connection's local
+// address. Used for connections handed over by a previous server.
+static struct listener *find_listener(int client_fd)
+{
+    struct sockaddr_storage local;
+    socklen_t addrlen = sizeof(local);
+    struct listener *wildcard = NULL;
+    int i;
+
+    if (getsockname(client_fd, (struct sockaddr*)&local, &addrlen) == -1) {
+        return NULL;
+    }
+
+    for (i = 0; i < listener_count; i++) {
+        struct sockaddr_storage *addr = &listeners[i].addr;
+
+        if (addr->ss_family != local.ss_family) {
+            continue;
+        }
+        if (addr->ss_family == AF_UNIX) {
+            if (strcmp(((struct sockaddr_un*)addr)->sun_path,
+                        ((struct sockaddr_un*)&local)->sun_path) == 0) {
+                return &listeners[i];
+            }
+        } else if (addr->ss_family == AF_INET) {
+            struct sockaddr_in *l4 = (struct sockaddr_in*)addr;
+            struct sockaddr_in *c4 = (struct sockaddr_in*)&local;
+
+            if (l4->sin_port != c4->sin_port) {
+                continue;
+            }
+            if (l4->sin_addr.s_addr == c4->sin_addr.s_addr) {
+                return &listeners[i];
+            }
+            if (l4->sin_addr.s_addr == htonl(INADDR_ANY)) {
+                wildcard = &listeners[i];
+            }
+        } else if (addr->ss_family == AF_INET6) {
+            struct sockaddr_in6 *l6 = (struct sockaddr_in6*)addr;
+            struct sockaddr_in6 *c6 = (struct sockaddr_in6*)&local;
+
+            if (l6->sin6_port != c6->sin6_port) {
+                continue;
+            }
+            if (IN6_ARE_ADDR_EQUAL(&l6->sin6_addr, &c6->sin6_addr)) {
+                return &listeners[i];
+            }
+            if (IN6_IS_ADDR_UNSPECIFIED(&l6->sin6_addr)) {
+                wildcard = &listeners[i];
+            }
+        }
+    }
+    return wildcard;
+}
+
+// Stop accepting on every listener. Unix socket paths stay in place while
+// a new server is taking them over.
+static void close_listeners(void)
+{
+    int i;
+
+    for (i = 0; i < listener_count; i++) {
+        if (listeners[i].fd != -1) {
+            close(listeners[i].fd);
+            listeners[i].fd = -1;
+            if (listeners[i].owned && (listeners[i].addr.ss_family == AF_UNIX) &&
+                !handoff_ready) {
+                unlink(((struct sockaddr_un*)&listeners[i].addr)->sun_path);
+            }
+        }
+    }
+}
+
 // Cleanup connections before closing
 void cleanup(bool terminate)
 {
     int status = 0;
 
-    if (socket_connected) {
-        close(socket_fd);
-        socket_connected = false;
-    }
+    close_listeners();
 
     // If we are exiting after this call, close all open file descriptors
     if (terminate) {
@@ -188,16 +660,52 @@ void cleanup(bool terminate)
 #endif
 
         if (mutex_active) {
-            status = pthread_mutex_destroy(&thread_mutex);
+            status = aesd_lock_destroy(&thread_mutex);
             if (status != 0) {
-                syslog(LOG_ERR, "Error pthread_mutex_destroy(): %s\n", strerror(status));
+                syslog(LOG_ERR, "Error aesd_lock_destroy(): %s\n", strerror(status));
             }
             mutex_active = false;
         }
 
+        if (conn_wheel_active) {
+            aesd_timerwheel_destroy(&conn_wheel);
+            conn_wheel_active = false;
+        }
+
+        if (exit_wake_fd != -1) {
+            close(exit_wake_fd);
+            exit_wake_fd = -1;
+        }
+
+        if (handoff_wake_fd != -1) {
+            close(handoff_wake_fd);
+            handoff_wake_fd = -1;
+        }
+
+        if (append_queue_active) {
+            aesd_fairq_destroy(&append_queue);
+            append_queue_active = false;
+        }
+
+        if (handoff_chan != -1) {
+            close(handoff_chan);
+            handoff_chan = -1;
+        }
+
+        // The follower appends through the history, stop it first
+        aesd_replica_unfollow();
+        aesd_capture_close();
+        aesd_trace_destroy();
+        aesd_prof_destroy();
+        aesd_statpage_close();
+        aesd_history_destroy();
+        aesd_checksum_close(tmp_file_exists && !handoff_ready);
+        aesd_cold_close(tmp_file_exists && !handoff_ready);
+
 #if USE_AESD_CHAR_DEVICE == 0
-        if (tmp_file_exists) {
-            status = remove(TMP_FILE);
+        // The data file belongs to the new server after an upgrade
+        if (tmp_file_exists && !handoff_ready) {
+            status = remove(config.data_path);
             if (status != 0) {
                 syslog(LOG_ERR, "Error remove(): %s\n", strerror(errno));
             }
@@ -227,255 +735,2861 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
-void* client_thread_func (void *thread_args)
+// Mapping of the data file referenced by a zerocopy reply
+struct zc_mapping {
+    void *addr;
+    size_t len;
+    off_t pin;                  // Data file offset kept from being punched
+};
+
+// Called by the send queue once the kernel has released a zerocopy reply
+static void zc_mapping_release(void *arg)
 {
-    struct thread_info* client_info = (struct thread_info*)thread_args;
-    int client_errors = 0;
-    bool tmp_file_open = false;
+    struct zc_mapping *mapping = (struct zc_mapping *)arg;
 
-    // Log message to syslog "Accepted connection from <CLIENT_IP_ADDRESS>"
-    char client_ip[INET6_ADDRSTRLEN];
-    memset(client_ip, 0, sizeof(client_ip));
-    inet_ntop(client_info->client_addr.ss_family, 
-                get_in_addr((struct sockaddr*)&(client_info->client_addr)), 
-                client_ip, 
-                sizeof(client_ip));
-    syslog(LOG_INFO, "Accepted connection from %s\n", client_ip);
+    if (munmap(mapping->addr, mapping->len) == -1) {
+        syslog(LOG_ERR, "Error munmap(): %s\n", strerror(errno));
+    }
+    aesd_history_unpin(mapping->pin);
+    free(mapping);
+}
 
-    int rx_size = READ_SIZE;
-    int rx_bytes = 0;
-    char* rx_buffer = malloc(rx_size);
+// Queue a large reply, at most limit bytes, as a MSG_ZEROCOPY reference to a
+// mapping of the data file instead of copying it. Returns 1 if the reply was
+// queued, 0 if the caller should fall back to copying and -1 if the
+// connection must be closed.
+static int queue_reply_zerocopy(struct thread_info *client_info, int data_fd, off_t file_pos,
+                                size_t limit)
+{
+    struct aesd_sendq *sendq = &(client_info->sendq);
+    struct zc_mapping *mapping = NULL;
+    struct stat data_stat;
+    size_t reply_len = 0;
+    off_t map_off = 0;
+
+    // Only a regular file can be mapped, the aesdchar device is always copied
+    if ((fstat(data_fd, &data_stat) == -1) || !S_ISREG(data_stat.st_mode) ||
+        (data_stat.st_size <= file_pos)) {
+        return 0;
+    }
 
-    if (rx_buffer == NULL) {
+    reply_len = data_stat.st_size - file_pos;
+    if (reply_len > limit) {
+        reply_len = limit;
+    }
+    if (reply_len < config.zerocopy_threshold) {
+        return 0;
+    }
+
+    // Client has fallen behind if the reply no longer fits in its queue
+    if (reply_len > aesd_sendq_room(sendq)) {
+        if (config.send_policy == SEND_POLICY_DROP) {
+            syslog(LOG_ERR, "Error send queue over %zu bytes, dropping client\n",
+                    sendq->hwm);
+            return -1;
+        }
+        reply_len = aesd_sendq_room(sendq);
+        syslog(LOG_WARNING, "Send queue over %zu bytes, truncated reply\n",
+                sendq->hwm);
+        if (reply_len == 0) {
+            client_info->replies++;
+            return 1;
+        }
+    }
+
+    mapping = malloc(sizeof(*mapping));
+    if (mapping == NULL) {
         syslog(LOG_ERR, "Error failed to malloc()\n");
-        close(client_info->client_fd);
-        client_info->client_connected = false;
-        client_info->thread_complete = true;
-        client_errors++;
-        cleanup(false);
-        pthread_exit(&client_errors);
+        return -1;
     }
 
-    // Zero memory before reading
-    memset(rx_buffer, 0, rx_size);
-    int total_bytes = 0;
-    int bytes_to_read = 0;
-    char* p_end = NULL;
+    // Retention punches no hole under the reply until the kernel is done
+    // with the mapping, unless it already has
+    if (!aesd_history_pin(file_pos)) {
+        free(mapping);
+        return 0;
+    }
+    mapping->pin = file_pos;
+
+    // Mappings must start on a page boundary
+    map_off = file_pos & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    mapping->len = (file_pos - map_off) + reply_len;
+    mapping->addr = mmap(NULL, mapping->len, PROT_READ, MAP_SHARED, data_fd, map_off);
+    if (mapping->addr == MAP_FAILED) {
+        syslog(LOG_ERR, "Error mmap(): %s\n", strerror(errno));
+        aesd_history_unpin(file_pos);
+        free(mapping);
+        return 0;
+    }
 
-    // Create file to write packets to
-    FILE* data_file = fopen(TMP_FILE, "a+");
+    if (aesd_sendq_append_ref(sendq, (char *)mapping->addr + (file_pos - map_off),
+                                reply_len, true, zc_mapping_release, mapping) == -1) {
+        syslog(LOG_ERR, "Error aesd_sendq_append_ref(): %s\n", strerror(errno));
+        zc_mapping_release(mapping);
+        return -1;
+    }
 
-    if (data_file == NULL) {
-        syslog(LOG_ERR, "Error fopen(): %s\n", strerror(errno));
-        if (rx_buffer != NULL) {
-            free(rx_buffer);
-            rx_buffer = NULL;
+    if (lseek(data_fd, file_pos + reply_len, SEEK_SET) == -1) {
+        syslog(LOG_ERR, "Error lseek(): %s\n", strerror(errno));
+        return -1;
+    }
+    client_info->replies++;
+    client_info->reply_bytes += reply_len;
+
+    return 1;
+}
+
+// Queue the frame header of a reply of *reply_len bytes, applying the send
+// policy up front as a framed reply cannot be cut short once its length is
+// sent. Returns false if the connection must be closed.
+static bool queue_frame_header(struct thread_info *client_info, size_t *reply_len)
+{
+    struct aesd_sendq *sendq = &(client_info->sendq);
+    char header[AESD_FRAME_VARINT_MAX];
+    size_t header_len = aesd_frame_put_varint(header, *reply_len);
+
+    if (header_len + *reply_len > aesd_sendq_room(sendq)) {
+        if ((config.send_policy == SEND_POLICY_DROP) || (aesd_sendq_room(sendq) <= header_len)) {
+            syslog(LOG_ERR, "Error send queue over %zu bytes, dropping client\n", sendq->hwm);
+            return false;
         }
-        close(client_info->client_fd);
-        client_info->client_connected = false;
-        client_info->thread_complete = true;
-        client_errors++;
-        cleanup(false);
-        pthread_exit(&client_errors);
-    } else {
-        tmp_file_exists = true;
-        tmp_file_open = true;
+        *reply_len = aesd_sendq_room(sendq) - header_len;
+        header_len = aesd_frame_put_varint(header, *reply_len);
+        syslog(LOG_WARNING, "Send queue over %zu bytes, truncated reply\n", sendq->hwm);
     }
 
-    while (1) {
+    if (aesd_sendq_append(sendq, header, header_len) == -1) {
+        syslog(LOG_ERR, "Error aesd_sendq_append(): %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
 
-        bytes_to_read = rx_size - total_bytes;
+// Read up to reply_left bytes of the data file, starting at file_pos, straight
+// into the send queue in REPLY_CHUNK_SIZE pieces aligned to the file offset.
+// Compressed history is decompressed into the queue instead. SIZE_MAX reads
+// to the end of the file. Returns false if the connection must be closed.
+static bool queue_file_bytes(struct thread_info *client_info, int data_fd,
+                                off_t file_pos, size_t reply_left)
+{
+    struct aesd_sendq *sendq = &(client_info->sendq);
+    ssize_t rd_bytes = 0;
+    size_t rd_size = 0;
+    size_t avail = 0;
+    bool framed = (client_info->framing == AESD_FRAME_BINARY);
+    char *p_tail = NULL;
+
+    if (lseek(data_fd, file_pos, SEEK_SET) == -1) {
+        syslog(LOG_ERR, "Error lseek(): %s\n", strerror(errno));
+        return false;
+    }
 
-        if (bytes_to_read == 0) {
-            // Increase size of rx_buffer
-            rx_size += READ_SIZE;
-            bytes_to_read = READ_SIZE;
-            rx_buffer = realloc(rx_buffer, rx_size);
-            if (rx_buffer == NULL) {
-                syslog(LOG_ERR, "Error failed to realloc()\n");
-                client_errors++;
-                break; // send to cleanup
+    while (reply_left > 0) {
+        p_tail = aesd_sendq_reserve(sendq, &avail);
+        if (p_tail == NULL) {
+            syslog(LOG_ERR, "Error aesd_sendq_reserve(): %s\n", strerror(errno));
+            return false;
+        }
+
+        // Behind a frame header file offsets no longer line up with the
+        // chunks, fill each chunk instead so it still takes one read
+        rd_size = framed ? avail : REPLY_CHUNK_SIZE - (file_pos % REPLY_CHUNK_SIZE);
+        if (rd_size > avail) {
+            rd_size = avail;
+        }
+        if (rd_size > reply_left) {
+            rd_size = reply_left;
+        }
+
+        rd_bytes = aesd_cold_read(p_tail, rd_size, file_pos);
+        if (rd_bytes > 0) {
+            // Keep the descriptor in step for the raw bytes that follow
+            if (lseek(data_fd, file_pos + rd_bytes, SEEK_SET) == -1) {
+                syslog(LOG_ERR, "Error lseek(): %s\n", strerror(errno));
+                return false;
             }
-            memset(&(rx_buffer[total_bytes]), 0, READ_SIZE);
+        } else if (rd_bytes == 0) {
+            rd_bytes = read(data_fd, p_tail, rd_size);
+
+            // Compressed meanwhile, the range may have been punched under the read
+            if ((rd_bytes > 0) && ((uint64_t)file_pos < aesd_cold_end())) {
+                ssize_t cold_bytes = aesd_cold_read(p_tail, rd_bytes, file_pos);
+
+                if (cold_bytes > 0) {
+                    rd_bytes = cold_bytes;
+                    if (lseek(data_fd, file_pos + rd_bytes, SEEK_SET) == -1) {
+                        syslog(LOG_ERR, "Error lseek(): %s\n", strerror(errno));
+                        return false;
+                    }
+                } else if (cold_bytes == -1) {
+                    rd_bytes = -1;
+                }
+            }
+        }
+        if (rd_bytes == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Error read(): %s\n", strerror(errno));
+            return false;
         }
 
-        rx_bytes = recv(client_info->client_fd,
-                        &(rx_buffer[total_bytes]),
-                        rx_size - total_bytes,
-                        0);
+        if (rd_bytes == 0) {
+            if (framed) {
+                syslog(LOG_ERR, "Error data file ended inside a framed reply\n");
+                return false;
+            }
+            break; // End of file, reply fully queued
+        }
 
-        if (rx_bytes == 0) {
-            break; // Client is done sending
+        file_pos += rd_bytes;
+        if (reply_left != SIZE_MAX) {
+            reply_left -= rd_bytes;
         }
 
-        total_bytes += rx_bytes;
+        // Client has fallen behind if the reply no longer fits in its queue
+        if ((size_t)rd_bytes > aesd_sendq_room(sendq)) {
+            if (config.send_policy == SEND_POLICY_DROP) {
+                syslog(LOG_ERR, "Error send queue over %zu bytes, dropping client\n",
+                        sendq->hwm);
+                return false;
+            }
+            rd_bytes = aesd_sendq_room(sendq);
+            aesd_sendq_commit(sendq, rd_bytes);
+            client_info->reply_bytes += rd_bytes;
+            syslog(LOG_WARNING, "Send queue over %zu bytes, truncated reply\n",
+                    sendq->hwm);
+            break;
+        }
 
-        // check buffer for '\n' newline character
-        // If it exists, append to file and send back on client 
-        // check for all '\n' characters, after transmitting
-        // move all data down to zero index of malloc'd packet
-        // USE strchr() to fine \n characters: 
-        // https://man7.org/linux/man-pages/man3/strchr.3.html
-        if (total_bytes < rx_size) {
-            while (1) {
-                int status = 0, num_tokens = 0;
-                struct aesd_seekto ioctl_arg;
-                memset(&ioctl_arg, 0, sizeof(ioctl_arg));
+        aesd_sendq_commit(sendq, rd_bytes);
+        client_info->reply_bytes += rd_bytes;
+    }
+    return true;
+}
 
-                // Check for newline
-                p_end = strchr(rx_buffer, '\n');
+// Queue at most limit bytes of the data file, starting at file_pos, as the
+// reply to a packet. Binary framed connections get the reply as one frame.
+// Returns false if the connection must be closed.
+static bool queue_reply_range(struct thread_info *client_info, FILE *data_file,
+                                off_t file_pos, size_t limit)
+{
+    int data_fd = fileno(data_file);
+    off_t file_end = 0;
+    size_t reply_left = limit;          // SIZE_MAX replies run to end of file
+    uint64_t cold_end;
+
+    // Flush any buffered writes so read() sees them
+    if (fflush(data_file) != 0) {
+        syslog(LOG_ERR, "Error fflush(): %s\n", strerror(errno));
+        return false;
+    }
 
-                if (p_end == NULL) {
-                    break; // no newline found
-                }
+    // Appends made after this point belong to later replies
+    if (client_info->framing == AESD_FRAME_BINARY) {
+        file_end = lseek(data_fd, 0, SEEK_END);
+        if (file_end == -1) {
+            syslog(LOG_ERR, "Error lseek(): %s\n", strerror(errno));
+            return false;
+        }
+        if ((size_t)((file_end > file_pos) ? file_end - file_pos : 0) < reply_left) {
+            reply_left = (file_end > file_pos) ? file_end - file_pos : 0;
+        }
+        if (!queue_frame_header(client_info, &reply_left)) {
+            return false;
+        }
+    }
 
-                // Write packet to file
-                char* p = rx_buffer;
-                int packet_len = p_end - p;
-                status = pthread_mutex_lock(client_info->mutex);
-                if (status) {
-                    syslog(LOG_ERR, "pthread_mutex_lock(): %s\n", strerror(status));
-                    client_errors++;
-                    break;
-                }
+    // Only what the data file still holds can be mapped, compressed history
+    // ahead of it is decompressed into the queue
+    cold_end = aesd_cold_end();
+    if (client_info->zerocopy && ((uint64_t)file_pos < cold_end)) {
+        size_t cold_len = cold_end - file_pos;
 
-                // Special handling for AESDCHAR_IOCSEEKTO:X,Y commands
-                if (strncmp(p, "AESDCHAR_IOCSEEKTO:", AESD_IOCTL_PREFIX_LEN) == 0) {
-                    syslog(LOG_INFO, "Received AESDCHAR_IOCSEEKTO command.\n");
-                    p += AESD_IOCTL_PREFIX_LEN;
-                    char *token = strtok(p, ",");
+        if (cold_len > reply_left) {
+            cold_len = reply_left;
+        }
+        if (!queue_file_bytes(client_info, data_fd, file_pos, cold_len)) {
+            return false;
+        }
+        file_pos += cold_len;
+        if (reply_left != SIZE_MAX) {
+            reply_left -= cold_len;
+        }
+    }
 
-                    if (token != NULL) {
-                        ioctl_arg.write_cmd = (uint32_t)strtoul(token, NULL, 10);
-                        num_tokens++;
+    if (client_info->zerocopy && (reply_left > 0)) {
+        int zc_status = queue_reply_zerocopy(client_info, data_fd, file_pos, reply_left);
+        if (zc_status != 0) {
+            return (zc_status == 1);
+        }
+    }
 
-                        // Get next token
-                        token = strtok(NULL, ",");
+    if (!queue_file_bytes(client_info, data_fd, file_pos, reply_left)) {
+        return false;
+    }
+    client_info->replies++;
+    return true;
+}
 
-                        if (token != NULL) {
-                            ioctl_arg.write_cmd_offset = (uint32_t)strtoul(token, NULL, 10);
-                            num_tokens++;
-                        } else {
-                            syslog(LOG_ERR, "write_cmd_offset missing.\n");
-                            client_errors++;
-                        }
+// Move the data file position to the oldest retained record, where full
+// replies start
+static void rewind_history(FILE *data_file)
+{
+    if (fseeko(data_file, aesd_history_start(), SEEK_SET) == -1) {
+        rewind(data_file);
+    }
+}
+
+// Queue the contents of the data file, starting at the current file position,
+// as the reply to a packet. Returns false if the connection must be closed.
+static bool queue_reply(struct thread_info *client_info, FILE *data_file)
+{
+    uint64_t trace_start = aesd_trace_begin();
+    off_t file_pos;
+    bool queued;
+
+    // Flush any buffered writes so the descriptor position is current
+    if (fflush(data_file) != 0) {
+        syslog(LOG_ERR, "Error fflush(): %s\n", strerror(errno));
+        return false;
+    }
+
+    file_pos = lseek(fileno(data_file), 0, SEEK_CUR);
+    if (file_pos == -1) {
+        file_pos = 0;
+    }
+    queued = queue_reply_range(client_info, data_file, file_pos, SIZE_MAX);
+    aesd_trace_end(AESD_TRACE_REPLY, trace_start, 0);
+    return queued;
+}
+
+// Queue a short reply built by the server, as a frame on binary framed
+// connections. Returns false if the connection must be closed.
+static bool queue_reply_text(struct thread_info *client_info, const char *text, size_t len)
+{
+    if ((client_info->framing == AESD_FRAME_BINARY) && !queue_frame_header(client_info, &len)) {
+        return false;
+    }
+
+    if (aesd_sendq_append(&(client_info->sendq), text, len) == -1) {
+        syslog(LOG_ERR, "Error aesd_sendq_append(): %s\n", strerror(errno));
+        return false;
+    }
+    client_info->replies++;
+    client_info->reply_bytes += len;
+    return true;
+}
+
+// Queue the replies held back under pressure. Returns false if the connection
+// must be closed.
+static bool queue_deferred_replies(struct thread_info *client_info, FILE *data_file)
+{
+    while (client_info->deferred_replies > 0) {
+        rewind_history(data_file);
+        if (!queue_reply(client_info, data_file)) {
+            return false;
+        }
+        client_info->deferred_replies--;
+    }
+    return true;
+}
+
+// Log a query the server cannot answer and reply to it with "ERR reason",
+// leaving the connection open. Returns false if the connection must be closed.
+static bool query_error(struct thread_info *client_info, const char *format, ...)
+{
+    char reason[QUERY_MAX_LEN + 64];
+    char reply[sizeof(reason) + 8];
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(reason, sizeof(reason), format, ap);
+    va_end(ap);
+    syslog(LOG_ERR, "Error %s\n", reason);
+    return queue_reply_text(client_info, reply, snprintf(reply, sizeof(reply), "ERR %s\n", reason));
+}
+
+// COUNT, the number of records in the history
+static bool query_count(struct thread_info *client_info, FILE *data_file, const char *args)
+{
+    uint64_t records, start, end;
+    char reply[32];
+
+    (void)data_file;
+    if (*args != '\0') {
+        return query_error(client_info, "COUNT takes no arguments");
+    }
+    if (aesd_history_stat(&records, &start, &end) == -1) {
+        return query_error(client_info, "queries need an indexed history");
+    }
+    return queue_reply_text(client_info, reply,
+                            snprintf(reply, sizeof(reply), "%llu\n", (unsigned long long)records));
+}
+
+// DURABLE, the offset everything before is synced to disk and the end
+static bool query_durable(struct thread_info *client_info, FILE *data_file, const char *args)
+{
+    struct aesd_history_stats history;
+    char reply[48];
+
+    (void)data_file;
+    if (*args != '\0') {
+        return query_error(client_info, "DURABLE takes no arguments");
+    }
+    aesd_history_get_stats(&history);
+    return queue_reply_text(client_info, reply,
+                            snprintf(reply, sizeof(reply), "%llu %llu\n",
+                                    (unsigned long long)history.durable,
+                                    (unsigned long long)history.end));
+}
+
+// TAIL n, the last n records
+static bool query_tail(struct thread_info *client_info, FILE *data_file, const char *args)
+{
+    unsigned long long records;
+    uint64_t offset, end;
+    char *p_end = NULL;
+
+    errno = 0;
+    records = strtoull(args, &p_end, 10);
+    if ((p_end == args) || (*p_end != '\0') || (errno != 0)) {
+        return query_error(client_info, "TAIL takes a record count");
+    }
+    if (aesd_history_tail(records, &offset, &end) == -1) {
+        return query_error(client_info, "queries need an indexed history");
+    }
+    return queue_reply_range(client_info, data_file, offset, end - offset);
+}
+
+// RANGE off,len, len bytes of the history from byte offset off
+static bool query_range(struct thread_info *client_info, FILE *data_file, const char *args)
+{
+    unsigned long long offset, len;
+    uint64_t records, start, end;
+    char *p_end = NULL;
+
+    errno = 0;
+    offset = strtoull(args, &p_end, 10);
+    if ((p_end == args) || (*p_end != ',')) {
+        return query_error(client_info, "RANGE takes an offset and length");
+    }
+    args = p_end + 1;
+    len = strtoull(args, &p_end, 10);
+    if ((p_end == args) || (*p_end != '\0') || (errno != 0)) {
+        return query_error(client_info, "RANGE takes an offset and length");
+    }
+    if (aesd_history_stat(&records, &start, &end) == -1) {
+        return query_error(client_info, "queries need an indexed history");
+    }
+
+    // Only what the history holds, a range past its end is an empty reply
+    // and one starting before retention dropped records starts later
+    if (offset < start) {
+        len = (len > start - offset) ? len - (start - offset) : 0;
+        offset = start;
+    }
+    if (offset > end) {
+        offset = end;
+    }
+    if (len > end - offset) {
+        len = end - offset;
+    }
+    return queue_reply_range(client_info, data_file, offset, len);
+}
+
+// GREP pattern, every record holding pattern
+static bool query_grep(struct thread_info *client_info, FILE *data_file, const char *args)
+{
+    struct aesd_history_grep result;
+    size_t reply_len;
+    size_t i;
+    bool queued = true;
+
+    if (*args == '\0') {
+        return query_error(client_info, "GREP takes a pattern");
+    }
+    if ((fflush(data_file) != 0) ||
+        (aesd_history_grep(fileno(data_file), args, strlen(args), &result) == -1)) {
+        return query_error(client_info, "aesd_history_grep(): %s", strerror(errno));
+    }
+    syslog(LOG_DEBUG, "GREP %s: %zu records, %zu of %zu segments searched\n",
+            args, result.records, result.searched, result.segments);
+
+    // Matching records go out back to back as one reply
+    reply_len = result.bytes;
+    if ((client_info->framing == AESD_FRAME_BINARY) &&
+        !queue_frame_header(client_info, &reply_len)) {
+        queued = false;
+    }
+    for (i = 0; queued && (i < result.count) && (reply_len > 0) &&
+                (aesd_sendq_room(&(client_info->sendq)) > 0); i++) {
+        size_t len = (result.matches[i].len < reply_len) ? result.matches[i].len : reply_len;
+
+        queued = queue_file_bytes(client_info, fileno(data_file), result.matches[i].offset, len);
+        reply_len -= len;
+    }
+
+    free(result.matches);
+    if (queued) {
+        client_info->replies++;
+    }
+    return queued;
+}
+
+// Write the stage trace into the --dump-dir directory, its path into path.
+// Returns the number of events written or -1.
+static long write_trace(char *path, size_t size)
+{
+    long events;
+
+    if (config.dump_dir == NULL) {
+        syslog(LOG_ERR, "Error no --dump-dir to write the trace to\n");
+        return -1;
+    }
+    snprintf(path, size, "%s/%s%s", config.dump_dir, DUMP_NAME, AESD_TRACE_SUFFIX);
+    events = aesd_trace_dump(path);
+    if (events == -1) {
+        syslog(LOG_ERR, "Error aesd_trace_dump(%s): %s\n", path, strerror(errno));
+    } else {
+        syslog(LOG_INFO, "Dumped %ld trace events to %s\n", events, path);
+    }
+    return events;
+}
+
+// TRACE, dump the stage trace and reply with the event count and its path.
+// Admin only.
+static bool query_trace(struct thread_info *client_info, FILE *data_file, const char *args)
+{
+    char path[PATH_MAX];
+    char reply[PATH_MAX + 32];
+    long events;
+
+    (void)data_file;
+    if (*args != '\0') {
+        return query_error(client_info, "TRACE takes no arguments");
+    }
+    if (config.dump_dir == NULL) {
+        return query_error(client_info, "TRACE needs --dump-dir");
+    }
+    events = write_trace(path, sizeof(path));
+    if (events == -1) {
+        return query_error(client_info, "TRACE could not write %s", path);
+    }
+    return queue_reply_text(client_info, reply,
+                            snprintf(reply, sizeof(reply), "%ld %s\n", events, path));
+}
+
+// LOCKS on|off|reset, switch lock profiling and reply with whether it is on.
+// The profile goes out with the USR1 stats. Admin only.
+static bool query_locks(struct thread_info *client_info, FILE *data_file, const char *args)
+{
+    (void)data_file;
+    if (strcmp(args, "on") == 0) {
+        aesd_lock_profile(true);
+    } else if (strcmp(args, "off") == 0) {
+        aesd_lock_profile(false);
+    } else if (strcmp(args, "reset") == 0) {
+        aesd_lock_reset();
+    } else if (*args != '\0') {
+        return query_error(client_info, "LOCKS takes on, off or reset");
+    }
+    return aesd_lock_profiling() ? queue_reply_text(client_info, "on\n", 3) :
+                                    queue_reply_text(client_info, "off\n", 4);
+}
+
+// PROFILE [on [HZ]|off], start or stop CPU sampling, or with no arguments
+// write the samples so far as folded stacks into the --dump-dir directory and
+// reply with the sample count and its path. Admin only.
+static bool query_profile(struct thread_info *client_info, FILE *data_file, const char *args)
+{
+    struct aesd_prof_stats prof;
+    char path[PATH_MAX];
+    char reply[PATH_MAX + 32];
+    unsigned long hz;
+    char *p_end;
+    long samples;
+
+    (void)data_file;
+    if (strncmp(args, "on", 2) == 0) {
+        hz = (config.profile_hz > 0) ? config.profile_hz : DEFAULT_PROFILE_HZ;
+        if (args[2] == ' ') {
+            hz = strtoul(&args[3], &p_end, 10);
+            if (*p_end != '\0') {
+                hz = 0;
+            }
+        } else if (args[2] != '\0') {
+            hz = 0;
+        }
+        if (aesd_prof_start(hz) == -1) {
+            return query_error(client_info, "aesd_prof_start(%lu): %s", hz, strerror(errno));
+        }
+        aesd_prof_get_stats(&prof);
+        return queue_reply_text(client_info, reply,
+                                snprintf(reply, sizeof(reply), "on %u\n", prof.hz));
+    } else if (strcmp(args, "off") == 0) {
+        aesd_prof_stop();
+        return queue_reply_text(client_info, "off\n", 4);
+    } else if (*args != '\0') {
+        return query_error(client_info, "PROFILE takes on [HZ] or off");
+    }
+
+    if (config.dump_dir == NULL) {
+        return query_error(client_info, "PROFILE needs --dump-dir");
+    }
+    snprintf(path, sizeof(path), "%s/%s%s", config.dump_dir, DUMP_NAME, AESD_PROF_SUFFIX);
+    samples = aesd_prof_dump(path);
+    if (samples == -1) {
+        return query_error(client_info, "aesd_prof_dump(%s): %s", path, strerror(errno));
+    }
+    syslog(LOG_INFO, "Dumped %ld profile samples to %s\n", samples, path);
+    return queue_reply_text(client_info, reply,
+                            snprintf(reply, sizeof(reply), "%ld %s\n", samples, path));
+}
+
+// Query verbs following AESD_QUERY_PREFIX, each answered from the history
+// index without reading more of the data file than the reply holds. Admin
+// verbs change the server or write files, only unix socket clients may
+// send them.
+static const struct query_command {
+    const char *verb;
+    bool (*handler)(struct thread_info *client_info, FILE *data_file, const char *args);
+    bool admin;
+} query_commands[] = {
+    { "COUNT", query_count, false },
+    { "TAIL", query_tail, false },
+    { "RANGE", query_range, false },
+    { "GREP", query_grep, false },
+    { "DURABLE", query_durable, false },
+    { "TRACE", query_trace, true },
+    { "LOCKS", query_locks, true },
+    { "PROFILE", query_profile, true },
+};
+
+// Answer the query in the len bytes following AESD_QUERY_PREFIX, or reply
+// with "ERR reason" if it cannot be. Returns false if the connection must be
+// closed.
+static bool dispatch_query(struct thread_info *client_info, FILE *data_file,
+                            const char *query, size_t len)
+{
+    char line[QUERY_MAX_LEN];
+    char *args = NULL;
+    size_t verb_len;
+    size_t i;
+
+    // Replies go out in packet order, after any held back so far
+    if (!queue_deferred_replies(client_info, data_file)) {
+        return false;
+    }
+
+    // Binary frames may carry the newline a text client would send
+    if ((len > 0) && (query[len - 1] == '\n')) {
+        len--;
+    }
+    if ((len >= sizeof(line)) || (memchr(query, '\0', len) != NULL)) {
+        return query_error(client_info, "malformed query");
+    }
+    memcpy(line, query, len);
+    line[len] = '\0';
+
+    // Exactly one space separates the arguments, a GREP pattern may start
+    // with spaces of its own
+    verb_len = strcspn(line, " ");
+    args = line + verb_len + ((line[verb_len] == ' ') ? 1 : 0);
+
+    for (i = 0; i < sizeof(query_commands) / sizeof(query_commands[0]); i++) {
+        if ((strlen(query_commands[i].verb) == verb_len) &&
+            (strncmp(line, query_commands[i].verb, verb_len) == 0)) {
+            uint64_t trace_start;
+            bool answered;
+
+            if (query_commands[i].admin && (client_info->client_addr.ss_family != AF_UNIX)) {
+                return query_error(client_info, "%s is only accepted on the unix socket",
+                                    query_commands[i].verb);
+            }
+            trace_start = aesd_trace_begin();
+            syslog(LOG_DEBUG, "Received query %s\n", line);
+            answered = query_commands[i].handler(client_info, data_file, args);
+            aesd_trace_end(AESD_TRACE_QUERY, trace_start, 0);
+            return answered;
+        }
+    }
+
+    return query_error(client_info, "unknown query %s", line);
+}
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+// Earliest active deadline of a connection, 0 if none
+static uint64_t client_next_deadline(struct thread_info *client_info)
+{
+    uint64_t next = 0;
+    uint64_t deadline;
+    int i;
+
+    for (i = 0; i < CONN_DEADLINES; i++) {
+        deadline = __atomic_load_n(&(client_info->deadlines[i]), __ATOMIC_RELAXED);
+        if ((deadline != 0) && ((next == 0) || (deadline < next))) {
+            next = deadline;
+        }
+    }
+    return next;
+}
+
+// Wake every client thread blocked in poll() on this eventfd. It is never
+// read so it stays readable from now on.
+static void wake_clients(int fd)
+{
+    uint64_t one = 1;
+
+    if ((fd != -1) && (write(fd, &one, sizeof(one)) == -1)) {
+        syslog(LOG_ERR, "Error write(eventfd): %s\n", strerror(errno));
+    }
+}
+
+// Timer wheel callback, runs on the main thread with the wheel locked. Client
+// threads only move deadlines later without touching the wheel, so the timer
+// may fire early and is simply re-armed for the real deadline.
+static void client_timer_expired(struct aesd_timer *timer, void *arg)
+{
+    struct thread_info *client_info = (struct thread_info *)arg;
+    uint64_t now = monotonic_ms();
+    uint64_t deadline;
+    int i;
+
+    for (i = 0; i < CONN_DEADLINES; i++) {
+        deadline = __atomic_load_n(&(client_info->deadlines[i]), __ATOMIC_RELAXED);
+        if ((deadline != 0) && (deadline <= now)) {
+            // The client thread removes its timer before closing the socket,
+            // so the descriptor is still this client's
+            __atomic_store_n(&(client_info->timed_out), i + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&(client_info->timer_armed_ms), 0, __ATOMIC_RELAXED);
+            shutdown(client_info->client_fd, SHUT_RDWR);
+            return;
+        }
+    }
+
+    deadline = client_next_deadline(client_info);
+    if (deadline != 0) {
+        aesd_timer_add_locked(&conn_wheel, timer, deadline);
+    }
+    __atomic_store_n(&(client_info->timer_armed_ms), deadline, __ATOMIC_RELAXED);
+}
+
+// Publish a connection's deadlines and arm its timer if one moved earlier
+static void client_set_deadlines(struct thread_info *client_info, const uint64_t *since)
+{
+    uint64_t next;
+    uint64_t armed;
+    int i;
+
+    for (i = 0; i < CONN_DEADLINES; i++) {
+        __atomic_store_n(&(client_info->deadlines[i]),
+                            ((since[i] != 0) && (config.timeouts_ms[i] != 0)) ?
+                                since[i] + config.timeouts_ms[i] : 0,
+                            __ATOMIC_RELAXED);
+    }
+
+    next = client_next_deadline(client_info);
+    armed = __atomic_load_n(&(client_info->timer_armed_ms), __ATOMIC_RELAXED);
+    if ((next != 0) && ((armed == 0) || (next < armed))) {
+        __atomic_store_n(&(client_info->timer_armed_ms), next, __ATOMIC_RELAXED);
+        aesd_timer_mod(&conn_wheel, &(client_info->timer), next);
+    }
+}
+
+// Count bytes moved on a connection against the listener it came in on
+static void listener_count_bytes(struct thread_info *client_info, size_t rx, size_t tx)
+{
+    if (client_info->listener != NULL) {
+        __atomic_fetch_add(&(client_info->listener->rx_bytes), rx, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&(client_info->listener->tx_bytes), tx, __ATOMIC_RELAXED);
+    }
+}
+
+// Make this connection's resource use visible to log_stats()
+static void store_usage(struct thread_info *client_info, size_t rx_buffered, size_t rx_size)
+{
+    struct conn_usage *usage = &(client_info->usage);
+
+    __atomic_store_n(&(usage->reply_bytes), client_info->reply_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&(usage->rx_buffered), rx_buffered, __ATOMIC_RELAXED);
+    __atomic_store_n(&(usage->queued), client_info->sendq.queued, __ATOMIC_RELAXED);
+    if (rx_size > usage->rx_peak) {
+        __atomic_store_n(&(usage->rx_peak), rx_size, __ATOMIC_RELAXED);
+    }
+}
+
+// A live connection's resource use, for the top lists of log_stats()
+struct conn_report {
+    const struct thread_info *conn;
+    uint64_t cpu_ns;
+    size_t memory;              // Receive buffer and queued replies
+};
+
+// CPU time of a connection's thread so far. RUSAGE_THREAD only reports on
+// the calling thread, so live threads are read through their CPU clock.
+static uint64_t conn_cpu_ns(const struct thread_info *conn)
+{
+    struct timespec cpu;
+    clockid_t clock;
+
+    if (!conn->thread_complete && (pthread_getcpuclockid(conn->thread_id, &clock) == 0) &&
+        (clock_gettime(clock, &cpu) == 0)) {
+        return (uint64_t)cpu.tv_sec * 1000000000ULL + cpu.tv_nsec;
+    }
+    return __atomic_load_n(&(conn->usage.cpu_ns), __ATOMIC_RELAXED);
+}
+
+static int compare_conn_cpu(const void *a, const void *b)
+{
+    const struct conn_report *x = a;
+    const struct conn_report *y = b;
+
+    return (x->cpu_ns > y->cpu_ns) ? -1 : (x->cpu_ns < y->cpu_ns);
+}
+
+static int compare_conn_memory(const void *a, const void *b)
+{
+    const struct conn_report *x = a;
+    const struct conn_report *y = b;
+
+    return (x->memory > y->memory) ? -1 : (x->memory < y->memory);
+}
+
+// Peer address of a connection into ip, returning its port, 0 for a unix socket
+static unsigned int conn_peer(const struct thread_info *conn, char *ip, size_t ip_len)
+{
+    if ((conn->client_addr.ss_family != AF_INET) && (conn->client_addr.ss_family != AF_INET6)) {
+        snprintf(ip, ip_len, "unix socket");
+        return 0;
+    }
+    inet_ntop(conn->client_addr.ss_family, get_in_addr((struct sockaddr*)&(conn->client_addr)),
+                ip, ip_len);
+    return ntohs((conn->client_addr.ss_family == AF_INET) ?
+                    ((const struct sockaddr_in *)&(conn->client_addr))->sin_port :
+                    ((const struct sockaddr_in6 *)&(conn->client_addr))->sin6_port);
+}
+
+static void log_conn(const char *ranking, int rank, const struct conn_report *report)
+{
+    const struct thread_info *conn = report->conn;
+    const struct conn_usage *usage = &(conn->usage);
+    char ip[INET6_ADDRSTRLEN];
+    unsigned int port = conn_peer(conn, ip, sizeof(ip));
+    syslog(LOG_INFO, "Stats: conn top %s %d %s port %u cpu %.1f ms, rx %llu bytes, "
+            "buffered %zu rx %zu queued, peak rx buffer %zu, replies %llu bytes\n", ranking,
+            rank, ip, port, report->cpu_ns / 1e6,
+            (unsigned long long)__atomic_load_n(&(usage->rx_bytes), __ATOMIC_RELAXED),
+            __atomic_load_n(&(usage->rx_buffered), __ATOMIC_RELAXED),
+            __atomic_load_n(&(usage->queued), __ATOMIC_RELAXED),
+            __atomic_load_n(&(usage->rx_peak), __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&(usage->reply_bytes), __ATOMIC_RELAXED));
+}
+
+// Resource use of every live connection, NULL on error. Only the main thread
+// adds and frees connections, so the list is walked without a lock.
+static struct conn_report *report_conns(const struct head_thread *head, size_t *count)
+{
+    const struct thread_info *conn;
+    struct conn_report *reports;
+    size_t i = 0;
+
+    *count = 0;
+    SLIST_FOREACH(conn, head, threads) {
+        (*count)++;
+    }
+    reports = malloc((*count + 1) * sizeof(*reports));
+    if (reports == NULL) {
+        syslog(LOG_ERR, "Error failed to malloc()\n");
+        *count = 0;
+        return NULL;
+    }
+    SLIST_FOREACH(conn, head, threads) {
+        reports[i].conn = conn;
+        reports[i].cpu_ns = conn_cpu_ns(conn);
+        reports[i].memory = __atomic_load_n(&(conn->usage.rx_peak), __ATOMIC_RELAXED) +
+                            __atomic_load_n(&(conn->usage.queued), __ATOMIC_RELAXED);
+        i++;
+    }
+    return reports;
+}
+
+// Log the connections using the most CPU and the most memory
+static void log_conn_stats(const struct head_thread *head)
+{
+    struct conn_report *reports;
+    uint64_t live_cpu_ns = 0;
+    size_t count, i;
+
+    reports = report_conns(head, &count);
+    if (reports == NULL) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        live_cpu_ns += reports[i].cpu_ns;
+    }
+    syslog(LOG_INFO, "Stats: conns %zu live cpu %.1f ms, %lu closed cpu %.1f ms\n", count,
+            live_cpu_ns / 1e6, closed_conns, closed_cpu_ns / 1e6);
+
+    qsort(reports, count, sizeof(*reports), compare_conn_cpu);
+    for (i = 0; (i < count) && (i < TOP_CONNS); i++) {
+        log_conn("cpu", i + 1, &reports[i]);
+    }
+    qsort(reports, count, sizeof(*reports), compare_conn_memory);
+    for (i = 0; (i < count) && (i < TOP_CONNS); i++) {
+        log_conn("memory", i + 1, &reports[i]);
+    }
+    free(reports);
+}
+
+// Log server statistics, requested with SIGUSR1
+static void log_stats(const struct head_thread *head)
+{
+    struct aesd_admission_stats admission;
+    struct aesd_history_stats history;
+    struct aesd_cold_stats cold;
+    struct aesd_replica_stats replica;
+    struct aesd_capture_stats capture;
+    struct aesd_prof_stats prof;
+    size_t trace_rings;
+    uint64_t trace_events;
+    struct aesd_lock_stats locks[MAX_LOCK_STATS];
+    size_t lock_count;
+    struct aesd_replica_follower followers[MAX_FOLLOWER_STATS];
+    size_t follower_count;
+    size_t f;
+    int i;
+
+    aesd_admission_get_stats(&admission);
+    syslog(LOG_INFO, "Stats: connections %u accepted %lu queued %zu bytes\n",
+            admission.connections, admission.accepted, admission.queued_bytes);
+    log_conn_stats(head);
+    syslog(LOG_INFO, "Stats: shed pressure %lu connections %lu queued %lu, "
+            "deferred replies %lu, shedding %d deferring %d\n",
+            admission.shed_pressure, admission.shed_connections, admission.shed_queued,
+            admission.replies_deferred, admission.shedding, admission.deferring);
+    syslog(LOG_INFO, "Stats: pressure avg10 cpu %.2f memory %.2f io %.2f\n",
+            admission.avg10[AESD_PSI_CPU], admission.avg10[AESD_PSI_MEMORY],
+            admission.avg10[AESD_PSI_IO]);
+    aesd_history_get_stats(&history);
+    if (history.indexed) {
+        syslog(LOG_INFO, "Stats: history %llu records at %llu-%llu (%llu bytes), "
+                "%llu records dropped, punched to %llu, %zu segments %zu bloom filters\n",
+                (unsigned long long)history.records, (unsigned long long)history.start,
+                (unsigned long long)history.end,
+                (unsigned long long)(history.end - history.start),
+                (unsigned long long)history.records_dropped,
+                (unsigned long long)history.punched, history.segments, history.blooms);
+    }
+    if (history.durability != AESD_DURABILITY_NONE) {
+        syslog(LOG_INFO, "Stats: durability %s durable to %llu of %llu, %llu of %llu appends, "
+                "%llu syncs of %.1f appends avg %.3f ms max %.3f ms%s\n",
+                durability_names[history.durability],
+                (unsigned long long)history.durable, (unsigned long long)history.end,
+                (unsigned long long)history.durable_appends,
+                (unsigned long long)history.appends, (unsigned long long)history.syncs,
+                history.syncs ? (double)history.durable_appends / history.syncs : 0.0,
+                history.syncs ? history.sync_us_total / 1e3 / history.syncs : 0.0,
+                history.sync_us_max / 1e3, history.sync_failed ? ", fdatasync failed" : "");
+    }
+    aesd_cold_get_stats(&cold);
+    if ((cold.blocks > 0) || (cold.compressed > 0)) {
+        syslog(LOG_INFO, "Stats: compressed %zu blocks at %llu-%llu, %llu bytes in %llu "
+                "(ratio %.2f), %llu written at %.1f MB/s, %llu decodes at %.1f MB/s, "
+                "%llu reads from a decoded block, %llu corrupt\n",
+                cold.blocks, (unsigned long long)cold.start, (unsigned long long)cold.end,
+                (unsigned long long)cold.raw_bytes, (unsigned long long)cold.comp_bytes,
+                cold.comp_bytes ? (double)cold.raw_bytes / cold.comp_bytes : 0.0,
+                (unsigned long long)cold.compressed,
+                cold.compress_ns ? cold.compressed_bytes * 1e3 / cold.compress_ns : 0.0,
+                (unsigned long long)cold.decodes,
+                cold.decode_ns ? cold.decode_bytes * 1e3 / cold.decode_ns : 0.0,
+                (unsigned long long)cold.cache_hits, (unsigned long long)cold.crc_errors);
+    }
+    aesd_capture_get_stats(&capture);
+    if (capture.active || (capture.records > 0)) {
+        syslog(LOG_INFO, "Stats: capture %s%s, %llu connections %llu records, %llu bytes "
+                "received in %llu written, %llu records dropped\n", config.capture_path,
+                capture.active ? "" : " (stopped)", (unsigned long long)capture.connections,
+                (unsigned long long)capture.records, (unsigned long long)capture.bytes,
+                (unsigned long long)capture.file_bytes, (unsigned long long)capture.dropped);
+    }
+    if (aesd_trace_get_stats(&trace_rings, &trace_events)) {
+        syslog(LOG_INFO, "Stats: trace %zu rings of %zu events, %llu events recorded\n",
+                trace_rings, config.trace_events, (unsigned long long)trace_events);
+    }
+    aesd_prof_get_stats(&prof);
+    if (prof.running || (prof.samples > 0) || (prof.dumped > 0)) {
+        syslog(LOG_INFO, "Stats: profile %s at %u Hz, %llu samples buffered, %llu dropped, "
+                "%llu dumped\n", prof.running ? "running" : "stopped", prof.hz,
+                (unsigned long long)prof.samples, (unsigned long long)prof.dropped,
+                (unsigned long long)prof.dumped);
+    }
+    lock_count = aesd_lock_get_stats(locks, MAX_LOCK_STATS);
+    for (f = 0; f < lock_count; f++) {
+        struct aesd_lock_stats *l = &locks[f];
+        int s;
+
+        if (l->acquisitions == 0) {
+            continue;
+        }
+        syslog(LOG_INFO, "Stats: lock %s%s %llu acquisitions %llu contended (%.1f%%), "
+                "wait avg %.1f p50 %.1f p99 %.1f max %.1f us, "
+                "hold avg %.1f p50 %.1f p99 %.1f max %.1f us\n", l->name,
+                aesd_lock_profiling() ? "" : " (profiling off)",
+                (unsigned long long)l->acquisitions, (unsigned long long)l->contended,
+                l->contended * 100.0 / l->acquisitions,
+                l->contended ? l->wait_ns / 1e3 / l->contended : 0.0,
+                l->wait_p50_ns / 1e3, l->wait_p99_ns / 1e3, l->wait_max_ns / 1e3,
+                l->hold_ns / 1e3 / l->acquisitions, l->hold_p50_ns / 1e3,
+                l->hold_p99_ns / 1e3, l->hold_max_ns / 1e3);
+        for (s = 0; (s < AESD_LOCK_TOP_SITES) && (l->top[s].func != NULL); s++) {
+            syslog(LOG_INFO, "Stats: lock %s site %s:%d waited %.3f ms in %llu of %llu "
+                    "acquisitions, held %.3f ms\n", l->name, l->top[s].func, l->top[s].line,
+                    l->top[s].wait_ns / 1e6, (unsigned long long)l->top[s].contended,
+                    (unsigned long long)l->top[s].acquisitions, l->top[s].hold_ns / 1e6);
+        }
+    }
+    aesd_replica_get_stats(&replica);
+    if (replica.following) {
+        syslog(LOG_INFO, "Stats: following %s%s, applied to %llu acked to %llu, leader at %llu "
+                "(%llu behind), %llu records %llu bytes, %llu connects\n", config.follow,
+                replica.connected ? "" : " (disconnected)", (unsigned long long)replica.applied,
+                (unsigned long long)replica.acked, (unsigned long long)replica.leader_end,
+                (unsigned long long)((replica.leader_end > replica.applied) ?
+                                        replica.leader_end - replica.applied : 0),
+                (unsigned long long)replica.records, (unsigned long long)replica.bytes,
+                (unsigned long long)replica.connects);
+    }
+    follower_count = aesd_replica_get_followers(followers, MAX_FOLLOWER_STATS);
+    for (f = 0; f < follower_count; f++) {
+        syslog(LOG_INFO, "Stats: follower %s sent to %llu acked to %llu (%llu in flight), "
+                "%llu records, %llu full window waits\n", followers[f].name,
+                (unsigned long long)followers[f].sent, (unsigned long long)followers[f].acked,
+                (unsigned long long)(followers[f].sent - followers[f].acked),
+                (unsigned long long)followers[f].records,
+                (unsigned long long)followers[f].window_waits);
+    }
+    for (i = 0; i < listener_count; i++) {
+        struct listener *l = &listeners[i];
+
+        syslog(LOG_INFO, "Stats: listener %s%s active %u connections %lu "
+                "rx %llu tx %llu bytes\n", l->name, (l->fd == -1) ? " (closed)" : "",
+                __atomic_load_n(&(l->active), __ATOMIC_RELAXED),
+                __atomic_load_n(&(l->connections), __ATOMIC_RELAXED),
+                __atomic_load_n(&(l->rx_bytes), __ATOMIC_RELAXED),
+                __atomic_load_n(&(l->tx_bytes), __ATOMIC_RELAXED));
+    }
+}
+
+// Publish the connections using the most CPU into their ranks of values,
+// and their peers into texts. Ranks without a connection stay empty.
+static void publish_conn_stats(const struct head_thread *head, uint64_t *values,
+                                const char **texts, char (*peers)[INET6_ADDRSTRLEN + 8])
+{
+    const struct conn_usage *usage;
+    struct conn_report *reports;
+    char ip[INET6_ADDRSTRLEN];
+    unsigned int port;
+    size_t count, i;
+    int rank;
+
+    reports = report_conns(head, &count);
+    if (reports != NULL) {
+        qsort(reports, count, sizeof(*reports), compare_conn_cpu);
+    }
+    for (i = 0; i < TOP_CONNS; i++) {
+        rank = i + 1;
+        peers[i][0] = '\0';
+        texts[CONN_TOP_FIELD(rank, CONN_TOP_PEER)] = peers[i];
+        values[CONN_TOP_FIELD(rank, CONN_TOP_PEER)] = 0;
+        values[CONN_TOP_FIELD(rank, CONN_TOP_CPU_NS)] = 0;
+        values[CONN_TOP_FIELD(rank, CONN_TOP_BUFFERED)] = 0;
+        values[CONN_TOP_FIELD(rank, CONN_TOP_RX_PEAK)] = 0;
+        values[CONN_TOP_FIELD(rank, CONN_TOP_REPLY_BYTES)] = 0;
+        if (i >= count) {
+            continue;
+        }
+        usage = &(reports[i].conn->usage);
+        port = conn_peer(reports[i].conn, ip, sizeof(ip));
+        if (port == 0) {
+            snprintf(peers[i], sizeof(peers[i]), "%s", ip);
+        } else {
+            snprintf(peers[i], sizeof(peers[i]),
+                        (reports[i].conn->client_addr.ss_family == AF_INET6) ? "[%s]:%u" : "%s:%u",
+                        ip, port);
+        }
+        values[CONN_TOP_FIELD(rank, CONN_TOP_CPU_NS)] = reports[i].cpu_ns;
+        values[CONN_TOP_FIELD(rank, CONN_TOP_BUFFERED)] =
+            __atomic_load_n(&(usage->rx_buffered), __ATOMIC_RELAXED) +
+            __atomic_load_n(&(usage->queued), __ATOMIC_RELAXED);
+        values[CONN_TOP_FIELD(rank, CONN_TOP_RX_PEAK)] =
+            __atomic_load_n(&(usage->rx_peak), __ATOMIC_RELAXED);
+        values[CONN_TOP_FIELD(rank, CONN_TOP_REPLY_BYTES)] =
+            __atomic_load_n(&(usage->reply_bytes), __ATOMIC_RELAXED);
+    }
+    free(reports);
+}
+
+// Publish the counters into the --stats-page file, from the main loop
+static void publish_stats(const struct head_thread *head)
+{
+    struct aesd_admission_stats admission;
+    struct aesd_history_stats history;
+    struct aesd_cold_stats cold;
+    struct aesd_replica_stats replica;
+    struct aesd_capture_stats capture;
+    struct aesd_prof_stats prof;
+    struct aesd_replica_follower followers[MAX_FOLLOWER_STATS];
+    uint64_t values[STAT_FIELDS];
+    const char *texts[STAT_FIELDS] = { NULL };
+    char peers[TOP_CONNS][INET6_ADDRSTRLEN + 8];
+    size_t trace_rings;
+    uint64_t trace_events = 0;
+
+    aesd_admission_get_stats(&admission);
+    aesd_history_get_stats(&history);
+    aesd_cold_get_stats(&cold);
+    aesd_replica_get_stats(&replica);
+    aesd_capture_get_stats(&capture);
+    aesd_prof_get_stats(&prof);
+    aesd_trace_get_stats(&trace_rings, &trace_events);
+
+    values[STAT_CONNECTIONS] = admission.connections;
+    values[STAT_ACCEPTED] = admission.accepted;
+    values[STAT_QUEUED_BYTES] = admission.queued_bytes;
+    values[STAT_SHED_PRESSURE] = admission.shed_pressure;
+    values[STAT_SHED_CONNECTIONS] = admission.shed_connections;
+    values[STAT_SHED_QUEUED] = admission.shed_queued;
+    values[STAT_REPLIES_DEFERRED] = admission.replies_deferred;
+    values[STAT_SHEDDING] = admission.shedding;
+    values[STAT_DEFERRING] = admission.deferring;
+    values[STAT_PRESSURE_CPU] = aesd_statpage_real(admission.avg10[AESD_PSI_CPU]);
+    values[STAT_PRESSURE_MEMORY] = aesd_statpage_real(admission.avg10[AESD_PSI_MEMORY]);
+    values[STAT_PRESSURE_IO] = aesd_statpage_real(admission.avg10[AESD_PSI_IO]);
+    values[STAT_HISTORY_RECORDS] = history.records;
+    values[STAT_HISTORY_START] = history.start;
+    values[STAT_HISTORY_END] = history.end;
+    values[STAT_HISTORY_DROPPED] = history.records_dropped;
+    values[STAT_HISTORY_SEGMENTS] = history.segments;
+    values[STAT_DURABLE] = history.durable;
+    values[STAT_APPENDS] = history.appends;
+    values[STAT_DURABLE_APPENDS] = history.durable_appends;
+    values[STAT_SYNCS] = history.syncs;
+    values[STAT_SYNC_US_TOTAL] = history.sync_us_total;
+    values[STAT_SYNC_US_MAX] = history.sync_us_max;
+    values[STAT_SYNC_FAILED] = history.sync_failed;
+    values[STAT_COLD_BLOCKS] = cold.blocks;
+    values[STAT_COLD_RAW_BYTES] = cold.raw_bytes;
+    values[STAT_COLD_COMP_BYTES] = cold.comp_bytes;
+    values[STAT_COLD_DECODES] = cold.decodes;
+    values[STAT_COLD_CRC_ERRORS] = cold.crc_errors;
+    values[STAT_CAPTURE_RECORDS] = capture.records;
+    values[STAT_CAPTURE_DROPPED] = capture.dropped;
+    values[STAT_REPLICA_CONNECTED] = replica.connected;
+    values[STAT_REPLICA_APPLIED] = replica.applied;
+    values[STAT_REPLICA_LEADER_END] = replica.leader_end;
+    values[STAT_REPLICA_CONNECTS] = replica.connects;
+    values[STAT_FOLLOWERS] = aesd_replica_get_followers(followers, MAX_FOLLOWER_STATS);
+    values[STAT_TRACE_EVENTS] = trace_events;
+    values[STAT_PROFILE_SAMPLES] = prof.samples;
+    values[STAT_PROFILE_DROPPED] = prof.dropped;
+    publish_conn_stats(head, values, texts, peers);
+    aesd_statpage_publish(values, texts);
+}
+
+// Hold the queued replies back until the records this client appended are
+// on disk, in batch durability mode. Waiting right before the send lets every
+// packet of a read, and every other client appending meanwhile, share one
+// fdatasync(). Returns false if they never will be.
+static bool wait_durable(struct thread_info *client_info)
+{
+    uint64_t trace_start;
+    int status;
+
+    if (client_info->durable_wait == 0) {
+        return true;
+    }
+    trace_start = aesd_trace_begin();
+    status = aesd_history_wait_durable(client_info->durable_wait);
+    aesd_trace_end(AESD_TRACE_DURABLE, trace_start, 0);
+    if (status == -1) {
+        syslog(LOG_ERR, "Error appends not made durable: %s\n", strerror(errno));
+        return false;
+    }
+    client_info->durable_wait = 0;
+    return true;
+}
+
+// Append the payload of a binary frame to the history and queue the reply.
+// Returns false if the connection must be closed.
+static bool append_frame(struct thread_info *client_info, FILE *data_file,
+                            const char *payload, size_t len)
+{
+    int status = 0;
+    bool appended = false;
+    uint64_t trace_start;
+
+    // Queries are answered without appending anything
+    if ((len >= AESD_QUERY_PREFIX_LEN) &&
+        (memcmp(payload, AESD_QUERY_PREFIX, AESD_QUERY_PREFIX_LEN) == 0)) {
+        return dispatch_query(client_info, data_file, payload + AESD_QUERY_PREFIX_LEN,
+                                len - AESD_QUERY_PREFIX_LEN);
+    }
+
+    if (__atomic_load_n(&read_only, __ATOMIC_RELAXED)) {
+        syslog(LOG_ERR, "Error refusing a frame to append on a read-only follower\n");
+        return false;
+    }
+
+    // Wait for this source's fair turn at the append stage
+    trace_start = aesd_trace_begin();
+    aesd_fairq_enter(&append_queue, &(client_info->source->flow), len);
+    aesd_trace_end(AESD_TRACE_FAIRQ, trace_start, len);
+
+    trace_start = aesd_trace_begin();
+    status = aesd_lock(client_info->mutex);
+    aesd_trace_end(AESD_TRACE_LOCK, trace_start, 0);
+    if (status) {
+        syslog(LOG_ERR, "aesd_lock(): %s\n", strerror(status));
+        aesd_fairq_leave(&append_queue);
+        return false;
+    }
+
+    trace_start = aesd_trace_begin();
+    appended = (aesd_history_append(data_file, payload, len, &(client_info->durable_wait)) == 0);
+    aesd_trace_end(AESD_TRACE_APPEND, trace_start, len);
+    if (!appended) {
+        syslog(LOG_ERR, "Error aesd_history_append(): %s\n", strerror(errno));
+    }
+    rewind_history(data_file);
+
+    status = aesd_unlock(client_info->mutex);
+    aesd_fairq_leave(&append_queue);
+    if (status) {
+        syslog(LOG_ERR, "aesd_unlock(): %s\n", strerror(status));
+        return false;
+    }
+
+    if (!appended) {
+        return false;
+    }
+
+    // Same reply as a newline packet gets, deferred under pressure
+    if ((client_info->deferred_replies > 0) || aesd_admission_defer_replies()) {
+        client_info->deferred_replies++;
+        aesd_admission_count_deferred();
+        return true;
+    }
+    return queue_reply(client_info, data_file);
+}
+
+// Append every complete frame at the start of the len buffered bytes and
+// queue their replies, without looking at the payload bytes. Returns the
+// number of bytes consumed or -1 if the connection must be closed, and sets
+// *frame_size to the buffer size the next frame needs.
+static ssize_t consume_frames(struct thread_info *client_info, FILE *data_file,
+                                const char *buf, size_t len, size_t *frame_size)
+{
+    size_t used = 0;
+    uint64_t payload_len = 0;
+    int header_len;
+
+    while (1) {
+        header_len = aesd_frame_get_varint(buf + used, len - used, &payload_len);
+        if ((header_len == -1) || ((header_len > 0) && (payload_len > MAX_FRAME_PAYLOAD))) {
+            syslog(LOG_ERR, "Error invalid frame header\n");
+            return -1;
+        }
+
+        if (header_len == 0) {
+            *frame_size = AESD_FRAME_VARINT_MAX;
+            return used;
+        }
+
+        if (len - used - header_len < payload_len) {
+            *frame_size = header_len + payload_len;
+            return used;
+        }
+
+        if (!append_frame(client_info, data_file, buf + used + header_len, payload_len)) {
+            return -1;
+        }
+        used += header_len + payload_len;
+    }
+}
+
+// Whether replication streams have to end, as the server exits or hands over
+static bool replica_stopping(void)
+{
+    return exit_status || __atomic_load_n(&handoff_ready, __ATOMIC_RELAXED);
+}
+
+// Stream the history to the follower on this connection until it goes away.
+// The stream has heartbeats of its own, so none of the deadlines apply.
+static void serve_follower(struct thread_info *client_info, const char *name,
+                            const char *buf, size_t len)
+{
+    uint64_t since[CONN_DEADLINES] = { 0 };
+
+    client_set_deadlines(client_info, since);
+    aesd_timer_del(&conn_wheel, &(client_info->timer));
+    aesd_replica_serve(client_info->client_fd, name, buf, len, config.data_path,
+                        replica_stopping);
+}
+
+void* client_thread_func (void *thread_args)
+{
+    struct thread_info* client_info = (struct thread_info*)thread_args;
+    int client_errors = 0;
+    bool tmp_file_open = false;
+    bool rx_done = false;
+    uint64_t now_ms = monotonic_ms();
+    uint64_t last_rx_ms = now_ms;       // Last time bytes arrived
+    uint64_t partial_ms = 0;            // First byte of the buffered partial packet
+    uint64_t last_tx_ms = 0;            // Last reply progress while replies are queued
+    bool handed_off = false;
+    bool handoff_failed = false;
+
+    // Log message to syslog "Accepted connection from <CLIENT_IP_ADDRESS>"
+    char client_ip[INET6_ADDRSTRLEN];
+    bool client_inet = (client_info->client_addr.ss_family == AF_INET) ||
+                        (client_info->client_addr.ss_family == AF_INET6);
+    memset(client_ip, 0, sizeof(client_ip));
+    if (client_inet) {
+        inet_ntop(client_info->client_addr.ss_family, 
+                    get_in_addr((struct sockaddr*)&(client_info->client_addr)), 
+                    client_ip, 
+                    sizeof(client_ip));
+    } else {
+        snprintf(client_ip, sizeof(client_ip), "unix socket");
+    }
+    syslog(LOG_INFO, "Accepted connection from %s\n", client_ip);
+
+    int rx_size = READ_SIZE;
+    int rx_bytes = 0;
+    char* rx_buffer = malloc(rx_size);
+
+    if (rx_buffer == NULL) {
+        syslog(LOG_ERR, "Error failed to malloc()\n");
+        close(client_info->client_fd);
+        client_info->client_connected = false;
+        client_info->thread_complete = true;
+        client_errors++;
+        cleanup(false);
+        pthread_exit(&client_errors);
+    }
+
+    // Zero memory before reading
+    memset(rx_buffer, 0, rx_size);
+    int total_bytes = 0;
+    int bytes_to_read = 0;
+    int scanned = 0;                    // Buffered bytes known to hold no newline
+    ssize_t consumed = 0;
+    size_t frame_size = 0;
+    char* p_end = NULL;
+    uint64_t trace_start = 0;
+
+    // Create file to write packets to
+    FILE* data_file = fopen(config.data_path, "a+e");
+
+    if (data_file == NULL) {
+        syslog(LOG_ERR, "Error fopen(): %s\n", strerror(errno));
+        if (rx_buffer != NULL) {
+            free(rx_buffer);
+            rx_buffer = NULL;
+        }
+        close(client_info->client_fd);
+        client_info->client_connected = false;
+        client_info->thread_complete = true;
+        client_errors++;
+        cleanup(false);
+        pthread_exit(&client_errors);
+    } else {
+        tmp_file_exists = true;
+        tmp_file_open = true;
+    }
+
+    // Stages of this connection's packets are traced into a ring of its own
+    aesd_trace_attach();
+
+    // Replies are queued and written out as the socket becomes writable so a
+    // slow reader can never block this thread inside send()
+    int fd_flags = fcntl(client_info->client_fd, F_GETFL);
+    if ((fd_flags == -1) ||
+        (fcntl(client_info->client_fd, F_SETFL, fd_flags | O_NONBLOCK) == -1)) {
+        syslog(LOG_ERR, "Error fcntl(): %s\n", strerror(errno));
+        client_errors++;
+    }
+
+    // Replies are written in large chunks with MSG_MORE, so Nagle only delays
+    // the final segment of each reply. Disable it. Unix sockets have neither.
+    int sockopt_yes = 1;
+    if (client_inet && (setsockopt(client_info->client_fd, IPPROTO_TCP, TCP_NODELAY,
+                                    &sockopt_yes, sizeof(sockopt_yes)) == -1)) {
+        syslog(LOG_ERR, "Error setsockopt(TCP_NODELAY): %s\n", strerror(errno));
+    }
+
+    // Large replies are sent straight out of a mapping of the data file
+    if (client_inet && (config.zerocopy_threshold > 0)) {
+        if (setsockopt(client_info->client_fd, SOL_SOCKET, SO_ZEROCOPY,
+                        &sockopt_yes, sizeof(sockopt_yes)) == -1) {
+            syslog(LOG_ERR, "Error setsockopt(SO_ZEROCOPY): %s\n", strerror(errno));
+        } else {
+            client_info->zerocopy = true;
+        }
+    }
+
+    while (!client_errors) {
+        struct pollfd client_pollfds[3];
+        struct pollfd *p_client_pollfd = &client_pollfds[0];
+        int poll_ms = -1;
+        size_t rx_allowed = 0;
+        size_t tx_allowed = 0;
+        ssize_t tx_bytes = 0;
+
+        // Pressure has eased, queue the replies held back so far
+        if ((client_info->deferred_replies > 0) && !aesd_admission_defer_replies() &&
+            !queue_deferred_replies(client_info, data_file)) {
+            client_errors++;
+            break;
+        }
+
+        aesd_admission_queued(&(client_info->queued_reported), client_info->sendq.queued);
+        store_usage(client_info, total_bytes, rx_size);
+
+        // Client is done sending and every reply has been written
+        if (rx_done && aesd_sendq_empty(&(client_info->sendq)) &&
+            (client_info->deferred_replies == 0)) {
+            break;
+        }
+
+        if ((client_info->deferred_replies > 0) && (poll_ms > DEFER_POLL_MS)) {
+            poll_ms = DEFER_POLL_MS;
+        }
+
+        // Once a new server has taken over the listener, pass it every
+        // connection with nothing buffered here. Unread bytes stay in the
+        // socket for the new server to read.
+        if (__atomic_load_n(&handoff_ready, __ATOMIC_RELAXED) && !handoff_failed &&
+            !rx_done && (total_bytes == 0) && aesd_sendq_empty(&(client_info->sendq)) &&
+            (client_info->deferred_replies == 0)) {
+            if (aesd_handoff_send(handoff_chan,
+                                    (client_info->framing == AESD_FRAME_BINARY) ?
+                                        AESD_HANDOFF_FRAMED : AESD_HANDOFF_CLIENT,
+                                    client_info->client_fd) == 0) {
+                handed_off = true;
+                break;
+            }
+            syslog(LOG_ERR, "Error handing off connection from %s: %s\n", client_ip, strerror(errno));
+            handoff_failed = true;
+        }
+
+        // Idle only counts while nothing is buffered, queued or held back
+        now_ms = monotonic_ms();
+        if (aesd_sendq_empty(&(client_info->sendq))) {
+            last_tx_ms = 0;
+        } else if (last_tx_ms == 0) {
+            last_tx_ms = now_ms;
+        }
+        {
+            uint64_t since[CONN_DEADLINES] = { 0 };
+
+            if (!rx_done && (total_bytes == 0) && (last_tx_ms == 0) &&
+                (client_info->deferred_replies == 0)) {
+                since[DEADLINE_IDLE] = last_rx_ms;
+            }
+            since[DEADLINE_HEADER] = partial_ms;
+            since[DEADLINE_REPLY] = last_tx_ms;
+            client_set_deadlines(client_info, since);
+        }
+
+        // Only wait for directions the client still has rate tokens for, the
+        // poll timeout wakes the thread once the buckets have refilled.
+        // Otherwise it sleeps until the socket or a wake eventfd is ready,
+        // deadlines shut the socket down from the timer wheel.
+        p_client_pollfd->fd = client_info->client_fd;
+        p_client_pollfd->events = 0;
+        p_client_pollfd->revents = 0;
+        if (!rx_done) {
+            rx_allowed = aesd_rl_allowance(&(client_info->buckets[AESD_RL_INGEST]),
+                                            client_info->source, AESD_RL_INGEST, &poll_ms);
+            if (rx_allowed > 0) {
+                p_client_pollfd->events |= POLLIN;
+            }
+        }
+        if (!aesd_sendq_empty(&(client_info->sendq))) {
+            tx_allowed = aesd_rl_allowance(&(client_info->buckets[AESD_RL_REPLY]),
+                                            client_info->source, AESD_RL_REPLY, &poll_ms);
+            if (tx_allowed > 0) {
+                p_client_pollfd->events |= POLLOUT;
+            }
+        }
+        client_pollfds[1].fd = exit_wake_fd;
+        client_pollfds[1].events = POLLIN;
+        client_pollfds[1].revents = 0;
+        // Once set it stays readable, only wait on it while it means a handoff
+        client_pollfds[2].fd = (__atomic_load_n(&handoff_ready, __ATOMIC_RELAXED) ||
+                                handoff_failed) ? -1 : handoff_wake_fd;
+        client_pollfds[2].events = POLLIN;
+        client_pollfds[2].revents = 0;
+
+        if (poll(client_pollfds, 3, poll_ms) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_ERR, "Error poll(): %s\n", strerror(errno));
+            client_errors++;
+            break;
+        }
+
+        if (exit_status) {
+            break;
+        }
+
+        if (__atomic_load_n(&(client_info->timed_out), __ATOMIC_RELAXED)) {
+            syslog(LOG_INFO, "Closing connection from %s after %s timeout\n", client_ip,
+                    deadline_names[client_info->timed_out - 1]);
+            break;
+        }
+
+        if (p_client_pollfd->revents & POLLNVAL) {
+            client_errors++;
+            break;
+        }
+
+        // Zerocopy completions are reported through the socket error queue
+        if ((p_client_pollfd->revents & POLLERR) && client_info->zerocopy) {
+            if (aesd_sendq_reap_zerocopy(&(client_info->sendq), client_info->client_fd) == -1) {
+                syslog(LOG_ERR, "Error recvmsg(MSG_ERRQUEUE): %s\n", strerror(errno));
+                client_errors++;
+                break;
+            }
+        }
+
+        if ((p_client_pollfd->revents & (POLLOUT | POLLERR)) && (tx_allowed > 0)) {
+            if (!wait_durable(client_info)) {
+                client_errors++;
+                break;
+            }
+            trace_start = aesd_trace_begin();
+            tx_bytes = aesd_sendq_flush(&(client_info->sendq), client_info->client_fd, tx_allowed);
+            aesd_trace_end(AESD_TRACE_SEND, trace_start, (tx_bytes > 0) ? tx_bytes : 0);
+            if (tx_bytes == -1) {
+                syslog(LOG_ERR, "Error send(): %s\n", strerror(errno));
+                client_errors++;
+                break;
+            }
+            aesd_rl_consume(&(client_info->buckets[AESD_RL_REPLY]), client_info->source,
+                            AESD_RL_REPLY, tx_bytes);
+            listener_count_bytes(client_info, 0, tx_bytes);
+            if (tx_bytes > 0) {
+                last_tx_ms = monotonic_ms();
+            }
+        }
+
+        if (!(p_client_pollfd->revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+
+        // Hung up while throttled, sleep out the wait instead of spinning on POLLHUP
+        if (rx_allowed == 0) {
+            if (!(p_client_pollfd->revents & POLLOUT)) {
+                poll(NULL, 0, (poll_ms < 0) ? DEFER_POLL_MS : poll_ms);
+            }
+            continue;
+        }
+
+        bytes_to_read = rx_size - total_bytes;
+
+        if (bytes_to_read == 0) {
+            // Increase size of rx_buffer
+            rx_size += READ_SIZE;
+            bytes_to_read = READ_SIZE;
+            rx_buffer = realloc(rx_buffer, rx_size);
+            if (rx_buffer == NULL) {
+                syslog(LOG_ERR, "Error failed to realloc()\n");
+                client_errors++;
+                break; // send to cleanup
+            }
+            memset(&(rx_buffer[total_bytes]), 0, READ_SIZE);
+        }
+
+        if ((size_t)bytes_to_read > rx_allowed) {
+            bytes_to_read = rx_allowed;
+        }
+
+        trace_start = aesd_trace_begin();
+        rx_bytes = recv(client_info->client_fd,
+                        &(rx_buffer[total_bytes]),
+                        bytes_to_read,
+                        0);
+        aesd_trace_end(AESD_TRACE_RECV, trace_start, (rx_bytes > 0) ? rx_bytes : 0);
+
+        if (rx_bytes == -1) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+                continue;
+            }
+            syslog(LOG_ERR, "Error recv(): %s\n", strerror(errno));
+            client_errors++;
+            break;
+        }
+
+        if (rx_bytes == 0) {
+            rx_done = true; // Client is done sending, finish queued replies
+            aesd_capture_shut(client_info->capture_conn);
+            continue;
+        }
+
+        aesd_capture_data(client_info->capture_conn, &(rx_buffer[total_bytes]), rx_bytes);
+        __atomic_store_n(&(client_info->usage.rx_bytes), client_info->usage.rx_bytes + rx_bytes,
+                            __ATOMIC_RELAXED);
+
+        aesd_rl_consume(&(client_info->buckets[AESD_RL_INGEST]), client_info->source,
+                        AESD_RL_INGEST, rx_bytes);
+        listener_count_bytes(client_info, rx_bytes, 0);
+        last_rx_ms = monotonic_ms();
+        if (total_bytes == 0) {
+            partial_ms = last_rx_ms;
+        }
+        total_bytes += rx_bytes;
+
+        // A connection that opens with the frame magic sends binary frames
+        if (client_info->framing == AESD_FRAME_UNKNOWN) {
+            client_info->framing = aesd_frame_detect(rx_buffer, total_bytes);
+            if (client_info->framing == AESD_FRAME_BINARY) {
+                total_bytes -= AESD_FRAME_MAGIC_LEN;
+                memmove(rx_buffer, rx_buffer + AESD_FRAME_MAGIC_LEN, total_bytes);
+            }
+        }
+
+        // A follower takes over the connection for as long as it replicates
+        if (client_info->framing == AESD_FRAME_REPLICA) {
+            serve_follower(client_info, client_ip, rx_buffer + AESD_FRAME_MAGIC_LEN,
+                            total_bytes - AESD_FRAME_MAGIC_LEN);
+            break;
+        }
+
+        if (client_info->framing == AESD_FRAME_BINARY) {
+            consumed = consume_frames(client_info, data_file, rx_buffer, total_bytes, &frame_size);
+            if (consumed == -1) {
+                client_errors++;
+                break;
+            }
+            if (consumed > 0) {
+                total_bytes -= consumed;
+                memmove(rx_buffer, rx_buffer + consumed, total_bytes);
+                partial_ms = (total_bytes > 0) ? last_rx_ms : 0;
+            }
+
+            // Room for the whole next frame so it arrives in large reads
+            if (frame_size > (size_t)rx_size) {
+                char *p_grown = realloc(rx_buffer, frame_size);
+                if (p_grown == NULL) {
+                    syslog(LOG_ERR, "Error failed to realloc()\n");
+                    client_errors++;
+                    break;
+                }
+                rx_buffer = p_grown;
+                rx_size = frame_size;
+            }
+        }
+
+        // check buffer for '\n' newline character
+        // If it exists, append to file and send back on client 
+        // check for all '\n' characters, after transmitting
+        // move all data down to zero index of malloc'd packet
+        // USE memchr() to find \n characters, only in bytes not searched
+        // before, so payloads may hold any other byte
+        if (client_info->framing == AESD_FRAME_NEWLINE) {
+            while (1) {
+                int status = 0, num_tokens = 0;
+                bool reply_from_start = false;
+                struct aesd_seekto ioctl_arg;
+                memset(&ioctl_arg, 0, sizeof(ioctl_arg));
+
+                // Check for newline
+                p_end = memchr(rx_buffer + scanned, '\n', total_bytes - scanned);
+
+                if (p_end == NULL) {
+                    scanned = total_bytes;
+                    break; // no newline found
+                }
+                scanned = 0;
+
+                // Write packet to file
+                char* p = rx_buffer;
+                int packet_len = p_end - p;
+
+                // Queries are answered without appending anything
+                if (strncmp(p, AESD_QUERY_PREFIX, AESD_QUERY_PREFIX_LEN) == 0) {
+                    if (!dispatch_query(client_info, data_file, p + AESD_QUERY_PREFIX_LEN,
+                                        packet_len - AESD_QUERY_PREFIX_LEN)) {
+                        client_errors++;
+                        break;
+                    }
+                    total_bytes -= packet_len + 1;
+                    memmove(rx_buffer, p_end + 1, total_bytes);
+                    partial_ms = (total_bytes > 0) ? last_rx_ms : 0;
+                    continue;
+                }
+
+                if (__atomic_load_n(&read_only, __ATOMIC_RELAXED)) {
+                    syslog(LOG_ERR, "Error refusing a packet to append from %s on a "
+                            "read-only follower\n", client_ip);
+                    client_errors++;
+                    break;
+                }
+
+                // Wait for this source's fair turn at the append stage
+                trace_start = aesd_trace_begin();
+                aesd_fairq_enter(&append_queue, &(client_info->source->flow), packet_len + 1);
+                aesd_trace_end(AESD_TRACE_FAIRQ, trace_start, packet_len + 1);
+
+                trace_start = aesd_trace_begin();
+                status = aesd_lock(client_info->mutex);
+                aesd_trace_end(AESD_TRACE_LOCK, trace_start, 0);
+                if (status) {
+                    syslog(LOG_ERR, "aesd_lock(): %s\n", strerror(status));
+                    aesd_fairq_leave(&append_queue);
+                    client_errors++;
+                    break;
+                }
+
+                // Special handling for AESDCHAR_IOCSEEKTO:X,Y commands
+                if (strncmp(p, "AESDCHAR_IOCSEEKTO:", AESD_IOCTL_PREFIX_LEN) == 0) {
+                    syslog(LOG_INFO, "Received AESDCHAR_IOCSEEKTO command.\n");
+                    // Keep strtok() inside this packet
+                    *p_end = '\0';
+                    p += AESD_IOCTL_PREFIX_LEN;
+                    char *token = strtok(p, ",");
+
+                    if (token != NULL) {
+                        ioctl_arg.write_cmd = (uint32_t)strtoul(token, NULL, 10);
+                        num_tokens++;
+
+                        // Get next token
+                        token = strtok(NULL, ",");
+
+                        if (token != NULL) {
+                            ioctl_arg.write_cmd_offset = (uint32_t)strtoul(token, NULL, 10);
+                            num_tokens++;
+                        } else {
+                            syslog(LOG_ERR, "write_cmd_offset missing.\n");
+                            client_errors++;
+                        }
                     } else {
                         syslog(LOG_ERR, "write_cmd missing.\n");
                         client_errors++;
                     }
 
-                    int data_fd = fileno(data_file);
+                    int data_fd = fileno(data_file);
+
+                    if ((!client_errors) && (num_tokens == 2)) {
+                        if(ioctl(data_fd, AESDCHAR_IOCSEEKTO, &ioctl_arg)) {
+                            syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s\n", 
+                                strerror(errno));
+                            client_errors++;
+                        }
+                    }
+                    p = p_end + 1;
+                    total_bytes -= packet_len + 1;
+
+                } else {
+                    // Normal write received command to file
+                    trace_start = aesd_trace_begin();
+                    status = aesd_history_append(data_file, p, packet_len + 1,
+                                                &(client_info->durable_wait));
+                    aesd_trace_end(AESD_TRACE_APPEND, trace_start, packet_len + 1);
+                    if (status == -1) {
+                        syslog(LOG_ERR, "Error aesd_history_append(): %s\n", strerror(errno));
+                        client_errors++;
+                    }
+                    p += packet_len + 1;
+                    total_bytes -= packet_len + 1;
+
+                    // Reset file pointer to read from beginning of file for
+                    // sending file back
+                    rewind_history(data_file);
+                    reply_from_start = true;
+                }
+
+                status = aesd_unlock(client_info->mutex);
+                aesd_fairq_leave(&append_queue);
+                if (status) {
+                    syslog(LOG_ERR, "aesd_unlock(): %s\n", strerror(status));
+                    client_errors++;
+                    break;
+                }
+
+                // Remove saved packet and shift data down to start of buffer.
+                memmove(rx_buffer, p, total_bytes);
+
+                // Any leftover bytes start the next packet's header deadline
+                partial_ms = (total_bytes > 0) ? last_rx_ms : 0;
+
+                // Queue contents of file to send back to client, unless the
+                // server is under pressure and full replies are held back
+                if (reply_from_start &&
+                    ((client_info->deferred_replies > 0) || aesd_admission_defer_replies())) {
+                    client_info->deferred_replies++;
+                    aesd_admission_count_deferred();
+                } else if (!queue_reply(client_info, data_file)) {
+                    client_errors++;
+                    break;
+                }
+            }
+        }
+
+        // Write out as much of the reply as the socket and rate limit take
+        // right now, the rest goes out as poll() reports the socket writable
+        tx_allowed = aesd_rl_allowance(&(client_info->buckets[AESD_RL_REPLY]),
+                                        client_info->source, AESD_RL_REPLY, &poll_ms);
+        if (!wait_durable(client_info)) {
+            client_errors++;
+            break;
+        }
+        trace_start = aesd_trace_begin();
+        tx_bytes = aesd_sendq_flush(&(client_info->sendq), client_info->client_fd, tx_allowed);
+        aesd_trace_end(AESD_TRACE_SEND, trace_start, (tx_bytes > 0) ? tx_bytes : 0);
+        if (tx_bytes == -1) {
+            syslog(LOG_ERR, "Error send(): %s\n", strerror(errno));
+            client_errors++;
+        } else {
+            aesd_rl_consume(&(client_info->buckets[AESD_RL_REPLY]), client_info->source,
+                            AESD_RL_REPLY, tx_bytes);
+            listener_count_bytes(client_info, 0, tx_bytes);
+        }
+    }
+
+    // Keep the data file mappings alive until the kernel has released them
+    while (aesd_sendq_zerocopy_pending(&(client_info->sendq))) {
+        struct pollfd zc_pollfd = { .fd = client_info->client_fd, .events = 0 };
+
+        if ((poll(&zc_pollfd, 1, ZEROCOPY_DRAIN_MS) <= 0) ||
+            (aesd_sendq_reap_zerocopy(&(client_info->sendq), client_info->client_fd) == -1)) {
+            syslog(LOG_ERR, "Error zerocopy sends still pending at close\n");
+            break;
+        }
+    }
+
+    struct tcp_info tcp_stats;
+    socklen_t tcp_stats_len = sizeof(tcp_stats);
+    memset(&tcp_stats, 0, sizeof(tcp_stats));
+    getsockopt(client_info->client_fd, IPPROTO_TCP, TCP_INFO, &tcp_stats, &tcp_stats_len);
+    struct rusage thread_usage;
+    memset(&thread_usage, 0, sizeof(thread_usage));
+    getrusage(RUSAGE_THREAD, &thread_usage);
+    syslog(LOG_DEBUG, "Connection %s: %lu replies, %llu bytes, %lu send() calls, "
+            "%u segments, %lu zerocopy sends (%lu copied), cpu user %.1f ms sys %.1f ms, "
+            "peak rx buffer %d\n", client_ip,
+            client_info->replies, client_info->reply_bytes,
+            client_info->sendq.send_calls, tcp_stats.tcpi_data_segs_out,
+            client_info->sendq.zc_completed, client_info->sendq.zc_copied,
+            thread_usage.ru_utime.tv_sec * 1e3 + thread_usage.ru_utime.tv_usec / 1e3,
+            thread_usage.ru_stime.tv_sec * 1e3 + thread_usage.ru_stime.tv_usec / 1e3, rx_size);
+    store_usage(client_info, 0, rx_size);
+    __atomic_store_n(&(client_info->usage.cpu_ns),
+                        (thread_usage.ru_utime.tv_sec + thread_usage.ru_stime.tv_sec) *
+                        1000000000ULL + (thread_usage.ru_utime.tv_usec +
+                        thread_usage.ru_stime.tv_usec) * 1000ULL, __ATOMIC_RELAXED);
+
+    aesd_sendq_destroy(&(client_info->sendq));
+    aesd_admission_queued(&(client_info->queued_reported), 0);
+
+    if (tmp_file_open) {
+        if (fclose(data_file) != 0) {
+            syslog(LOG_ERR, "Error fclose(): %s\n", strerror(errno));
+        }
+        tmp_file_open = false;
+    }
+
+    if (rx_buffer != NULL) {
+        free(rx_buffer);
+        rx_buffer = NULL;
+    }
+
+    // No timer callback may touch the socket once it is closed
+    aesd_timer_del(&conn_wheel, &(client_info->timer));
+    aesd_capture_disconnect(client_info->capture_conn);
+    aesd_trace_detach();
+
+    if (client_info->client_connected) {
+        close(client_info->client_fd);
+        client_info->client_connected = false;
+    }
+
+    // Log message to syslog "Closed connection from <CLIENT_IP_ADDRESS>"
+    if (handed_off) {
+        syslog(LOG_INFO, "Handed off connection from %s\n", client_ip);
+    } else {
+        syslog(LOG_INFO, "Closed connection from %s\n", client_ip);
+    }
+
+    client_info->thread_complete = true;
+    pthread_exit(&client_errors);
+}
+
+static void usage(void)
+{
+    printf("Usage: ./aesdsocket [-d] [--sendq-hwm BYTES] [--send-policy drop|truncate]\n"
+           "                    [--zerocopy-threshold BYTES]\n"
+           "                    [--conn-ingest-rate BPS] [--conn-reply-rate BPS]\n"
+           "                    [--ip-ingest-rate BPS] [--ip-reply-rate BPS]\n"
+           "                    [--ip-weight ADDR=WEIGHT]...\n"
+           "                    [--psi-shed cpu|memory|io=AVG10]...\n"
+           "                    [--psi-defer cpu|memory|io=AVG10]...\n"
+           "                    [--max-connections N] [--max-queued-bytes BYTES]\n"
+           "                    [--idle-timeout SEC] [--header-timeout SEC] [--reply-timeout SEC]\n"
+           "                    [--listen ADDR[:PORT] | --listen [ADDR6]:PORT ...]\n"
+           "                    [--unix-socket PATH] [--shm-socket PATH] [--shm-size BYTES]\n"
+           "                    [--retain-bytes BYTES] [--retain-records N] [--retain-age SEC]\n"
+           "                    [--durability none|periodic[:MS]|batch] [--checksums]\n"
+           "                    [--compress-cold BYTES] [--data-file PATH]\n"
+           "                    [--follow ADDR[:PORT] | --follow [ADDR6]:PORT | --follow PATH]\n"
+           "                    [--capture PATH] [--capture-limit BYTES] [--trace EVENTS]\n"
+           "                    [--lock-profile] [--profile HZ] [--stats-page PATH]\n"
+           "                    [--dump-dir DIR]\n");
+}
+
+// Parse a RESOURCE=AVG10 pressure threshold into thresholds
+static bool parse_psi_threshold(const char *arg, double *thresholds)
+{
+    const char *p_value = strchr(arg, '=');
+    char *p_end = NULL;
+    int res;
+
+    if (p_value == NULL) {
+        return false;
+    }
+
+    for (res = 0; res < AESD_PSI_RESOURCES; res++) {
+        if ((strlen(aesd_psi_names[res]) == (size_t)(p_value - arg)) &&
+            (strncmp(arg, aesd_psi_names[res], p_value - arg) == 0)) {
+            thresholds[res] = strtod(p_value + 1, &p_end);
+            return (*p_end == '\0') && (thresholds[res] >= 0) && (thresholds[res] <= 100);
+        }
+    }
+    return false;
+}
+
+// Parse none, batch, periodic or periodic:MS into the durability config
+static bool parse_durability(const char *arg)
+{
+    char *p_end = NULL;
+
+    if (strcmp(arg, "none") == 0) {
+        config.durability = AESD_DURABILITY_NONE;
+    } else if (strcmp(arg, "batch") == 0) {
+        config.durability = AESD_DURABILITY_BATCH;
+    } else if (strncmp(arg, "periodic", 8) == 0) {
+        config.durability = AESD_DURABILITY_PERIODIC;
+        if (arg[8] == ':') {
+            config.sync_period_ms = strtoul(arg + 9, &p_end, 10);
+            return (*p_end == '\0') && (config.sync_period_ms > 0);
+        }
+        return arg[8] == '\0';
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Split ADDR[:PORT] into host and port, IPv6 addresses with a port are
+// written [ADDR]:PORT. Returns false on a malformed address.
+static bool split_listen_addr(const char *spec, char *host, size_t host_len,
+                                char *port, size_t port_len)
+{
+    const char *p_colon = strrchr(spec, ':');
+    const char *p_host = spec;
+    size_t len;
+
+    snprintf(port, port_len, "%s", SERVER_PORT);
+
+    if (spec[0] == '[') {
+        const char *p_close = strchr(spec, ']');
+
+        if ((p_close == NULL) || ((p_close[1] != '\0') && (p_close[1] != ':'))) {
+            return false;
+        }
+        p_host = spec + 1;
+        len = p_close - p_host;
+        if (p_close[1] == ':') {
+            snprintf(port, port_len, "%s", p_close + 2);
+        }
+    } else if ((p_colon != NULL) && (strchr(spec, ':') == p_colon)) {
+        // A single colon separates an IPv4 address or host name from the port
+        len = p_colon - spec;
+        snprintf(port, port_len, "%s", p_colon + 1);
+    } else {
+        len = strlen(spec);
+    }
+
+    if ((len == 0) || (len >= host_len) || (port[0] == '\0')) {
+        return false;
+    }
+    memcpy(host, p_host, len);
+    host[len] = '\0';
+    return true;
+}
+
+// Parse command line options into config, returns false on invalid usage
+static bool parse_args(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"sendq-hwm",   required_argument, NULL, 'q'},
+        {"send-policy", required_argument, NULL, 'p'},
+        {"zerocopy-threshold", required_argument, NULL, 'z'},
+        {"conn-ingest-rate", required_argument, NULL, 'i'},
+        {"conn-reply-rate", required_argument, NULL, 'r'},
+        {"ip-ingest-rate", required_argument, NULL, 'I'},
+        {"ip-reply-rate", required_argument, NULL, 'R'},
+        {"ip-weight", required_argument, NULL, 'w'},
+        {"psi-shed", required_argument, NULL, 'S'},
+        {"psi-defer", required_argument, NULL, 'D'},
+        {"max-connections", required_argument, NULL, 'c'},
+        {"max-queued-bytes", required_argument, NULL, 'Q'},
+        {"idle-timeout", required_argument, NULL, 'T'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"reply-timeout", required_argument, NULL, 'Y'},
+        {"listen",      required_argument, NULL, 'l'},
+        {"unix-socket", required_argument, NULL, 'U'},
+        {"shm-socket",  required_argument, NULL, 'M'},
+        {"shm-size",    required_argument, NULL, 'm'},
+        {"retain-bytes", required_argument, NULL, 'b'},
+        {"retain-records", required_argument, NULL, 'n'},
+        {"retain-age",  required_argument, NULL, 'a'},
+        {"durability",  required_argument, NULL, 'f'},
+        {"checksums",   no_argument,       NULL, 'k'},
+        {"compress-cold", required_argument, NULL, 'C'},
+        {"data-file",   required_argument, NULL, 'P'},
+        {"follow",      required_argument, NULL, 'L'},
+        {"capture",     required_argument, NULL, 'x'},
+        {"capture-limit", required_argument, NULL, 'X'},
+        {"trace",       required_argument, NULL, 'F'},
+        {"lock-profile", no_argument,      NULL, 'K'},
+        {"profile",     required_argument, NULL, 'O'},
+        {"stats-page",  required_argument, NULL, 'G'},
+        {"dump-dir",    required_argument, NULL, 'W'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    char *p_end = NULL;
+    char *p_weight = NULL;
+    double *p_rate = NULL;
+    uint64_t *p_limit = NULL;
+    double timeout_sec = 0;
+    char listen_host[NI_MAXHOST];
+    char listen_port[NI_MAXSERV];
+
+    while ((opt = getopt_long(argc, argv, "d", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            // daemon mode specified
+            config.daemon = true;
+            break;
+        case 'q':
+            config.sendq_hwm = strtoul(optarg, &p_end, 10);
+            if ((*p_end != '\0') || (config.sendq_hwm == 0)) {
+                printf("ERROR: Invalid send queue high-water mark %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'p':
+            if (strcmp(optarg, "drop") == 0) {
+                config.send_policy = SEND_POLICY_DROP;
+            } else if (strcmp(optarg, "truncate") == 0) {
+                config.send_policy = SEND_POLICY_TRUNCATE;
+            } else {
+                printf("ERROR: Invalid send policy %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'z':
+            config.zerocopy_threshold = strtoul(optarg, &p_end, 10);
+            if (*p_end != '\0') {
+                printf("ERROR: Invalid zerocopy threshold %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'i':
+        case 'r':
+        case 'I':
+        case 'R':
+            if (opt == 'i') {
+                p_rate = &config.conn_rates[AESD_RL_INGEST];
+            } else if (opt == 'r') {
+                p_rate = &config.conn_rates[AESD_RL_REPLY];
+            } else if (opt == 'I') {
+                p_rate = &config.source_rates[AESD_RL_INGEST];
+            } else {
+                p_rate = &config.source_rates[AESD_RL_REPLY];
+            }
+            *p_rate = strtod(optarg, &p_end);
+            if ((*p_end != '\0') || (*p_rate < 0)) {
+                printf("ERROR: Invalid rate %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'w':
+            p_weight = strchr(optarg, '=');
+            if (p_weight == NULL) {
+                printf("ERROR: Invalid weight %s\n", optarg);
+                return false;
+            }
+            *p_weight++ = '\0';
+            if ((strtod(p_weight, &p_end) <= 0) || (*p_end != '\0') ||
+                (aesd_rl_set_source_weight(optarg, strtod(p_weight, NULL)) == -1)) {
+                printf("ERROR: Invalid weight %s\n", p_weight);
+                return false;
+            }
+            break;
+        case 'S':
+        case 'D':
+            if (!parse_psi_threshold(optarg, (opt == 'S') ? config.admission.shed_avg10 :
+                                                            config.admission.defer_avg10)) {
+                printf("ERROR: Invalid pressure threshold %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'c':
+            config.admission.max_connections = strtoul(optarg, &p_end, 10);
+            if (*p_end != '\0') {
+                printf("ERROR: Invalid connection limit %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'Q':
+            config.admission.max_queued_bytes = strtoul(optarg, &p_end, 10);
+            if (*p_end != '\0') {
+                printf("ERROR: Invalid queued bytes limit %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'T':
+        case 'H':
+        case 'Y':
+            timeout_sec = strtod(optarg, &p_end);
+            if ((*p_end != '\0') || (timeout_sec < 0)) {
+                printf("ERROR: Invalid timeout %s\n", optarg);
+                return false;
+            }
+            config.timeouts_ms[(opt == 'T') ? DEADLINE_IDLE :
+                               (opt == 'H') ? DEADLINE_HEADER : DEADLINE_REPLY] =
+                (uint64_t)(timeout_sec * 1000);
+            break;
+        case 'l':
+            if ((config.listen_addr_count == MAX_LISTENERS) ||
+                !split_listen_addr(optarg, listen_host, sizeof(listen_host),
+                                    listen_port, sizeof(listen_port))) {
+                printf("ERROR: Invalid listen address %s\n", optarg);
+                return false;
+            }
+            config.listen_addrs[config.listen_addr_count++] = optarg;
+            break;
+        case 'U':
+        case 'M':
+            if ((optarg[0] == '\0') ||
+                (strlen(optarg) >= sizeof(((struct sockaddr_un*)0)->sun_path))) {
+                printf("ERROR: Invalid unix socket path %s\n", optarg);
+                return false;
+            }
+            if (opt == 'U') {
+                config.unix_path = optarg;
+            } else {
+                config.shm_path = optarg;
+            }
+            break;
+        case 'm':
+            config.shm_size = strtoul(optarg, &p_end, 10);
+            if ((*p_end != '\0') || (config.shm_size == 0)) {
+                printf("ERROR: Invalid history mirror size %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'b':
+        case 'n':
+        case 'a':
+            p_limit = (opt == 'b') ? &config.retention.max_bytes :
+                        (opt == 'n') ? &config.retention.max_records :
+                        &config.retention.max_age_s;
+            *p_limit = strtoull(optarg, &p_end, 10);
+            if ((*p_end != '\0') || (*p_limit == 0)) {
+                printf("ERROR: Invalid retention limit %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'f':
+            if (!parse_durability(optarg)) {
+                printf("ERROR: Invalid durability mode %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'k':
+            config.checksums = true;
+            break;
+        case 'C':
+            config.retention.compress_after = strtoull(optarg, &p_end, 10);
+            if ((*p_end != '\0') || (config.retention.compress_after == 0)) {
+                printf("ERROR: Invalid compression distance %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'P':
+            if (optarg[0] == '\0') {
+                printf("ERROR: Invalid data file %s\n", optarg);
+                return false;
+            }
+            config.data_path = optarg;
+            break;
+        case 'L':
+            // A path names the leader's unix socket
+            config.follow_port[0] = '\0';
+            if (strchr(optarg, '/') != NULL) {
+                if (strlen(optarg) >= sizeof(((struct sockaddr_un*)0)->sun_path)) {
+                    printf("ERROR: Invalid unix socket path %s\n", optarg);
+                    return false;
+                }
+                snprintf(config.follow_host, sizeof(config.follow_host), "%s", optarg);
+            } else if (!split_listen_addr(optarg, config.follow_host, sizeof(config.follow_host),
+                                            config.follow_port, sizeof(config.follow_port))) {
+                printf("ERROR: Invalid leader address %s\n", optarg);
+                return false;
+            }
+            config.follow = optarg;
+            break;
+        case 'x':
+            if (optarg[0] == '\0') {
+                printf("ERROR: Invalid capture file %s\n", optarg);
+                return false;
+            }
+            config.capture_path = optarg;
+            break;
+        case 'X':
+            config.capture_limit = strtoull(optarg, &p_end, 10);
+            if ((*p_end != '\0') || (config.capture_limit == 0)) {
+                printf("ERROR: Invalid capture limit %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'F':
+            config.trace_events = strtoul(optarg, &p_end, 10);
+            if ((*p_end != '\0') || (config.trace_events == 0) ||
+                (config.trace_events > MAX_TRACE_EVENTS)) {
+                printf("ERROR: Invalid trace ring size %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'K':
+            config.lock_profile = true;
+            break;
+        case 'O':
+            config.profile_hz = strtoul(optarg, &p_end, 10);
+            if ((*p_end != '\0') || (config.profile_hz == 0) ||
+                (config.profile_hz > AESD_PROF_MAX_HZ)) {
+                printf("ERROR: Invalid profile rate %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'G':
+            config.stats_page = optarg;
+            break;
+        case 'W':
+            config.dump_dir = optarg;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    aesd_rl_set_source_rates(config.source_rates[AESD_RL_INGEST],
+                                config.source_rates[AESD_RL_REPLY]);
+
+    if (optind != argc) {
+        printf("ERROR: Invalid arguments %i\n", argc);
+        return false;
+    }
+
+#if USE_AESD_CHAR_DEVICE == 1
+    // The aesdchar device keeps its own bounded history
+    if ((config.retention.max_bytes > 0) || (config.retention.max_records > 0) ||
+        (config.retention.max_age_s > 0)) {
+        printf("ERROR: Retention limits need the data file, not the aesdchar device\n");
+        return false;
+    }
+    if (config.durability != AESD_DURABILITY_NONE) {
+        printf("ERROR: Durability modes need the data file, not the aesdchar device\n");
+        return false;
+    }
+    if (config.checksums) {
+        printf("ERROR: Checksums need the data file, not the aesdchar device\n");
+        return false;
+    }
+    if (config.retention.compress_after > 0) {
+        printf("ERROR: Compression needs the data file, not the aesdchar device\n");
+        return false;
+    }
+    if (config.data_path != TMP_FILE) {
+        printf("ERROR: The data file cannot be chosen with the aesdchar device\n");
+        return false;
+    }
+    if (config.follow != NULL) {
+        printf("ERROR: Following needs the data file, not the aesdchar device\n");
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+// Bind every address host (every local address when NULL) resolves to
+static bool open_listeners_for(const char *host, const char *port)
+{
+    int status = 0;
+    int bound = 0;
+    int sockopt_yes = 1;
+    int fd;
+    struct addrinfo *socket_addrinfo, *p_ai;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_protocol = DEFAULT_PROTOCOL;
+
+    status = getaddrinfo(host, port, &hints, &socket_addrinfo);
+
+    if (status != 0) {
+        syslog(LOG_ERR, "Error getaddrinfo(%s): %s\n", (host != NULL) ? host : "*",
+                gai_strerror(status));
+        return false;
+    }
+    
+    // Open a stream socket SOCK_STREAM bound to each address returned. IPv6
+    // sockets are v6 only so IPv4 clients land on the IPv4 socket.
+    for (p_ai = socket_addrinfo ; p_ai != NULL; p_ai = p_ai->ai_next) {
+
+        fd = socket(p_ai->ai_family,
+                    p_ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                    p_ai->ai_protocol);
+
+        if (fd == -1) {
+            syslog(LOG_ERR, "Error socket(): %s\n", strerror(errno));
+            continue;
+        }
+
+        status = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+                            &sockopt_yes, sizeof(sockopt_yes));
+        if ((status == 0) && (p_ai->ai_family == AF_INET6)) {
+            status = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+                                &sockopt_yes, sizeof(sockopt_yes));
+        }
+
+        if (status == -1) {
+            syslog(LOG_ERR, "Error setsockopt(): %s\n", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        status = bind(fd, p_ai->ai_addr, p_ai->ai_addrlen);
+        if (status == -1) {
+            syslog(LOG_ERR, "Error bind(): %s\n", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        if (!add_listener(fd)) {
+            close(fd);
+            break;
+        }
+        bound++;
+    }
+
+    // Free memory allocated in getaddrinfo() call
+    if (socket_addrinfo != NULL) {
+        freeaddrinfo(socket_addrinfo);
+        socket_addrinfo = NULL;
+    }
+
+    return bound > 0;
+}
+
+// Bind the configured listen addresses, or every local address of SERVER_PORT
+static bool open_listeners(void)
+{
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    int i;
+
+    if (config.listen_addr_count == 0) {
+        if (!open_listeners_for(NULL, SERVER_PORT)) {
+            syslog(LOG_ERR, "Errors during socket setup\n");
+            return false;
+        }
+        return true;
+    }
+
+    for (i = 0; i < config.listen_addr_count; i++) {
+        split_listen_addr(config.listen_addrs[i], host, sizeof(host), port, sizeof(port));
+        if (!open_listeners_for(host, port)) {
+            syslog(LOG_ERR, "Errors during socket setup for %s\n", config.listen_addrs[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Listen on a unix domain socket at path unless it was inherited. History
+// listeners hand out the history mirror instead of serving clients.
+static bool open_unix_listener(const char *path, bool history)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+    int i;
+
+    if (path == NULL) {
+        return true;
+    }
+
+    for (i = 0; i < listener_count; i++) {
+        if ((listeners[i].addr.ss_family == AF_UNIX) &&
+            (strcmp(((struct sockaddr_un*)&listeners[i].addr)->sun_path, path) == 0)) {
+            listeners[i].history = history;
+            return true;
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    // Replace a socket left behind by a server that did not exit cleanly,
+    // but never anything else
+    if ((lstat(path, &st) == 0) && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, DEFAULT_PROTOCOL);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Error socket(): %s\n", strerror(errno));
+        return false;
+    }
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        syslog(LOG_ERR, "Error bind(%s): %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    if ((listen(fd, BACKLOG) == -1) || !add_listener(fd)) {
+        syslog(LOG_ERR, "Error listen(%s): %s\n", path, strerror(errno));
+        close(fd);
+        unlink(path);
+        return false;
+    }
+
+    listeners[listener_count - 1].owned = true;
+    listeners[listener_count - 1].history = history;
+    return true;
+}
+
+// Pass a reader connected to a history listener a read-only descriptor for
+// the history mirror, the reader follows it without the server from then on
+static void serve_history_reader(int client_fd, struct listener *listener)
+{
+    int reader_fd = aesd_history_reader_fd();
+
+    if (reader_fd == -1) {
+        syslog(LOG_ERR, "Error aesd_history_reader_fd(): %s\n", strerror(errno));
+    } else {
+        if (aesd_handoff_send(client_fd, AESD_HANDOFF_HISTORY, reader_fd) == -1) {
+            syslog(LOG_ERR, "Error sending history mirror: %s\n", strerror(errno));
+        }
+        close(reader_fd);
+    }
+    close(client_fd);
+    listener->connections++;
+}
+
+// Use the listening sockets passed by a service manager or aesdlaunch. Returns
+// 1 when some were passed, 0 when not socket activated and -1 on error.
+static int activated_listener(void)
+{
+    int fds = aesd_activation_listen_fds();
+    int fd;
+
+    for (fd = AESD_LISTEN_FDS_START; fd < AESD_LISTEN_FDS_START + fds; fd++) {
+        if (!aesd_activation_is_listener(fd)) {
+            syslog(LOG_ERR, "Error ignoring passed descriptor %d\n", fd);
+            close(fd);
+            continue;
+        }
+
+        // Same flags open_listeners() creates its sockets with
+        if ((fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) ||
+            (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)) {
+            syslog(LOG_ERR, "Error fcntl(): %s\n", strerror(errno));
+            close(fd);
+            continue;
+        }
+
+        if (!add_listener(fd)) {
+            close(fd);
+            continue;
+        }
+        syslog(LOG_INFO, "Using listening socket %s passed by socket activation\n",
+                listeners[listener_count - 1].name);
+    }
+
+    if (fds == 0) {
+        return 0;
+    }
+    if (listener_count == 0) {
+        syslog(LOG_ERR, "Error no usable listening socket among %d passed\n", fds);
+        return -1;
+    }
+    return 1;
+}
+
+#if USE_AESD_CHAR_DEVICE == 0
+// Start reading the history left by a previous run into the page cache while
+// early connections wait in the listen backlog
+static void warm_history(void)
+{
+    struct stat st;
+    int fd = open(config.data_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return;
+    }
+
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+        syslog(LOG_DEBUG, "Warming %lld bytes of history\n", (long long)st.st_size);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+    close(fd);
+}
+#endif
+
+// Take over the listening sockets of the server being upgraded
+static bool receive_listeners(void)
+{
+    char type;
+    int fd;
+
+    while (aesd_handoff_recv(handoff_chan, &type, &fd) == 1) {
+        if (type == AESD_HANDOFF_END) {
+            if (listener_count == 0) {
+                break;
+            }
+            syslog(LOG_INFO, "Took over %d listening sockets from previous server\n",
+                    listener_count);
+            return true;
+        }
+
+        if ((type != AESD_HANDOFF_LISTENER) || (fd == -1) || !add_listener(fd)) {
+            syslog(LOG_ERR, "Error unexpected handoff message '%c'\n", type);
+            if (fd != -1) {
+                close(fd);
+            }
+            continue;
+        }
+
+        // Cleaning up the listener's unix socket path falls to this server now
+        listeners[listener_count - 1].owned = true;
+    }
+
+    syslog(LOG_ERR, "Error receiving listening socket from previous server\n");
+    return false;
+}
+
+// Start serving a connection accepted here or handed over by an old server.
+// Returns false only when the server has to exit.
+static bool start_client(struct head_thread *head, int client_fd,
+                            struct sockaddr_storage *client_addr, struct listener *listener,
+                            enum aesd_frame_mode framing, pthread_attr_t *attr)
+{
+    struct thread_info* p_thread_info = NULL;
+    int status = 0;
+
+    // Shed the connection right away rather than let it wait in the
+    // backlog while the system is under pressure
+    if (!aesd_admission_admit()) {
+        close(client_fd);
+        return true;
+    }
+
+    // Allocate memory for thread_data            
+    p_thread_info = (struct thread_info*) malloc(sizeof(struct thread_info));
+
+    if (p_thread_info == NULL) {
+        syslog(LOG_ERR, "Failed to malloc for new thread(): %s\n", strerror(errno));
+        close(client_fd);
+        aesd_admission_release();
+        return false;
+    }
+
+    // Rate limits and fair share are tracked per source address
+    p_thread_info->source = aesd_rl_source_get(client_addr);
+    if (p_thread_info->source == NULL) {
+        syslog(LOG_ERR, "Failed to malloc for client source\n");
+        close(client_fd);
+        free(p_thread_info);
+        aesd_admission_release();
+        return true;
+    }
+    
+    // Setup mutex and wait arguments
+    p_thread_info->mutex = &thread_mutex;
+    p_thread_info->thread_complete = false;
+    p_thread_info->client_connected = true;
+    p_thread_info->client_fd = client_fd;
+    p_thread_info->client_addr = *client_addr;
+    p_thread_info->listener = listener;
+    p_thread_info->framing = framing;
+    aesd_sendq_init(&(p_thread_info->sendq), config.sendq_hwm);
+    p_thread_info->zerocopy = false;
+    aesd_token_bucket_init(&(p_thread_info->buckets[AESD_RL_INGEST]),
+                            config.conn_rates[AESD_RL_INGEST]);
+    aesd_token_bucket_init(&(p_thread_info->buckets[AESD_RL_REPLY]),
+                            config.conn_rates[AESD_RL_REPLY]);
+    p_thread_info->replies = 0;
+    p_thread_info->reply_bytes = 0;
+    memset(&(p_thread_info->usage), 0, sizeof(p_thread_info->usage));
+    p_thread_info->queued_reported = 0;
+    p_thread_info->deferred_replies = 0;
+    p_thread_info->durable_wait = 0;
+    aesd_timer_init(&(p_thread_info->timer), client_timer_expired, p_thread_info);
+    memset(p_thread_info->deadlines, 0, sizeof(p_thread_info->deadlines));
+    p_thread_info->timer_armed_ms = 0;
+    p_thread_info->timed_out = 0;
+    p_thread_info->capture_conn = aesd_capture_connect((framing == AESD_FRAME_BINARY) ?
+                                                        AESD_CAPTURE_FRAMED : 0);
+
+    // Pass thread_data to created thread. Use threadfunc() as entry point.
+    status = pthread_create(&(p_thread_info->thread_id), attr, client_thread_func, p_thread_info);
+    if (status != 0) {
+        syslog(LOG_ERR, "Error pthread_create(): %s\n", strerror(status));
+        aesd_capture_disconnect(p_thread_info->capture_conn);
+        aesd_rl_source_put(p_thread_info->source);
+        aesd_sendq_destroy(&(p_thread_info->sendq));
+        close(client_fd);
+        free(p_thread_info);
+        aesd_admission_release();
+        return true;
+    }
+
+    // ADD THREAD TO LINKED LIST
+    SLIST_INSERT_HEAD(head, p_thread_info, threads);
+
+    if (listener != NULL) {
+        __atomic_fetch_add(&(listener->active), 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&(listener->connections), 1, __ATOMIC_RELAXED);
+    }
+
+    return true;
+}
+
+// Resume following the leader after an upgrade that did not happen
+static void follow_again(void)
+{
+#if USE_AESD_CHAR_DEVICE == 0
+    if (read_only &&
+        (aesd_replica_follow(config.follow_host,
+                                (config.follow_port[0] != '\0') ? config.follow_port : NULL,
+                                config.data_path, &thread_mutex) == -1)) {
+        syslog(LOG_ERR, "Error aesd_replica_follow(): %s\n", strerror(errno));
+    }
+#endif
+}
+
+// Take over from the leader: stop following, accept appends and write the
+// timestamps. An upgrade from now on starts a leader too.
+static void promote(void)
+{
+    struct aesd_replica_stats replica;
+    int i, j;
+
+    if (!read_only) {
+        syslog(LOG_ERR, "Error not a follower, nothing to promote\n");
+        return;
+    }
 
-                    if ((!client_errors) && (num_tokens == 2)) {
-                        if(ioctl(data_fd, AESDCHAR_IOCSEEKTO, &ioctl_arg)) {
-                            syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s\n", 
-                                strerror(errno));
-                            client_errors++;
-                        }
-                    }
+    aesd_replica_unfollow();
+    aesd_replica_get_stats(&replica);
+    __atomic_store_n(&read_only, false, __ATOMIC_RELAXED);
+#if USE_AESD_CHAR_DEVICE == 0
+    start_timestamps();
+#endif
 
-                } else {
-                    // Normal write received command to file
-                    while (p <= p_end) {
-                        fprintf(data_file, "%c", *p);
-                        p++;
-                        total_bytes--;
-                    }
+    for (i = 0, j = 0; server_argv[i] != NULL; i++) {
+        if (strncmp(server_argv[i], "--follow=", 9) == 0) {
+            continue;
+        }
+        if ((strcmp(server_argv[i], "--follow") == 0) && (server_argv[i + 1] != NULL)) {
+            i++;
+            continue;
+        }
+        server_argv[j++] = server_argv[i];
+    }
+    server_argv[j] = NULL;
 
-                    // Reset file pointer to read from beginning of file for
-                    // sending file back
-                    rewind(data_file);
-                }
+    syslog(LOG_INFO, "Promoted to leader at offset %llu, the last leader end seen was %llu\n",
+            (unsigned long long)replica.applied, (unsigned long long)replica.leader_end);
+}
 
-                status = pthread_mutex_unlock(client_info->mutex);
-                if (status) {
-                    syslog(LOG_ERR, "pthread_mutex_unlock(): %s\n", strerror(status));
-                    client_errors++;
-                    break;
-                }
+// Stop an upgrade that never got as far as the new server accepting
+static void abort_upgrade(void)
+{
+    close(handoff_chan);
+    handoff_chan = -1;
+    if (handoff_pid > 0) {
+        kill(handoff_pid, SIGTERM);
+        waitpid(handoff_pid, NULL, 0);
+        handoff_pid = 0;
+    }
+    aesd_history_pause_compression(false);
+    follow_again();
+}
 
-                // Remove saved packet and shift data down to start of buffer.
-                memset(rx_buffer, 0, packet_len);
-                memcpy(rx_buffer, p, total_bytes);
-
-                // Send contents of file back to client
-                char line[WRITE_SIZE];
-                memset(line, 0, WRITE_SIZE);
-                int tx_bytes = 0;
-                int tx_bytes_to_send = 0;
-
-                while (fgets(line, WRITE_SIZE, data_file) != NULL) {
-                    tx_bytes_to_send = strlen(line);
-                    tx_bytes = send(client_info->client_fd, line, 
-                                    tx_bytes_to_send, 0);
-                    if (tx_bytes == -1) {
-                        syslog(LOG_ERR, "Error send(): %s\n", strerror(errno));
-                        client_errors++;
-                        break;
-                    } else if (tx_bytes_to_send != tx_bytes) {
-                        syslog(LOG_ERR, "Error only sent %i bytes but"
-                            "should have been %i bytes\n", 
-                            tx_bytes, tx_bytes_to_send);
-                        client_errors++;
-                        break;
-                    } else {
-                        syslog(LOG_DEBUG, "Success: sent %i bytes\n", tx_bytes);
-                    }
-                    memset(line, 0, sizeof(line));
-                }
-            }
-        }
+// Exec the installed binary and pass it the listening socket. This server
+// keeps accepting until the new one reports it is ready.
+static void start_upgrade(void)
+{
+    int i;
+
+    if ((handoff_chan != -1) || handoff_ready) {
+        syslog(LOG_ERR, "Error upgrade already in progress\n");
+        return;
+    }
+
+    // The new server loads the compressed blocks, none may be half written,
+    // and follows the leader itself
+    aesd_history_pause_compression(true);
+    aesd_replica_unfollow();
+    handoff_pid = aesd_handoff_spawn(exe_path, server_argv, &handoff_chan);
+    if (handoff_pid == -1) {
+        syslog(LOG_ERR, "Error starting %s: %s\n", exe_path, strerror(errno));
+        handoff_pid = 0;
+        aesd_history_pause_compression(false);
+        follow_again();
+        return;
+    }
 
-        // If there were any errors, don't try to receive more data, exit
-        if (client_errors > 0) {
+    for (i = 0; i < listener_count; i++) {
+        if (aesd_handoff_send(handoff_chan, AESD_HANDOFF_LISTENER, listeners[i].fd) == -1) {
             break;
         }
     }
+    if ((i < listener_count) || (aesd_handoff_send(handoff_chan, AESD_HANDOFF_END, -1) == -1)) {
+        syslog(LOG_ERR, "Error passing listeners to new server: %s\n", strerror(errno));
+        abort_upgrade();
+        return;
+    }
 
-    if (tmp_file_open) {
-        if (fclose(data_file) != 0) {
-            syslog(LOG_ERR, "Error fclose(): %s\n", strerror(errno));
+    syslog(LOG_INFO, "Upgrading, started %s as pid %d\n", exe_path, handoff_pid);
+}
+
+// Handle a message from the other server taking part in an upgrade
+static bool handle_handoff(struct head_thread *head, pthread_attr_t *attr)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t client_addrlen = sizeof(client_addr);
+    char type;
+    int fd = -1;
+    int status;
+
+    status = aesd_handoff_recv(handoff_chan, &type, &fd);
+    if (status != 1) {
+        if (handoff_pid == 0) {
+            // Previous server has drained and exited, the upgrade is complete
+            close(handoff_chan);
+            handoff_chan = -1;
+            aesd_history_pause_compression(false);
+        } else if (!handoff_ready) {
+            syslog(LOG_ERR, "Error new server exited before taking over\n");
+            abort_upgrade();
+        } else {
+            // Client threads may still use the channel, leave it open
+            syslog(LOG_ERR, "Error new server closed the handoff channel\n");
+            handoff_closed = true;
         }
-        tmp_file_open = false;
+        return true;
     }
 
-    if (rx_buffer != NULL) {
-        free(rx_buffer);
-        rx_buffer = NULL;
+    if ((type == AESD_HANDOFF_READY) && (handoff_pid > 0) && !handoff_ready) {
+        syslog(LOG_INFO, "New server pid %d is accepting, draining connections\n", handoff_pid);
+        __atomic_store_n(&handoff_ready, true, __ATOMIC_RELAXED);
+        wake_clients(handoff_wake_fd);
+        close_listeners();
+        // Readers reconnect to the new server's mirror, queries on the
+        // draining connections still use the index
+        aesd_history_close_mirror();
+#if USE_AESD_CHAR_DEVICE == 0
+        // The new server writes the timestamps from now on
+        if (timer_active) {
+            timer_delete(timer);
+            timer_active = false;
+        }
+#endif
+        return true;
     }
 
-    if (client_info->client_connected) {
-        close(client_info->client_fd);
-        client_info->client_connected = false;
+    if (((type == AESD_HANDOFF_CLIENT) || (type == AESD_HANDOFF_FRAMED)) &&
+        (handoff_pid == 0) && (fd != -1)) {
+        if (getpeername(fd, (struct sockaddr*)&client_addr, &client_addrlen) == -1) {
+            syslog(LOG_ERR, "Error getpeername(): %s\n", strerror(errno));
+            close(fd);
+            return true;
+        }
+        return start_client(head, fd, &client_addr, find_listener(fd),
+                            (type == AESD_HANDOFF_FRAMED) ? AESD_FRAME_BINARY : AESD_FRAME_UNKNOWN,
+                            attr);
     }
 
-    // Log message to syslog "Closed connection from <CLIENT_IP_ADDRESS>"
-    syslog(LOG_INFO, "Closed connection from %s\n", client_ip);
-
-    client_info->thread_complete = true;
-    pthread_exit(&client_errors);
+    syslog(LOG_ERR, "Error unexpected handoff message '%c'\n", type);
+    if (fd != -1) {
+        close(fd);
+    }
+    return true;
 }
 
 int main(int argc, char *argv[])
 {
-    int daemon;
-
     // Verify proper usage of program
-    if ((argc == 2) && (strcmp(argv[1],"-d") == 0)) {
-        // daemon mode specified
-        daemon = 1;
-    } else if (argc == 1) {
-        // foreground application
-        daemon = 0;
-    } else {
-        printf("ERROR: Invalid arguments %i\n", argc);
-        printf("Usage: ./aesdsocket [-d]\n");
+    if (!parse_args(argc, argv)) {
+        usage();
         return SERVER_FAILURE;
     }
 
     openlog("aesdsocket", LOG_CONS, LOG_USER);
     syslog_open = true;
 
+    // Each connection holds descriptors and the server runs out of them
+    // before anything else, so never admit more than the open file limit allows
+    struct rlimit nofile;
+
+    if ((getrlimit(RLIMIT_NOFILE, &nofile) == 0) && (nofile.rlim_cur != RLIM_INFINITY) &&
+        (nofile.rlim_cur > RESERVED_FDS + CONN_FDS)) {
+        unsigned int fd_connections = (nofile.rlim_cur - RESERVED_FDS) / CONN_FDS;
+
+        if ((config.admission.max_connections == 0) ||
+            (config.admission.max_connections > fd_connections)) {
+            config.admission.max_connections = fd_connections;
+            syslog(LOG_INFO, "Open file limit %llu allows %u connections\n",
+                    (unsigned long long)nofile.rlim_cur, fd_connections);
+        }
+    }
+    aesd_admission_init(&config.admission);
+
     if (signal(SIGINT, signal_handler) == SIG_ERR) {
         syslog(LOG_ERR, "Error: Cannot register SIGINT\n");
         cleanup(true);
@@ -488,68 +3602,68 @@ int main(int argc, char *argv[])
         return SERVER_FAILURE;
     }
 
-    int status = 0;
-    int errors = 0;
-    int sockopt_yes = 1;
-    struct addrinfo *socket_addrinfo, *p_ai;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_protocol = DEFAULT_PROTOCOL;
-
-    status = getaddrinfo(NULL, SERVER_PORT, &hints, &socket_addrinfo);
-
-    if (status != 0) {
-        syslog(LOG_ERR, "Error getaddrinfo(): %s\n", gai_strerror(status));
+    if (signal(SIGUSR1, signal_handler) == SIG_ERR) {
+        syslog(LOG_ERR, "Error: Cannot register SIGUSR1\n");
         cleanup(true);
         return SERVER_FAILURE;
     }
-    
-    // Open a stream socket SOCK_STREAM bound to port 9000, return -1 if 
-    // connection steps fail
-    for (p_ai = socket_addrinfo ; p_ai != NULL; p_ai = p_ai->ai_next) {
-
-        socket_fd = socket(p_ai->ai_family, p_ai->ai_socktype, p_ai->ai_protocol);
-
-        if (socket_fd == -1) {
-            syslog(LOG_ERR, "Error socket(): %s\n", strerror(errno));
-            errors++;
-        } else {
-            socket_connected = true;
-            status = setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR,
-                                &sockopt_yes, sizeof(sockopt_yes));
 
-            if (status == -1) {
-                syslog(LOG_ERR, "Error setsockopt(): %s\n", strerror(errno));
-                errors++;
-            } else {
-                status = bind(socket_fd, p_ai->ai_addr, p_ai->ai_addrlen);
-                
-                if (status == -1) {
-                    syslog(LOG_ERR, "Error bind(): %s\n", strerror(errno));
-                    errors++;
-                }
-                break;
-            }
-        }
+    if (signal(SIGUSR2, signal_handler) == SIG_ERR) {
+        syslog(LOG_ERR, "Error: Cannot register SIGUSR2\n");
+        cleanup(true);
+        return SERVER_FAILURE;
     }
 
-    // Free memory allocated in getaddrinfo() call
-    if (socket_addrinfo != NULL) {
-        freeaddrinfo(socket_addrinfo);
-        socket_addrinfo = NULL;
+    if (signal(SIGHUP, signal_handler) == SIG_ERR) {
+        syslog(LOG_ERR, "Error: Cannot register SIGHUP\n");
+        cleanup(true);
+        return SERVER_FAILURE;
     }
 
-    if (errors > 0) {
-        syslog(LOG_ERR, "Errors during socket setup\n");
+    // SIGQUIT keeps its default action unless there is a trace to dump
+    if ((config.trace_events > 0) && (signal(SIGQUIT, signal_handler) == SIG_ERR)) {
+        syslog(LOG_ERR, "Error: Cannot register SIGQUIT\n");
         cleanup(true);
         return SERVER_FAILURE;
     }
 
-    // DAEMON argument fork() here
-    if (daemon) {
+    // Remember how this server was started so an upgrade can repeat it
+    ssize_t exe_len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (exe_len == -1) {
+        snprintf(exe_path, sizeof(exe_path), "%s", argv[0]);
+    } else {
+        exe_path[exe_len] = '\0';
+    }
+    server_argv = argv;
+
+    int status = 0;
+    bool listener_inherited = true;
+    int i;
+
+    // After an upgrade the listener comes from the previous server instead,
+    // and with socket activation from whoever started this one
+    handoff_chan = aesd_handoff_inherited();
+    if (handoff_chan != -1) {
+        if (!receive_listeners()) {
+            cleanup(true);
+            return SERVER_FAILURE;
+        }
+    } else {
+        status = activated_listener();
+        if (status == 0) {
+            listener_inherited = false;
+            if (!open_listeners()) {
+                status = -1;
+            }
+        }
+        if (status == -1) {
+            cleanup(true);
+            return SERVER_FAILURE;
+        }
+    }
+
+    // DAEMON argument fork() here, an upgraded server is already a daemon
+    if (config.daemon && (handoff_chan == -1)) {
         pid_t pid = fork();
         switch (pid) {
         case -1:
@@ -570,8 +3684,11 @@ int main(int argc, char *argv[])
 
     // Listen for and accept a connection, restarts when connection closed
     // listens forever unless SIGINT or SIGTERM received, if signal received,
-    // gracefully exit.
-    status = listen(socket_fd, BACKLOG);
+    // gracefully exit. Inherited sockets are already listening with the
+    // backlog their owner chose.
+    for (i = 0; (i < listener_count) && !listener_inherited && (status != -1); i++) {
+        status = listen(listeners[i].fd, BACKLOG);
+    }
 
     if (status == -1) {
         syslog(LOG_ERR, "Error listen(): %s\n", strerror(errno));
@@ -579,28 +3696,53 @@ int main(int argc, char *argv[])
         return SERVER_FAILURE;
     }
 
+    // Bound after the daemon fork, the exiting parent would remove its path
+    if (!open_unix_listener(config.unix_path, false) ||
+        !open_unix_listener(config.shm_path, true)) {
+        cleanup(true);
+        return SERVER_FAILURE;
+    }
+
     syslog(LOG_DEBUG, "Waiting for a client to connect...\n");
 
     // Setup thread linked list
     struct thread_info* p_thread_info = NULL;
     struct thread_info* p_thread_temp = NULL;
-    SLIST_HEAD(head_thread, thread_info) head;
+    struct head_thread head;
     SLIST_INIT(&head);
 
     // Setup thread mutex, we are about to start spawning threads
-    status = pthread_mutex_init(&thread_mutex, NULL);
+    status = aesd_lock_init(&thread_mutex, "thread_mutex");
     if (status != 0) {
-        syslog(LOG_ERR, "Error pthread_mutex_init(): %s\n", strerror(status));
+        syslog(LOG_ERR, "Error aesd_lock_init(): %s\n", strerror(status));
         cleanup(true);
         return SERVER_FAILURE;
     } else {
         mutex_active = true;
     }
 
+    aesd_fairq_init(&append_queue);
+    append_queue_active = true;
+
+    aesd_timerwheel_init(&conn_wheel, MAIN_TICK_MS, monotonic_ms());
+    conn_wheel_active = true;
+
+    exit_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    handoff_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if ((exit_wake_fd == -1) || (handoff_wake_fd == -1)) {
+        syslog(LOG_ERR, "Error eventfd(): %s\n", strerror(errno));
+        cleanup(true);
+        return SERVER_FAILURE;
+    }
+
+    // Small client stacks so many idle connections fit in the address space
+    pthread_attr_t client_attr;
+    pthread_attr_init(&client_attr);
+    pthread_attr_setstacksize(&client_attr, CLIENT_STACK_SIZE);
+
 #if USE_AESD_CHAR_DEVICE == 0
     // Setup timer for logging to tmp file
     struct sigevent timer_event;
-    struct itimerspec itime_spec;
 
     memset(&timer_event, 0, sizeof(struct sigevent));
     timer_event.sigev_value.sival_ptr = &thread_mutex;
@@ -617,59 +3759,235 @@ int main(int argc, char *argv[])
         timer_active = true;
     }
 
-    // Set time to trigger every 10 seconds, 0 nanoseconds
-    memset(&itime_spec, 0, sizeof(struct itimerspec));
-    itime_spec.it_interval.tv_sec = 10;
-    itime_spec.it_value.tv_sec = 10;
+    // A follower's timestamps come from its leader until it is promoted
+    read_only = (config.follow != NULL);
+    if (!read_only && !start_timestamps()) {
+        cleanup(true);
+        return SERVER_FAILURE;
+    }
+#endif
 
-    status = timer_settime(timer, 0, &itime_spec, NULL);
+#if USE_AESD_CHAR_DEVICE == 0
+    // Check the records against their checksums before anything reads them,
+    // a torn tail is only cut off when no other server is appending
+    if (config.checksums) {
+        struct aesd_checksum_recovery recovery;
 
-    if (status) {
-        syslog(LOG_ERR, "Error timer_settime(): %s\n", strerror(errno));
+        if (aesd_checksum_open(config.data_path, (handoff_chan == -1), &recovery) == -1) {
+            syslog(LOG_ERR, "Error aesd_checksum_open(): %s\n", strerror(errno));
+            cleanup(true);
+            return SERVER_FAILURE;
+        }
+        tmp_file_exists = true;
+        syslog(LOG_INFO, "Checksums: %llu records (%llu bytes) checked in %.1f ms, "
+                "%.2f GB/s with %s crc32c, %llu adopted, %llu unchecked bytes\n",
+                (unsigned long long)recovery.records, (unsigned long long)recovery.bytes,
+                recovery.seconds * 1e3,
+                (recovery.seconds > 0) ? recovery.bytes / recovery.seconds / 1e9 : 0.0,
+                aesd_crc32c_impl(), (unsigned long long)recovery.adopted,
+                (unsigned long long)recovery.unchecked);
+        if ((recovery.torn_bytes > 0) || (recovery.torn_entries > 0)) {
+            syslog(LOG_ERR, "Torn tail of %llu bytes and %llu checksums %s\n",
+                    (unsigned long long)recovery.torn_bytes,
+                    (unsigned long long)recovery.torn_entries,
+                    recovery.truncated ? "cut off" : "left to the other server");
+        }
+        if (recovery.corrupt > 0) {
+            syslog(LOG_ERR, "Error %llu corrupt records, the first at offset %llu\n",
+                    (unsigned long long)recovery.corrupt,
+                    (unsigned long long)recovery.first_corrupt);
+        }
+    } else {
+        aesd_checksum_discard(config.data_path);
+    }
+
+    warm_history();
+
+    // Compressed history is read from its blocks, which the data file no
+    // longer holds. The blocks are written from then on if asked for.
+    struct aesd_cold_stats cold;
+
+    if (aesd_cold_open(config.data_path, (config.retention.compress_after > 0)) == -1) {
+        syslog(LOG_ERR, "Error aesd_cold_open(): %s\n", strerror(errno));
+        cleanup(true);
+        return SERVER_FAILURE;
+    }
+    aesd_cold_get_stats(&cold);
+    if (cold.blocks > 0) {
+        syslog(LOG_INFO, "Compressed history: %zu blocks at %llu-%llu, %llu bytes in %llu\n",
+                cold.blocks, (unsigned long long)cold.start, (unsigned long long)cold.end,
+                (unsigned long long)cold.raw_bytes, (unsigned long long)cold.comp_bytes);
+    }
+#endif
+
+    // Index the history for queries, and mirror it for readers on the shm
+    // socket, before accepting. The aesdchar device is not indexed.
+    if (aesd_history_init(config.data_path, history_is_file,
+                            (config.shm_path != NULL) ? config.shm_size : 0) == -1) {
+        syslog(LOG_ERR, "Error aesd_history_init(): %s\n", strerror(errno));
+        cleanup(true);
+        return SERVER_FAILURE;
+    }
+
+    // Keep the history bounded and compress its cold segments, this creates
+    // the data file. While the previous server drains it may read history
+    // that is still raw to it, so nothing is compressed until it exits.
+    if ((config.retention.max_bytes > 0) || (config.retention.max_records > 0) ||
+        (config.retention.max_age_s > 0) || (config.retention.compress_after > 0)) {
+        aesd_history_pause_compression(handoff_chan != -1);
+        if (aesd_history_retain(config.data_path, &config.retention) == -1) {
+            syslog(LOG_ERR, "Error aesd_history_retain(): %s\n", strerror(errno));
+            cleanup(true);
+            return SERVER_FAILURE;
+        }
+        tmp_file_exists = true;
+    }
+
+    // Sync appends to disk as the durability mode asks, this creates the data file
+    if (config.durability != AESD_DURABILITY_NONE) {
+        if (aesd_history_durable(config.data_path, config.durability, config.sync_period_ms) == -1) {
+            syslog(LOG_ERR, "Error aesd_history_durable(): %s\n", strerror(errno));
+            cleanup(true);
+            return SERVER_FAILURE;
+        }
+        tmp_file_exists = true;
+    }
+
+#if USE_AESD_CHAR_DEVICE == 0
+    // Replicate the leader's history from where this one ends
+    if ((config.follow != NULL) &&
+        (aesd_replica_follow(config.follow_host,
+                                (config.follow_port[0] != '\0') ? config.follow_port : NULL,
+                                config.data_path, &thread_mutex) == -1)) {
+        syslog(LOG_ERR, "Error aesd_replica_follow(): %s\n", strerror(errno));
         cleanup(true);
         return SERVER_FAILURE;
     }
 #endif
 
-    // Loop back to accept multiple connections
+    // Record client traffic for aesdreplay
+    if ((config.capture_path != NULL) &&
+        (aesd_capture_open(config.capture_path, config.capture_limit) == -1)) {
+        syslog(LOG_ERR, "Error aesd_capture_open(%s): %s\n", config.capture_path, strerror(errno));
+        cleanup(true);
+        return SERVER_FAILURE;
+    }
+
+    // The LOCKS query switches lock profiling later on
+    aesd_lock_profile(config.lock_profile);
+
+    // Publish the counters for monitoring agents to map
+    if ((config.stats_page != NULL) &&
+        (aesd_statpage_open(config.stats_page, stat_fields, STAT_FIELDS, STATS_PAGE_MS) == -1)) {
+        syslog(LOG_ERR, "Error aesd_statpage_open(%s): %s\n", config.stats_page, strerror(errno));
+        cleanup(true);
+        return SERVER_FAILURE;
+    }
+
+    // Sample CPU stacks from the start, the PROFILE query does so later on
+    if ((config.profile_hz > 0) && (aesd_prof_start(config.profile_hz) == -1)) {
+        syslog(LOG_ERR, "Error aesd_prof_start(): %s\n", strerror(errno));
+        cleanup(true);
+        return SERVER_FAILURE;
+    }
+
+    // Trace the stages of every packet into per-connection rings
+    if ((config.trace_events > 0) && (aesd_trace_init(config.trace_events) == -1)) {
+        syslog(LOG_ERR, "Error aesd_trace_init(): %s\n", strerror(errno));
+        cleanup(true);
+        return SERVER_FAILURE;
+    }
+
+    // Let the previous server stop accepting and hand over its connections
+    if ((handoff_chan != -1) &&
+        (aesd_handoff_send(handoff_chan, AESD_HANDOFF_READY, -1) == -1)) {
+        syslog(LOG_ERR, "Error signalling previous server: %s\n", strerror(errno));
+        close(handoff_chan);
+        handoff_chan = -1;
+    }
+
+    // Loop back to accept multiple connections. The listening socket is
+    // polled with a timeout so housekeeping runs even when no one connects.
+    struct timespec last_sample;
+    struct timespec last_publish;
+    memset(&last_sample, 0, sizeof(last_sample));
+    memset(&last_publish, 0, sizeof(last_publish));
+
     while (!exit_status)
     {
         int client_fd;
         struct sockaddr_storage client_addr;
-        socklen_t client_addrlen = sizeof(client_addr);
-        client_fd = accept(socket_fd, 
-                            (struct sockaddr*)&client_addr, 
-                            &client_addrlen);
+        socklen_t client_addrlen;
+        struct pollfd main_pollfds[MAX_LISTENERS + 1];
+        struct timespec now;
+
+        // Every listener, then the upgrade handoff channel
+        for (i = 0; i < listener_count; i++) {
+            main_pollfds[i].fd = listeners[i].fd;
+            main_pollfds[i].events = POLLIN;
+            main_pollfds[i].revents = 0;
+        }
+        main_pollfds[listener_count].fd = handoff_closed ? -1 : handoff_chan;
+        main_pollfds[listener_count].events = POLLIN;
+        main_pollfds[listener_count].revents = 0;
 
-        if (client_fd == -1) {
-            // Ignore bad file descriptor error when shutdown starts
-            if (errno != EBADF) {
-                syslog(LOG_ERR, "Error accept(): %s\n", strerror(errno));
-            }
+        status = poll(main_pollfds, listener_count + 1, MAIN_TICK_MS);
+        if ((status == -1) && (errno != EINTR)) {
+            syslog(LOG_ERR, "Error poll(): %s\n", strerror(errno));
             exit_status = true;
             continue;
-        } else {
-            // Allocate memory for thread_data            
-            p_thread_info = (struct thread_info*) malloc(sizeof(struct thread_info));
+        }
+
+        if (exit_status) {
+            continue;
+        }
+
+        // Sample system pressure for admission decisions
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (((now.tv_sec - last_sample.tv_sec) * 1000 +
+             (now.tv_nsec - last_sample.tv_nsec) / 1000000) >= ADMISSION_SAMPLE_MS) {
+            aesd_admission_sample();
+            aesd_capture_flush();
+            last_sample = now;
+        }
+        if ((config.stats_page != NULL) &&
+            (((now.tv_sec - last_publish.tv_sec) * 1000 +
+              (now.tv_nsec - last_publish.tv_nsec) / 1000000) >= STATS_PAGE_MS)) {
+            publish_stats(&head);
+            last_publish = now;
+        }
+
+        if (dump_stats) {
+            dump_stats = false;
+            log_stats(&head);
+        }
+
+        if (dump_trace) {
+            char trace_path[PATH_MAX];
+
+            dump_trace = false;
+            write_trace(trace_path, sizeof(trace_path));
+        }
+
+        // Expire connection deadlines
+        aesd_timerwheel_advance(&conn_wheel, monotonic_ms());
+
+        if (upgrade_requested) {
+            upgrade_requested = false;
+            start_upgrade();
+        }
 
-            if (p_thread_info == NULL) {
-                syslog(LOG_ERR, "Failed to malloc for new thread(): %s\n", strerror(errno));
+        if (promote_requested) {
+            promote_requested = false;
+            promote();
+        }
+
+        if ((status > 0) &&
+            (main_pollfds[listener_count].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (!handle_handoff(&head, &client_attr)) {
                 exit_status = true;
                 continue;
             }
-            
-            // Setup mutex and wait arguments
-            p_thread_info->mutex = &thread_mutex;
-            p_thread_info->thread_complete = false;
-            p_thread_info->client_connected = true;
-            p_thread_info->client_fd = client_fd;
-            p_thread_info->client_addr = client_addr;
-
-            // Pass thread_data to created thread. Use threadfunc() as entry point.
-            status = pthread_create(&(p_thread_info->thread_id), NULL, client_thread_func, p_thread_info);
-
-            // ADD THREAD TO LINKED LIST
-            SLIST_INSERT_HEAD(&head, p_thread_info, threads);
         }
 
         // Check on all threads to see if they are complete
@@ -680,13 +3998,74 @@ int main(int argc, char *argv[])
                     close(p_thread_info->client_fd);
                 }
                 pthread_join(p_thread_info->thread_id, NULL);
+                closed_cpu_ns += p_thread_info->usage.cpu_ns;
+                closed_conns++;
                 SLIST_REMOVE(&head, p_thread_info, thread_info, threads);
+                if (p_thread_info->listener != NULL) {
+                    __atomic_fetch_sub(&(p_thread_info->listener->active), 1, __ATOMIC_RELAXED);
+                }
+                aesd_rl_source_put(p_thread_info->source);
+                aesd_admission_release();
                 free(p_thread_info);
             }
 
         }
+
+        // After an upgrade this server exits once its last connection is done
+        if (handoff_ready && SLIST_EMPTY(&head)) {
+            syslog(LOG_INFO, "Connections drained, exiting after upgrade\n");
+            exit_status = true;
+            continue;
+        }
+
+        if (status <= 0) {
+            continue;
+        }
+
+        // One accept per ready listener each pass so a busy address cannot
+        // starve the others
+        for (i = 0; (i < listener_count) && !exit_status; i++) {
+            if (!(main_pollfds[i].revents & POLLIN)) {
+                continue;
+            }
+
+            client_addrlen = sizeof(client_addr);
+            client_fd = accept4(listeners[i].fd,
+                                (struct sockaddr*)&client_addr, 
+                                &client_addrlen, SOCK_CLOEXEC);
+
+            if (client_fd == -1) {
+                // The listeners are non-blocking as during an upgrade the
+                // other server may have taken the connection first
+                if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ECONNABORTED)) {
+                    continue;
+                }
+
+                // Out of descriptors, the connection waits in the backlog
+                // until one is closed
+                if ((errno == EMFILE) || (errno == ENFILE)) {
+                    syslog(LOG_ERR, "Error accept(): %s\n", strerror(errno));
+                    poll(NULL, 0, MAIN_TICK_MS);
+                    continue;
+                }
+
+                // Ignore bad file descriptor error when shutdown starts
+                if (errno != EBADF) {
+                    syslog(LOG_ERR, "Error accept(): %s\n", strerror(errno));
+                }
+                exit_status = true;
+            } else if (listeners[i].history) {
+                serve_history_reader(client_fd, &listeners[i]);
+            } else if (!start_client(&head, client_fd, &client_addr, &listeners[i],
+                                        AESD_FRAME_UNKNOWN, &client_attr)) {
+                exit_status = true;
+            }
+        }
     }
 
+    pthread_attr_destroy(&client_attr);
+    wake_clients(exit_wake_fd);
+
     // Cleanup all threads here - join calls and free all pthread objects
     while (!SLIST_EMPTY(&head)) {
         p_thread_info = SLIST_FIRST(&head);
@@ -695,6 +4074,11 @@ int main(int argc, char *argv[])
         }
         pthread_join(p_thread_info->thread_id, NULL);
         SLIST_REMOVE_HEAD(&head, threads);
+        if (p_thread_info->listener != NULL) {
+            __atomic_fetch_sub(&(p_thread_info->listener->active), 1, __ATOMIC_RELAXED);
+        }
+        aesd_rl_source_put(p_thread_info->source);
+        aesd_admission_release();
         free(p_thread_info);
     }
 
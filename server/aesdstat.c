@@ -0,0 +1,234 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesdstat.c
+​*​ ​@brief​ Print the counters the server publishes in its stats page
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* Usage: ./aesdstat [-w SEC] path [field...]
+*
+* Maps the page the server publishes with --stats-page and prints its
+* fields, or only the named ones, as "name value" lines. Reading costs no
+* system call on the server side. With -w it prints them again every SEC
+* seconds, a blank line between, and reopens the path once the server
+* stops updating the page on exit or upgrade.
+*/
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd-statpage.h"
+
+#define STAT_SUCCESS        (0)
+#define STAT_FAILURE        (1)
+#define REOPEN_MS           (100)
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./aesdstat [-w SEC] path [field...]\n");
+}
+
+// Map the page at path, NULL on error
+static const struct aesd_statpage *open_page(const char *path, size_t *len, bool quiet)
+{
+    const struct aesd_statpage *page;
+    const struct aesd_statpage_field *field;
+    struct stat st;
+    void *mapping;
+    uint32_t i;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        if (!quiet) {
+            fprintf(stderr, "Error open(%s): %s\n", path, strerror(errno));
+        }
+        return NULL;
+    }
+    if ((fstat(fd, &st) == -1) || ((size_t)st.st_size < sizeof(struct aesd_statpage))) {
+        if (!quiet) {
+            fprintf(stderr, "Error %s is not a stats page\n", path);
+        }
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        if (!quiet) {
+            fprintf(stderr, "Error mmap(%s): %s\n", path, strerror(errno));
+        }
+        return NULL;
+    }
+
+    page = mapping;
+    if ((page->magic != AESD_STATPAGE_MAGIC) || (page->version != AESD_STATPAGE_VERSION) ||
+        (page->field_size < sizeof(struct aesd_statpage_field)) ||
+        (page->header_size < sizeof(struct aesd_statpage)) ||
+        (page->header_size + (size_t)page->field_count * page->field_size >
+            (size_t)st.st_size)) {
+        if (!quiet) {
+            fprintf(stderr, "Error %s is not a version %d stats page\n", path,
+                    AESD_STATPAGE_VERSION);
+        }
+        munmap(mapping, st.st_size);
+        return NULL;
+    }
+    for (i = 0; i < page->field_count; i++) {
+        field = aesd_statpage_field(page, i);
+        if ((field->type == AESD_STAT_TEXT) && ((field->text_offset % sizeof(uint64_t) != 0) ||
+            ((size_t)field->text_offset + AESD_STATPAGE_TEXT > (size_t)st.st_size))) {
+            if (!quiet) {
+                fprintf(stderr, "Error %s has a text field outside the page\n", path);
+            }
+            munmap(mapping, st.st_size);
+            return NULL;
+        }
+    }
+    *len = st.st_size;
+    return page;
+}
+
+// Index of the field called name, -1 if the page has none
+static int find_field(const struct aesd_statpage *page, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < page->field_count; i++) {
+        if (strncmp(aesd_statpage_field(page, i)->name, name, AESD_STATPAGE_NAME) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void print_field(const struct aesd_statpage_field *field, uint64_t value,
+                        const char *text)
+{
+    switch (field->type) {
+    case AESD_STAT_COUNTER:
+    case AESD_STAT_GAUGE:
+        printf("%.*s %llu\n", AESD_STATPAGE_NAME, field->name, (unsigned long long)value);
+        break;
+    case AESD_STAT_REAL:
+        printf("%.*s %.2f\n", AESD_STATPAGE_NAME, field->name, aesd_statpage_to_real(value));
+        break;
+    case AESD_STAT_TEXT:
+        printf("%.*s %s\n", AESD_STATPAGE_NAME, field->name, text);
+        break;
+    default:
+        break;
+    }
+}
+
+// Print the named fields of the page, or all of them with none named
+static bool print_page(const struct aesd_statpage *page, char **names, int name_count)
+{
+    static char texts[AESD_STATPAGE_MAX_FIELDS][AESD_STATPAGE_TEXT];
+    uint64_t values[AESD_STATPAGE_MAX_FIELDS];
+    uint64_t updated_ns;
+    uint32_t i;
+    int n, index;
+
+    if ((page->field_count > AESD_STATPAGE_MAX_FIELDS) ||
+        !aesd_statpage_read(page, values, texts, &updated_ns)) {
+        fprintf(stderr, "Error the stats page did not settle\n");
+        return false;
+    }
+    if (name_count == 0) {
+        for (i = 0; i < page->field_count; i++) {
+            print_field(aesd_statpage_field(page, i), values[i], texts[i]);
+        }
+    }
+    for (n = 0; n < name_count; n++) {
+        index = find_field(page, names[n]);
+        if (index == -1) {
+            fprintf(stderr, "Error no field %s\n", names[n]);
+            return false;
+        }
+        print_field(aesd_statpage_field(page, index), values[index], texts[index]);
+    }
+    fflush(stdout);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    const struct aesd_statpage *page;
+    struct timespec pause;
+    unsigned long watch_sec = 0;
+    char *p_end;
+    size_t len = 0, next_len = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:")) != -1) {
+        switch (opt) {
+        case 'w':
+            watch_sec = strtoul(optarg, &p_end, 10);
+            if ((*p_end != '\0') || (watch_sec == 0)) {
+                usage();
+                return STAT_FAILURE;
+            }
+            break;
+        default:
+            usage();
+            return STAT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return STAT_FAILURE;
+    }
+
+    page = open_page(argv[optind], &len, false);
+    if (page == NULL) {
+        return STAT_FAILURE;
+    }
+    if (!print_page(page, &argv[optind + 1], argc - optind - 1)) {
+        return STAT_FAILURE;
+    }
+
+    while (watch_sec > 0) {
+        pause.tv_sec = watch_sec;
+        pause.tv_nsec = 0;
+        nanosleep(&pause, NULL);
+
+        // A new server renames its page over the path, wait for one to
+        while (__atomic_load_n(&page->closed, __ATOMIC_ACQUIRE)) {
+            const struct aesd_statpage *next = open_page(argv[optind], &next_len, true);
+
+            if (next != NULL) {
+                munmap((void *)page, len);
+                page = next;
+                len = next_len;
+                break;
+            }
+            pause.tv_sec = 0;
+            pause.tv_nsec = REOPEN_MS * 1000000L;
+            nanosleep(&pause, NULL);
+        }
+        printf("\n");
+        if (!print_page(page, &argv[optind + 1], argc - optind - 1)) {
+            return STAT_FAILURE;
+        }
+    }
+    munmap((void *)page, len);
+    return STAT_SUCCESS;
+}
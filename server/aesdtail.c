@@ -0,0 +1,217 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesdtail.c
+​*​ ​@brief​ Follow the aesdsocket history through its shared memory mirror
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* Usage: ./aesdtail -s path [-f] [-c bytes]
+*
+* Connects to the server's --shm-socket, receives a read-only descriptor for
+* the history mirror and prints the history from it, starting bytes back
+* from the end with -c. With -f it keeps following appends, sleeping on the
+* mirror's futex once caught up, and reconnects when the server closes the
+* mirror on exit or upgrade.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "aesd-handoff.h"
+#include "aesd-history.h"
+
+#define TAIL_FAILURE        (1)
+#define COPY_SIZE           (64 * 1024)
+#define WAIT_SEC            (1)
+#define RECONNECT_MS        (100)
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./aesdtail -s path [-f] [-c bytes]\n");
+}
+
+// Connect to the shm socket and map the mirror it hands out, NULL on error
+static struct aesd_history_shm *open_mirror(const char *path, size_t *len, bool quiet)
+{
+    struct aesd_history_shm *shm = NULL;
+    struct sockaddr_un addr;
+    struct stat st;
+    void *mapping;
+    char type;
+    int fd = -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock == -1) {
+        fprintf(stderr, "Error socket(): %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    if ((connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) ||
+        (aesd_handoff_recv(sock, &type, &fd) != 1) ||
+        (type != AESD_HANDOFF_HISTORY) || (fd == -1)) {
+        if (!quiet) {
+            fprintf(stderr, "Error no history mirror from %s: %s\n", path, strerror(errno));
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        close(sock);
+        return NULL;
+    }
+    close(sock);
+
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr, "Error fstat(): %s\n", strerror(errno));
+    } else if ((mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Error mmap(): %s\n", strerror(errno));
+    } else {
+        shm = mapping;
+        *len = st.st_size;
+        if ((shm->magic != AESD_HISTORY_MAGIC) || (shm->version != AESD_HISTORY_VERSION) ||
+            (shm->header_size + shm->capacity > *len)) {
+            fprintf(stderr, "Error %s did not hand out a history mirror\n", path);
+            munmap(mapping, *len);
+            shm = NULL;
+        }
+    }
+    close(fd);
+    return shm;
+}
+
+// Sleep until the writer bumps seq past the value seen, or WAIT_SEC passes
+static void wait_append(struct aesd_history_shm *shm, uint32_t seq)
+{
+    struct timespec timeout = { .tv_sec = WAIT_SEC, .tv_nsec = 0 };
+
+    syscall(SYS_futex, &shm->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = NULL;
+    bool follow = false;
+    bool from_end = false;
+    uint64_t back = 0;
+    uint64_t pos = 0;
+    uint64_t lost = 0;
+    uint64_t end, oldest;
+    uint32_t seq;
+    struct aesd_history_shm *shm;
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = RECONNECT_MS * 1000000L };
+    size_t shm_len = 0;
+    size_t rx_bytes;
+    char *buf;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:fc:")) != -1) {
+        switch (opt) {
+        case 's':
+            path = optarg;
+            break;
+        case 'f':
+            follow = true;
+            break;
+        case 'c':
+            back = strtoull(optarg, NULL, 10);
+            from_end = true;
+            break;
+        default:
+            usage();
+            return TAIL_FAILURE;
+        }
+    }
+
+    if ((path == NULL) || (optind != argc)) {
+        usage();
+        return TAIL_FAILURE;
+    }
+
+    buf = malloc(COPY_SIZE);
+    shm = open_mirror(path, &shm_len, false);
+    if ((buf == NULL) || (shm == NULL)) {
+        free(buf);
+        return TAIL_FAILURE;
+    }
+
+    // Start at the oldest byte still held, or back bytes before the end
+    end = __atomic_load_n(&shm->end, __ATOMIC_ACQUIRE);
+    oldest = (shm->reserve > shm->capacity) ? shm->reserve - shm->capacity : shm->start;
+    pos = (from_end && (end > back)) ? end - back : 0;
+    if (pos < oldest) {
+        pos = oldest;
+    }
+
+    while (1) {
+        rx_bytes = aesd_history_shm_read(shm, &pos, buf, COPY_SIZE, &lost);
+        if (lost > 0) {
+            fflush(stdout);
+            fprintf(stderr, "aesdtail: %llu bytes overwritten before they were read\n",
+                    (unsigned long long)lost);
+            lost = 0;
+        }
+        if (rx_bytes > 0) {
+            if (fwrite(buf, 1, rx_bytes, stdout) != rx_bytes) {
+                break;
+            }
+            continue;
+        }
+
+        fflush(stdout);
+        if (!follow) {
+            break;
+        }
+
+        // Read seq before checking end again, an append in between bumps it
+        seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shm->end, __ATOMIC_ACQUIRE) != pos) {
+            continue;
+        }
+
+        if (!__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE)) {
+            wait_append(shm, seq);
+            continue;
+        }
+
+        // The server exited or handed over to a new one, follow its mirror
+        munmap(shm, shm_len);
+        while ((shm = open_mirror(path, &shm_len, true)) == NULL) {
+            nanosleep(&pause, NULL);
+        }
+        if (pos > __atomic_load_n(&shm->end, __ATOMIC_ACQUIRE)) {
+            // A different history, start over from its beginning
+            pos = 0;
+        }
+    }
+
+    if (shm != NULL) {
+        munmap(shm, shm_len);
+    }
+    free(buf);
+    return ferror(stdout) ? TAIL_FAILURE : 0;
+}
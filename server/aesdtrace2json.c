@@ -0,0 +1,192 @@
+/*****************************************************************************
+​*​ ​Copyright​ ​(C)​ ​2023 ​by​ Matthew Skogen
+​*
+​*​ ​Redistribution,​ ​modification​ ​or​ ​use​ ​of​ ​this​ ​software​ ​in​ ​source​ ​or​ ​binary
+​*​ ​forms​ ​is​ ​permitted​ ​as​ ​long​ ​as​ ​the​ ​files​ ​maintain​ ​this​ ​copyright.​ ​Users​ ​are
+​*​ ​permitted​ ​to​ ​modify​ ​this​ ​and​ ​use​ ​it​ ​to​ ​learn​ ​about​ ​the​ ​field​ ​of​ ​embedded
+​*​ ​software.​ ​Matthew Skogen ​and​ ​the​ ​University​ ​of​ ​Colorado​ ​are​ ​not​ ​liable​ ​for
+​*​ ​any​ ​misuse​ ​of​ ​this​ ​material.
+​*
+*****************************************************************************/
+/**
+​*​ ​@file​ aesdtrace2json.c
+​*​ ​@brief​ Convert a dumped stage trace to Chrome trace JSON or a summary
+​*
+​*​ ​@author​s ​Matthew Skogen
+​*​ ​@date​ October 17 2026
+*
+* Usage: ./aesdtrace2json [-s] trace
+*
+* Converts a stage trace the server dumped on SIGQUIT or the TRACE query
+* into Chrome trace event JSON on stdout, for chrome://tracing or Perfetto.
+* Every ring shows as a thread, every stage as a complete event on it with
+* the connection and bytes as arguments. Times are in microseconds from the
+* first event of the trace.
+*
+* With -s it prints how often each stage ran and its latency percentiles
+* instead, a quick look at which stage a slow packet spent its time in.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "aesd-trace.h"
+
+#define TRACE2JSON_SUCCESS  (0)
+#define TRACE2JSON_FAILURE  (1)
+
+static int compare_start(const void *a, const void *b)
+{
+    const struct aesd_trace_event *x = a;
+    const struct aesd_trace_event *y = b;
+
+    if (x->start_ns != y->start_ns) {
+        return (x->start_ns < y->start_ns) ? -1 : 1;
+    }
+    return (x->ring < y->ring) ? -1 : (x->ring > y->ring);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+// Read the events of the trace at path, returns them or NULL
+static struct aesd_trace_event *read_trace(const char *path, size_t *count)
+{
+    struct aesd_trace_header header;
+    struct aesd_trace_event *events = NULL;
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL) {
+        fprintf(stderr, "Error fopen(%s): %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if ((fread(&header, sizeof(header), 1, file) != 1) ||
+        (memcmp(header.magic, AESD_TRACE_MAGIC, sizeof(header.magic)) != 0) ||
+        (header.event_size != sizeof(struct aesd_trace_event))) {
+        fprintf(stderr, "Error %s is not a trace\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    // An empty trace still gets a buffer so NULL always means failure
+    events = malloc((header.events + 1) * sizeof(*events));
+    if (events == NULL) {
+        fprintf(stderr, "Error failed to malloc()\n");
+    } else if (fread(events, sizeof(*events), header.events, file) != header.events) {
+        fprintf(stderr, "Error %s is truncated\n", path);
+        free(events);
+        events = NULL;
+    }
+    fclose(file);
+    *count = header.events;
+    return events;
+}
+
+static void print_json(const struct aesd_trace_event *events, size_t count)
+{
+    uint64_t base_ns = (count > 0) ? events[0].start_ns : 0;
+    size_t i;
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (i = 0; i < count; i++) {
+        const struct aesd_trace_event *event = &events[i];
+
+        printf("{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+                "\"args\":{\"conn\":%u,\"bytes\":%u}}%s\n",
+                aesd_trace_stage_name(event->stage), (event->start_ns - base_ns) / 1e3,
+                event->dur_ns / 1e3, event->ring, event->conn, event->bytes,
+                (i + 1 < count) ? "," : "");
+    }
+    printf("]}\n");
+}
+
+static int print_summary(const struct aesd_trace_event *events, size_t count)
+{
+    uint32_t *durations = malloc((count + 1) * sizeof(*durations));
+    unsigned int stage;
+    size_t n, i;
+
+    if (durations == NULL) {
+        fprintf(stderr, "Error failed to malloc()\n");
+        return TRACE2JSON_FAILURE;
+    }
+    if (count > 0) {
+        printf("%zu events over %.3f ms\n", count,
+                (events[count - 1].start_ns - events[0].start_ns) / 1e6);
+    }
+    printf("%-8s %10s %10s %10s %10s %10s %12s\n", "stage", "count", "mean us", "p50 us",
+            "p99 us", "max us", "total ms");
+    for (stage = 0; stage < AESD_TRACE_STAGES; stage++) {
+        uint64_t total_ns = 0;
+
+        for (n = 0, i = 0; i < count; i++) {
+            if (events[i].stage == stage) {
+                durations[n++] = events[i].dur_ns;
+                total_ns += events[i].dur_ns;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        qsort(durations, n, sizeof(*durations), compare_u32);
+        printf("%-8s %10zu %10.1f %10.1f %10.1f %10.1f %12.3f\n",
+                aesd_trace_stage_name(stage), n, total_ns / 1e3 / n,
+                durations[(n - 1) / 2] / 1e3, durations[(size_t)((n - 1) * 0.99)] / 1e3,
+                durations[n - 1] / 1e3, total_ns / 1e6);
+    }
+    free(durations);
+    return TRACE2JSON_SUCCESS;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: ./aesdtrace2json [-s] trace\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct aesd_trace_event *events;
+    bool summary = false;
+    size_t count = 0;
+    int status = TRACE2JSON_SUCCESS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+        case 's':
+            summary = true;
+            break;
+        default:
+            usage();
+            return TRACE2JSON_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return TRACE2JSON_FAILURE;
+    }
+
+    events = read_trace(argv[optind], &count);
+    if (events == NULL) {
+        return TRACE2JSON_FAILURE;
+    }
+
+    // Rings are dumped one after another, put them back in time order
+    qsort(events, count, sizeof(*events), compare_start);
+    if (summary) {
+        status = print_summary(events, count);
+    } else {
+        print_json(events, count);
+    }
+    free(events);
+    return status;
+}
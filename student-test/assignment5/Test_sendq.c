@@ -0,0 +1,80 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../../server/aesd-sendq.h"
+
+#define REF_LEN     (8192)
+
+static bool released = false;
+
+static void release_ref(void *arg)
+{
+    (void)arg;
+    released = true;
+}
+
+/**
+* A copied reply ending exactly on a chunk boundary leaves an empty chunk reserved at the end
+* of the queue, as queue_file_bytes() in aesdsocket.c does. A reply queued by reference behind
+* it must still be sent.
+*/
+void test_sendq_ref_after_full_chunk()
+{
+    static char copied[AESD_SENDQ_CHUNK_SIZE];
+    static char ref[REF_LEN];
+    static char received[AESD_SENDQ_CHUNK_SIZE + REF_LEN];
+    struct aesd_sendq q;
+    size_t avail = 0;
+    size_t total = 0;
+    ssize_t rx_bytes;
+    char *p_tail;
+    int fds[2];
+    int flushes;
+
+    memset(copied, 'c', sizeof(copied));
+    memset(ref, 'r', sizeof(ref));
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds),
+                                    "FAIL: socketpair() failed");
+    aesd_sendq_init(&q, 1024 * 1024);
+
+    /* Copied reply filling the first chunk, then the next chunk reserved and left empty */
+    p_tail = aesd_sendq_reserve(&q, &avail);
+    TEST_ASSERT_NOT_NULL(p_tail);
+    TEST_ASSERT_EQUAL_UINT(AESD_SENDQ_CHUNK_SIZE, avail);
+    memcpy(p_tail, copied, avail);
+    aesd_sendq_commit(&q, avail);
+    p_tail = aesd_sendq_reserve(&q, &avail);
+    TEST_ASSERT_NOT_NULL(p_tail);
+
+    /* Reply queued by reference behind the empty chunk */
+    TEST_ASSERT_EQUAL_INT(0, aesd_sendq_append_ref(&q, ref, sizeof(ref), false, release_ref, NULL));
+
+    for (flushes = 0; (flushes < 100) && !aesd_sendq_empty(&q); flushes++) {
+        TEST_ASSERT_TRUE_MESSAGE(aesd_sendq_flush(&q, fds[0], SIZE_MAX) >= 0,
+                                    "FAIL: aesd_sendq_flush() failed");
+        while ((total < sizeof(received)) &&
+               ((rx_bytes = recv(fds[1], received + total, sizeof(received) - total,
+                                    MSG_DONTWAIT)) > 0)) {
+            total += rx_bytes;
+        }
+    }
+    while ((total < sizeof(received)) &&
+           ((rx_bytes = recv(fds[1], received + total, sizeof(received) - total,
+                                MSG_DONTWAIT)) > 0)) {
+        total += rx_bytes;
+    }
+
+    TEST_ASSERT_TRUE_MESSAGE(aesd_sendq_empty(&q), "FAIL: reply stuck behind an empty chunk");
+    TEST_ASSERT_EQUAL_UINT(sizeof(received), total);
+    TEST_ASSERT_EQUAL_MEMORY(copied, received, sizeof(copied));
+    TEST_ASSERT_EQUAL_MEMORY(ref, received + sizeof(copied), sizeof(ref));
+    TEST_ASSERT_TRUE_MESSAGE(released, "FAIL: sent reference was not released");
+
+    aesd_sendq_destroy(&q);
+    close(fds[0]);
+    close(fds[1]);
+}